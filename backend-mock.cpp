@@ -0,0 +1,409 @@
+#include <time.h>
+
+#include "backend-mock.h"
+#include "misc.h"
+
+uint64_t mock_now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Paces a source to `rate` packets per second. Returns false if the next
+// packet is not due within timeout_ms; a source that fell behind skips the
+// packets it missed instead of bursting, like a device refreshing a report.
+static bool mock_wait_due(uint64_t *next_due, unsigned int rate, int timeout_ms) {
+	if (rate == 0)
+		return true;
+
+	uint64_t period = 1000000000ull / rate;
+	uint64_t now = mock_now_ns();
+	if (*next_due == 0 || *next_due + period < now)
+		*next_due = now;
+
+	if (timeout_ms >= 0 && *next_due > now + (uint64_t)timeout_ms * 1000000ull) {
+		usleep(timeout_ms * 1000);
+		return false;
+	}
+
+	struct timespec ts;
+	ts.tv_sec = *next_due / 1000000000ull;
+	ts.tv_nsec = *next_due % 1000000000ull;
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	*next_due += period;
+	return true;
+}
+
+static void mock_fill_payload(uint8_t *data, int length, uint64_t sequence) {
+	for (int i = 0; i < length; i++)
+		data[i] = (uint8_t)(sequence + i);
+
+	uint64_t now = mock_now_ns();
+	if (length >= (int)sizeof(now))
+		memcpy(data, &now, sizeof(now));
+}
+
+void mock_record_latency(struct mock_ep_counters *counters, const uint8_t *data,
+			int length, bool recording) {
+	if (!recording)
+		return;
+
+	counters->packets.fetch_add(1, std::memory_order_relaxed);
+	counters->bytes.fetch_add(length, std::memory_order_relaxed);
+
+	uint64_t sent;
+	if (length < (int)sizeof(sent) ||
+	    counters->latencies_ns.size() >= MOCK_MAX_LATENCY_SAMPLES)
+		return;
+
+	memcpy(&sent, data, sizeof(sent));
+	uint64_t now = mock_now_ns();
+	if (sent <= now)
+		counters->latencies_ns.push_back(now - sent);
+}
+
+static int mock_ep_index(uint8_t address) {
+	return address & USB_ENDPOINT_NUMBER_MASK;
+}
+
+/*----------------------------------------------------------------------*/
+
+MockDevice::MockDevice(const std::vector<mock_endpoint> &endpoints)
+	: endpoints(endpoints) {
+	recording = false;
+	for (int i = 0; i < 16; i++) {
+		out[i].packets = 0;
+		out[i].bytes = 0;
+		next_due[i] = 0;
+	}
+
+	for (const mock_endpoint &ep : endpoints) {
+		struct libusb_endpoint_descriptor desc = {};
+		desc.bLength = USB_DT_ENDPOINT_SIZE;
+		desc.bDescriptorType = USB_DT_ENDPOINT;
+		desc.bEndpointAddress = ep.bEndpointAddress;
+		desc.bmAttributes = ep.bmAttributes;
+		desc.wMaxPacketSize = ep.wMaxPacketSize;
+		desc.bInterval = ep.bInterval;
+		libusb_endpoints.push_back(desc);
+
+		if (!(ep.bEndpointAddress & USB_DIR_IN))
+			out[mock_ep_index(ep.bEndpointAddress)].latencies_ns.reserve(MOCK_MAX_LATENCY_SAMPLES);
+	}
+
+	libusb_altsetting = {};
+	libusb_altsetting.bLength = USB_DT_INTERFACE_SIZE;
+	libusb_altsetting.bDescriptorType = USB_DT_INTERFACE;
+	libusb_altsetting.bNumEndpoints = libusb_endpoints.size();
+	libusb_altsetting.bInterfaceClass = USB_CLASS_VENDOR_SPEC;
+	libusb_altsetting.endpoint = libusb_endpoints.data();
+
+	libusb_interface = {};
+	libusb_interface.altsetting = &libusb_altsetting;
+	libusb_interface.num_altsetting = 1;
+
+	libusb_config = {};
+	libusb_config.bLength = USB_DT_CONFIG_SIZE;
+	libusb_config.bDescriptorType = USB_DT_CONFIG;
+	libusb_config.wTotalLength = USB_DT_CONFIG_SIZE + USB_DT_INTERFACE_SIZE +
+		USB_DT_ENDPOINT_SIZE * libusb_endpoints.size();
+	libusb_config.bNumInterfaces = 1;
+	libusb_config.bConfigurationValue = 1;
+	libusb_config.bmAttributes = USB_CONFIG_ATT_ONE;
+	libusb_config.MaxPower = 50;
+	libusb_config.interface = &libusb_interface;
+
+	libusb_device = {};
+	libusb_device.bLength = USB_DT_DEVICE_SIZE;
+	libusb_device.bDescriptorType = USB_DT_DEVICE;
+	libusb_device.bcdUSB = 0x0200;
+	libusb_device.bMaxPacketSize0 = 64;
+	libusb_device.idVendor = 0x1d6b;
+	libusb_device.idProduct = 0x0104;
+	libusb_device.bcdDevice = 0x0100;
+	libusb_device.bNumConfigurations = 1;
+
+	// Wire format of the configuration, for GET_DESCRIPTOR requests.
+	const unsigned char config[] = {
+		USB_DT_CONFIG_SIZE, USB_DT_CONFIG,
+		(unsigned char)(libusb_config.wTotalLength & 0xff),
+		(unsigned char)(libusb_config.wTotalLength >> 8),
+		1, 1, 0, USB_CONFIG_ATT_ONE, 50,
+		USB_DT_INTERFACE_SIZE, USB_DT_INTERFACE, 0, 0,
+		(unsigned char)libusb_endpoints.size(), USB_CLASS_VENDOR_SPEC, 0, 0, 0,
+	};
+	config_bytes.assign(config, config + sizeof(config));
+	for (const libusb_endpoint_descriptor &desc : libusb_endpoints) {
+		const unsigned char endpoint[] = {
+			USB_DT_ENDPOINT_SIZE, USB_DT_ENDPOINT, desc.bEndpointAddress,
+			desc.bmAttributes, (unsigned char)(desc.wMaxPacketSize & 0xff),
+			(unsigned char)(desc.wMaxPacketSize >> 8), desc.bInterval,
+		};
+		config_bytes.insert(config_bytes.end(), endpoint, endpoint + sizeof(endpoint));
+	}
+}
+
+const struct libusb_device_descriptor *MockDevice::device_descriptor() {
+	return &libusb_device;
+}
+
+const struct libusb_config_descriptor *MockDevice::config_descriptor(int index) {
+	return index == 0 ? &libusb_config : NULL;
+}
+
+void MockDevice::set_configuration(int configuration) {
+	(void)configuration;
+}
+
+void MockDevice::claim_interface(int interface) {
+	(void)interface;
+}
+
+void MockDevice::release_interface(int interface) {
+	(void)interface;
+}
+
+void MockDevice::set_interface_alt_setting(int interface, int altsetting) {
+	(void)interface;
+	(void)altsetting;
+}
+
+int MockDevice::control_request(const usb_ctrlrequest *setup_packet, int *nbytes,
+		unsigned char **dataptr, int timeout) {
+	(void)timeout;
+	if (control_latency_us)
+		usleep(control_latency_us);
+
+	static const unsigned char string_langids[] = { 4, USB_DT_STRING, 0x09, 0x04 };
+	static const unsigned char status[] = { 0, 0 };
+
+	if (!(setup_packet->bRequestType & USB_DIR_IN)) {
+		*nbytes = setup_packet->wLength;
+		return 0;
+	}
+
+	const unsigned char *reply = NULL;
+	int length = 0;
+	if (setup_packet->bRequest == USB_REQ_GET_DESCRIPTOR) {
+		switch (setup_packet->wValue >> 8) {
+		case USB_DT_DEVICE:
+			reply = (const unsigned char *)&libusb_device;
+			length = USB_DT_DEVICE_SIZE;
+			break;
+		case USB_DT_CONFIG:
+			reply = config_bytes.data();
+			length = config_bytes.size();
+			break;
+		case USB_DT_STRING:
+			reply = string_langids;
+			length = sizeof(string_langids);
+			break;
+		}
+	}
+	else if (setup_packet->bRequest == USB_REQ_GET_STATUS) {
+		reply = status;
+		length = sizeof(status);
+	}
+
+	if (!reply)
+		return -1;
+
+	*nbytes = std::min(length, (int)setup_packet->wLength);
+	memcpy(*dataptr, reply, *nbytes);
+	return 0;
+}
+
+int MockDevice::send_data(uint8_t endpoint, uint8_t attributes, uint8_t *dataptr,
+		int length) {
+	(void)attributes;
+	mock_record_latency(&out[mock_ep_index(endpoint)], dataptr, length, recording);
+	return LIBUSB_SUCCESS;
+}
+
+void MockDevice::receive_data(uint8_t endpoint, uint8_t attributes, int maxLength,
+		uint8_t **dataptr, int *length, int timeout) {
+	(void)attributes;
+	const mock_endpoint *ep = NULL;
+	for (const mock_endpoint &candidate : endpoints) {
+		if (candidate.bEndpointAddress == endpoint)
+			ep = &candidate;
+	}
+
+	*length = -1;
+	*dataptr = new uint8_t[maxLength];
+	if (!ep || !mock_wait_due(&next_due[mock_ep_index(endpoint)], ep->rate, timeout))
+		return;
+
+	mock_fill_payload(*dataptr, maxLength, next_due[mock_ep_index(endpoint)]);
+	*length = maxLength;
+}
+
+/*----------------------------------------------------------------------*/
+
+MockHost::MockHost(const std::vector<mock_endpoint> &endpoints)
+	: endpoints(endpoints) {
+	recording = false;
+	ep0_stalls = 0;
+	ep_stalls = 0;
+	is_configured = false;
+	for (int i = 0; i < 16; i++) {
+		in[i].packets = 0;
+		in[i].bytes = 0;
+	}
+	for (const mock_endpoint &ep : endpoints) {
+		if (ep.bEndpointAddress & USB_DIR_IN)
+			in[mock_ep_index(ep.bEndpointAddress)].latencies_ns.reserve(MOCK_MAX_LATENCY_SAMPLES);
+	}
+	memset(enabled, 0, sizeof(enabled));
+	memset(next_due, 0, sizeof(next_due));
+
+	// What a host does after reset: read the descriptors, then configure.
+	enumeration.push_back({ USB_DIR_IN, USB_REQ_GET_DESCRIPTOR, USB_DT_DEVICE << 8, 0, 64 });
+	enumeration.push_back({ USB_DIR_IN, USB_REQ_GET_DESCRIPTOR, USB_DT_DEVICE << 8, 0, USB_DT_DEVICE_SIZE });
+	enumeration.push_back({ USB_DIR_IN, USB_REQ_GET_DESCRIPTOR, USB_DT_CONFIG << 8, 0, USB_DT_CONFIG_SIZE });
+	enumeration.push_back({ USB_DIR_IN, USB_REQ_GET_DESCRIPTOR, USB_DT_CONFIG << 8, 0, 255 });
+	enumeration.push_back({ USB_DIR_IN, USB_REQ_GET_DESCRIPTOR, USB_DT_STRING << 8, 0, 255 });
+	enumeration.push_back({ USB_DIR_OUT, USB_REQ_SET_CONFIGURATION, 1, 0, 0 });
+}
+
+void MockHost::init(enum usb_device_speed speed, const char *driver, const char *device) {
+	(void)speed;
+	(void)driver;
+	(void)device;
+}
+
+void MockHost::run() {
+}
+
+void MockHost::close() {
+}
+
+void MockHost::event_fetch(struct usb_raw_event *event) {
+	struct usb_raw_control_event *control = (struct usb_raw_control_event *)event;
+
+	while (!please_stop_ep0 && next_event > enumeration.size())
+		usleep(10000);
+
+	if (please_stop_ep0) {
+		event->type = USB_RAW_EVENT_INVALID;
+		event->length = 4294967295;
+		return;
+	}
+
+	if (next_event == 0) {
+		event->type = USB_RAW_EVENT_CONNECT;
+		event->length = 0;
+	}
+	else {
+		event->type = USB_RAW_EVENT_CONTROL;
+		event->length = sizeof(control->ctrl);
+		control->ctrl = enumeration[next_event - 1];
+	}
+	next_event++;
+}
+
+int MockHost::ep0_read(struct usb_raw_ep_io *io) {
+	return io->length;
+}
+
+int MockHost::ep0_write(struct usb_raw_ep_io *io) {
+	return io->length;
+}
+
+void MockHost::ep0_stall() {
+	ep0_stalls++;
+}
+
+void MockHost::ep_stall(uint32_t num __attribute__((unused))) {
+	ep_stalls++;
+}
+
+int MockHost::ep_enable(struct usb_endpoint_descriptor *desc) {
+	for (int i = 0; i < USB_RAW_EPS_NUM_MAX; i++) {
+		if (!enabled[i]) {
+			enabled[i] = desc->bEndpointAddress;
+			next_due[i] = 0;
+			poll_period_ns[i] = 0;
+			if (usb_endpoint_is_int_in(desc) && desc->bInterval)
+				poll_period_ns[i] = 125000ull << (std::min(desc->bInterval, (uint8_t)16) - 1);
+			return i;
+		}
+	}
+	return -1;
+}
+
+int MockHost::ep_disable(uint32_t num) {
+	if (num >= USB_RAW_EPS_NUM_MAX)
+		return -1;
+	enabled[num] = 0;
+	return 0;
+}
+
+int MockHost::ep_read(struct usb_raw_ep_io *io) {
+	const mock_endpoint *ep = NULL;
+	for (const mock_endpoint &candidate : endpoints) {
+		if (candidate.bEndpointAddress == enabled[io->ep])
+			ep = &candidate;
+	}
+	if (!ep) {
+		// An OUT endpoint the host never writes to.
+		while (!please_stop_eps)
+			usleep(20000);
+		return -1;
+	}
+
+	// Blocks like a real OUT endpoint until the host sends, but gives the
+	// proxy a chance to notice please_stop_eps every 20 ms.
+	while (!mock_wait_due(&next_due[io->ep], ep->rate, 20)) {
+		if (please_stop_eps)
+			return -1;
+	}
+
+	int length = std::min((uint32_t)ep->wMaxPacketSize, io->length);
+	mock_fill_payload(io->data, length, next_due[io->ep]);
+	return length;
+}
+
+int MockHost::ep_write(struct usb_raw_ep_io *io) {
+	struct mock_ep_counters *counters = &in[mock_ep_index(enabled[io->ep])];
+	uint64_t period = poll_period_ns[io->ep];
+	if (polling && period) {
+		// The host's polls are on a fixed schedule, independent of when
+		// the packet arrived.
+		uint64_t poll = (mock_now_ns() / period + 1) * period;
+		struct timespec ts;
+		ts.tv_sec = poll / 1000000000ull;
+		ts.tv_nsec = poll % 1000000000ull;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	}
+	if (timestamped)
+		mock_record_latency(counters, io->data, io->length, recording);
+	else if (recording) {
+		counters->packets.fetch_add(1, std::memory_order_relaxed);
+		counters->bytes.fetch_add(io->length, std::memory_order_relaxed);
+	}
+	return io->length;
+}
+
+void MockHost::configure() {
+	is_configured = true;
+}
+
+void MockHost::vbus_draw(uint32_t power) {
+	(void)power;
+}
+
+int MockHost::eps_info(struct usb_raw_eps_info *info) {
+	memset(info, 0, sizeof(*info));
+	for (int i = 0; i < 15; i++) {
+		struct usb_raw_ep_info *ep = &info->eps[i];
+		snprintf((char *)ep->name, sizeof(ep->name), "ep%d", i + 1);
+		ep->addr = USB_RAW_EP_ADDR_ANY;
+		ep->caps.type_int = 1;
+		ep->caps.type_bulk = 1;
+		ep->caps.dir_in = 1;
+		ep->caps.dir_out = 1;
+		ep->limits.maxpacket_limit = 1024;
+	}
+	return 15;
+}
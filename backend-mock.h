@@ -0,0 +1,116 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+
+#include "backend.h"
+
+/*
+ * In-memory backends that emulate a configurable device and host, used by
+ * usb-proxy-bench to run the real proxy core without hardware.
+ *
+ * Every generated packet starts with the CLOCK_MONOTONIC time it was created
+ * at (in ns, if wMaxPacketSize allows), so the receiving side can measure
+ * the latency through the proxy.
+ */
+
+struct mock_endpoint {
+	uint8_t		bEndpointAddress;
+	uint8_t		bmAttributes;
+	uint16_t	wMaxPacketSize;
+	uint8_t		bInterval;
+	unsigned int	rate;		// packets per second from the source, 0 for as fast as possible
+};
+
+struct mock_ep_counters {
+	std::atomic<uint64_t>	packets;
+	std::atomic<uint64_t>	bytes;
+	std::vector<uint64_t>	latencies_ns;	// written only by the sink thread while recording
+};
+
+#define MOCK_MAX_LATENCY_SAMPLES	(1 << 20)
+
+uint64_t mock_now_ns();
+
+class MockDevice : public DeviceBackend {
+public:
+	explicit MockDevice(const std::vector<mock_endpoint> &endpoints);
+
+	const struct libusb_device_descriptor *device_descriptor() override;
+	const struct libusb_config_descriptor *config_descriptor(int index) override;
+	void set_configuration(int configuration) override;
+	void claim_interface(int interface) override;
+	void release_interface(int interface) override;
+	void set_interface_alt_setting(int interface, int altsetting) override;
+	int control_request(const usb_ctrlrequest *setup_packet, int *nbytes,
+			unsigned char **dataptr, int timeout) override;
+	int send_data(uint8_t endpoint, uint8_t attributes, uint8_t *dataptr,
+			int length) override;
+	void receive_data(uint8_t endpoint, uint8_t attributes, int maxLength,
+			uint8_t **dataptr, int *length, int timeout) override;
+
+	// Emulated device round trip for each control request.
+	unsigned int		control_latency_us = 0;
+
+	// Sink side for OUT endpoints.
+	struct mock_ep_counters	out[16];
+	std::atomic<bool>	recording;
+
+private:
+	std::vector<mock_endpoint>			endpoints;
+	std::vector<struct libusb_endpoint_descriptor>	libusb_endpoints;
+	struct libusb_interface_descriptor		libusb_altsetting;
+	struct libusb_interface				libusb_interface;
+	struct libusb_config_descriptor			libusb_config;
+	struct libusb_device_descriptor			libusb_device;
+	std::vector<unsigned char>			config_bytes;
+	uint64_t					next_due[16];
+};
+
+class MockHost : public HostBackend {
+public:
+	explicit MockHost(const std::vector<mock_endpoint> &endpoints);
+
+	void init(enum usb_device_speed speed, const char *driver, const char *device) override;
+	void run() override;
+	void close() override;
+	void event_fetch(struct usb_raw_event *event) override;
+	int ep0_read(struct usb_raw_ep_io *io) override;
+	int ep0_write(struct usb_raw_ep_io *io) override;
+	void ep0_stall() override;
+	int ep_enable(struct usb_endpoint_descriptor *desc) override;
+	int ep_disable(uint32_t num) override;
+	int ep_read(struct usb_raw_ep_io *io) override;
+	int ep_write(struct usb_raw_ep_io *io) override;
+	void ep_stall(uint32_t num) override;
+	void configure() override;
+	void vbus_draw(uint32_t power) override;
+	int eps_info(struct usb_raw_eps_info *info) override;
+
+	bool configured() { return is_configured; }
+
+	// Whether IN payloads carry the mock timestamp, false for replayed traffic.
+	bool			timestamped = true;
+	// Deliver interrupt IN packets only at the next poll, every
+	// 2^(bInterval-1) microframes of the enabled endpoint, like a
+	// high-speed host.
+	bool			polling = false;
+
+	// Sink side for IN endpoints.
+	struct mock_ep_counters	in[16];
+	std::atomic<bool>	recording;
+	std::atomic<uint64_t>	ep0_stalls;
+	std::atomic<uint64_t>	ep_stalls;
+
+private:
+	std::vector<mock_endpoint>	endpoints;
+	std::vector<usb_ctrlrequest>	enumeration;
+	size_t				next_event = 0;
+	std::atomic<bool>		is_configured;
+	uint8_t				enabled[USB_RAW_EPS_NUM_MAX];
+	uint64_t			next_due[USB_RAW_EPS_NUM_MAX];
+	uint64_t			poll_period_ns[USB_RAW_EPS_NUM_MAX];
+};
+
+void mock_record_latency(struct mock_ep_counters *counters, const uint8_t *data,
+			int length, bool recording);
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <libusb-1.0/libusb.h>
+
+#include "host-raw-gadget.h"
+
+/*
+ * The proxy core (proxy.cpp) talks to the USB host through a HostBackend and
+ * to the proxied device through a DeviceBackend. The methods mirror the
+ * raw-gadget ioctls and the libusb calls the proxy has always made, so the
+ * real backends are thin wrappers around host-raw-gadget.cpp and
+ * device-libusb.cpp. backend-mock.cpp provides in-memory implementations
+ * that need neither /dev/raw-gadget nor a device.
+ */
+
+class HostBackend {
+public:
+	virtual ~HostBackend() {}
+
+	virtual void init(enum usb_device_speed speed, const char *driver,
+			const char *device) = 0;
+	virtual void run() = 0;
+	virtual void close() = 0;
+
+	// Sets event->length to 4294967295 when interrupted by a signal.
+	virtual void event_fetch(struct usb_raw_event *event) = 0;
+	virtual int ep0_read(struct usb_raw_ep_io *io) = 0;
+	virtual int ep0_write(struct usb_raw_ep_io *io) = 0;
+	virtual void ep0_stall() = 0;
+	virtual int ep_enable(struct usb_endpoint_descriptor *desc) = 0;
+	virtual int ep_disable(uint32_t num) = 0;
+	virtual int ep_read(struct usb_raw_ep_io *io) = 0;
+	virtual int ep_write(struct usb_raw_ep_io *io) = 0;
+	virtual void ep_stall(uint32_t num) = 0;
+	virtual void configure() = 0;
+	virtual void vbus_draw(uint32_t power) = 0;
+	virtual int eps_info(struct usb_raw_eps_info *info) = 0;
+};
+
+// One request of a DeviceBackend::control_requests() batch. On success
+// result is 0 and data holds the response, as for control_request().
+struct control_transfer {
+	struct usb_ctrlrequest	setup;
+	std::string		data;
+	int			result;
+};
+
+class DeviceBackend {
+public:
+	virtual ~DeviceBackend() {}
+
+	virtual const struct libusb_device_descriptor *device_descriptor() = 0;
+	virtual const struct libusb_config_descriptor *config_descriptor(int index) = 0;
+	// The speed the descriptors above were reported at.
+	virtual enum usb_device_speed link_speed() { return USB_SPEED_HIGH; }
+
+	virtual void set_configuration(int configuration) = 0;
+	virtual void claim_interface(int interface) = 0;
+	virtual void release_interface(int interface) = 0;
+	virtual void set_interface_alt_setting(int interface, int altsetting) = 0;
+	virtual int control_request(const usb_ctrlrequest *setup_packet, int *nbytes,
+			unsigned char **dataptr, int timeout) = 0;
+	// Returns 0 once the packet is sent, or a LIBUSB_ERROR_* code.
+	virtual int send_data(uint8_t endpoint, uint8_t attributes, uint8_t *dataptr,
+			int length) = 0;
+	// Reads up to maxLength bytes. *length is always set: to the bytes
+	// received, 0 for a zero-length packet (a real one, to be forwarded),
+	// or -1 if nothing arrived within timeout, on error, or for a transfer
+	// type the backend doesn't handle. *dataptr may be set to a new[]
+	// buffer, for the caller to free, even then; it is left alone if not.
+	virtual void receive_data(uint8_t endpoint, uint8_t attributes, int maxLength,
+			uint8_t **dataptr, int *length, int timeout) = 0;
+
+	// Runs a batch of independent IN requests. Backends that can keep
+	// several requests in flight override this.
+	virtual void control_requests(std::vector<control_transfer> &transfers, int timeout) {
+		for (control_transfer &transfer : transfers) {
+			int nbytes = 0;
+			unsigned char *data = new unsigned char[transfer.setup.wLength];
+			transfer.result = control_request(&transfer.setup, &nbytes, &data, timeout);
+			if (transfer.result == 0)
+				transfer.data.assign((const char *)data, nbytes);
+			delete[] data;
+		}
+	}
+};
+
+extern HostBackend	*host_backend;
+extern DeviceBackend	*device_backend;
+
+/*----------------------------------------------------------------------*/
+
+class RawGadgetHost : public HostBackend {
+public:
+	void init(enum usb_device_speed speed, const char *driver, const char *device) override;
+	void run() override;
+	void close() override;
+	void event_fetch(struct usb_raw_event *event) override;
+	int ep0_read(struct usb_raw_ep_io *io) override;
+	int ep0_write(struct usb_raw_ep_io *io) override;
+	void ep0_stall() override;
+	int ep_enable(struct usb_endpoint_descriptor *desc) override;
+	int ep_disable(uint32_t num) override;
+	int ep_read(struct usb_raw_ep_io *io) override;
+	int ep_write(struct usb_raw_ep_io *io) override;
+	void ep_stall(uint32_t num) override;
+	void configure() override;
+	void vbus_draw(uint32_t power) override;
+	int eps_info(struct usb_raw_eps_info *info) override;
+
+private:
+	int fd = -1;
+};
+
+class LibusbDevice : public DeviceBackend {
+public:
+	const struct libusb_device_descriptor *device_descriptor() override;
+	const struct libusb_config_descriptor *config_descriptor(int index) override;
+	enum usb_device_speed link_speed() override;
+	void set_configuration(int configuration) override;
+	void claim_interface(int interface) override;
+	void release_interface(int interface) override;
+	void set_interface_alt_setting(int interface, int altsetting) override;
+	int control_request(const usb_ctrlrequest *setup_packet, int *nbytes,
+			unsigned char **dataptr, int timeout) override;
+	int send_data(uint8_t endpoint, uint8_t attributes, uint8_t *dataptr,
+			int length) override;
+	void receive_data(uint8_t endpoint, uint8_t attributes, int maxLength,
+			uint8_t **dataptr, int *length, int timeout) override;
+	void control_requests(std::vector<control_transfer> &transfers, int timeout) override;
+};
@@ -0,0 +1,172 @@
+#include <inttypes.h>
+#include <mutex>
+#include <sstream>
+#include <stdio.h>
+#include <time.h>
+
+#include "backend.h"
+#include "capture.h"
+#include "descriptors.h"
+
+std::atomic<bool> capture_active(false);
+
+static std::mutex capture_mutex;
+static FILE *capture_file = NULL;
+static std::string capture_file_path;
+
+static uint64_t capture_timestamp() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void capture_hex(const char *data, int length) {
+	static const char digits[] = "0123456789abcdef";
+	if (length <= 0) {
+		fputc('-', capture_file);
+		return;
+	}
+	for (int i = 0; i < length; i++) {
+		fputc(digits[((unsigned char)data[i]) >> 4], capture_file);
+		fputc(digits[((unsigned char)data[i]) & 0x0f], capture_file);
+	}
+}
+
+static void write_descriptor(uint8_t type, uint8_t index, const std::string &raw) {
+	struct usb_ctrlrequest ctrl;
+	ctrl.bRequestType = USB_DIR_IN;
+	ctrl.bRequest = USB_REQ_GET_DESCRIPTOR;
+	ctrl.wValue = (type << 8) | index;
+	ctrl.wIndex = 0;
+	ctrl.wLength = raw.size();
+
+	fprintf(capture_file, "%" PRIu64 " 00 descriptor in ", capture_timestamp());
+	capture_hex((const char *)&ctrl, sizeof(ctrl));
+	fputc(' ', capture_file);
+	capture_hex(raw.data(), raw.size());
+	fputc('\n', capture_file);
+}
+
+bool capture_start(const std::string &path) {
+	std::lock_guard<std::mutex> lock(capture_mutex);
+	if (capture_file) {
+		capture_active = false;
+		fclose(capture_file);
+		capture_file = NULL;
+	}
+
+	capture_file = fopen(path.c_str(), "a");
+	if (!capture_file) {
+		perror("fopen() capture file");
+		return false;
+	}
+	capture_file_path = path;
+	fprintf(capture_file, "# usb-proxy capture v1\n");
+	capture_active = true;
+	printf("Capture started: %s\n", path.c_str());
+	return true;
+}
+
+void capture_stop() {
+	std::lock_guard<std::mutex> lock(capture_mutex);
+	capture_active = false;
+	if (!capture_file)
+		return;
+	fclose(capture_file);
+	capture_file = NULL;
+	printf("Capture stopped: %s\n", capture_file_path.c_str());
+}
+
+std::string capture_path() {
+	std::lock_guard<std::mutex> lock(capture_mutex);
+	return capture_file ? capture_file_path : "";
+}
+
+void capture_packet(uint8_t bEndpointAddress, const char *transfer_type,
+			const char *dir, const char *data, int length) {
+	std::lock_guard<std::mutex> lock(capture_mutex);
+	if (!capture_file)
+		return;
+	fprintf(capture_file, "%" PRIu64 " %02x %s %s - ", capture_timestamp(),
+		bEndpointAddress, transfer_type, dir);
+	capture_hex(data, length);
+	fputc('\n', capture_file);
+}
+
+void capture_control(const struct usb_ctrlrequest *ctrl, const char *data,
+			int length) {
+	std::lock_guard<std::mutex> lock(capture_mutex);
+	if (!capture_file)
+		return;
+	fprintf(capture_file, "%" PRIu64 " 00 control %s ", capture_timestamp(),
+		(ctrl->bRequestType & USB_DIR_IN) ? "in" : "out");
+	capture_hex((const char *)ctrl, sizeof(*ctrl));
+	fputc(' ', capture_file);
+	capture_hex(data, length);
+	fputc('\n', capture_file);
+}
+
+void capture_descriptors(DeviceBackend *device) {
+	std::lock_guard<std::mutex> lock(capture_mutex);
+	if (!capture_file || !device)
+		return;
+
+	const struct libusb_device_descriptor *device_desc = device->device_descriptor();
+	write_descriptor(USB_DT_DEVICE, 0, descriptor_serialize_device(device_desc));
+	for (int i = 0; i < device_desc->bNumConfigurations; i++) {
+		const struct libusb_config_descriptor *config = device->config_descriptor(i);
+		if (config)
+			write_descriptor(USB_DT_CONFIG, i, descriptor_serialize_config(config));
+	}
+}
+
+static bool parse_hex(const std::string &hex, std::string &out) {
+	out.clear();
+	if (hex == "-")
+		return true;
+	if (hex.size() % 2)
+		return false;
+	for (size_t i = 0; i < hex.size(); i += 2) {
+		char *end;
+		std::string byte = hex.substr(i, 2);
+		long value = strtol(byte.c_str(), &end, 16);
+		if (*end)
+			return false;
+		out += (char)value;
+	}
+	return true;
+}
+
+bool capture_parse_line(const std::string &line, struct capture_record &record) {
+	std::istringstream iss(line);
+	std::string ep, setup_hex, data_hex;
+	if (!(iss >> record.timestamp_us >> ep >> record.transfer_type >> record.dir >>
+			setup_hex >> data_hex))
+		return false;
+	char *end;
+	record.bEndpointAddress = strtoul(ep.c_str(), &end, 16);
+	if (ep.size() != 2 || *end || !parse_hex(setup_hex, record.setup) ||
+	    !parse_hex(data_hex, record.data))
+		return false;
+	return record.setup.empty() || record.setup.size() == sizeof(struct usb_ctrlrequest);
+}
+
+std::string capture_format_line(const struct capture_record &record) {
+	static const char digits[] = "0123456789abcdef";
+	auto hex = [](const std::string &bytes) {
+		if (bytes.empty())
+			return std::string("-");
+		std::string out;
+		for (unsigned char c : bytes) {
+			out += digits[c >> 4];
+			out += digits[c & 0x0f];
+		}
+		return out;
+	};
+
+	char prefix[32];
+	snprintf(prefix, sizeof(prefix), "%" PRIu64 " %02x ", record.timestamp_us,
+		record.bEndpointAddress);
+	return prefix + record.transfer_type + " " + record.dir + " " + hex(record.setup) +
+		" " + hex(record.data);
+}
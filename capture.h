@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <linux/usb/ch9.h>
+
+/*
+ * Packet capture to a text file, one packet per line:
+ *
+ *   <timestamp_us> <ep_address> <transfer_type> <dir> <setup|-> <data|->
+ *
+ * ep_address is two hex digits, setup is the 8-byte setup packet of a
+ * control transfer and data is the payload, both as plain hex strings.
+ * Lines starting with '#' are comments.
+ *
+ * The device and configuration descriptors of the proxied device are
+ * recorded as `descriptor` lines on ep 00, with the GET_DESCRIPTOR setup
+ * packet that returns them, so a capture can be replayed without the
+ * device (see device-replay.h).
+ */
+
+class DeviceBackend;
+
+struct capture_record {
+	uint64_t	timestamp_us;
+	uint8_t		bEndpointAddress;
+	std::string	transfer_type;
+	std::string	dir;
+	std::string	setup;	// empty, or the 8-byte setup packet
+	std::string	data;
+};
+
+extern std::atomic<bool> capture_active;
+
+bool capture_start(const std::string &path);
+void capture_stop();
+std::string capture_path();
+
+void capture_packet(uint8_t bEndpointAddress, const char *transfer_type,
+			const char *dir, const char *data, int length);
+void capture_control(const struct usb_ctrlrequest *ctrl, const char *data,
+			int length);
+void capture_descriptors(DeviceBackend *device);
+
+// Parses a non-comment line of a capture file.
+bool capture_parse_line(const std::string &line, struct capture_record &record);
+std::string capture_format_line(const struct capture_record &record);
@@ -0,0 +1,249 @@
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "backend.h"
+#include "control-cache.h"
+#include "descriptors.h"
+#include "hid-report.h"
+#include "stats.h"
+
+std::atomic<bool> control_cache_enabled(true);
+
+struct control_cache_entry {
+	std::string	data;
+	bool		complete;	// data is the whole response, whatever wLength asks for
+};
+
+static std::mutex cache_mutex;
+static std::map<std::string, control_cache_entry> cache;
+
+// Keyed by the setup packet without wLength.
+static std::string cache_key(const struct usb_ctrlrequest *ctrl) {
+	return std::string((const char *)ctrl, 6);
+}
+
+static bool cacheable(const struct usb_ctrlrequest *ctrl) {
+	if (ctrl->bRequestType == (USB_DIR_IN | USB_TYPE_STANDARD | USB_RECIP_DEVICE)) {
+		if (ctrl->bRequest == USB_REQ_GET_STATUS)
+			return true;
+		if (ctrl->bRequest != USB_REQ_GET_DESCRIPTOR)
+			return false;
+		switch (ctrl->wValue >> 8) {
+		case USB_DT_DEVICE:
+		case USB_DT_CONFIG:
+		case USB_DT_STRING:
+		case USB_DT_DEVICE_QUALIFIER:
+		case USB_DT_OTHER_SPEED_CONFIG:
+		case USB_DT_BOS:
+			return true;
+		}
+		return false;
+	}
+	if (ctrl->bRequestType == (USB_DIR_IN | USB_TYPE_STANDARD | USB_RECIP_INTERFACE) &&
+	    ctrl->bRequest == USB_REQ_GET_DESCRIPTOR) {
+		uint8_t type = ctrl->wValue >> 8;
+		return type == HID_DT_HID || type == HID_DT_REPORT;
+	}
+	return false;
+}
+
+// Whether a response holds the whole descriptor, so that it also answers
+// requests with a larger wLength.
+static bool is_complete(const struct usb_ctrlrequest *ctrl, const std::string &data) {
+	if (data.size() < ctrl->wLength || ctrl->bRequest == USB_REQ_GET_STATUS)
+		return true;
+	if (data.size() < 4)
+		return false;
+
+	switch (ctrl->wValue >> 8) {
+	case USB_DT_CONFIG:
+	case USB_DT_OTHER_SPEED_CONFIG:
+	case USB_DT_BOS:
+		return data.size() >= (size_t)((uint8_t)data[2] | ((uint8_t)data[3] << 8));
+	case HID_DT_REPORT:
+		return false;
+	default:
+		return data.size() >= (uint8_t)data[0];
+	}
+}
+
+bool control_cache_lookup(const struct usb_ctrlrequest *ctrl, unsigned char *data, int *nbytes) {
+	if (!control_cache_enabled || !cacheable(ctrl))
+		return false;
+
+	std::lock_guard<std::mutex> lock(cache_mutex);
+	auto entry = cache.find(cache_key(ctrl));
+	if (entry == cache.end() ||
+	    (!entry->second.complete && entry->second.data.size() < ctrl->wLength)) {
+		stats_inc(proxy_stats.control_cache_misses);
+		return false;
+	}
+
+	*nbytes = std::min((int)entry->second.data.size(), (int)ctrl->wLength);
+	memcpy(data, entry->second.data.data(), *nbytes);
+	stats_inc(proxy_stats.control_cache_hits);
+	return true;
+}
+
+void control_cache_store(const struct usb_ctrlrequest *ctrl, const unsigned char *data, int nbytes) {
+	if (!control_cache_enabled || !cacheable(ctrl) || nbytes < 0)
+		return;
+
+	std::string response((const char *)data, nbytes);
+	std::lock_guard<std::mutex> lock(cache_mutex);
+	control_cache_entry &entry = cache[cache_key(ctrl)];
+	if (entry.complete || response.size() < entry.data.size())
+		return;
+	entry.data = response;
+	entry.complete = is_complete(ctrl, response);
+}
+
+void control_cache_invalidate(const struct usb_ctrlrequest *ctrl) {
+	if ((ctrl->bRequestType & USB_TYPE_MASK) != USB_TYPE_STANDARD)
+		return;
+
+	std::lock_guard<std::mutex> lock(cache_mutex);
+	switch (ctrl->bRequest) {
+	case USB_REQ_SET_DESCRIPTOR:
+		cache.clear();
+		break;
+	case USB_REQ_SET_FEATURE:
+	case USB_REQ_CLEAR_FEATURE:
+	case USB_REQ_SET_CONFIGURATION: {
+		struct usb_ctrlrequest status = { USB_DIR_IN, USB_REQ_GET_STATUS, 0, 0, 2 };
+		cache.erase(cache_key(&status));
+		break;
+	}
+	}
+}
+
+void control_cache_clear() {
+	std::lock_guard<std::mutex> lock(cache_mutex);
+	cache.clear();
+}
+
+/*----------------------------------------------------------------------*/
+
+static void add_request(std::vector<control_transfer> &transfers, uint8_t bRequestType,
+			uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength) {
+	control_transfer transfer;
+	transfer.setup = { bRequestType, bRequest, wValue, wIndex, wLength };
+	transfer.result = -1;
+	transfers.push_back(transfer);
+}
+
+static int store_results(const std::vector<control_transfer> &transfers) {
+	int stored = 0;
+	for (const control_transfer &transfer : transfers) {
+		if (transfer.result != 0)
+			continue;
+		control_cache_store(&transfer.setup, (const unsigned char *)transfer.data.data(),
+			transfer.data.size());
+		stored++;
+	}
+	return stored;
+}
+
+static const std::string *find_result(const std::vector<control_transfer> &transfers,
+			uint8_t type) {
+	for (const control_transfer &transfer : transfers) {
+		if (transfer.result == 0 && transfer.setup.bRequest == USB_REQ_GET_DESCRIPTOR &&
+		    (transfer.setup.wValue >> 8) == type && transfer.setup.wIndex == 0)
+			return &transfer.data;
+	}
+	return NULL;
+}
+
+int control_cache_prefetch(DeviceBackend *device) {
+	control_cache_clear();
+	if (!control_cache_enabled)
+		return 0;
+
+	const struct libusb_device_descriptor *device_desc = device->device_descriptor();
+	std::vector<uint8_t> string_indexes = {
+		device_desc->iManufacturer, device_desc->iProduct, device_desc->iSerialNumber };
+
+	// Everything that does not depend on another response goes in the first batch.
+	std::vector<control_transfer> first;
+	add_request(first, USB_DIR_IN, USB_REQ_GET_DESCRIPTOR, USB_DT_DEVICE << 8, 0, 64);
+	add_request(first, USB_DIR_IN, USB_REQ_GET_STATUS, 0, 0, 2);
+	add_request(first, USB_DIR_IN, USB_REQ_GET_DESCRIPTOR, USB_DT_STRING << 8, 0, 255);
+	if (device_desc->bcdUSB >= 0x0201)
+		add_request(first, USB_DIR_IN, USB_REQ_GET_DESCRIPTOR, USB_DT_BOS << 8, 0, USB_DT_BOS_SIZE);
+	if (device_desc->bcdUSB >= 0x0200)
+		add_request(first, USB_DIR_IN, USB_REQ_GET_DESCRIPTOR, USB_DT_DEVICE_QUALIFIER << 8, 0,
+			sizeof(struct usb_qualifier_descriptor));
+
+	for (int i = 0; i < device_desc->bNumConfigurations; i++) {
+		const struct libusb_config_descriptor *config = device->config_descriptor(i);
+		if (!config)
+			continue;
+		uint16_t total_length = descriptor_serialize_config(config).size();
+		add_request(first, USB_DIR_IN, USB_REQ_GET_DESCRIPTOR, (USB_DT_CONFIG << 8) | i, 0,
+			std::max(total_length, config->wTotalLength));
+		string_indexes.push_back(config->iConfiguration);
+
+		for (int j = 0; j < config->bNumInterfaces; j++) {
+			const struct libusb_interface *iface = &config->interface[j];
+			for (int k = 0; k < iface->num_altsetting; k++) {
+				const struct libusb_interface_descriptor *alt = &iface->altsetting[k];
+				string_indexes.push_back(alt->iInterface);
+				if (alt->bInterfaceClass != USB_CLASS_HID || k != 0)
+					continue;
+
+				// The HID descriptor lists the length of the report descriptor.
+				for (int pos = 0; pos + 9 <= alt->extra_length; pos += alt->extra[pos]) {
+					const unsigned char *hid = alt->extra + pos;
+					if (hid[0] < 9)
+						break;
+					if (hid[1] != HID_DT_HID)
+						continue;
+					add_request(first, USB_DIR_IN | USB_RECIP_INTERFACE, USB_REQ_GET_DESCRIPTOR,
+						HID_DT_HID << 8, alt->bInterfaceNumber, hid[0]);
+					for (int d = 0; 6 + d * 3 + 2 < hid[0] && d < hid[5]; d++) {
+						if (hid[6 + d * 3] != HID_DT_REPORT)
+							continue;
+						add_request(first, USB_DIR_IN | USB_RECIP_INTERFACE,
+							USB_REQ_GET_DESCRIPTOR, (HID_DT_REPORT << 8) | d,
+							alt->bInterfaceNumber,
+							hid[7 + d * 3] | (hid[8 + d * 3] << 8));
+					}
+				}
+			}
+		}
+	}
+	device->control_requests(first, 1000);
+	int cached = store_results(first);
+
+	// Strings in every language, and the BOS descriptor in full.
+	std::vector<control_transfer> second;
+	const std::string *langids = find_result(first, USB_DT_STRING);
+	std::sort(string_indexes.begin(), string_indexes.end());
+	string_indexes.erase(std::unique(string_indexes.begin(), string_indexes.end()),
+		string_indexes.end());
+	for (size_t i = 2; langids && i + 1 < langids->size(); i += 2) {
+		uint16_t langid = (uint8_t)(*langids)[i] | ((uint8_t)(*langids)[i + 1] << 8);
+		for (uint8_t index : string_indexes) {
+			if (index)
+				add_request(second, USB_DIR_IN, USB_REQ_GET_DESCRIPTOR,
+					(USB_DT_STRING << 8) | index, langid, 255);
+		}
+	}
+	const std::string *bos = find_result(first, USB_DT_BOS);
+	if (bos && bos->size() >= USB_DT_BOS_SIZE) {
+		uint16_t total_length = (uint8_t)(*bos)[2] | ((uint8_t)(*bos)[3] << 8);
+		if (total_length > bos->size())
+			add_request(second, USB_DIR_IN, USB_REQ_GET_DESCRIPTOR, USB_DT_BOS << 8, 0,
+				total_length);
+	}
+	if (!second.empty()) {
+		device->control_requests(second, 1000);
+		cached += store_results(second);
+	}
+
+	printf("Prefetched %d of %zu ep0 responses\n", cached, first.size() + second.size());
+	return cached;
+}
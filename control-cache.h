@@ -0,0 +1,25 @@
+#pragma once
+
+#include <atomic>
+#include <linux/usb/ch9.h>
+
+class DeviceBackend;
+
+/*
+ * Cache of ep0 responses that do not change while the device stays
+ * connected: the device, configuration, string, BOS, qualifier and HID class
+ * descriptors, and the device's GET_STATUS until the next SET_FEATURE or
+ * CLEAR_FEATURE. control_cache_prefetch() reads them from the device before
+ * the host connects, so ep0_loop() can answer enumeration without a device
+ * round trip. Injection still applies to cached responses.
+ */
+
+extern std::atomic<bool> control_cache_enabled;
+
+bool control_cache_lookup(const struct usb_ctrlrequest *ctrl, unsigned char *data, int *nbytes);
+void control_cache_store(const struct usb_ctrlrequest *ctrl, const unsigned char *data, int nbytes);
+// Drops the entries an OUT request may have made stale.
+void control_cache_invalidate(const struct usb_ctrlrequest *ctrl);
+void control_cache_clear();
+// Returns the number of responses cached.
+int control_cache_prefetch(DeviceBackend *device);
@@ -0,0 +1,458 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "control-socket.h"
+#include "backend.h"
+#include "capture.h"
+#include "cpu-accounting.h"
+#include "injection.h"
+#include "stats.h"
+
+#define CONTROL_MAX_LINE	4096		// a client sending more without a newline is dropped
+
+static int control_fd = -1;
+static std::string control_path;
+static std::atomic<bool> control_running(false);
+static pthread_t control_thread;
+static std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+static const char *transfer_type_name(uint8_t bmAttributes) {
+	switch (bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) {
+	case USB_ENDPOINT_XFER_CONTROL:
+		return "control";
+	case USB_ENDPOINT_XFER_ISOC:
+		return "isoc";
+	case USB_ENDPOINT_XFER_BULK:
+		return "bulk";
+	default:
+		return "int";
+	}
+}
+
+static std::string stats_prometheus() {
+	std::ostringstream out;
+	double uptime = std::chrono::duration<double>(
+		std::chrono::steady_clock::now() - start_time).count();
+
+	out << "# TYPE usb_proxy_uptime_seconds gauge\n";
+	out << "usb_proxy_uptime_seconds " << uptime << "\n";
+	out << "# TYPE usb_proxy_injection_enabled gauge\n";
+	out << "usb_proxy_injection_enabled " << (injection_enabled ? 1 : 0) << "\n";
+	out << "# TYPE usb_proxy_capture_active gauge\n";
+	out << "usb_proxy_capture_active " << (capture_active ? 1 : 0) << "\n";
+	out << "# TYPE usb_proxy_verbose_level gauge\n";
+	out << "usb_proxy_verbose_level " << verbose_level << "\n";
+
+	out << "# TYPE usb_proxy_injection_reloads_total counter\n";
+	out << "usb_proxy_injection_reloads_total " << injection_reload_stats.reloads << "\n";
+	out << "# TYPE usb_proxy_injection_rejected_total counter\n";
+	out << "usb_proxy_injection_rejected_total " << injection_reload_stats.rejected << "\n";
+	out << "# TYPE usb_proxy_injection_reload_latency_us gauge\n";
+	out << "usb_proxy_injection_reload_latency_us " << injection_reload_stats.last_latency_us << "\n";
+	out << "# TYPE usb_proxy_injection_generation gauge\n";
+	out << "usb_proxy_injection_generation " << injection_reload_stats.generation << "\n";
+
+	out << "# TYPE usb_proxy_control_requests_total counter\n";
+	out << "usb_proxy_control_requests_total " << proxy_stats.control_requests << "\n";
+	out << "# TYPE usb_proxy_control_stalls_total counter\n";
+	out << "usb_proxy_control_stalls_total " << proxy_stats.control_stalls << "\n";
+	out << "# TYPE usb_proxy_control_ignored_total counter\n";
+	out << "usb_proxy_control_ignored_total " << proxy_stats.control_ignored << "\n";
+	out << "# TYPE usb_proxy_control_injected_total counter\n";
+	out << "usb_proxy_control_injected_total " << proxy_stats.control_injected << "\n";
+	out << "# TYPE usb_proxy_control_cache_hits_total counter\n";
+	out << "usb_proxy_control_cache_hits_total " << proxy_stats.control_cache_hits << "\n";
+	out << "# TYPE usb_proxy_control_cache_misses_total counter\n";
+	out << "usb_proxy_control_cache_misses_total " << proxy_stats.control_cache_misses << "\n";
+	out << "# TYPE usb_proxy_host_configured_seconds gauge\n";
+	out << "usb_proxy_host_configured_seconds " << proxy_stats.host_configured_us / 1e6 << "\n";
+	out << "# TYPE usb_proxy_time_to_first_packet_seconds gauge\n";
+	out << "usb_proxy_time_to_first_packet_seconds " << proxy_stats.first_packet_us / 1e6 << "\n";
+	out << "# TYPE usb_proxy_device_reconnects_total counter\n";
+	out << "usb_proxy_device_reconnects_total " << proxy_stats.device_reconnects << "\n";
+	out << "# TYPE usb_proxy_device_downtime_seconds gauge\n";
+	out << "usb_proxy_device_downtime_seconds " << proxy_stats.device_downtime_us / 1e6 << "\n";
+
+	struct {
+		const char *name;
+		const char *type;
+		uint64_t ep_stats_snapshot::*field;
+	} counters[] = {
+		{"usb_proxy_ep_enqueued_total", "counter", &ep_stats_snapshot::enqueued},
+		{"usb_proxy_ep_forwarded_total", "counter", &ep_stats_snapshot::forwarded},
+		{"usb_proxy_ep_bytes_total", "counter", &ep_stats_snapshot::bytes},
+		{"usb_proxy_ep_injected_total", "counter", &ep_stats_snapshot::injected},
+		{"usb_proxy_ep_errors_total", "counter", &ep_stats_snapshot::errors},
+	};
+
+	struct ep_stats_snapshot snapshots[EP_STATS_SLOTS];
+	for (int i = 0; i < EP_STATS_SLOTS; i++)
+		stats_ep_snapshot(i, &snapshots[i]);
+
+	char labels[64];
+	for (auto &counter : counters) {
+		out << "# TYPE " << counter.name << " " << counter.type << "\n";
+		for (int i = 0; i < EP_STATS_SLOTS; i++) {
+			struct ep_stats_snapshot *s = &snapshots[i];
+			if (!s->enqueued && !s->forwarded && !s->active)
+				continue;
+			snprintf(labels, sizeof(labels), "{ep=\"%02x\",type=\"%s\",dir=\"%s\"}",
+				s->bEndpointAddress, transfer_type_name(s->bmAttributes),
+				(s->bEndpointAddress & USB_DIR_IN) ? "in" : "out");
+			out << counter.name << labels << " " << s->*counter.field << "\n";
+		}
+	}
+
+	if (cpu_accounting_mode) {
+		out << "# TYPE usb_proxy_ep_cpu_seconds_total counter\n";
+		for (int i = 0; i < EP_STATS_SLOTS; i++) {
+			uint8_t address = (i & 0x0f) | ((i & 0x10) << 3);
+			for (int stage = 0; stage < CPU_STAGE_COUNT; stage++) {
+				double seconds = cpu_stage_seconds(i, stage);
+				if (!seconds)
+					continue;
+				snprintf(labels, sizeof(labels), "{ep=\"%02x\",stage=\"%s\"}",
+					address, cpu_stage_name(stage));
+				out << "usb_proxy_ep_cpu_seconds_total" << labels << " " << seconds << "\n";
+			}
+		}
+	}
+
+	out << "# TYPE usb_proxy_ep_queue_depth gauge\n";
+	for (int i = 0; i < EP_STATS_SLOTS; i++) {
+		struct ep_stats_snapshot *s = &snapshots[i];
+		if (!s->active)
+			continue;
+		snprintf(labels, sizeof(labels), "{ep=\"%02x\"}", s->bEndpointAddress);
+		out << "usb_proxy_ep_queue_depth" << labels << " " << s->queue_depth << "\n";
+	}
+
+	out << "# TYPE usb_proxy_ep_queue_depth_max gauge\n";
+	for (int i = 0; i < EP_STATS_SLOTS; i++) {
+		struct ep_stats_snapshot *s = &snapshots[i];
+		if (!s->active)
+			continue;
+		snprintf(labels, sizeof(labels), "{ep=\"%02x\"}", s->bEndpointAddress);
+		out << "usb_proxy_ep_queue_depth_max" << labels << " " << s->queue_max << "\n";
+	}
+
+	return out.str();
+}
+
+static std::string stats_json() {
+	Json::Value root;
+	root["uptime_seconds"] = std::chrono::duration<double>(
+		std::chrono::steady_clock::now() - start_time).count();
+	root["injection_enabled"] = injection_enabled.load();
+	root["capture_active"] = capture_active.load();
+	root["verbose_level"] = verbose_level.load();
+	root["injection"]["reloads"] = (Json::UInt64)injection_reload_stats.reloads;
+	root["injection"]["rejected"] = (Json::UInt64)injection_reload_stats.rejected;
+	root["injection"]["reload_latency_us"] = (Json::UInt64)injection_reload_stats.last_latency_us;
+	root["injection"]["generation"] = (Json::UInt64)injection_reload_stats.generation;
+	root["injection"]["last_error"] = injection_last_error();
+	root["control"]["requests"] = (Json::UInt64)proxy_stats.control_requests;
+	root["control"]["stalls"] = (Json::UInt64)proxy_stats.control_stalls;
+	root["control"]["ignored"] = (Json::UInt64)proxy_stats.control_ignored;
+	root["control"]["injected"] = (Json::UInt64)proxy_stats.control_injected;
+	root["control"]["cache_hits"] = (Json::UInt64)proxy_stats.control_cache_hits;
+	root["control"]["cache_misses"] = (Json::UInt64)proxy_stats.control_cache_misses;
+	root["host_configured_seconds"] = proxy_stats.host_configured_us / 1e6;
+	root["time_to_first_packet_seconds"] = proxy_stats.first_packet_us / 1e6;
+	root["device"]["reconnects"] = (Json::UInt64)proxy_stats.device_reconnects;
+	root["device"]["downtime_seconds"] = proxy_stats.device_downtime_us / 1e6;
+	root["endpoints"] = Json::arrayValue;
+
+	for (int i = 0; i < EP_STATS_SLOTS; i++) {
+		struct ep_stats_snapshot s;
+		stats_ep_snapshot(i, &s);
+		if (!s.enqueued && !s.forwarded && !s.active)
+			continue;
+
+		char address[8];
+		snprintf(address, sizeof(address), "%02x", s.bEndpointAddress);
+
+		Json::Value ep;
+		ep["ep_address"] = address;
+		ep["type"] = transfer_type_name(s.bmAttributes);
+		ep["dir"] = (s.bEndpointAddress & USB_DIR_IN) ? "in" : "out";
+		ep["active"] = s.active;
+		ep["enqueued"] = (Json::UInt64)s.enqueued;
+		ep["forwarded"] = (Json::UInt64)s.forwarded;
+		ep["bytes"] = (Json::UInt64)s.bytes;
+		ep["injected"] = (Json::UInt64)s.injected;
+		ep["errors"] = (Json::UInt64)s.errors;
+		ep["queue_depth"] = s.queue_depth;
+		ep["queue_max"] = s.queue_max;
+		root["endpoints"].append(ep);
+	}
+
+	Json::StreamWriterBuilder builder;
+	builder["indentation"] = "";
+	return Json::writeString(builder, root) + "\n";
+}
+
+static std::string list_endpoints() {
+	std::ostringstream out;
+	char line[160];
+	for (int i = 0; i < EP_STATS_SLOTS; i++) {
+		struct ep_stats_snapshot s;
+		stats_ep_snapshot(i, &s);
+		if (!s.active)
+			continue;
+		snprintf(line, sizeof(line), "EP%02x %s_%s queue=%d max=%d enqueued=%llu forwarded=%llu\n",
+			s.bEndpointAddress, transfer_type_name(s.bmAttributes),
+			(s.bEndpointAddress & USB_DIR_IN) ? "in" : "out",
+			s.queue_depth, s.queue_max,
+			(unsigned long long)s.enqueued, (unsigned long long)s.forwarded);
+		out << line;
+	}
+	return out.str();
+}
+
+static void list_rule(std::ostringstream &out, const std::string &name, int index,
+			const Json::Value &rule) {
+	if (!rule.isObject())
+		return;
+	out << name << " " << index << " " << (rule["enable"].isBool() && rule["enable"].asBool() ?
+		"on" : "off");
+	if (rule["ep_address"].isInt())
+		out << " ep_address=" << rule["ep_address"].asInt();
+	if (rule["comment"].isString())
+		out << " comment=" << rule["comment"].asString();
+	out << "\n";
+}
+
+static void list_rules_of(std::ostringstream &out, const std::string &name,
+			const Json::Value &rules) {
+	for (unsigned int i = 0; rules.isArray() && i < rules.size(); i++)
+		list_rule(out, name, i, rules[i]);
+}
+
+static std::string list_rules() {
+	rcu_read_guard guard;
+	const Json::Value &config = injection_rules()->source;
+	std::ostringstream out;
+
+	if (!config.isObject())
+		return "";
+	for (const char *type : {"modify", "ignore", "stall"})
+		if (config["control"].isObject())
+			list_rules_of(out, std::string("control ") + type, config["control"][type]);
+	for (const char *type : {"int", "bulk", "isoc"})
+		list_rules_of(out, type, config[type]);
+
+	return out.str();
+}
+
+static bool parse_switch(const std::string &word, bool *value) {
+	if (word == "on" || word == "1" || word == "enable") {
+		*value = true;
+		return true;
+	}
+	if (word == "off" || word == "0" || word == "disable") {
+		*value = false;
+		return true;
+	}
+	return false;
+}
+
+// rule <int|bulk|isoc> <index> <on|off>
+// rule control <modify|ignore|stall> <index> <on|off>
+static std::string toggle_rule(std::istringstream &args) {
+	std::string type, control_type, state;
+	unsigned int index;
+	bool enable;
+
+	args >> type;
+	if (type == "control")
+		args >> control_type;
+	if (!(args >> index >> state) || !parse_switch(state, &enable))
+		return "error: usage: rule [control <modify|ignore|stall>|int|bulk|isoc] <index> <on|off>\n";
+
+	std::string error;
+	if (!injection_rule_set_enabled(type, control_type, index, enable, error))
+		return "error: " + error + "\n";
+	printf("Control socket: rule %s %s%d %s\n", type.c_str(),
+		control_type.empty() ? "" : (control_type + " ").c_str(), index,
+		enable ? "enabled" : "disabled");
+	return "ok\n";
+}
+
+std::string control_command(const std::string &line) {
+	std::istringstream args(line);
+	std::string command;
+	args >> command;
+
+	if (command.empty())
+		return "";
+	if (command == "help") {
+		return "stats [prometheus|json]\n"
+			"endpoints\n"
+			"rules\n"
+			"rule [control <modify|ignore|stall>|int|bulk|isoc] <index> <on|off>\n"
+			"injection <on|off>\n"
+			"reload\n"
+			"capture start <file>\n"
+			"capture stop\n"
+			"loglevel <level>\n";
+	}
+	if (command == "stats") {
+		std::string format;
+		args >> format;
+		if (format.empty() || format == "prometheus")
+			return stats_prometheus();
+		if (format == "json")
+			return stats_json();
+		return "error: unknown stats format\n";
+	}
+	if (command == "endpoints")
+		return list_endpoints();
+	if (command == "rules")
+		return list_rules();
+	if (command == "rule")
+		return toggle_rule(args);
+	if (command == "injection") {
+		std::string state;
+		bool enable;
+		args >> state;
+		if (!parse_switch(state, &enable))
+			return "error: usage: injection <on|off>\n";
+		injection_enabled = enable;
+		printf("Control socket: injection %s\n", enable ? "enabled" : "disabled");
+		return "ok\n";
+	}
+	if (command == "reload") {
+		std::string error;
+		if (injection_file.empty() || !injection_rules_load(injection_file, error))
+			return "error: " + error + "\n";
+		return "ok\n";
+	}
+	if (command == "capture") {
+		std::string action, path;
+		args >> action >> path;
+		if (action == "start" && !path.empty()) {
+			if (!capture_start(path))
+				return "error: could not open capture file\n";
+			capture_descriptors(device_backend);
+			return "ok\n";
+		}
+		if (action == "stop") {
+			capture_stop();
+			return "ok\n";
+		}
+		return "error: usage: capture start <file> | capture stop\n";
+	}
+	if (command == "loglevel") {
+		int level;
+		if (!(args >> level) || level < 0)
+			return "error: usage: loglevel <level>\n";
+		verbose_level = level;
+		printf("Control socket: verbose level set to %d\n", level);
+		return "ok\n";
+	}
+
+	return "error: unknown command, try 'help'\n";
+}
+
+static void handle_client(int client_fd) {
+	std::string buffer;
+	char chunk[256];
+
+	while (control_running) {
+		struct pollfd pfd = { client_fd, POLLIN, 0 };
+		int rv = poll(&pfd, 1, 200);
+		if (rv == 0)
+			continue;
+		if (rv < 0 && errno == EINTR)
+			continue;
+		if (rv < 0)
+			break;
+
+		ssize_t n = read(client_fd, chunk, sizeof(chunk));
+		if (n <= 0)
+			break;
+		buffer.append(chunk, n);
+
+		size_t pos;
+		while ((pos = buffer.find('\n')) != std::string::npos) {
+			std::string response = control_command(buffer.substr(0, pos));
+			buffer.erase(0, pos + 1);
+			if (send(client_fd, response.data(), response.size(), MSG_NOSIGNAL) < 0)
+				return;
+		}
+		if (buffer.size() >= CONTROL_MAX_LINE) {
+			static const char error[] = "error: line too long\n";
+			send(client_fd, error, sizeof(error) - 1, MSG_NOSIGNAL);
+			return;
+		}
+	}
+}
+
+static void *control_socket_loop(void *arg __attribute__((unused))) {
+	printf("Start control socket thread, thread id(%d)\n", gettid());
+
+	while (control_running) {
+		struct pollfd pfd = { control_fd, POLLIN, 0 };
+		int rv = poll(&pfd, 1, 200);
+		if (rv <= 0)
+			continue;
+
+		int client_fd = accept(control_fd, NULL, NULL);
+		if (client_fd < 0)
+			continue;
+		handle_client(client_fd);
+		close(client_fd);
+	}
+
+	printf("End control socket thread, thread id(%d)\n", gettid());
+	return NULL;
+}
+
+int control_socket_start(const std::string &path) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Control socket path too long: %s\n", path.c_str());
+		return -1;
+	}
+	strcpy(addr.sun_path, path.c_str());
+
+	control_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (control_fd < 0) {
+		perror("socket() control socket");
+		return -1;
+	}
+
+	unlink(path.c_str());
+	if (bind(control_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(control_fd, 4) < 0) {
+		perror("bind() control socket");
+		close(control_fd);
+		control_fd = -1;
+		return -1;
+	}
+
+	control_path = path;
+	control_running = true;
+	pthread_create(&control_thread, 0, control_socket_loop, nullptr);
+	printf("Control socket listening on %s\n", path.c_str());
+	return 0;
+}
+
+void control_socket_stop() {
+	if (control_fd < 0)
+		return;
+
+	control_running = false;
+	if (pthread_join(control_thread, NULL))
+		fprintf(stderr, "Error join control_thread\n");
+	close(control_fd);
+	unlink(control_path.c_str());
+	control_fd = -1;
+}
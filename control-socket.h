@@ -0,0 +1,7 @@
+#include <string>
+
+#include "misc.h"
+
+int control_socket_start(const std::string &path);
+void control_socket_stop();
+std::string control_command(const std::string &line);
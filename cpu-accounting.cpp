@@ -0,0 +1,180 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "cpu-accounting.h"
+#include "stats.h"
+
+int cpu_accounting_mode = CPU_ACCOUNTING_OFF;
+
+struct alignas(64) cpu_ep_account {
+	std::atomic<uint64_t>	ticks[CPU_STAGE_COUNT];
+};
+
+struct cpu_thread_account {
+	int		slot = 0;
+	int		stage = CPU_STAGE_OTHER;
+	uint64_t	since = 0;
+};
+
+static const char *stage_names[CPU_STAGE_COUNT] = {
+	"other", "libusb", "raw-gadget", "injection", "queue", "log", "capture", "idle"
+};
+
+static struct cpu_ep_account cpu_accounts[EP_STATS_SLOTS];
+static thread_local struct cpu_thread_account cpu_thread;
+static double ticks_per_second = 1e9;
+
+static int report_interval;
+static std::atomic<bool> report_running(false);
+static pthread_t report_thread;
+
+static inline uint64_t cpu_ticks() {
+	struct timespec ts;
+	if (cpu_accounting_mode == CPU_ACCOUNTING_CYCLES) {
+#if defined(__x86_64__) || defined(__i386__)
+		return __rdtsc();
+#elif defined(__aarch64__)
+		uint64_t value;
+		asm volatile("mrs %0, cntvct_el0" : "=r"(value));
+		return value;
+#else
+		clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+		return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+	}
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int cpu_stage_switch(int stage) {
+	uint64_t now = cpu_ticks();
+	int previous = cpu_thread.stage;
+
+	if (cpu_thread.since)
+		cpu_accounts[cpu_thread.slot].ticks[previous].fetch_add(
+			now - cpu_thread.since, std::memory_order_relaxed);
+	cpu_thread.since = now;
+	cpu_thread.stage = stage;
+	return previous;
+}
+
+void cpu_account_thread(uint8_t bEndpointAddress) {
+	cpu_thread.slot = (bEndpointAddress & 0x0f) | ((bEndpointAddress & 0x80) >> 3);
+	cpu_thread.stage = CPU_STAGE_OTHER;
+	cpu_thread.since = cpu_accounting_mode ? cpu_ticks() : 0;
+}
+
+const char *cpu_stage_name(int stage) {
+	return stage_names[stage];
+}
+
+double cpu_stage_seconds(int slot, int stage) {
+	return cpu_accounts[slot].ticks[stage].load(std::memory_order_relaxed) / ticks_per_second;
+}
+
+static void calibrate_ticks() {
+	if (cpu_accounting_mode != CPU_ACCOUNTING_CYCLES)
+		return;
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+	uint64_t ticks_start = cpu_ticks();
+	usleep(50 * 1000);
+	uint64_t ticks_end = cpu_ticks();
+	clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	ticks_per_second = (ticks_end - ticks_start) / elapsed;
+	printf("CPU accounting: cycle counter runs at %.1f MHz\n", ticks_per_second / 1e6);
+}
+
+static void print_report(uint64_t previous[EP_STATS_SLOTS][CPU_STAGE_COUNT], double elapsed) {
+	for (int slot = 0; slot < EP_STATS_SLOTS; slot++) {
+		uint64_t delta[CPU_STAGE_COUNT];
+		uint64_t busy = 0;
+		for (int stage = 0; stage < CPU_STAGE_COUNT; stage++) {
+			uint64_t ticks = cpu_accounts[slot].ticks[stage].load(std::memory_order_relaxed);
+			delta[stage] = ticks - previous[slot][stage];
+			previous[slot][stage] = ticks;
+			if (stage != CPU_STAGE_IDLE)
+				busy += delta[stage];
+		}
+		if (!busy)
+			continue;
+
+		uint8_t address = (slot & 0x0f) | ((slot & 0x10) << 3);
+		char line[256];
+		int length = snprintf(line, sizeof(line), "CPU EP%02x (%.1f ms/s):",
+			address, busy / ticks_per_second * 1000 / elapsed);
+
+		// Largest share first, like a profiler would list them.
+		bool printed[CPU_STAGE_COUNT] = {};
+		for (int n = 0; n < CPU_STAGE_IDLE; n++) {
+			int top = -1;
+			for (int stage = 0; stage < CPU_STAGE_IDLE; stage++)
+				if (!printed[stage] && (top < 0 || delta[stage] > delta[top]))
+					top = stage;
+			printed[top] = true;
+			if (!delta[top])
+				break;
+			length += snprintf(line + length, sizeof(line) - length, "%s %.0f%% %s",
+				n ? "," : "", 100.0 * delta[top] / busy, stage_names[top]);
+			if (length >= (int)sizeof(line))
+				break;
+		}
+		printf("%s\n", line);
+	}
+}
+
+static void *cpu_report_loop(void *arg __attribute__((unused))) {
+	static uint64_t previous[EP_STATS_SLOTS][CPU_STAGE_COUNT];
+	struct timespec last, now;
+	clock_gettime(CLOCK_MONOTONIC, &last);
+
+	while (report_running) {
+		for (int i = 0; i < report_interval * 10 && report_running; i++)
+			usleep(100 * 1000);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		double elapsed = (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9;
+		last = now;
+		print_report(previous, elapsed);
+	}
+	return NULL;
+}
+
+int cpu_accounting_start(const char *mode, int interval) {
+	if (!strcmp(mode, "thread"))
+		cpu_accounting_mode = CPU_ACCOUNTING_THREAD;
+	else if (!strcmp(mode, "cycles"))
+		cpu_accounting_mode = CPU_ACCOUNTING_CYCLES;
+	else {
+		fprintf(stderr, "Unknown CPU accounting mode: %s\n", mode);
+		return -1;
+	}
+
+	calibrate_ticks();
+	printf("CPU accounting enabled (%s), reporting every %d s\n", mode, interval);
+
+	if (interval > 0) {
+		report_interval = interval;
+		report_running = true;
+		pthread_create(&report_thread, 0, cpu_report_loop, nullptr);
+	}
+	return 0;
+}
+
+void cpu_accounting_stop() {
+	if (!report_running)
+		return;
+
+	report_running = false;
+	if (pthread_join(report_thread, NULL))
+		fprintf(stderr, "Error join cpu report thread\n");
+}
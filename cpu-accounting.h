@@ -0,0 +1,62 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+/*
+ * Optional per-endpoint CPU cost accounting, split by pipeline stage.
+ *
+ * Each thread is always "in" one stage. cpu_stage() switches to a new stage
+ * (cpu_stage_scope does so for its lifetime) and charges the time spent since
+ * the previous switch to the stage that was active, so every boundary costs
+ * exactly one clock read and one relaxed atomic add. When accounting is off, a scope is a single
+ * branch on a global that never changes after startup.
+ */
+
+enum cpu_stage {
+	CPU_STAGE_OTHER,
+	CPU_STAGE_LIBUSB,
+	CPU_STAGE_RAW_GADGET,
+	CPU_STAGE_INJECTION,
+	CPU_STAGE_QUEUE,
+	CPU_STAGE_LOG,
+	CPU_STAGE_CAPTURE,
+	CPU_STAGE_IDLE,		// sleeping while polling, never reported as cost
+	CPU_STAGE_COUNT
+};
+
+enum cpu_accounting_mode {
+	CPU_ACCOUNTING_OFF,
+	CPU_ACCOUNTING_THREAD,	// CLOCK_THREAD_CPUTIME_ID, CPU time only
+	CPU_ACCOUNTING_CYCLES,	// cycle counter, wall time spent in each stage
+};
+
+extern int cpu_accounting_mode;
+
+int cpu_stage_switch(int stage);
+void cpu_account_thread(uint8_t bEndpointAddress);
+
+static inline void cpu_stage(int stage) {
+	if (cpu_accounting_mode)
+		cpu_stage_switch(stage);
+}
+
+struct cpu_stage_scope {
+	int previous;
+
+	explicit cpu_stage_scope(int stage) : previous(-1) {
+		if (cpu_accounting_mode)
+			previous = cpu_stage_switch(stage);
+	}
+	~cpu_stage_scope() {
+		if (previous >= 0)
+			cpu_stage_switch(previous);
+	}
+	cpu_stage_scope(const cpu_stage_scope &) = delete;
+	cpu_stage_scope &operator=(const cpu_stage_scope &) = delete;
+};
+
+int cpu_accounting_start(const char *mode, int report_interval);
+void cpu_accounting_stop();
+const char *cpu_stage_name(int stage);
+double cpu_stage_seconds(int slot, int stage);
@@ -0,0 +1,460 @@
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include <linux/usb/ch9.h>
+
+#include "descriptors.h"
+
+static void put_le16(std::string &out, uint16_t value) {
+	out += (char)(value & 0xff);
+	out += (char)(value >> 8);
+}
+
+static uint16_t get_le16(const std::string &raw, size_t pos) {
+	return (uint8_t)raw[pos] | ((uint8_t)raw[pos + 1] << 8);
+}
+
+static void put_extra(std::string &out, const unsigned char *extra, int length) {
+	if (extra && length > 0)
+		out.append((const char *)extra, length);
+}
+
+std::string descriptor_serialize_device(const struct libusb_device_descriptor *desc) {
+	std::string out;
+	out += (char)USB_DT_DEVICE_SIZE;
+	out += (char)USB_DT_DEVICE;
+	put_le16(out, desc->bcdUSB);
+	out += (char)desc->bDeviceClass;
+	out += (char)desc->bDeviceSubClass;
+	out += (char)desc->bDeviceProtocol;
+	out += (char)desc->bMaxPacketSize0;
+	put_le16(out, desc->idVendor);
+	put_le16(out, desc->idProduct);
+	put_le16(out, desc->bcdDevice);
+	out += (char)desc->iManufacturer;
+	out += (char)desc->iProduct;
+	out += (char)desc->iSerialNumber;
+	out += (char)desc->bNumConfigurations;
+	return out;
+}
+
+std::string descriptor_serialize_config(const struct libusb_config_descriptor *config) {
+	std::string out;
+	out += (char)USB_DT_CONFIG_SIZE;
+	out += (char)USB_DT_CONFIG;
+	put_le16(out, 0);	// wTotalLength, filled in below
+	out += (char)config->bNumInterfaces;
+	out += (char)config->bConfigurationValue;
+	out += (char)config->iConfiguration;
+	out += (char)config->bmAttributes;
+	out += (char)config->MaxPower;
+	put_extra(out, config->extra, config->extra_length);
+
+	for (int i = 0; i < config->bNumInterfaces; i++) {
+		const struct libusb_interface *iface = &config->interface[i];
+		for (int j = 0; j < iface->num_altsetting; j++) {
+			const struct libusb_interface_descriptor *alt = &iface->altsetting[j];
+			out += (char)USB_DT_INTERFACE_SIZE;
+			out += (char)USB_DT_INTERFACE;
+			out += (char)alt->bInterfaceNumber;
+			out += (char)alt->bAlternateSetting;
+			out += (char)alt->bNumEndpoints;
+			out += (char)alt->bInterfaceClass;
+			out += (char)alt->bInterfaceSubClass;
+			out += (char)alt->bInterfaceProtocol;
+			out += (char)alt->iInterface;
+			put_extra(out, alt->extra, alt->extra_length);
+
+			for (int k = 0; k < alt->bNumEndpoints; k++) {
+				const struct libusb_endpoint_descriptor *ep = &alt->endpoint[k];
+				// Audio endpoints carry bRefresh and bSynchAddress.
+				bool audio = ep->bLength >= USB_DT_ENDPOINT_AUDIO_SIZE;
+				out += (char)(audio ? USB_DT_ENDPOINT_AUDIO_SIZE : USB_DT_ENDPOINT_SIZE);
+				out += (char)USB_DT_ENDPOINT;
+				out += (char)ep->bEndpointAddress;
+				out += (char)ep->bmAttributes;
+				put_le16(out, ep->wMaxPacketSize);
+				out += (char)ep->bInterval;
+				if (audio) {
+					out += (char)ep->bRefresh;
+					out += (char)ep->bSynchAddress;
+				}
+				put_extra(out, ep->extra, ep->extra_length);
+			}
+		}
+	}
+
+	out[2] = (char)(out.size() & 0xff);
+	out[3] = (char)(out.size() >> 8);
+	return out;
+}
+
+bool descriptor_parse_device(const std::string &raw, struct libusb_device_descriptor *desc) {
+	if (raw.size() < USB_DT_DEVICE_SIZE || (uint8_t)raw[1] != USB_DT_DEVICE)
+		return false;
+
+	desc->bLength = raw[0];
+	desc->bDescriptorType = raw[1];
+	desc->bcdUSB = get_le16(raw, 2);
+	desc->bDeviceClass = raw[4];
+	desc->bDeviceSubClass = raw[5];
+	desc->bDeviceProtocol = raw[6];
+	desc->bMaxPacketSize0 = raw[7];
+	desc->idVendor = get_le16(raw, 8);
+	desc->idProduct = get_le16(raw, 10);
+	desc->bcdDevice = get_le16(raw, 12);
+	desc->iManufacturer = raw[14];
+	desc->iProduct = raw[15];
+	desc->iSerialNumber = raw[16];
+	desc->bNumConfigurations = raw[17];
+	return true;
+}
+
+static unsigned char *copy_extra(const std::string &extra) {
+	if (extra.empty())
+		return NULL;
+	unsigned char *copy = new unsigned char[extra.size()];
+	memcpy(copy, extra.data(), extra.size());
+	return copy;
+}
+
+struct parsed_altsetting {
+	struct libusb_interface_descriptor		desc;
+	std::string					extra;
+	std::vector<struct libusb_endpoint_descriptor>	endpoints;
+	std::vector<std::string>			endpoint_extra;
+};
+
+struct parsed_interface {
+	uint8_t					bInterfaceNumber;
+	std::vector<parsed_altsetting>		altsettings;
+};
+
+struct libusb_config_descriptor *descriptor_parse_config(const std::string &raw) {
+	if (raw.size() < USB_DT_CONFIG_SIZE || (uint8_t)raw[1] != USB_DT_CONFIG)
+		return NULL;
+
+	std::string config_extra;
+	std::vector<parsed_interface> interfaces;
+	parsed_altsetting *alt = NULL;
+
+	size_t end = std::min(raw.size(), (size_t)get_le16(raw, 2));
+	for (size_t pos = (uint8_t)raw[0]; pos + 2 <= end;) {
+		uint8_t length = raw[pos];
+		uint8_t type = raw[pos + 1];
+		if (length < 2 || pos + length > end)
+			return NULL;
+		std::string desc = raw.substr(pos, length);
+		pos += length;
+
+		if (type == USB_DT_INTERFACE && length >= USB_DT_INTERFACE_SIZE) {
+			parsed_interface *iface = NULL;
+			for (parsed_interface &candidate : interfaces) {
+				if (candidate.bInterfaceNumber == (uint8_t)desc[2])
+					iface = &candidate;
+			}
+			if (!iface) {
+				interfaces.push_back({ (uint8_t)desc[2], {} });
+				iface = &interfaces.back();
+			}
+			iface->altsettings.emplace_back();
+			alt = &iface->altsettings.back();
+			alt->desc = {};
+			alt->desc.bLength = length;
+			alt->desc.bDescriptorType = type;
+			alt->desc.bInterfaceNumber = desc[2];
+			alt->desc.bAlternateSetting = desc[3];
+			alt->desc.bInterfaceClass = desc[5];
+			alt->desc.bInterfaceSubClass = desc[6];
+			alt->desc.bInterfaceProtocol = desc[7];
+			alt->desc.iInterface = desc[8];
+		}
+		else if (type == USB_DT_ENDPOINT && length >= USB_DT_ENDPOINT_SIZE && alt) {
+			struct libusb_endpoint_descriptor ep = {};
+			ep.bLength = length;
+			ep.bDescriptorType = type;
+			ep.bEndpointAddress = desc[2];
+			ep.bmAttributes = desc[3];
+			ep.wMaxPacketSize = get_le16(desc, 4);
+			ep.bInterval = desc[6];
+			if (length >= USB_DT_ENDPOINT_AUDIO_SIZE) {
+				ep.bRefresh = desc[7];
+				ep.bSynchAddress = desc[8];
+			}
+			alt->endpoints.push_back(ep);
+			alt->endpoint_extra.emplace_back();
+		}
+		else if (alt && !alt->endpoints.empty())
+			alt->endpoint_extra.back() += desc;
+		else if (alt)
+			alt->extra += desc;
+		else
+			config_extra += desc;
+	}
+
+	struct libusb_config_descriptor *config = new libusb_config_descriptor();
+	config->bLength = raw[0];
+	config->bDescriptorType = raw[1];
+	config->wTotalLength = get_le16(raw, 2);
+	config->bNumInterfaces = interfaces.size();
+	config->bConfigurationValue = raw[5];
+	config->iConfiguration = raw[6];
+	config->bmAttributes = raw[7];
+	config->MaxPower = raw[8];
+	config->extra = copy_extra(config_extra);
+	config->extra_length = config_extra.size();
+
+	struct libusb_interface *ifaces = new libusb_interface[interfaces.size()];
+	for (size_t i = 0; i < interfaces.size(); i++) {
+		std::vector<parsed_altsetting> &parsed = interfaces[i].altsettings;
+		struct libusb_interface_descriptor *alts = new libusb_interface_descriptor[parsed.size()];
+		for (size_t j = 0; j < parsed.size(); j++) {
+			alts[j] = parsed[j].desc;
+			alts[j].bNumEndpoints = parsed[j].endpoints.size();
+			alts[j].extra = copy_extra(parsed[j].extra);
+			alts[j].extra_length = parsed[j].extra.size();
+
+			struct libusb_endpoint_descriptor *eps = NULL;
+			if (!parsed[j].endpoints.empty())
+				eps = new libusb_endpoint_descriptor[parsed[j].endpoints.size()];
+			for (size_t k = 0; k < parsed[j].endpoints.size(); k++) {
+				eps[k] = parsed[j].endpoints[k];
+				eps[k].extra = copy_extra(parsed[j].endpoint_extra[k]);
+				eps[k].extra_length = parsed[j].endpoint_extra[k].size();
+			}
+			alts[j].endpoint = eps;
+		}
+		ifaces[i].altsetting = alts;
+		ifaces[i].num_altsetting = parsed.size();
+	}
+	config->interface = ifaces;
+	return config;
+}
+
+void descriptor_free_config(struct libusb_config_descriptor *config) {
+	if (!config)
+		return;
+
+	for (int i = 0; i < config->bNumInterfaces; i++) {
+		const struct libusb_interface *iface = &config->interface[i];
+		for (int j = 0; j < iface->num_altsetting; j++) {
+			const struct libusb_interface_descriptor *alt = &iface->altsetting[j];
+			for (int k = 0; k < alt->bNumEndpoints; k++)
+				delete[] alt->endpoint[k].extra;
+			delete[] alt->endpoint;
+			delete[] alt->extra;
+		}
+		delete[] iface->altsetting;
+	}
+	delete[] config->interface;
+	delete[] config->extra;
+	delete config;
+}
+
+/*----------------------------------------------------------------------*/
+
+bool descriptor_find_ss_companion(const struct libusb_endpoint_descriptor *ep,
+		struct usb_ss_ep_comp_descriptor *companion) {
+	for (int i = 0; i + USB_DT_SS_EP_COMP_SIZE <= ep->extra_length; i += ep->extra[i]) {
+		if (ep->extra[i] < 2)
+			break;
+		if (ep->extra[i + 1] == USB_DT_SS_ENDPOINT_COMP &&
+		    ep->extra[i] >= USB_DT_SS_EP_COMP_SIZE) {
+			memcpy(companion, &ep->extra[i], USB_DT_SS_EP_COMP_SIZE);
+			return true;
+		}
+	}
+	return false;
+}
+
+void descriptor_adapt_endpoint(struct usb_endpoint_descriptor *ep,
+		enum usb_device_speed device_speed, enum usb_device_speed gadget_speed) {
+	if (gadget_speed >= device_speed)
+		return;
+
+	int maxp = usb_endpoint_maxp(ep);
+	switch (usb_endpoint_type(ep)) {
+	case USB_ENDPOINT_XFER_BULK:
+		maxp = gadget_speed == USB_SPEED_HIGH ? 512 : std::min(maxp, 64);
+		break;
+	case USB_ENDPOINT_XFER_INT:
+		maxp = std::min(maxp, gadget_speed == USB_SPEED_HIGH ? 1024 :
+				gadget_speed == USB_SPEED_FULL ? 64 : 8);
+		break;
+	case USB_ENDPOINT_XFER_ISOC:
+		maxp = std::min(maxp, gadget_speed == USB_SPEED_HIGH ? 1024 : 1023);
+		break;
+	}
+	ep->wMaxPacketSize = maxp;
+
+	// High speed and faster count periodic intervals as 2^(bInterval-1)
+	// microframes, full and low speed in frames.
+	if (device_speed >= USB_SPEED_HIGH && gadget_speed < USB_SPEED_HIGH && ep->bInterval) {
+		int exponent = std::min(ep->bInterval, (uint8_t)16) - 1;
+		if (usb_endpoint_xfer_int(ep))
+			ep->bInterval = std::min(std::max((1 << exponent) / 8, 1), 255);
+		else if (usb_endpoint_xfer_isoc(ep))
+			ep->bInterval = std::max(exponent + 1 - 3, 1);
+	}
+}
+
+void descriptor_adapt_device(unsigned char *raw, int length,
+		enum usb_device_speed device_speed, enum usb_device_speed gadget_speed) {
+	if (gadget_speed >= USB_SPEED_SUPER || device_speed < USB_SPEED_SUPER)
+		return;
+
+	// What a USB 3 device reports itself when it is attached at high speed.
+	if (length >= 4 && (raw[2] | (raw[3] << 8)) >= 0x0300) {
+		raw[2] = 0x10;
+		raw[3] = 0x02;
+	}
+	if (length >= 8 && raw[7] == 9)
+		raw[7] = 64;
+}
+
+std::string descriptor_adapt_config(const std::string &raw,
+		enum usb_device_speed device_speed, enum usb_device_speed gadget_speed) {
+	if (gadget_speed >= device_speed)
+		return raw;
+
+	std::string out;
+	size_t pos = 0;
+	while (pos + 2 <= raw.size()) {
+		size_t length = (uint8_t)raw[pos];
+		uint8_t type = raw[pos + 1];
+		if (length < 2 || pos + length > raw.size())
+			break;
+
+		std::string desc = raw.substr(pos, length);
+		pos += length;
+
+		if (gadget_speed < USB_SPEED_SUPER &&
+		    (type == USB_DT_SS_ENDPOINT_COMP || type == USB_DT_SSP_ISOC_ENDPOINT_COMP))
+			continue;
+		if (type == USB_DT_ENDPOINT && length >= USB_DT_ENDPOINT_SIZE) {
+			struct usb_endpoint_descriptor ep;
+			memcpy(&ep, desc.data(), USB_DT_ENDPOINT_SIZE);
+			descriptor_adapt_endpoint(&ep, device_speed, gadget_speed);
+			desc.replace(0, USB_DT_ENDPOINT_SIZE, (const char *)&ep, USB_DT_ENDPOINT_SIZE);
+		}
+		out += desc;
+	}
+
+	if (out.size() >= USB_DT_CONFIG_SIZE) {
+		out[2] = (char)(out.size() & 0xff);
+		out[3] = (char)(out.size() >> 8);
+	}
+	return out;
+}
+
+void descriptor_override_interval(struct usb_endpoint_descriptor *ep,
+		const std::map<uint8_t, unsigned int> &intervals_us, enum usb_device_speed speed) {
+	auto it = intervals_us.find(ep->bEndpointAddress);
+	if (it == intervals_us.end() || !usb_endpoint_xfer_int(ep))
+		return;
+
+	// 2^(bInterval-1) microframes of 125 us at high speed and faster,
+	// frames of 1 ms below.
+	if (speed >= USB_SPEED_HIGH) {
+		int exponent = 1;
+		while (exponent < 16 && (125u << exponent) <= it->second)
+			exponent++;
+		ep->bInterval = exponent;
+	}
+	else
+		ep->bInterval = std::min(std::max(it->second / 1000, 1u), 255u);
+}
+
+std::string descriptor_override_intervals(const std::string &raw,
+		const std::map<uint8_t, unsigned int> &intervals_us, enum usb_device_speed speed) {
+	if (intervals_us.empty())
+		return raw;
+
+	std::string out = raw;
+	size_t pos = 0;
+	while (pos + 2 <= out.size()) {
+		size_t length = (uint8_t)out[pos];
+		if (length < 2 || pos + length > out.size())
+			break;
+
+		if ((uint8_t)out[pos + 1] == USB_DT_ENDPOINT && length >= USB_DT_ENDPOINT_SIZE) {
+			struct usb_endpoint_descriptor ep;
+			memcpy(&ep, out.data() + pos, USB_DT_ENDPOINT_SIZE);
+			descriptor_override_interval(&ep, intervals_us, speed);
+			out[pos + 6] = (char)ep.bInterval;
+		}
+		pos += length;
+	}
+	return out;
+}
+
+std::string descriptor_hide(const std::string &raw, const std::set<int> &interfaces,
+		const std::set<uint8_t> &endpoints) {
+	if ((interfaces.empty() && endpoints.empty()) || raw.size() < USB_DT_CONFIG_SIZE)
+		return raw;
+
+	std::string out = raw.substr(0, USB_DT_CONFIG_SIZE);
+	std::set<int> kept;
+	bool hiding = false;		// inside a hidden interface
+	bool hiding_endpoint = false;	// after a hidden endpoint, for its companions
+	size_t interface_pos = 0;	// offset in out of the last kept interface
+	size_t pos = USB_DT_CONFIG_SIZE;
+	while (pos + 2 <= raw.size()) {
+		size_t length = (uint8_t)raw[pos];
+		uint8_t type = raw[pos + 1];
+		if (length < 2 || pos + length > raw.size())
+			break;
+
+		std::string desc = raw.substr(pos, length);
+		pos += length;
+
+		if (type == USB_DT_INTERFACE_ASSOCIATION && length >= 4) {
+			hiding = hiding_endpoint = false;
+			// Narrowed to the interfaces left of the function, from the
+			// first to the last; a hidden one between them stays a gap.
+			int first = -1, last = -1;
+			for (int i = 0; i < (uint8_t)desc[3]; i++) {
+				int number = (uint8_t)desc[2] + i;
+				if (interfaces.count(number))
+					continue;
+				if (first < 0)
+					first = number;
+				last = number;
+			}
+			if (first < 0)
+				continue;
+			desc[2] = (char)first;
+			desc[3] = (char)(last - first + 1);
+		}
+		else if (type == USB_DT_INTERFACE && length >= USB_DT_INTERFACE_SIZE) {
+			hiding_endpoint = false;
+			hiding = interfaces.count((uint8_t)desc[2]) != 0;
+			if (hiding)
+				continue;
+			kept.insert((uint8_t)desc[2]);
+			interface_pos = out.size();
+		}
+		else if (hiding)
+			continue;
+		else if (type == USB_DT_ENDPOINT && length >= USB_DT_ENDPOINT_SIZE) {
+			hiding_endpoint = endpoints.count((uint8_t)desc[2]) != 0;
+			if (hiding_endpoint) {
+				if (interface_pos)
+					out[interface_pos + 4] = (char)((uint8_t)out[interface_pos + 4] - 1);
+				continue;
+			}
+		}
+		else if (type == USB_DT_SS_ENDPOINT_COMP || type == USB_DT_SSP_ISOC_ENDPOINT_COMP) {
+			if (hiding_endpoint)
+				continue;
+		}
+		else
+			hiding_endpoint = false;
+		out += desc;
+	}
+
+	out[2] = (char)(out.size() & 0xff);
+	out[3] = (char)(out.size() >> 8);
+	out[4] = (char)kept.size();
+	return out;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <map>
+#include <set>
+#include <string>
+#include <libusb-1.0/libusb.h>
+#include <linux/usb/ch9.h>
+
+/*
+ * Conversion between the libusb descriptor structs the proxy works with and
+ * the wire format a device returns for GET_DESCRIPTOR. Class-specific
+ * descriptors are kept in the `extra` fields, the same way libusb does.
+ */
+
+std::string descriptor_serialize_device(const struct libusb_device_descriptor *desc);
+std::string descriptor_serialize_config(const struct libusb_config_descriptor *config);
+
+bool descriptor_parse_device(const std::string &raw, struct libusb_device_descriptor *desc);
+// Returns NULL if raw is not a valid configuration descriptor. Free the
+// result with descriptor_free_config().
+struct libusb_config_descriptor *descriptor_parse_config(const std::string &raw);
+void descriptor_free_config(struct libusb_config_descriptor *config);
+
+// Finds the SuperSpeed endpoint companion libusb keeps in the endpoint's
+// extra descriptors.
+bool descriptor_find_ss_companion(const struct libusb_endpoint_descriptor *ep,
+		struct usb_ss_ep_comp_descriptor *companion);
+
+/*
+ * The device answers at its own speed. When the gadget runs slower, the
+ * descriptors the host sees are rewritten to be valid at gadget_speed: packet
+ * sizes are capped, intervals converted and SuperSpeed companions dropped.
+ * All three are no-ops when gadget_speed >= device_speed.
+ */
+void descriptor_adapt_endpoint(struct usb_endpoint_descriptor *ep,
+		enum usb_device_speed device_speed, enum usb_device_speed gadget_speed);
+void descriptor_adapt_device(unsigned char *raw, int length,
+		enum usb_device_speed device_speed, enum usb_device_speed gadget_speed);
+std::string descriptor_adapt_config(const std::string &raw,
+		enum usb_device_speed device_speed, enum usb_device_speed gadget_speed);
+
+/*
+ * Advertises a shorter polling interval to the host for the interrupt
+ * endpoints in intervals_us (interval in microseconds by endpoint address),
+ * rounded down to what bInterval can express at speed. The proxy keeps
+ * reading the device at the device's own interval.
+ */
+void descriptor_override_interval(struct usb_endpoint_descriptor *ep,
+		const std::map<uint8_t, unsigned int> &intervals_us, enum usb_device_speed speed);
+std::string descriptor_override_intervals(const std::string &raw,
+		const std::map<uint8_t, unsigned int> &intervals_us, enum usb_device_speed speed);
+
+/*
+ * Drops the interfaces and endpoints the host is not to see from a
+ * configuration, along with their class and companion descriptors, and an
+ * association once all of its interfaces are gone. bNumEndpoints,
+ * bNumInterfaces and wTotalLength are rewritten to match. The remaining
+ * interfaces keep their numbers.
+ */
+std::string descriptor_hide(const std::string &raw, const std::set<int> &interfaces,
+		const std::set<uint8_t> &endpoints);
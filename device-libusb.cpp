@@ -1,6 +1,16 @@
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+
 #include "device-libusb.h"
+#include "backend.h"
+#include "descriptors.h"
+#include "probes.h"
+#include "stats.h"
 
-libusb_device 			**devs;
 libusb_device_handle 		*dev_handle;
 libusb_context 			*context = NULL;
 libusb_hotplug_callback_handle	callback_handle = -1;
@@ -9,27 +19,180 @@ struct libusb_device_descriptor		device_device_desc;
 struct libusb_config_descriptor		**device_config_desc;
 
 pthread_t hotplug_monitor_thread;
+pthread_t reconnect_thread;
+
+bool device_reconnect = false;
+
+/*
+ * Reconnect mode. Every LibusbDevice call holds device_lock shared and waits
+ * while device_present is false; reconnect_monitor holds it exclusively while
+ * dev_handle is closed and reopened, and replays the state below onto the
+ * new handle before letting traffic through again.
+ */
+static std::shared_mutex		device_lock;
+static std::atomic<bool>		device_present(true);
+static std::atomic<libusb_device *>	attached_device(NULL);
+static std::mutex			device_left_mutex;
+static std::condition_variable		device_left_cv;
+static int				reconnect_vendor_id;
+static int				reconnect_product_id;
+
+static int				applied_configuration = -1;
+static std::set<int>			claimed_interfaces;
+static std::map<int, int>		applied_altsettings;
 
 int hotplug_callback(struct libusb_context *ctx __attribute__((unused)),
-			struct libusb_device *dev __attribute__((unused)),
+			struct libusb_device *dev,
 			libusb_hotplug_event envet __attribute__((unused)),
 			void *user_data __attribute__((unused))) {
+	if (dev != attached_device.load())
+		return 0;
+
 	printf("Hotplug event\n");
 
-	kill(0, SIGINT);
+	if (!device_reconnect) {
+		kill(0, SIGINT);
+		return 0;
+	}
+
+	std::lock_guard<std::mutex> lock(device_left_mutex);
+	device_present = false;
+	device_left_cv.notify_one();
 	return 0;
 }
 
 void *hotplug_monitor(void *arg __attribute__((unused))) {
 	printf("Start hotplug_monitor thread, thread id(%d)\n", gettid());
-	while(true) {
-		usleep(100 * 1000);
-		libusb_handle_events_completed(NULL, NULL);
+	while (!please_stop_ep0) {
+		struct timeval tv = { 0, 100 * 1000 };
+		libusb_handle_events_timeout_completed(context, &tv, NULL);
 	}
+	return NULL;
+}
+
+// Compares against the descriptors the host was given at startup; libusb
+// reads them from the kernel's cache, so this does no I/O.
+static bool same_descriptors(libusb_device *device) {
+	struct libusb_device_descriptor desc;
+	if (libusb_get_device_descriptor(device, &desc) != LIBUSB_SUCCESS ||
+	    descriptor_serialize_device(&desc) != descriptor_serialize_device(&device_device_desc))
+		return false;
+
+	for (int i = 0; i < desc.bNumConfigurations; i++) {
+		struct libusb_config_descriptor *config;
+		if (libusb_get_config_descriptor(device, i, &config) != LIBUSB_SUCCESS)
+			return false;
+		bool same = descriptor_serialize_config(config) ==
+			descriptor_serialize_config(device_config_desc[i]);
+		libusb_free_config_descriptor(config);
+		if (!same)
+			return false;
+	}
+	return true;
+}
+
+static bool device_matches(libusb_device *device, int vendor_id, int product_id) {
+	struct libusb_device_descriptor desc;
+	if (libusb_get_device_descriptor(device, &desc) != LIBUSB_SUCCESS)
+		return false;
+	if (desc.bDeviceClass == LIBUSB_CLASS_HUB)
+		return false;
+	return (vendor_id == desc.idVendor || vendor_id == LIBUSB_HOTPLUG_MATCH_ANY) &&
+		(product_id == desc.idProduct || product_id == LIBUSB_HOTPLUG_MATCH_ANY);
+}
+
+struct device_arrival {
+	int		vendor_id;
+	int		product_id;
+	bool		same_device;
+	libusb_device	*device;
+};
+
+static int arrival_callback(struct libusb_context *ctx __attribute__((unused)),
+			struct libusb_device *dev,
+			libusb_hotplug_event event __attribute__((unused)),
+			void *user_data) {
+	struct device_arrival *arrival = (struct device_arrival *)user_data;
+	if (arrival->device || !device_matches(dev, arrival->vendor_id, arrival->product_id))
+		return 0;
+	if (arrival->same_device && !same_descriptors(dev)) {
+		printf("Ignoring a device with different descriptors\n");
+		return 0;
+	}
+
+	arrival->device = libusb_ref_device(dev);
+	return 0;
+}
+
+// Blocks until a matching device is present and returns it referenced, or
+// NULL once the proxy is stopping. Devices that are already plugged in are
+// reported straight away through LIBUSB_HOTPLUG_ENUMERATE, later ones as soon
+// as the kernel announces them.
+static libusb_device *wait_for_device(int vendor_id, int product_id, bool same_device) {
+	struct device_arrival arrival = { vendor_id, product_id, same_device, NULL };
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		while (!arrival.device && !please_stop_ep0) {
+			libusb_device **list = NULL;
+			int cnt = libusb_get_device_list(context, &list);
+			if (cnt < 0) {
+				fprintf(stderr, "Get Device Error: %s\n",
+						libusb_strerror((libusb_error)cnt));
+				return NULL;
+			}
+			for (int i = 0; i < cnt && !arrival.device; i++) {
+				if (device_matches(list[i], vendor_id, product_id) &&
+				    (!same_device || same_descriptors(list[i])))
+					arrival.device = libusb_ref_device(list[i]);
+			}
+			libusb_free_device_list(list, 1);
+			if (!arrival.device)
+				usleep(100 * 1000);
+		}
+		return arrival.device;
+	}
+
+	libusb_hotplug_callback_handle handle;
+	int result = libusb_hotplug_register_callback(context,
+		LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_ENUMERATE,
+		vendor_id, product_id, LIBUSB_HOTPLUG_MATCH_ANY,
+		arrival_callback, &arrival, &handle);
+	if (result != LIBUSB_SUCCESS) {
+		fprintf(stderr, "Error registering arrival callback: %s\n",
+				libusb_strerror((libusb_error)result));
+		return NULL;
+	}
+
+	if (!arrival.device)
+		printf("Waiting for device\n");
+	while (!arrival.device && !please_stop_ep0) {
+		struct timeval tv = { 0, 100 * 1000 };
+		result = libusb_handle_events_timeout_completed(context, &tv, NULL);
+		if (result != LIBUSB_SUCCESS && result != LIBUSB_ERROR_INTERRUPTED) {
+			fprintf(stderr, "Error waiting for device: %s\n",
+					libusb_strerror((libusb_error)result));
+			break;
+		}
+	}
+
+	libusb_hotplug_deregister_callback(context, handle);
+	return arrival.device;
+}
+
+void free_descriptor() {
+	if (!device_config_desc)
+		return;
+	for (int i = 0; i < device_device_desc.bNumConfigurations; i++) {
+		if (device_config_desc[i])
+			libusb_free_config_descriptor(device_config_desc[i]);
+	}
+	delete[] device_config_desc;
+	device_config_desc = NULL;
 }
 
 int get_descriptor(libusb_device *device) {
 	int result;
+	free_descriptor();
 	result = libusb_get_device_descriptor(device, &device_device_desc);
 	if (result != LIBUSB_SUCCESS) {
 		if (verbose_level) {
@@ -39,7 +202,7 @@ int get_descriptor(libusb_device *device) {
 		return result;
 	}
 
-	device_config_desc = new struct libusb_config_descriptor *[device_device_desc.bNumConfigurations];
+	device_config_desc = new struct libusb_config_descriptor *[device_device_desc.bNumConfigurations]();
 	for (int i = 0; i < device_device_desc.bNumConfigurations; i++) {
 		result = libusb_get_config_descriptor(device, i, &device_config_desc[i]);
 		if (result != LIBUSB_SUCCESS) {
@@ -47,6 +210,8 @@ int get_descriptor(libusb_device *device) {
 				fprintf(stderr, "Error retrieving configuration(%d) descriptor: %s\n",
 						i, libusb_strerror((libusb_error)result));
 			}
+			device_config_desc[i] = NULL;
+			free_descriptor();
 			return result;
 		}
 	}
@@ -54,71 +219,164 @@ int get_descriptor(libusb_device *device) {
 	return LIBUSB_SUCCESS;
 }
 
-int connect_device(int vendor_id, int product_id) {
-	int result;
-	result = libusb_init(&context);
-	if (result < 0) {
-		fprintf(stderr, "Init error: %s\n", libusb_strerror((libusb_error)result));
-		return 1;
+static int detach_kernel_drivers() {
+	int config = 0;
+	int result = libusb_get_configuration(dev_handle, &config);
+	if (result != LIBUSB_SUCCESS) {
+		fprintf(stderr, "libusb_get_configuration() failed: %s\n",
+				libusb_strerror((libusb_error)result));
+		return result;
 	}
-	libusb_set_debug(context, 3);
 
-	libusb_device **list = NULL;
-	libusb_device *found = NULL;
+	for (int i = 0; i < device_device_desc.bNumConfigurations; i++) {
+		if (device_config_desc[i]->bConfigurationValue != config)
+			continue;
+		for (int j = 0; j < device_config_desc[i]->bNumInterfaces; j++)
+			libusb_detach_kernel_driver(dev_handle, j);
+	}
+	return LIBUSB_SUCCESS;
+}
 
-	int cnt = libusb_get_device_list(context, &list);
-	if (cnt < 0) {
-		if (verbose_level) {
-			fprintf(stderr, "Error retrieving device list: %s\n",
-					libusb_strerror((libusb_error)cnt));
-		}
-		return cnt;
+// Opens a re-attached device and puts it back into the configuration,
+// claimed interfaces and altsettings the proxy had applied before it left.
+static int reopen_device(libusb_device *device) {
+	int result = libusb_open(device, &dev_handle);
+	if (result != LIBUSB_SUCCESS) {
+		dev_handle = NULL;
+		return result;
 	}
 
-	while (found == NULL) {
-		cnt = libusb_get_device_list(context, &devs);
-		if (cnt < 0) {
-			fprintf(stderr, "Get Device Error: %s\n",
-					libusb_strerror((libusb_error)cnt));
-			return 1;
+	libusb_set_auto_detach_kernel_driver(dev_handle, 1);
+	result = detach_kernel_drivers();
+	if (result != LIBUSB_SUCCESS)
+		return result;
+
+	if (applied_configuration != -1) {
+		result = libusb_set_configuration(dev_handle, applied_configuration);
+		if (result != LIBUSB_SUCCESS)
+			return result;
+	}
+	for (int interface : claimed_interfaces) {
+		result = libusb_claim_interface(dev_handle, interface);
+		if (result != LIBUSB_SUCCESS)
+			return result;
+	}
+	for (const auto &altsetting : applied_altsettings) {
+		result = libusb_set_interface_alt_setting(dev_handle,
+				altsetting.first, altsetting.second);
+		if (result != LIBUSB_SUCCESS)
+			return result;
+	}
+
+	attached_device = device;
+	return LIBUSB_SUCCESS;
+}
+
+void *reconnect_monitor(void *arg __attribute__((unused))) {
+	printf("Start reconnect_monitor thread, thread id(%d)\n", gettid());
+	while (!please_stop_ep0) {
+		{
+			std::unique_lock<std::mutex> lock(device_left_mutex);
+			device_left_cv.wait_for(lock, std::chrono::milliseconds(100),
+				[] { return !device_present; });
 		}
-		if (verbose_level)
-			printf("%d Devices in list\n", cnt);
+		if (device_present)
+			continue;
 
-		for (int i = 0; i < cnt; i++) {
-			libusb_device *dvc = devs[i];
-			result = get_descriptor(dvc);
-			if (result != LIBUSB_SUCCESS)
-				continue;
+		uint64_t left_us = stats_now_us();
+		printf("Device left, holding traffic until it is back\n");
 
-			if (device_device_desc.bDeviceClass == LIBUSB_CLASS_HUB)
-				continue;
+		std::unique_lock<std::shared_mutex> lock(device_lock);
+		libusb_close(dev_handle);
+		dev_handle = NULL;
 
-			if (vendor_id == -1 && product_id == -1) {
-				found = dvc;
+		while (!please_stop_ep0) {
+			libusb_device *device = wait_for_device(reconnect_vendor_id,
+							reconnect_product_id, true);
+			if (!device)
 				break;
-			}
-			else if ((vendor_id == device_device_desc.idVendor || vendor_id == LIBUSB_HOTPLUG_MATCH_ANY) &&
-				(product_id == device_device_desc.idProduct || product_id == LIBUSB_HOTPLUG_MATCH_ANY)) {
-				found = dvc;
+
+			int result = reopen_device(device);
+			libusb_unref_device(device);
+			if (result == LIBUSB_SUCCESS)
 				break;
+
+			fprintf(stderr, "Error restoring reconnected device: %s\n",
+					libusb_strerror((libusb_error)result));
+			if (dev_handle) {
+				libusb_close(dev_handle);
+				dev_handle = NULL;
 			}
+			usleep(100 * 1000);
 		}
+		if (!dev_handle)
+			break;
+
+		uint64_t downtime_us = stats_now_us() - left_us;
+		proxy_stats.device_downtime_us.store(downtime_us, std::memory_order_relaxed);
+		stats_inc(proxy_stats.device_reconnects);
+		stats_device_attached();
+		device_present = true;
+		printf("Device reconnected after %.1f ms\n", downtime_us / 1000.0);
+	}
+	return NULL;
+}
 
-		if (verbose_level && vendor_id != -1 && product_id != -1)
-			printf("Target device not found\n");
-		libusb_free_device_list(devs, 1);
-		sleep(1);
+// Takes device_lock shared for one backend call. Returns false, with the lock
+// not held, if the proxy stops while the device is absent.
+static bool device_hold() {
+	if (!device_reconnect)
+		return true;
+
+	while (true) {
+		if (device_present.load(std::memory_order_acquire)) {
+			device_lock.lock_shared();
+			if (device_present.load(std::memory_order_relaxed))
+				return true;
+			device_lock.unlock_shared();
+		}
+		if (please_stop_ep0 || please_stop_eps)
+			return false;
+		usleep(1000);
+	}
+}
+
+static void device_release() {
+	if (device_reconnect)
+		device_lock.unlock_shared();
+}
+
+int connect_device(int vendor_id, int product_id) {
+	int result;
+	if (!context) {
+		result = libusb_init(&context);
+		if (result < 0) {
+			fprintf(stderr, "Init error: %s\n", libusb_strerror((libusb_error)result));
+			context = NULL;
+			return 1;
+		}
+		libusb_set_debug(context, 3);
+	}
+
+	libusb_device *found = wait_for_device(vendor_id, product_id, false);
+	if (!found)
+		return 1;
+	stats_device_attached();
+
+	result = get_descriptor(found);
+	if (result != LIBUSB_SUCCESS) {
+		libusb_unref_device(found);
+		return result;
 	}
 
 	result = libusb_open(found, &dev_handle);
+	libusb_unref_device(found);
 	if (result != LIBUSB_SUCCESS) {
 		if (verbose_level) {
 			fprintf(stderr, "Error opening device handle: %s\n",
 					libusb_strerror((libusb_error)result));
 		}
 		dev_handle = NULL;
-		libusb_free_device_list(list, 1);
 		return result;
 	}
 
@@ -129,20 +387,9 @@ int connect_device(int vendor_id, int product_id) {
 		return result;
 	}
 
-	int config = 0;
-	result = libusb_get_configuration(dev_handle, &config);
-	if (result != LIBUSB_SUCCESS) {
-		fprintf(stderr, "libusb_get_configuration() failed: %s\n",
-				libusb_strerror((libusb_error)result));
+	result = detach_kernel_drivers();
+	if (result != LIBUSB_SUCCESS)
 		return result;
-	}
-
-	for (int i = 0; i < device_device_desc.bNumConfigurations; i++) {
-		if (device_config_desc[i]->bConfigurationValue != config)
-			continue;
-		for (int j = 0; j < device_config_desc[i]->bNumInterfaces; j++)
-			libusb_detach_kernel_driver(dev_handle, j);
-	}
 
 	result = libusb_reset_device(dev_handle);
 	if (result != LIBUSB_SUCCESS) {
@@ -159,6 +406,7 @@ int connect_device(int vendor_id, int product_id) {
 				libusb_strerror((libusb_error)result));
 		return result;
 	}
+	attached_device = libusb_get_device(dev_handle);
 
 	if (callback_handle == -1) {
 		result = libusb_hotplug_register_callback(context,
@@ -168,11 +416,17 @@ int connect_device(int vendor_id, int product_id) {
 
 		if (result != LIBUSB_SUCCESS) {
 			fprintf(stderr, "Error registering callback\n");
-			libusb_exit(context);
 			return result;
 		}
 		pthread_create(&hotplug_monitor_thread, 0,
 			hotplug_monitor, nullptr);
+
+		if (device_reconnect) {
+			reconnect_vendor_id = vendor_id;
+			reconnect_product_id = product_id;
+			pthread_create(&reconnect_thread, 0,
+				reconnect_monitor, nullptr);
+		}
 	}
 
 	return 0;
@@ -183,7 +437,10 @@ void set_configuration(int configuration) {
 	if (result != LIBUSB_SUCCESS) {
 		fprintf(stderr, "Error setting configuration(%d): %s\n",
 				configuration, libusb_strerror((libusb_error)result));
+		return;
 	}
+	applied_configuration = configuration;
+	applied_altsettings.clear();
 }
 
 void claim_interface(int interface) {
@@ -191,7 +448,9 @@ void claim_interface(int interface) {
 	if (result != LIBUSB_SUCCESS) {
 		fprintf(stderr, "Error claiming interface(%d): %s\n",
 				interface, libusb_strerror((libusb_error)result));
+		return;
 	}
+	claimed_interfaces.insert(interface);
 }
 
 void release_interface(int interface) {
@@ -200,6 +459,8 @@ void release_interface(int interface) {
 		fprintf(stderr, "Error releasing interface(%d): %s\n",
 				interface, libusb_strerror((libusb_error)result));
 	}
+	claimed_interfaces.erase(interface);
+	applied_altsettings.erase(interface);
 }
 
 void set_interface_alt_setting(int interface, int altsetting) {
@@ -207,7 +468,9 @@ void set_interface_alt_setting(int interface, int altsetting) {
 	if (result != LIBUSB_SUCCESS) {
 		fprintf(stderr, "Error setting interface altsetting(%d, %d): %s\n",
 				interface, altsetting, libusb_strerror((libusb_error)result));
+		return;
 	}
+	applied_altsettings[interface] = altsetting;
 }
 
 int control_request(const usb_ctrlrequest *setup_packet, int *nbytes,
@@ -235,7 +498,7 @@ int control_request(const usb_ctrlrequest *setup_packet, int *nbytes,
 	return 0;
 }
 
-void send_data(uint8_t endpoint, uint8_t attributes, uint8_t *dataptr,
+int send_data(uint8_t endpoint, uint8_t attributes, uint8_t *dataptr,
 			int length) {
 	int transferred;
 	int attempt = 0;
@@ -243,13 +506,17 @@ void send_data(uint8_t endpoint, uint8_t attributes, uint8_t *dataptr,
 
 	bool incomplete_transfer = false;
 
+	USB_PROXY_PROBE(send_data_entry, endpoint, length);
+
 	switch (attributes & USB_ENDPOINT_XFERTYPE_MASK) {
 	case USB_ENDPOINT_XFER_CONTROL:
 		fprintf(stderr, "Can't send on a control endpoint.\n");
+		result = LIBUSB_ERROR_NOT_SUPPORTED;
 		break;
 	case USB_ENDPOINT_XFER_ISOC:
 		if (verbose_level)
 			fprintf(stderr, "Isochronous(write) endpoint EP%02x unhandled.\n", endpoint);
+		result = LIBUSB_ERROR_NOT_SUPPORTED;
 		break;
 	case USB_ENDPOINT_XFER_BULK:
 		do {
@@ -283,17 +550,23 @@ void send_data(uint8_t endpoint, uint8_t attributes, uint8_t *dataptr,
 			printf("Sent %d bytes (Int) to libusb EP%02x\n", transferred, endpoint);
 		break;
 	}
-	if (result != LIBUSB_SUCCESS) {
+	if (result != LIBUSB_SUCCESS && result != LIBUSB_ERROR_NOT_SUPPORTED) {
 		fprintf(stderr, "Transfer error sending on EP%02x: %s\n",
 				endpoint, libusb_strerror((libusb_error)result));
 	}
+
+	USB_PROXY_PROBE(send_data_return, endpoint, length, result);
+	return result;
 }
 
-void receive_data(uint8_t endpoint, uint8_t attributes, uint16_t maxPacketSize,
+void receive_data(uint8_t endpoint, uint8_t attributes, int maxLength,
 			uint8_t **dataptr, int *length, int timeout) {
 	int result = LIBUSB_SUCCESS;
 
 	int attempt = 0;
+	*length = -1;
+	USB_PROXY_PROBE(receive_data_entry, endpoint, maxLength, timeout);
+
 	switch (attributes & USB_ENDPOINT_XFERTYPE_MASK) {
 	case USB_ENDPOINT_XFER_CONTROL:
 		fprintf(stderr, "Can't read on a control endpoint.\n");
@@ -303,20 +576,24 @@ void receive_data(uint8_t endpoint, uint8_t attributes, uint16_t maxPacketSize,
 			fprintf(stderr, "Isochronous(read) endpoint EP%02x unhandled.\n", endpoint);
 		break;
 	case USB_ENDPOINT_XFER_BULK:
-		*dataptr = new uint8_t[maxPacketSize * 8];
+		*dataptr = new uint8_t[maxLength];
 		do {
-			result = libusb_bulk_transfer(dev_handle, endpoint, *dataptr, maxPacketSize, length, timeout);
+			result = libusb_bulk_transfer(dev_handle, endpoint, *dataptr, maxLength, length, timeout);
 			if (result == LIBUSB_SUCCESS && verbose_level > 2)
 				printf("Received bulk data(%d) bytes\n", *length);
-			if ((result == LIBUSB_ERROR_PIPE || result == LIBUSB_ERROR_TIMEOUT))
+			if (result == LIBUSB_ERROR_PIPE)
 				libusb_clear_halt(dev_handle, endpoint);
 
 			attempt++;
-		} while ((result == LIBUSB_ERROR_PIPE || result == LIBUSB_ERROR_TIMEOUT) && attempt < MAX_ATTEMPTS);
+		} while (result == LIBUSB_ERROR_PIPE && attempt < MAX_ATTEMPTS);
+		// A multi-packet read can time out part way; what arrived is
+		// still the device's data.
+		if (result == LIBUSB_ERROR_TIMEOUT && *length > 0)
+			result = LIBUSB_SUCCESS;
 		break;
 	case USB_ENDPOINT_XFER_INT:
-		*dataptr = new uint8_t[maxPacketSize];
-		result = libusb_interrupt_transfer(dev_handle, endpoint, *dataptr, maxPacketSize, length, timeout);
+		*dataptr = new uint8_t[maxLength];
+		result = libusb_interrupt_transfer(dev_handle, endpoint, *dataptr, maxLength, length, timeout);
 		if (result == LIBUSB_SUCCESS && verbose_level > 2)
 			printf("Received int data(%d) bytes\n", *length);
 		break;
@@ -326,4 +603,169 @@ void receive_data(uint8_t endpoint, uint8_t attributes, uint16_t maxPacketSize,
 		fprintf(stderr, "Transfer error receiving on EP%02x: %s\n",
 				endpoint, libusb_strerror((libusb_error)result));
 	}
+	if (result != LIBUSB_SUCCESS)
+		*length = -1;
+
+	USB_PROXY_PROBE(receive_data_return, endpoint, *length, result);
+}
+
+static void control_requests_callback(struct libusb_transfer *transfer) {
+	std::atomic<int> *pending = (std::atomic<int> *)transfer->user_data;
+	(*pending)--;
+}
+
+// Submits all requests at once so the host controller has them queued back
+// to back, instead of one user/kernel round trip per request.
+void control_requests(std::vector<control_transfer> &transfers, int timeout) {
+	std::vector<struct libusb_transfer *> submitted(transfers.size(), NULL);
+	// Completions may be reaped by hotplug_monitor, which handles events on
+	// the same context.
+	std::atomic<int> pending(0);
+
+	for (size_t i = 0; i < transfers.size(); i++) {
+		const struct usb_ctrlrequest *setup = &transfers[i].setup;
+		struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+		unsigned char *buffer = (unsigned char *)malloc(LIBUSB_CONTROL_SETUP_SIZE + setup->wLength);
+		if (!transfer || !buffer) {
+			libusb_free_transfer(transfer);
+			free(buffer);
+			transfers[i].result = LIBUSB_ERROR_NO_MEM;
+			continue;
+		}
+
+		libusb_fill_control_setup(buffer, setup->bRequestType, setup->bRequest,
+			setup->wValue, setup->wIndex, setup->wLength);
+		libusb_fill_control_transfer(transfer, dev_handle, buffer,
+			control_requests_callback, &pending, timeout);
+		transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+
+		int result = libusb_submit_transfer(transfer);
+		if (result != LIBUSB_SUCCESS) {
+			libusb_free_transfer(transfer);
+			transfers[i].result = result;
+			continue;
+		}
+		submitted[i] = transfer;
+		pending++;
+	}
+
+	bool cancelled = false;
+	while (pending > 0) {
+		struct timeval tv = { 1, 0 };
+		int result = libusb_handle_events_timeout_completed(context, &tv, NULL);
+		if (result != LIBUSB_SUCCESS && result != LIBUSB_ERROR_INTERRUPTED && !cancelled) {
+			fprintf(stderr, "Error handling control requests: %s\n",
+					libusb_strerror((libusb_error)result));
+			for (struct libusb_transfer *transfer : submitted) {
+				if (transfer)
+					libusb_cancel_transfer(transfer);
+			}
+			cancelled = true;
+		}
+	}
+
+	for (size_t i = 0; i < transfers.size(); i++) {
+		struct libusb_transfer *transfer = submitted[i];
+		if (!transfer)
+			continue;
+
+		if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+			transfers[i].data.assign((const char *)libusb_control_transfer_get_data(transfer),
+				transfer->actual_length);
+			transfers[i].result = 0;
+		}
+		else
+			transfers[i].result = transfer->status == LIBUSB_TRANSFER_STALL ? -1 : LIBUSB_ERROR_IO;
+		libusb_free_transfer(transfer);
+	}
+}
+
+/*----------------------------------------------------------------------*/
+
+const struct libusb_device_descriptor *LibusbDevice::device_descriptor() {
+	return &device_device_desc;
+}
+
+const struct libusb_config_descriptor *LibusbDevice::config_descriptor(int index) {
+	return device_config_desc[index];
+}
+
+enum usb_device_speed LibusbDevice::link_speed() {
+	switch (libusb_get_device_speed(libusb_get_device(dev_handle))) {
+	case LIBUSB_SPEED_LOW:
+		return USB_SPEED_LOW;
+	case LIBUSB_SPEED_FULL:
+		return USB_SPEED_FULL;
+	case LIBUSB_SPEED_SUPER:
+		return USB_SPEED_SUPER;
+	case LIBUSB_SPEED_SUPER_PLUS:
+		return USB_SPEED_SUPER_PLUS;
+	default:
+		return USB_SPEED_HIGH;
+	}
+}
+
+void LibusbDevice::set_configuration(int configuration) {
+	if (!device_hold())
+		return;
+	::set_configuration(configuration);
+	device_release();
+}
+
+void LibusbDevice::claim_interface(int interface) {
+	if (!device_hold())
+		return;
+	::claim_interface(interface);
+	device_release();
+}
+
+void LibusbDevice::release_interface(int interface) {
+	if (!device_hold())
+		return;
+	::release_interface(interface);
+	device_release();
+}
+
+void LibusbDevice::set_interface_alt_setting(int interface, int altsetting) {
+	if (!device_hold())
+		return;
+	::set_interface_alt_setting(interface, altsetting);
+	device_release();
+}
+
+int LibusbDevice::control_request(const usb_ctrlrequest *setup_packet, int *nbytes,
+			unsigned char **dataptr, int timeout) {
+	if (!device_hold())
+		return LIBUSB_ERROR_NO_DEVICE;
+	int result = ::control_request(setup_packet, nbytes, dataptr, timeout);
+	device_release();
+	return result;
+}
+
+int LibusbDevice::send_data(uint8_t endpoint, uint8_t attributes, uint8_t *dataptr,
+			int length) {
+	if (!device_hold())
+		return LIBUSB_ERROR_NO_DEVICE;
+	int result = ::send_data(endpoint, attributes, dataptr, length);
+	device_release();
+	return result;
+}
+
+void LibusbDevice::receive_data(uint8_t endpoint, uint8_t attributes, int maxLength,
+			uint8_t **dataptr, int *length, int timeout) {
+	*length = -1;
+	if (!device_hold())
+		return;
+	::receive_data(endpoint, attributes, maxLength, dataptr, length, timeout);
+	device_release();
+}
+
+void LibusbDevice::control_requests(std::vector<control_transfer> &transfers, int timeout) {
+	if (!device_hold()) {
+		for (control_transfer &transfer : transfers)
+			transfer.result = LIBUSB_ERROR_NO_DEVICE;
+		return;
+	}
+	::control_requests(transfers, timeout);
+	device_release();
 }
@@ -0,0 +1,187 @@
+#include <fstream>
+#include <time.h>
+
+#include "device-replay.h"
+#include "capture.h"
+#include "descriptors.h"
+#include "misc.h"
+
+static uint64_t replay_now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Recorded responses are keyed by the setup packet without wLength.
+static std::string response_key(const struct usb_ctrlrequest *ctrl) {
+	return std::string((const char *)ctrl, 6);
+}
+
+ReplayDevice::~ReplayDevice() {
+	for (struct libusb_config_descriptor *config : configs)
+		descriptor_free_config(config);
+}
+
+bool ReplayDevice::load(const std::string &path, std::string &error) {
+	std::ifstream ifs(path.c_str());
+	if (!ifs.is_open()) {
+		error = "cannot open file";
+		return false;
+	}
+
+	std::string line;
+	for (int number = 1; std::getline(ifs, line); number++) {
+		if (line.empty() || line[0] == '#')
+			continue;
+
+		struct capture_record record;
+		if (!capture_parse_line(line, record)) {
+			error = "line " + std::to_string(number) + ": malformed";
+			return false;
+		}
+		const std::string &type = record.transfer_type;
+		const std::string &data = record.data;
+
+		if (type == "descriptor" || type == "control") {
+			if (record.dir != "in" || record.setup.empty())
+				continue;
+			// Hosts often read a descriptor twice, short and then in full.
+			std::string &response = responses[response_key(
+				(const struct usb_ctrlrequest *)record.setup.data())];
+			if (data.size() >= response.size())
+				response = data;
+		}
+		else if ((type == "int" || type == "bulk") && record.dir == "in" && !data.empty()) {
+			endpoints[record.bEndpointAddress].packets.push_back({ record.timestamp_us, data });
+			if (!first_us || record.timestamp_us < first_us)
+				first_us = record.timestamp_us;
+			last_us = std::max(last_us, record.timestamp_us);
+		}
+	}
+
+	// The descriptor lines and the host's own GET_DESCRIPTOR requests share
+	// the same keys, so either is enough.
+	struct usb_ctrlrequest ctrl = { USB_DIR_IN, USB_REQ_GET_DESCRIPTOR, USB_DT_DEVICE << 8, 0, 0 };
+	if (!descriptor_parse_device(responses[response_key(&ctrl)], &device)) {
+		error = "no device descriptor recorded";
+		return false;
+	}
+
+	for (int i = 0; i < device.bNumConfigurations; i++) {
+		ctrl.wValue = (USB_DT_CONFIG << 8) | i;
+		const std::string &raw = responses[response_key(&ctrl)];
+		struct libusb_config_descriptor *config = descriptor_parse_config(raw);
+		if (!config || config->wTotalLength > raw.size()) {
+			descriptor_free_config(config);
+			error = "configuration " + std::to_string(i) + " not recorded in full";
+			return false;
+		}
+		configs.push_back(config);
+	}
+
+	printf("Replay: %s, %04x:%04x, %zu ep0 responses, %zu IN endpoints\n", path.c_str(),
+		device.idVendor, device.idProduct, responses.size(), endpoints.size());
+	return true;
+}
+
+const struct libusb_device_descriptor *ReplayDevice::device_descriptor() {
+	return &device;
+}
+
+const struct libusb_config_descriptor *ReplayDevice::config_descriptor(int index) {
+	return index < (int)configs.size() ? configs[index] : NULL;
+}
+
+// The capture does not record the link speed; a USB 3 device's descriptors
+// are SuperSpeed ones, anything else is replayed at high speed as before.
+enum usb_device_speed ReplayDevice::link_speed() {
+	return device.bcdUSB >= 0x0300 ? USB_SPEED_SUPER : USB_SPEED_HIGH;
+}
+
+void ReplayDevice::set_configuration(int configuration __attribute__((unused))) {
+}
+
+void ReplayDevice::claim_interface(int interface __attribute__((unused))) {
+}
+
+void ReplayDevice::release_interface(int interface __attribute__((unused))) {
+}
+
+void ReplayDevice::set_interface_alt_setting(int interface __attribute__((unused)),
+		int altsetting __attribute__((unused))) {
+}
+
+int ReplayDevice::control_request(const usb_ctrlrequest *setup_packet, int *nbytes,
+		unsigned char **dataptr, int timeout __attribute__((unused))) {
+	if (!(setup_packet->bRequestType & USB_DIR_IN)) {
+		*nbytes = setup_packet->wLength;
+		return 0;
+	}
+
+	auto response = responses.find(response_key(setup_packet));
+	if (response == responses.end()) {
+		if (verbose_level)
+			printf("Replay: no recorded response, stalling\n");
+		return -1;
+	}
+
+	*nbytes = std::min((int)response->second.size(), (int)setup_packet->wLength);
+	memcpy(*dataptr, response->second.data(), *nbytes);
+	return 0;
+}
+
+int ReplayDevice::send_data(uint8_t endpoint __attribute__((unused)),
+		uint8_t attributes __attribute__((unused)),
+		uint8_t *dataptr __attribute__((unused)), int length __attribute__((unused))) {
+	return LIBUSB_SUCCESS;
+}
+
+void ReplayDevice::receive_data(uint8_t endpoint, uint8_t attributes __attribute__((unused)),
+		int maxLength, uint8_t **dataptr, int *length, int timeout) {
+	*length = -1;
+	*dataptr = new uint8_t[maxLength];
+
+	auto it = endpoints.find(endpoint);
+	if (!traffic || it == endpoints.end()) {
+		usleep(timeout * 1000);
+		return;
+	}
+
+	replay_endpoint &ep = it->second;
+	if (ep.next == ep.packets.size()) {
+		if (!loop) {
+			usleep(timeout * 1000);
+			return;
+		}
+		ep.next = 0;
+		ep.iteration++;
+	}
+
+	// All endpoints share one time base, started by the first IN request.
+	uint64_t start = start_ns.load();
+	if (!start) {
+		uint64_t now = replay_now_ns();
+		start = start_ns.compare_exchange_strong(start, now) ? now : start;
+	}
+
+	const replay_packet &packet = ep.packets[ep.next];
+	if (speed > 0) {
+		uint64_t session_ns = (last_us - first_us) * 1000 / speed + 1000000;
+		uint64_t due = start + ep.iteration * session_ns +
+			(uint64_t)((packet.timestamp_us - first_us) * 1000 / speed);
+		uint64_t now = replay_now_ns();
+		if (due > now + (uint64_t)timeout * 1000000) {
+			usleep(timeout * 1000);
+			return;
+		}
+
+		struct timespec ts;
+		ts.tv_sec = due / 1000000000ull;
+		ts.tv_nsec = due % 1000000000ull;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	}
+
+	*length = std::min(packet.data.size(), (size_t)maxLength);
+	memcpy(*dataptr, packet.data.data(), *length);
+	ep.next++;
+}
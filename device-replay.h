@@ -0,0 +1,62 @@
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <vector>
+
+#include "backend.h"
+
+/*
+ * A DeviceBackend that serves a session recorded with --capture_file
+ * instead of a real device: the recorded descriptors, the recorded ep0
+ * responses keyed by setup packet and, optionally, the recorded IN traffic.
+ *
+ * IN requests that were never recorded are stalled. A recorded response is
+ * also used for the same request with a different wLength, truncated to it.
+ * OUT transfers are accepted and dropped.
+ */
+
+struct replay_packet {
+	uint64_t	timestamp_us;
+	std::string	data;
+};
+
+struct replay_endpoint {
+	std::vector<replay_packet>	packets;
+	size_t				next = 0;
+	uint64_t			iteration = 0;
+};
+
+class ReplayDevice : public DeviceBackend {
+public:
+	~ReplayDevice();
+
+	bool load(const std::string &path, std::string &error);
+
+	const struct libusb_device_descriptor *device_descriptor() override;
+	const struct libusb_config_descriptor *config_descriptor(int index) override;
+	enum usb_device_speed link_speed() override;
+	void set_configuration(int configuration) override;
+	void claim_interface(int interface) override;
+	void release_interface(int interface) override;
+	void set_interface_alt_setting(int interface, int altsetting) override;
+	int control_request(const usb_ctrlrequest *setup_packet, int *nbytes,
+			unsigned char **dataptr, int timeout) override;
+	int send_data(uint8_t endpoint, uint8_t attributes, uint8_t *dataptr,
+			int length) override;
+	void receive_data(uint8_t endpoint, uint8_t attributes, int maxLength,
+			uint8_t **dataptr, int *length, int timeout) override;
+
+	bool		traffic = false;	// serve the recorded IN traffic
+	double		speed = 1.0;		// timing factor, 0 for as fast as possible
+	bool		loop = false;		// start over at the end of the traffic
+
+private:
+	struct libusb_device_descriptor				device = {};
+	std::vector<struct libusb_config_descriptor *>		configs;
+	std::map<std::string, std::string>			responses;	// setup packet -> data
+	std::map<uint8_t, replay_endpoint>			endpoints;
+	uint64_t						first_us = 0;
+	uint64_t						last_us = 0;
+	std::atomic<uint64_t>					start_ns{0};
+};
@@ -0,0 +1,434 @@
+#include <chrono>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+
+#include "device-usbfs.h"
+#include "probes.h"
+#include "realtime.h"
+
+// Without USBDEVFS_CAP_NO_PACKET_SIZE_LIM the kernel rejects bulk URBs larger
+// than this, and longer transfers are split.
+#define USBFS_MAX_BULK_URB	16384
+
+// URB status to the libusb error the rest of the proxy reports.
+static int urb_result(int status) {
+	switch (status) {
+	case 0:
+		return LIBUSB_SUCCESS;
+	case -ENOENT:
+	case -ECONNRESET:
+		return LIBUSB_ERROR_TIMEOUT;
+	case -EPIPE:
+		return LIBUSB_ERROR_PIPE;
+	case -EOVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case -ENODEV:
+	case -ESHUTDOWN:
+		return LIBUSB_ERROR_NO_DEVICE;
+	default:
+		return LIBUSB_ERROR_IO;
+	}
+}
+
+static int errno_result(int error) {
+	switch (error) {
+	case ETIMEDOUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case EPIPE:
+		return LIBUSB_ERROR_PIPE;
+	case ENODEV:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case EBUSY:
+		return LIBUSB_ERROR_BUSY;
+	case ENOENT:
+	case EINVAL:
+		return LIBUSB_ERROR_NOT_FOUND;
+	default:
+		return LIBUSB_ERROR_IO;
+	}
+}
+
+int UsbfsDevice::open() {
+	libusb_device *device = libusb_get_device(dev_handle);
+	char path[64];
+	snprintf(path, sizeof(path), "/dev/bus/usb/%03d/%03d",
+		libusb_get_bus_number(device), libusb_get_device_address(device));
+
+	fd = ::open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	if (ioctl(fd, USBDEVFS_GET_CAPABILITIES, &capabilities) < 0)
+		capabilities = 0;
+
+	printf("usbfs: %s, capabilities 0x%x\n", path, capabilities);
+	pthread_create(&reaper_thread, 0, reaper, this);
+	return 0;
+}
+
+void UsbfsDevice::close() {
+	if (fd < 0)
+		return;
+	closing = true;
+	if (reaper_thread && pthread_join(reaper_thread, NULL))
+		fprintf(stderr, "Error join usbfs reaper_thread\n");
+	reaper_thread = 0;
+	::close(fd);
+	fd = -1;
+}
+
+void *UsbfsDevice::reaper(void *arg) {
+	UsbfsDevice *self = (UsbfsDevice *)arg;
+	printf("Start usbfs reaper thread, thread id(%d)\n", gettid());
+	// Completes the transfers of every endpoint, interrupt ones included.
+	realtime_thread(PRIORITY_HIGH);
+
+	struct pollfd pfd = { self->fd, POLLOUT, 0 };
+	std::vector<usbfs_request *> reaped;
+	while (!self->closing) {
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+
+		// Take everything that completed since the last wakeup, then
+		// hand it back under one lock.
+		struct usbdevfs_urb *urb;
+		while (ioctl(self->fd, USBDEVFS_REAPURBNDELAY, &urb) == 0)
+			reaped.push_back((usbfs_request *)urb->usercontext);
+		bool gone = errno == ENODEV;
+		USB_PROXY_PROBE(usbfs_reap, reaped.size());
+
+		{
+			std::lock_guard<std::mutex> lock(self->reap_mutex);
+			for (usbfs_request *request : reaped)
+				request->done = true;
+			self->gone = gone;
+		}
+		self->reap_cv.notify_all();
+		reaped.clear();
+
+		if (gone) {
+			printf("usbfs: device gone, reaper stops\n");
+			break;
+		}
+	}
+	return NULL;
+}
+
+// Submits the requests in order and waits until the reaper has given all of
+// them back. Requests still pending after timeout ms (0 waits forever) are
+// discarded, and come back with -ENOENT. Returns LIBUSB_SUCCESS, or the error
+// of a failed submission.
+int UsbfsDevice::transfer(std::vector<usbfs_request> &requests, int timeout) {
+	int result = LIBUSB_SUCCESS;
+	size_t submitted = 0;
+	for (; submitted < requests.size(); submitted++) {
+		usbfs_request &request = requests[submitted];
+		request.done = false;
+		request.urb.usercontext = &request;
+		if (ioctl(fd, USBDEVFS_SUBMITURB, &request.urb) < 0) {
+			result = errno_result(errno);
+			break;
+		}
+	}
+
+	auto finished = [&]() {
+		if (gone)
+			return true;
+		for (size_t i = 0; i < submitted; i++) {
+			if (!requests[i].done)
+				return false;
+		}
+		return true;
+	};
+
+	std::unique_lock<std::mutex> lock(reap_mutex);
+	bool complete = result == LIBUSB_SUCCESS && (timeout <= 0 ||
+		reap_cv.wait_for(lock, std::chrono::milliseconds(timeout), finished));
+	if (!complete) {
+		// Discarding an URB that already completed fails harmlessly.
+		lock.unlock();
+		for (size_t i = 0; i < submitted; i++)
+			ioctl(fd, USBDEVFS_DISCARDURB, &requests[i].urb);
+		lock.lock();
+	}
+	reap_cv.wait(lock, finished);
+
+	for (size_t i = submitted; i < requests.size(); i++)
+		requests[i].urb.status = -ENOENT;
+	return result;
+}
+
+// Splits transfers the kernel can't take in one URB. For IN, every URB but the
+// last must fill up, and a short packet makes the kernel cancel the URBs
+// queued after it (bulk continuation), so they arrive in order.
+int UsbfsDevice::bulk_transfer(uint8_t endpoint, uint8_t *data, int length,
+			int *transferred, int timeout) {
+	bool in = endpoint & USB_DIR_IN;
+	int chunk = length;
+	if (!(capabilities & USBDEVFS_CAP_NO_PACKET_SIZE_LIM) && length > USBFS_MAX_BULK_URB) {
+		chunk = USBFS_MAX_BULK_URB;
+		// Without continuation a short packet would leave the later
+		// URBs reading the next transfer; read one at a time.
+		if (in && !(capabilities & USBDEVFS_CAP_BULK_CONTINUATION))
+			length = chunk;
+	}
+
+	int count = length ? (length + chunk - 1) / chunk : 1;
+	std::vector<usbfs_request> requests(count);
+	for (int i = 0; i < count; i++) {
+		struct usbdevfs_urb *urb = &requests[i].urb;
+		*urb = {};
+		urb->type = USBDEVFS_URB_TYPE_BULK;
+		urb->endpoint = endpoint;
+		urb->buffer = data + i * chunk;
+		urb->buffer_length = std::min(chunk, length - i * chunk);
+		if (in && i > 0)
+			urb->flags |= USBDEVFS_URB_BULK_CONTINUATION;
+		if (in && i < count - 1)
+			urb->flags |= USBDEVFS_URB_SHORT_NOT_OK;
+	}
+
+	int result = transfer(requests, timeout);
+	*transferred = 0;
+	for (usbfs_request &request : requests) {
+		struct usbdevfs_urb *urb = &request.urb;
+		*transferred += urb->actual_length;
+		if (urb->status == -EREMOTEIO)
+			break;
+		if (result == LIBUSB_SUCCESS)
+			result = urb_result(urb->status);
+		if (urb->status || urb->actual_length < urb->buffer_length)
+			break;
+	}
+	return result;
+}
+
+int UsbfsDevice::interrupt_transfer(uint8_t endpoint, uint8_t *data, int length,
+			int *transferred, int timeout) {
+	std::vector<usbfs_request> requests(1);
+	struct usbdevfs_urb *urb = &requests[0].urb;
+	*urb = {};
+	urb->type = USBDEVFS_URB_TYPE_INTERRUPT;
+	urb->endpoint = endpoint;
+	urb->buffer = data;
+	urb->buffer_length = length;
+
+	int result = transfer(requests, timeout);
+	*transferred = urb->actual_length;
+	if (result == LIBUSB_SUCCESS)
+		result = urb_result(urb->status);
+	return result;
+}
+
+void UsbfsDevice::clear_halt(uint8_t endpoint) {
+	unsigned int ep = endpoint;
+	if (ioctl(fd, USBDEVFS_CLEAR_HALT, &ep) < 0)
+		fprintf(stderr, "Error clearing halt on EP%02x: %s\n", endpoint, strerror(errno));
+}
+
+/*----------------------------------------------------------------------*/
+
+void UsbfsDevice::set_configuration(int configuration) {
+	int config = configuration;
+	if (ioctl(fd, USBDEVFS_SETCONFIGURATION, &config) < 0) {
+		fprintf(stderr, "Error setting configuration(%d): %s\n",
+				configuration, strerror(errno));
+	}
+}
+
+void UsbfsDevice::claim_interface(int interface) {
+	// Detaches a kernel driver that bound to the interface after the last
+	// SET_CONFIGURATION, and claims it, in one step.
+	struct usbdevfs_disconnect_claim claim = {};
+	claim.interface = interface;
+	claim.flags = USBDEVFS_DISCONNECT_CLAIM_EXCEPT_DRIVER;
+	strcpy(claim.driver, "usbfs");
+	if (ioctl(fd, USBDEVFS_DISCONNECT_CLAIM, &claim) == 0)
+		return;
+
+	unsigned int number = interface;
+	if (ioctl(fd, USBDEVFS_CLAIMINTERFACE, &number) < 0) {
+		fprintf(stderr, "Error claiming interface(%d): %s\n",
+				interface, strerror(errno));
+	}
+}
+
+void UsbfsDevice::release_interface(int interface) {
+	unsigned int number = interface;
+	if (ioctl(fd, USBDEVFS_RELEASEINTERFACE, &number) < 0 && errno != EINVAL) {
+		fprintf(stderr, "Error releasing interface(%d): %s\n",
+				interface, strerror(errno));
+	}
+}
+
+void UsbfsDevice::set_interface_alt_setting(int interface, int altsetting) {
+	struct usbdevfs_setinterface setting = {};
+	setting.interface = interface;
+	setting.altsetting = altsetting;
+	if (ioctl(fd, USBDEVFS_SETINTERFACE, &setting) < 0) {
+		fprintf(stderr, "Error setting interface altsetting(%d, %d): %s\n",
+				interface, altsetting, strerror(errno));
+	}
+}
+
+int UsbfsDevice::control_request(const usb_ctrlrequest *setup_packet, int *nbytes,
+			unsigned char **dataptr, int timeout) {
+	struct usbdevfs_ctrltransfer ctrl = {};
+	ctrl.bRequestType = setup_packet->bRequestType;
+	ctrl.bRequest = setup_packet->bRequest;
+	ctrl.wValue = setup_packet->wValue;
+	ctrl.wIndex = setup_packet->wIndex;
+	ctrl.wLength = setup_packet->wLength;
+	ctrl.timeout = timeout;
+	ctrl.data = *dataptr;
+
+	int result = ioctl(fd, USBDEVFS_CONTROL, &ctrl);
+	if (result < 0) {
+		result = errno_result(errno);
+		if (verbose_level) {
+			fprintf(stderr, "Error sending setup packet: %s\n",
+					libusb_strerror((libusb_error)result));
+		}
+		if (result == LIBUSB_ERROR_PIPE)
+			return -1;
+		return result;
+	}
+	else {
+		if (verbose_level)
+			printf("Control transfer succeed\n");
+	}
+
+	*nbytes = result;
+	return 0;
+}
+
+int UsbfsDevice::send_data(uint8_t endpoint, uint8_t attributes, uint8_t *dataptr,
+			int length) {
+	int transferred = 0;
+	int attempt = 0;
+	int result = LIBUSB_SUCCESS;
+
+	USB_PROXY_PROBE(send_data_entry, endpoint, length);
+
+	switch (attributes & USB_ENDPOINT_XFERTYPE_MASK) {
+	case USB_ENDPOINT_XFER_CONTROL:
+		fprintf(stderr, "Can't send on a control endpoint.\n");
+		result = LIBUSB_ERROR_NOT_SUPPORTED;
+		break;
+	case USB_ENDPOINT_XFER_ISOC:
+		if (verbose_level)
+			fprintf(stderr, "Isochronous(write) endpoint EP%02x unhandled.\n", endpoint);
+		result = LIBUSB_ERROR_NOT_SUPPORTED;
+		break;
+	case USB_ENDPOINT_XFER_BULK:
+		do {
+			result = bulk_transfer(endpoint, dataptr, length, &transferred, 0);
+			if (result == LIBUSB_ERROR_PIPE)
+				clear_halt(endpoint);
+			attempt++;
+		} while (result == LIBUSB_ERROR_PIPE && attempt < MAX_ATTEMPTS);
+		if (transferred != length) {
+			fprintf(stderr, "Incomplete Bulk transfer on EP%02x. length(%d), transferred(%d)\n",
+				endpoint, length, transferred);
+		}
+		if (result == LIBUSB_SUCCESS && verbose_level > 2)
+			printf("Sent %d bytes (Bulk) to EP%02x\n", transferred, endpoint);
+		break;
+	case USB_ENDPOINT_XFER_INT:
+		result = interrupt_transfer(endpoint, dataptr, length, &transferred, 0);
+		if (transferred != length)
+			fprintf(stderr, "Incomplete Interrupt transfer on EP%02x\n", endpoint);
+		if (result == LIBUSB_SUCCESS && verbose_level > 2)
+			printf("Sent %d bytes (Int) to usbfs EP%02x\n", transferred, endpoint);
+		break;
+	}
+	if (result != LIBUSB_SUCCESS && result != LIBUSB_ERROR_NOT_SUPPORTED) {
+		fprintf(stderr, "Transfer error sending on EP%02x: %s\n",
+				endpoint, libusb_strerror((libusb_error)result));
+	}
+
+	USB_PROXY_PROBE(send_data_return, endpoint, length, result);
+	return result;
+}
+
+void UsbfsDevice::receive_data(uint8_t endpoint, uint8_t attributes, int maxLength,
+			uint8_t **dataptr, int *length, int timeout) {
+	int result = LIBUSB_SUCCESS;
+	int attempt = 0;
+
+	*length = -1;
+	USB_PROXY_PROBE(receive_data_entry, endpoint, maxLength, timeout);
+
+	switch (attributes & USB_ENDPOINT_XFERTYPE_MASK) {
+	case USB_ENDPOINT_XFER_CONTROL:
+		fprintf(stderr, "Can't read on a control endpoint.\n");
+		result = LIBUSB_ERROR_NOT_SUPPORTED;
+		break;
+	case USB_ENDPOINT_XFER_ISOC:
+		if (verbose_level)
+			fprintf(stderr, "Isochronous(read) endpoint EP%02x unhandled.\n", endpoint);
+		result = LIBUSB_ERROR_NOT_SUPPORTED;
+		break;
+	case USB_ENDPOINT_XFER_BULK:
+		*dataptr = new uint8_t[maxLength];
+		do {
+			result = bulk_transfer(endpoint, *dataptr, maxLength, length, timeout);
+			if (result == LIBUSB_SUCCESS && verbose_level > 2)
+				printf("Received bulk data(%d) bytes\n", *length);
+			if (result == LIBUSB_ERROR_PIPE)
+				clear_halt(endpoint);
+
+			attempt++;
+		} while (result == LIBUSB_ERROR_PIPE && attempt < MAX_ATTEMPTS);
+		if (result == LIBUSB_ERROR_TIMEOUT && *length > 0)
+			result = LIBUSB_SUCCESS;
+		break;
+	case USB_ENDPOINT_XFER_INT:
+		*dataptr = new uint8_t[maxLength];
+		result = interrupt_transfer(endpoint, *dataptr, maxLength, length, timeout);
+		if (result == LIBUSB_SUCCESS && verbose_level > 2)
+			printf("Received int data(%d) bytes\n", *length);
+		break;
+	}
+
+	if (result != LIBUSB_SUCCESS && result != LIBUSB_ERROR_TIMEOUT &&
+	    result != LIBUSB_ERROR_NOT_SUPPORTED) {
+		fprintf(stderr, "Transfer error receiving on EP%02x: %s\n",
+				endpoint, libusb_strerror((libusb_error)result));
+	}
+	if (result != LIBUSB_SUCCESS)
+		*length = -1;
+
+	USB_PROXY_PROBE(receive_data_return, endpoint, *length, result);
+}
+
+// All requests are submitted as control URBs at once and reaped together.
+void UsbfsDevice::control_requests(std::vector<control_transfer> &transfers, int timeout) {
+	std::vector<usbfs_request> requests(transfers.size());
+	std::vector<std::string> buffers(transfers.size());
+	for (size_t i = 0; i < transfers.size(); i++) {
+		const struct usb_ctrlrequest *setup = &transfers[i].setup;
+		buffers[i].assign((const char *)setup, sizeof(*setup));
+		buffers[i].resize(sizeof(*setup) + setup->wLength);
+
+		struct usbdevfs_urb *urb = &requests[i].urb;
+		*urb = {};
+		urb->type = USBDEVFS_URB_TYPE_CONTROL;
+		urb->endpoint = 0;
+		urb->buffer = &buffers[i][0];
+		urb->buffer_length = buffers[i].size();
+	}
+
+	transfer(requests, timeout);
+	for (size_t i = 0; i < transfers.size(); i++) {
+		struct usbdevfs_urb *urb = &requests[i].urb;
+		transfers[i].result = urb_result(urb->status);
+		if (transfers[i].result == LIBUSB_ERROR_PIPE)
+			transfers[i].result = -1;
+		if (transfers[i].result == LIBUSB_SUCCESS)
+			transfers[i].data = buffers[i].substr(sizeof(struct usb_ctrlrequest),
+						urb->actual_length);
+	}
+}
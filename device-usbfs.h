@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+#include <pthread.h>
+#include <linux/usbdevice_fs.h>
+
+#include "device-libusb.h"
+
+/*
+ * A DeviceBackend that moves every request after discovery off libusb.
+ * connect_device() still finds, resets and describes the device; open() then
+ * opens its usbfs node a second time and all configuration, interface claims,
+ * control and data transfers go through that fd as URBs. One reaper thread
+ * polls the fd and reaps every completed URB in a batch, for all endpoints,
+ * instead of each synchronous libusb transfer running the event loop itself.
+ *
+ * Isochronous endpoints are unhandled, as with LibusbDevice. --reconnect is
+ * not supported, since the interfaces are claimed on this fd and not on the
+ * libusb handle that reconnect_monitor reopens.
+ */
+
+// The URB goes last: it ends in the flexible array of isochronous packets.
+struct usbfs_request {
+	bool			done;
+	struct usbdevfs_urb	urb;
+};
+
+class UsbfsDevice : public LibusbDevice {
+public:
+	// Call after connect_device(). Returns 0 on success.
+	int open();
+	void close();
+
+	void set_configuration(int configuration) override;
+	void claim_interface(int interface) override;
+	void release_interface(int interface) override;
+	void set_interface_alt_setting(int interface, int altsetting) override;
+	int control_request(const usb_ctrlrequest *setup_packet, int *nbytes,
+			unsigned char **dataptr, int timeout) override;
+	int send_data(uint8_t endpoint, uint8_t attributes, uint8_t *dataptr,
+			int length) override;
+	void receive_data(uint8_t endpoint, uint8_t attributes, int maxLength,
+			uint8_t **dataptr, int *length, int timeout) override;
+	void control_requests(std::vector<control_transfer> &transfers, int timeout) override;
+
+private:
+	static void *reaper(void *arg);
+	int transfer(std::vector<usbfs_request> &requests, int timeout);
+	int bulk_transfer(uint8_t endpoint, uint8_t *data, int length, int *transferred,
+			int timeout);
+	int interrupt_transfer(uint8_t endpoint, uint8_t *data, int length, int *transferred,
+			int timeout);
+	void clear_halt(uint8_t endpoint);
+
+	int				fd = -1;
+	uint32_t			capabilities = 0;
+	pthread_t			reaper_thread = 0;
+	std::atomic<bool>		closing{false};
+	bool				gone = false;
+	std::mutex			reap_mutex;
+	std::condition_variable		reap_cv;
+};
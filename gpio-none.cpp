@@ -0,0 +1,12 @@
+#include "gpio.h"
+
+int gpio_setup() {
+	return 0;
+}
+
+void gpio_input_pullup(unsigned int pin __attribute__((unused))) {
+}
+
+bool gpio_is_low(unsigned int pin __attribute__((unused))) {
+	return false;
+}
@@ -0,0 +1,16 @@
+#include <wiringPi.h>
+
+#include "gpio.h"
+
+int gpio_setup() {
+	return wiringPiSetupGpio();
+}
+
+void gpio_input_pullup(unsigned int pin) {
+	pinMode(pin, INPUT);
+	pullUpDnControl(pin, PUD_UP);
+}
+
+bool gpio_is_low(unsigned int pin) {
+	return digitalRead(pin) == LOW;
+}
@@ -0,0 +1,9 @@
+/*
+ * GPIO inputs used by the injection rules. gpio-wiringpi.cpp reads the
+ * Raspberry Pi pins through wiringPi; gpio-none.cpp is linked instead where
+ * there are no pins (e.g. usb-proxy-bench) and reports every pin as released.
+ */
+
+int gpio_setup();
+void gpio_input_pullup(unsigned int pin);
+bool gpio_is_low(unsigned int pin);
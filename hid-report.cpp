@@ -0,0 +1,304 @@
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <strings.h>
+
+#include "backend.h"
+#include "control-cache.h"
+#include "hid-report.h"
+
+static std::mutex reports_mutex;
+static std::map<uint8_t, std::string> reports;
+static std::atomic<bool> reports_loaded(false);
+
+/*----------------------------------------------------------------------*/
+
+// Global items, saved and restored by Push and Pop.
+struct hid_globals {
+	uint32_t	usage_page = 0;
+	int32_t		logical_minimum = 0;
+	uint32_t	logical_maximum = 0;	// signed only when logical_minimum is
+	int		logical_maximum_size = 0;
+	unsigned int	report_size = 0;
+	unsigned int	report_count = 0;
+	uint8_t		report_id = 0;
+};
+
+struct hid_locals {
+	std::vector<uint32_t>	usages;
+	uint32_t		usage_minimum = 0;
+	uint32_t		usage_maximum = 0;
+	bool			usage_range = false;
+};
+
+static int32_t sign_extend(uint32_t value, int size) {
+	if (size == 1)
+		return (int8_t)value;
+	if (size == 2)
+		return (int16_t)value;
+	return (int32_t)value;
+}
+
+static uint32_t full_usage(uint32_t value, int size, const hid_globals &globals) {
+	return size == 4 ? value : (globals.usage_page << 16) | value;
+}
+
+// The usage of the index-th field of a main item.
+static bool field_usage(const hid_locals &locals, unsigned int index, uint32_t *usage) {
+	if (locals.usage_range) {
+		*usage = std::min(locals.usage_minimum + index, locals.usage_maximum);
+		return true;
+	}
+	if (locals.usages.empty())
+		return false;
+	*usage = locals.usages[std::min((size_t)index, locals.usages.size() - 1)];
+	return true;
+}
+
+bool hid_report_parse(const std::string &raw, std::vector<hid_field> &fields) {
+	std::vector<hid_globals> stack;
+	hid_globals globals;
+	hid_locals locals;
+	// Bits used so far, by Input or Output and report ID.
+	std::map<std::pair<bool, uint8_t>, unsigned int> offsets;
+	bool report_ids = false;
+
+	fields.clear();
+	size_t pos = 0;
+	while (pos < raw.size()) {
+		uint8_t prefix = raw[pos];
+		if (prefix == 0xfe) {		// long item, none are defined
+			if (pos + 1 >= raw.size())
+				return false;
+			pos += 3 + (uint8_t)raw[pos + 1];
+			continue;
+		}
+
+		int size = prefix & 0x03;
+		if (size == 3)
+			size = 4;
+		if (pos + 1 + size > raw.size())
+			return false;
+		uint32_t value = 0;
+		for (int i = 0; i < size; i++)
+			value |= (uint32_t)(uint8_t)raw[pos + 1 + i] << (8 * i);
+		pos += 1 + size;
+
+		uint8_t item = prefix & 0xfc;
+		switch (item) {
+		// Main items
+		case 0x80:		// Input
+		case 0x90: {		// Output
+			bool output = item == 0x90;
+			unsigned int &offset = offsets[{output, globals.report_id}];
+			// Both come from the device; bound them before looping or adding.
+			uint64_t bits = (uint64_t)globals.report_count * globals.report_size;
+			if (bits > HID_MAX_REPORT_BITS - offset)
+				return false;
+			bool constant = value & 0x01, variable = value & 0x02;
+			for (unsigned int i = 0; i < globals.report_count; i++) {
+				uint32_t usage;
+				if (variable && !constant && globals.report_size >= 1 &&
+				    globals.report_size <= 32 && field_usage(locals, i, &usage)) {
+					hid_field field;
+					field.report_id = globals.report_id;
+					field.output = output;
+					field.bit_offset = offset + i * globals.report_size;
+					field.bit_size = globals.report_size;
+					field.usage = usage;
+					field.logical_minimum = globals.logical_minimum;
+					field.logical_maximum = globals.logical_minimum < 0 ?
+						sign_extend(globals.logical_maximum, globals.logical_maximum_size) :
+						(int32_t)globals.logical_maximum;
+					fields.push_back(field);
+				}
+			}
+			offset += bits;
+			locals = hid_locals();
+			break;
+		}
+		case 0xb0:		// Feature
+		case 0xa0:		// Collection
+		case 0xc0:		// End Collection
+			locals = hid_locals();
+			break;
+
+		// Global items
+		case 0x04:
+			globals.usage_page = value;
+			break;
+		case 0x14:
+			globals.logical_minimum = sign_extend(value, size);
+			break;
+		case 0x24:
+			globals.logical_maximum = value;
+			globals.logical_maximum_size = size;
+			break;
+		case 0x74:
+			globals.report_size = value;
+			break;
+		case 0x84:
+			if (value == 0 || value > 0xff)
+				return false;
+			globals.report_id = value;
+			report_ids = true;
+			break;
+		case 0x94:
+			globals.report_count = value;
+			break;
+		case 0xa4:
+			stack.push_back(globals);
+			break;
+		case 0xb4:
+			if (stack.empty())
+				return false;
+			globals = stack.back();
+			stack.pop_back();
+			break;
+
+		// Local items
+		case 0x08:
+			locals.usages.push_back(full_usage(value, size, globals));
+			break;
+		case 0x18:
+			locals.usage_minimum = full_usage(value, size, globals);
+			locals.usage_range = true;
+			break;
+		case 0x28:
+			locals.usage_maximum = full_usage(value, size, globals);
+			locals.usage_range = true;
+			break;
+		}
+	}
+
+	// Reports then start with their ID.
+	if (report_ids) {
+		for (hid_field &field : fields)
+			field.bit_offset += 8;
+	}
+	return true;
+}
+
+/*----------------------------------------------------------------------*/
+
+static const struct {
+	const char	*name;
+	uint16_t	usage;
+} generic_desktop_usages[] = {
+	{ "X", 0x30 }, { "Y", 0x31 }, { "Z", 0x32 },
+	{ "Rx", 0x33 }, { "Ry", 0x34 }, { "Rz", 0x35 },
+	{ "Slider", 0x36 }, { "Dial", 0x37 }, { "Wheel", 0x38 },
+	{ "Hat switch", 0x39 },
+};
+
+bool hid_usage_parse(const std::string &name, uint32_t *usage) {
+	unsigned int page, id, button;
+	char end;
+	if (sscanf(name.c_str(), "%x:%x%c", &page, &id, &end) == 2) {
+		if (page > 0xffff || id > 0xffff)
+			return false;
+		*usage = page << 16 | id;
+		return true;
+	}
+	if (sscanf(name.c_str(), "Button %u%c", &button, &end) == 1) {
+		if (button == 0 || button > 0xffff)
+			return false;
+		*usage = HID_USAGE_PAGE_BUTTON << 16 | button;
+		return true;
+	}
+
+	std::string base = name;
+	if (base.size() > 5 && !strcasecmp(base.c_str() + base.size() - 5, " axis"))
+		base.erase(base.size() - 5);
+	for (const auto &entry : generic_desktop_usages) {
+		if (!strcasecmp(base.c_str(), entry.name)) {
+			*usage = HID_USAGE_PAGE_GENERIC_DESKTOP << 16 | entry.usage;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*----------------------------------------------------------------------*/
+
+void hid_report_set(uint8_t ep_address, const std::string &raw) {
+	std::lock_guard<std::mutex> lock(reports_mutex);
+	reports[ep_address] = raw;
+}
+
+bool hid_report_fields(uint8_t ep_address, std::vector<hid_field> &fields) {
+	std::string raw;
+	{
+		std::lock_guard<std::mutex> lock(reports_mutex);
+		auto it = reports.find(ep_address);
+		if (it == reports.end())
+			return false;
+		raw = it->second;
+	}
+	return hid_report_parse(raw, fields);
+}
+
+// Reads the report descriptor of an interface, whose length its HID
+// descriptor gives.
+static bool read_report_descriptor(DeviceBackend *device,
+			const struct libusb_interface_descriptor *alt, std::string &raw) {
+	for (int pos = 0; pos + 9 <= alt->extra_length; pos += alt->extra[pos]) {
+		const unsigned char *hid = alt->extra + pos;
+		if (hid[0] < 9)
+			break;
+		if (hid[1] != HID_DT_HID || hid[6] != HID_DT_REPORT)
+			continue;
+
+		struct usb_ctrlrequest ctrl = { USB_DIR_IN | USB_RECIP_INTERFACE,
+			USB_REQ_GET_DESCRIPTOR, HID_DT_REPORT << 8, alt->bInterfaceNumber,
+			(uint16_t)(hid[7] | (hid[8] << 8)) };
+		int nbytes = 0;
+		unsigned char *data = new unsigned char[ctrl.wLength];
+		bool found = control_cache_lookup(&ctrl, data, &nbytes) ||
+			device->control_request(&ctrl, &nbytes, &data, 1000) == 0;
+		if (found)
+			raw.assign((const char *)data, nbytes);
+		delete[] data;
+		return found;
+	}
+	return false;
+}
+
+int hid_reports_load(DeviceBackend *device) {
+	{
+		std::lock_guard<std::mutex> lock(reports_mutex);
+		reports.clear();
+	}
+
+	int loaded = 0;
+	const struct libusb_device_descriptor *device_desc = device->device_descriptor();
+	for (int i = 0; i < device_desc->bNumConfigurations; i++) {
+		const struct libusb_config_descriptor *config = device->config_descriptor(i);
+		if (!config)
+			continue;
+		for (int j = 0; j < config->bNumInterfaces; j++) {
+			const struct libusb_interface_descriptor *alt = &config->interface[j].altsetting[0];
+			std::string raw;
+			if (alt->bInterfaceClass != USB_CLASS_HID ||
+			    !read_report_descriptor(device, alt, raw))
+				continue;
+
+			for (int k = 0; k < alt->bNumEndpoints; k++) {
+				const struct libusb_endpoint_descriptor *ep = &alt->endpoint[k];
+				if ((ep->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) != USB_ENDPOINT_XFER_INT)
+					continue;
+				hid_report_set(ep->bEndpointAddress, raw);
+				printf("HID report descriptor of interface %d: %zu bytes, endpoint %02x\n",
+					alt->bInterfaceNumber, raw.size(), ep->bEndpointAddress);
+				loaded++;
+			}
+		}
+	}
+	reports_loaded = true;
+	return loaded;
+}
+
+bool hid_reports_loaded() {
+	return reports_loaded;
+}
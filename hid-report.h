@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#define HID_DT_HID	0x21
+#define HID_DT_REPORT	0x22
+
+#define HID_USAGE_PAGE_GENERIC_DESKTOP	0x01
+#define HID_USAGE_PAGE_BUTTON		0x09
+
+// Reports can't be longer than a control transfer's 64 KiB.
+#define HID_MAX_REPORT_BITS	(65536 * 8)
+
+class DeviceBackend;
+
+/*
+ * The fields of a device's reports, as its HID report descriptor lays them
+ * out. Only variable items are listed: a field in an array item holds
+ * whichever usage is active, so it has no fixed position to rewrite.
+ */
+
+struct hid_field {
+	uint8_t		report_id;	// 0 when the device uses no report IDs
+	bool		output;		// an Output item, else an Input item
+	unsigned int	bit_offset;	// from the start of the report, report ID included
+	unsigned int	bit_size;	// 1 to 32
+	uint32_t	usage;		// usage page << 16 | usage ID
+	int32_t		logical_minimum;
+	int32_t		logical_maximum;
+};
+
+// Returns false for a malformed descriptor, or one with reports too long to be real.
+bool hid_report_parse(const std::string &raw, std::vector<hid_field> &fields);
+
+/*
+ * Parses a usage written in a rule file: "Button 5", a generic desktop
+ * usage such as "X", "Rz" or "Hat switch" (an " axis" suffix is allowed),
+ * or "<page>:<id>" in hex, e.g. "0c:e9".
+ */
+bool hid_usage_parse(const std::string &name, uint32_t *usage);
+
+/*
+ * Report descriptors by endpoint address, for the interrupt endpoints of
+ * every HID interface. hid_reports_load() fills them in once the device is
+ * open, from the control cache when it holds them. Returns the number of
+ * endpoints with a report descriptor.
+ */
+int hid_reports_load(DeviceBackend *device);
+// Whether hid_reports_load() has run, so that an endpoint without a report
+// descriptor really has none rather than not being read yet.
+bool hid_reports_loaded();
+void hid_report_set(uint8_t ep_address, const std::string &raw);
+// Returns false if no report descriptor is known for the endpoint.
+bool hid_report_fields(uint8_t ep_address, std::vector<hid_field> &fields);
@@ -0,0 +1,582 @@
+#include <algorithm>
+#include <fcntl.h>
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "host-functionfs.h"
+#include "descriptors.h"
+#include "probes.h"
+#include "proxy.h"
+
+#define FFS_GADGET	"/sys/kernel/config/usb_gadget/usb-proxy"
+#define FFS_NAME	"usb-proxy"
+#define FFS_MOUNT	"/dev/ffs-usb-proxy"
+
+// Linux AIO without libaio.
+static int sys_io_setup(unsigned nr, aio_context_t *ctx) {
+	return syscall(SYS_io_setup, nr, ctx);
+}
+
+static int sys_io_destroy(aio_context_t ctx) {
+	return syscall(SYS_io_destroy, ctx);
+}
+
+static int sys_io_submit(aio_context_t ctx, long nr, struct iocb **iocbs) {
+	return syscall(SYS_io_submit, ctx, nr, iocbs);
+}
+
+static int sys_io_getevents(aio_context_t ctx, long min_nr, long nr,
+			struct io_event *events, struct timespec *timeout) {
+	return syscall(SYS_io_getevents, ctx, min_nr, nr, events, timeout);
+}
+
+/*----------------------------------------------------------------------*/
+
+static void write_attr(const std::string &path, const std::string &value) {
+	FILE *file = fopen(path.c_str(), "w");
+	if (!file || fputs(value.c_str(), file) < 0 || fclose(file) != 0) {
+		perror(path.c_str());
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void make_dir(const std::string &path) {
+	if (mkdir(path.c_str(), 0755) < 0 && errno != EEXIST) {
+		perror(path.c_str());
+		exit(EXIT_FAILURE);
+	}
+}
+
+static std::string hex(int value) {
+	char buffer[8];
+	snprintf(buffer, sizeof(buffer), "0x%04x", value);
+	return buffer;
+}
+
+// String descriptor `index` of the proxied device, in US English, as UTF-8.
+static std::string device_string(int index) {
+	if (!index)
+		return "";
+
+	struct usb_ctrlrequest ctrl = {
+		.bRequestType =	USB_DIR_IN,
+		.bRequest =	USB_REQ_GET_DESCRIPTOR,
+		.wValue =	(__u16)((USB_DT_STRING << 8) | index),
+		.wIndex =	0x0409,
+		.wLength =	255,
+	};
+	unsigned char *data = new unsigned char[ctrl.wLength];
+	int nbytes = 0;
+	std::string result;
+	if (device_backend->control_request(&ctrl, &nbytes, &data, 1000) == 0) {
+		for (int i = 2; i + 1 < nbytes; i += 2) {
+			unsigned c = data[i] | data[i + 1] << 8;
+			if (c < 0x80)
+				result += (char)c;
+			else if (c < 0x800) {
+				result += (char)(0xc0 | c >> 6);
+				result += (char)(0x80 | (c & 0x3f));
+			}
+			else {
+				result += (char)(0xe0 | c >> 12);
+				result += (char)(0x80 | ((c >> 6) & 0x3f));
+				result += (char)(0x80 | (c & 0x3f));
+			}
+		}
+	}
+	delete[] data;
+	return result;
+}
+
+/*
+ * The descriptors of a configuration after its header, as FunctionFS takes
+ * them for one speed. Interface and function strings are renumbered into
+ * FunctionFS's own table. Returns the number of descriptors.
+ */
+static int function_descriptors(const std::string &config, std::map<int, int> &strings,
+			std::string &out) {
+	int count = 0;
+	int interface_class = 0;
+	size_t pos = USB_DT_CONFIG_SIZE;
+	while (pos + 2 <= config.size()) {
+		size_t length = (uint8_t)config[pos];
+		uint8_t type = config[pos + 1];
+		if (length < 2 || pos + length > config.size())
+			break;
+
+		std::string desc = config.substr(pos, length);
+		pos += length;
+
+		int string_offset = -1;
+		switch (type) {
+		case USB_DT_INTERFACE:
+			interface_class = (uint8_t)desc[5];
+			string_offset = 8;
+			break;
+		case USB_DT_INTERFACE_ASSOCIATION:
+			string_offset = 7;
+			break;
+		case USB_DT_ENDPOINT:
+		case USB_DT_SS_ENDPOINT_COMP:
+			break;
+		case USB_TYPE_CLASS | 0x01:
+			if (interface_class == USB_CLASS_HID ||
+			    interface_class == USB_CLASS_CSCID)
+				break;
+			// fall through
+		default:
+			printf("FunctionFS can't carry descriptor type 0x%02x, dropped\n", type);
+			continue;
+		}
+
+		if (string_offset >= 0 && (size_t)string_offset < length && desc[string_offset]) {
+			int index = (uint8_t)desc[string_offset];
+			if (!strings.count(index)) {
+				int next = strings.size() + 1;
+				strings[index] = next;
+			}
+			desc[string_offset] = (char)strings[index];
+		}
+		out += desc;
+		count++;
+	}
+	return count;
+}
+
+static void append_le32(std::string &out, uint32_t value) {
+	value = htole32(value);
+	out.append((const char *)&value, sizeof(value));
+}
+
+/*----------------------------------------------------------------------*/
+
+// Undoes whatever a previous run left behind; every step may fail.
+void FunctionFsHost::teardown() {
+	FILE *file = fopen(FFS_GADGET "/UDC", "w");
+	if (file) {
+		fputs("\n", file);
+		fclose(file);
+	}
+	umount(FFS_MOUNT);
+	rmdir(FFS_MOUNT);
+	unlink(FFS_GADGET "/configs/c.1/" "ffs." FFS_NAME);
+	rmdir(FFS_GADGET "/configs/c.1/strings/0x409");
+	rmdir(FFS_GADGET "/configs/c.1");
+	rmdir(FFS_GADGET "/functions/ffs." FFS_NAME);
+	rmdir(FFS_GADGET "/strings/0x409");
+	rmdir(FFS_GADGET);
+}
+
+void FunctionFsHost::init(enum usb_device_speed speed, const char *driver __attribute__((unused)),
+			const char *device) {
+	udc = device;
+	teardown();
+
+	const struct usb_device_descriptor *dev = &host_device_desc.device;
+	const struct usb_config_descriptor *config = &host_device_desc.configs[0].config;
+	if (config->bConfigurationValue)
+		configuration = config->bConfigurationValue;
+	if (dev->bNumConfigurations > 1)
+		printf("FunctionFS exposes only the first of %d configurations\n",
+			dev->bNumConfigurations);
+
+	std::string gadget = FFS_GADGET;
+	std::string config_dir = gadget + "/configs/c.1";
+	std::string function_dir = gadget + "/functions/ffs." FFS_NAME;
+	make_dir(gadget);
+	write_attr(gadget + "/idVendor", hex(dev->idVendor));
+	write_attr(gadget + "/idProduct", hex(dev->idProduct));
+	write_attr(gadget + "/bcdDevice", hex(dev->bcdDevice));
+	write_attr(gadget + "/bcdUSB", hex(dev->bcdUSB));
+	write_attr(gadget + "/bDeviceClass", std::to_string(dev->bDeviceClass));
+	write_attr(gadget + "/bDeviceSubClass", std::to_string(dev->bDeviceSubClass));
+	write_attr(gadget + "/bDeviceProtocol", std::to_string(dev->bDeviceProtocol));
+	write_attr(gadget + "/max_speed", usb_speed_name(speed));
+	make_dir(gadget + "/strings/0x409");
+	write_attr(gadget + "/strings/0x409/manufacturer", device_string(dev->iManufacturer));
+	write_attr(gadget + "/strings/0x409/product", device_string(dev->iProduct));
+	write_attr(gadget + "/strings/0x409/serialnumber", device_string(dev->iSerialNumber));
+
+	make_dir(config_dir);
+	write_attr(config_dir + "/bmAttributes", hex(config->bmAttributes));
+	write_attr(config_dir + "/MaxPower", std::to_string(config->bMaxPower *
+		(speed >= USB_SPEED_SUPER ? 8 : 2)));
+	make_dir(config_dir + "/strings/0x409");
+	write_attr(config_dir + "/strings/0x409/configuration",
+		device_string(config->iConfiguration));
+	make_dir(function_dir);
+	if (symlink(function_dir.c_str(), (config_dir + "/ffs." FFS_NAME).c_str()) < 0) {
+		perror("symlink() FunctionFS function");
+		exit(EXIT_FAILURE);
+	}
+
+	make_dir(FFS_MOUNT);
+	if (mount(FFS_NAME, FFS_MOUNT, "functionfs", 0, NULL) < 0) {
+		perror("mount() functionfs");
+		exit(EXIT_FAILURE);
+	}
+	ep0 = open(FFS_MOUNT "/ep0", O_RDWR);
+	if (ep0 < 0) {
+		perror("open() FunctionFS ep0");
+		exit(EXIT_FAILURE);
+	}
+
+	// One descriptor set per speed the gadget can run at.
+	std::string raw = descriptor_serialize_config(device_backend->config_descriptor(0));
+	auto config_at = [&](enum usb_device_speed at) {
+		return descriptor_hide(descriptor_override_intervals(
+				descriptor_adapt_config(raw, device_speed, at), poll_intervals, at),
+				hidden_interfaces, hidden_endpoints);
+	};
+	std::map<int, int> strings;
+	std::string fs, hs, ss;
+	int fs_count = function_descriptors(config_at(USB_SPEED_FULL), strings, fs);
+	int hs_count = 0, ss_count = 0;
+	uint32_t flags = FUNCTIONFS_HAS_FS_DESC | FUNCTIONFS_VIRTUAL_ADDR |
+			FUNCTIONFS_ALL_CTRL_RECIP | FUNCTIONFS_CONFIG0_SETUP;
+	if (speed >= USB_SPEED_HIGH) {
+		hs_count = function_descriptors(config_at(USB_SPEED_HIGH), strings, hs);
+		flags |= FUNCTIONFS_HAS_HS_DESC;
+	}
+	if (speed >= USB_SPEED_SUPER) {
+		ss_count = function_descriptors(config_at(USB_SPEED_SUPER), strings, ss);
+		flags |= FUNCTIONFS_HAS_SS_DESC;
+	}
+
+	std::string descs;
+	append_le32(descs, FUNCTIONFS_DESCRIPTORS_MAGIC_V2);
+	append_le32(descs, 0);
+	append_le32(descs, flags);
+	append_le32(descs, fs_count);
+	if (flags & FUNCTIONFS_HAS_HS_DESC)
+		append_le32(descs, hs_count);
+	if (flags & FUNCTIONFS_HAS_SS_DESC)
+		append_le32(descs, ss_count);
+	descs += fs + hs + ss;
+	uint32_t length = htole32(descs.size());
+	descs.replace(4, sizeof(length), (const char *)&length, sizeof(length));
+
+	if (write(ep0, descs.data(), descs.size()) < 0) {
+		perror("write() FunctionFS descriptors");
+		exit(EXIT_FAILURE);
+	}
+
+	std::vector<std::string> table(strings.size());
+	for (const auto &string : strings)
+		table[string.second - 1] = device_string(string.first);
+
+	std::string strs;
+	append_le32(strs, FUNCTIONFS_STRINGS_MAGIC);
+	append_le32(strs, 0);
+	append_le32(strs, table.size());
+	append_le32(strs, table.empty() ? 0 : 1);
+	if (!table.empty()) {
+		uint16_t lang = htole16(0x0409);
+		strs.append((const char *)&lang, sizeof(lang));
+		for (const std::string &string : table)
+			strs.append(string.c_str(), string.size() + 1);
+	}
+	length = htole32(strs.size());
+	strs.replace(4, sizeof(length), (const char *)&length, sizeof(length));
+
+	if (write(ep0, strs.data(), strs.size()) < 0) {
+		perror("write() FunctionFS strings");
+		exit(EXIT_FAILURE);
+	}
+
+	// Endpoint files are numbered in descriptor order.
+	int count = 0;
+	for (size_t pos = 0; pos + 2 <= fs.size(); pos += (uint8_t)fs[pos]) {
+		if (fs[pos + 1] == USB_DT_ENDPOINT && count + 1 < FFS_MAX_EPS)
+			eps[++count].address = fs[pos + 2];
+	}
+	printf("FunctionFS: %d endpoints, %zu strings\n", count, table.size());
+}
+
+void FunctionFsHost::run() {
+	write_attr(FFS_GADGET "/UDC", udc);
+}
+
+void FunctionFsHost::close() {
+	for (int i = 1; i < FFS_MAX_EPS; i++)
+		ep_disable(i);
+	if (ep0 >= 0)
+		::close(ep0);
+	ep0 = -1;
+	teardown();
+}
+
+void FunctionFsHost::event_fetch(struct usb_raw_event *event) {
+	while (true) {
+		struct usb_functionfs_event ffs_event;
+		int rv = read(ep0, &ffs_event, sizeof(ffs_event));
+		if (rv < 0) {
+			if (errno == EINTR) {
+				event->length = 4294967295;
+				return;
+			}
+			perror("read() FunctionFS ep0");
+			exit(EXIT_FAILURE);
+		}
+
+		switch (ffs_event.type) {
+		case FUNCTIONFS_BIND:
+			event->type = USB_RAW_EVENT_CONNECT;
+			event->length = 0;
+			return;
+		case FUNCTIONFS_ENABLE:
+			// Enabled again without a DISABLE: a SET_INTERFACE the
+			// proxy can't tell apart.
+			if (enabled) {
+				printf("FunctionFS: interface change ignored\n");
+				continue;
+			}
+			enabled = true;
+			synthetic = true;
+			setup = {
+				.bRequestType =	USB_DIR_OUT | USB_TYPE_STANDARD | USB_RECIP_DEVICE,
+				.bRequest =	USB_REQ_SET_CONFIGURATION,
+				.wValue =	(__u16)configuration,
+				.wIndex =	0,
+				.wLength =	0,
+			};
+			break;
+		case FUNCTIONFS_DISABLE:
+			enabled = false;
+			continue;
+		case FUNCTIONFS_SETUP:
+			synthetic = false;
+			setup = ffs_event.u.setup;
+			break;
+		default:
+			continue;
+		}
+
+		event->type = USB_RAW_EVENT_CONTROL;
+		event->length = sizeof(setup);
+		memcpy(&event->data[0], &setup, sizeof(setup));
+		return;
+	}
+}
+
+int FunctionFsHost::ep0_read(struct usb_raw_ep_io *io) {
+	if (synthetic) {
+		synthetic = false;
+		return 0;
+	}
+	int rv = read(ep0, io->data, io->length);
+	if (rv < 0) {
+		perror("read() FunctionFS ep0");
+		return rv;
+	}
+	return rv;
+}
+
+int FunctionFsHost::ep0_write(struct usb_raw_ep_io *io) {
+	int rv = write(ep0, io->data, io->length);
+	if (rv < 0) {
+		perror("write() FunctionFS ep0");
+		return rv;
+	}
+	return rv;
+}
+
+// FunctionFS stalls a request when ep0 is used in the wrong direction.
+void FunctionFsHost::ep0_stall() {
+	printf("ep0: stalling\n");
+	if (synthetic) {
+		synthetic = false;
+		return;
+	}
+	if (setup.bRequestType & USB_DIR_IN)
+		(void)!read(ep0, NULL, 0);
+	else
+		(void)!write(ep0, NULL, 0);
+}
+
+// Endpoint files too halt their endpoint when used in the wrong direction.
+void FunctionFsHost::ep_stall(uint32_t num) {
+	if (num == 0 || num >= FFS_MAX_EPS || eps[num].fd < 0)
+		return;
+	if (eps[num].address & USB_DIR_IN)
+		(void)!read(eps[num].fd, NULL, 0);
+	else
+		(void)!write(eps[num].fd, NULL, 0);
+}
+
+int FunctionFsHost::ep_enable(struct usb_endpoint_descriptor *desc) {
+	for (int i = 1; i < FFS_MAX_EPS; i++) {
+		struct ffs_endpoint *ep = &eps[i];
+		if (ep->address != desc->bEndpointAddress)
+			continue;
+		if (ep->fd >= 0)
+			return i;
+
+		std::string path = FFS_MOUNT "/ep" + std::to_string(i);
+		// Non-blocking, so a submission while the host has the
+		// function disabled fails instead of waiting.
+		ep->fd = open(path.c_str(), O_RDWR | O_NONBLOCK);
+		if (ep->fd < 0) {
+			perror(path.c_str());
+			exit(EXIT_FAILURE);
+		}
+		ep->ctx = 0;
+		if (sys_io_setup(FFS_QUEUE_DEPTH, &ep->ctx) < 0) {
+			perror("io_setup()");
+			exit(EXIT_FAILURE);
+		}
+		for (int slot = 0; slot < FFS_QUEUE_DEPTH; slot++) {
+			if (!ep->buffers[slot])
+				ep->buffers[slot] = new char[USB_RAW_TRANSFER_MAX];
+		}
+		ep->head = 0;
+		ep->in_flight = 0;
+		return i;
+	}
+	fprintf(stderr, "FunctionFS has no endpoint 0x%02x\n", desc->bEndpointAddress);
+	exit(EXIT_FAILURE);
+}
+
+int FunctionFsHost::ep_disable(uint32_t num) {
+	if (num == 0 || num >= FFS_MAX_EPS)
+		return -1;
+	struct ffs_endpoint *ep = &eps[num];
+	if (ep->fd < 0)
+		return 0;
+
+	// Cancels and waits for whatever is still queued.
+	sys_io_destroy(ep->ctx);
+	::close(ep->fd);
+	ep->fd = -1;
+	ep->in_flight = 0;
+	return 0;
+}
+
+int FunctionFsHost::submit(struct ffs_endpoint *ep, int slot, bool in, uint32_t length) {
+	struct iocb *iocb = &ep->iocbs[slot];
+	memset(iocb, 0, sizeof(*iocb));
+	iocb->aio_data = slot;
+	iocb->aio_lio_opcode = in ? IOCB_CMD_PWRITE : IOCB_CMD_PREAD;
+	iocb->aio_fildes = ep->fd;
+	iocb->aio_buf = (uint64_t)(uintptr_t)ep->buffers[slot];
+	iocb->aio_nbytes = length;
+	ep->done[slot] = false;
+
+	int rv = sys_io_submit(ep->ctx, 1, &iocb);
+	if (rv < 0)
+		return rv;
+	ep->in_flight++;
+	return 0;
+}
+
+// Collects completions into their slots. With wait, returns false if the
+// proxy is stopping before any arrived.
+bool FunctionFsHost::reap(struct ffs_endpoint *ep, bool wait) {
+	struct io_event events[FFS_QUEUE_DEPTH];
+	while (true) {
+		struct timespec timeout = { 0, wait ? 100 * 1000 * 1000 : 0 };
+		int rv = sys_io_getevents(ep->ctx, wait ? 1 : 0, FFS_QUEUE_DEPTH, events, &timeout);
+		if (rv < 0 && errno != EINTR) {
+			perror("io_getevents()");
+			return false;
+		}
+		for (int i = 0; i < rv; i++) {
+			int slot = events[i].data;
+			ep->results[slot] = events[i].res;
+			ep->done[slot] = true;
+		}
+		if (rv > 0 || !wait)
+			return true;
+		if (please_stop_eps)
+			return false;
+	}
+}
+
+int FunctionFsHost::ep_read(struct usb_raw_ep_io *io) {
+	struct ffs_endpoint *ep = &eps[io->ep];
+	uint32_t length = std::min(io->length, (uint32_t)USB_RAW_TRANSFER_MAX);
+	USB_PROXY_PROBE(raw_ep_read_entry, io->ep, io->length);
+
+	// Keep the queue full, so the UDC always has a request to fill.
+	while (ep->in_flight < FFS_QUEUE_DEPTH) {
+		int slot = (ep->head + ep->in_flight) % FFS_QUEUE_DEPTH;
+		if (submit(ep, slot, false, length) < 0) {
+			if (ep->in_flight)
+				break;
+			// Disabled by the host, try again later.
+			usleep(1000);
+			return -1;
+		}
+	}
+
+	while (!ep->done[ep->head]) {
+		if (!reap(ep, true))
+			return -1;
+	}
+
+	int slot = ep->head;
+	ep->head = (ep->head + 1) % FFS_QUEUE_DEPTH;
+	ep->in_flight--;
+
+	long rv = ep->results[slot];
+	USB_PROXY_PROBE(raw_ep_read_return, io->ep, rv);
+	if (rv < 0) {
+		if (rv != -ESHUTDOWN && rv != -ECONNRESET)
+			fprintf(stderr, "FunctionFS read on ep%d: %s\n", io->ep, strerror(-rv));
+		return -1;
+	}
+	rv = std::min(rv, (long)io->length);
+	memcpy(io->data, ep->buffers[slot], rv);
+	return rv;
+}
+
+int FunctionFsHost::ep_write(struct usb_raw_ep_io *io) {
+	struct ffs_endpoint *ep = &eps[io->ep];
+	USB_PROXY_PROBE(raw_ep_write_entry, io->ep, io->length);
+
+	// Retire completed writes; wait only when every slot is taken.
+	reap(ep, false);
+	while (true) {
+		while (ep->in_flight && ep->done[ep->head]) {
+			long rv = ep->results[ep->head];
+			if (rv < 0 && rv != -ESHUTDOWN && rv != -ECONNRESET)
+				fprintf(stderr, "FunctionFS write on ep%d: %s\n", io->ep, strerror(-rv));
+			ep->head = (ep->head + 1) % FFS_QUEUE_DEPTH;
+			ep->in_flight--;
+		}
+		if (ep->in_flight < FFS_QUEUE_DEPTH)
+			break;
+		if (!reap(ep, true))
+			return -1;
+	}
+
+	int slot = (ep->head + ep->in_flight) % FFS_QUEUE_DEPTH;
+	uint32_t length = std::min(io->length, (uint32_t)USB_RAW_TRANSFER_MAX);
+	memcpy(ep->buffers[slot], io->data, length);
+	int rv = submit(ep, slot, true, length);
+	USB_PROXY_PROBE(raw_ep_write_return, io->ep, rv < 0 ? rv : (int)length);
+	if (rv < 0) {
+		usleep(1000);
+		return -1;
+	}
+	return length;
+}
+
+void FunctionFsHost::configure() {
+}
+
+void FunctionFsHost::vbus_draw(uint32_t power __attribute__((unused))) {
+}
+
+// The UDC's endpoints are FunctionFS's business.
+int FunctionFsHost::eps_info(struct usb_raw_eps_info *info __attribute__((unused))) {
+	return 0;
+}
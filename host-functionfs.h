@@ -0,0 +1,75 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <linux/aio_abi.h>
+#include <linux/usb/functionfs.h>
+
+#include "backend.h"
+
+/*
+ * A HostBackend that exposes the proxied device as a FunctionFS function of
+ * a configfs gadget instead of through raw-gadget. init() creates the gadget
+ * with the device's ids and strings, writes the interface, endpoint and
+ * class descriptors of its first configuration to ep0, and run() binds the
+ * gadget to the UDC. Needs configfs mounted and the libcomposite and
+ * usb_f_fs modules.
+ *
+ * Endpoint I/O goes through Linux AIO on the endpoint files, with
+ * FFS_QUEUE_DEPTH requests queued per endpoint: OUT endpoints keep that many
+ * reads in flight, and ep_write() returns as soon as the write is queued.
+ *
+ * The composite framework answers GET_DESCRIPTOR and SET_CONFIGURATION
+ * itself, so the proxy only sees the first FUNCTIONFS_ENABLE, turned into a
+ * SET_CONFIGURATION request, plus the class and vendor requests. Only one
+ * configuration is exposed, FunctionFS enables every endpoint regardless of
+ * SET_INTERFACE, and class-specific descriptors other than HID and CCID are
+ * dropped, since FunctionFS rejects them.
+ */
+
+#define FFS_QUEUE_DEPTH		4
+#define FFS_MAX_EPS		32
+
+struct ffs_endpoint {
+	int			fd = -1;
+	uint8_t			address = 0;
+	aio_context_t		ctx = 0;
+	struct iocb		iocbs[FFS_QUEUE_DEPTH];
+	char			*buffers[FFS_QUEUE_DEPTH] = {};
+	long			results[FFS_QUEUE_DEPTH];
+	bool			done[FFS_QUEUE_DEPTH];
+	int			head = 0;	// oldest request in flight
+	int			in_flight = 0;
+};
+
+class FunctionFsHost : public HostBackend {
+public:
+	void init(enum usb_device_speed speed, const char *driver, const char *device) override;
+	void run() override;
+	void close() override;
+	void event_fetch(struct usb_raw_event *event) override;
+	int ep0_read(struct usb_raw_ep_io *io) override;
+	int ep0_write(struct usb_raw_ep_io *io) override;
+	void ep0_stall() override;
+	int ep_enable(struct usb_endpoint_descriptor *desc) override;
+	int ep_disable(uint32_t num) override;
+	int ep_read(struct usb_raw_ep_io *io) override;
+	int ep_write(struct usb_raw_ep_io *io) override;
+	void ep_stall(uint32_t num) override;
+	void configure() override;
+	void vbus_draw(uint32_t power) override;
+	int eps_info(struct usb_raw_eps_info *info) override;
+
+private:
+	void teardown();
+	bool reap(struct ffs_endpoint *ep, bool wait);
+	int submit(struct ffs_endpoint *ep, int slot, bool in, uint32_t length);
+
+	std::string		udc;
+	int			ep0 = -1;
+	int			configuration = 1;
+	struct usb_ctrlrequest	setup = {};
+	bool			synthetic = false;	// setup was made up from an ENABLE
+	bool			enabled = false;
+	struct ffs_endpoint	eps[FFS_MAX_EPS];
+};
@@ -14,12 +14,89 @@
 
 #include <linux/types.h>
 
-#include "host-raw-gadget.h"
+#include "backend.h"
+#include "probes.h"
 
 struct raw_gadget_device host_device_desc;
 
 /*----------------------------------------------------------------------*/
 
+struct usb_raw_transfer_io *usb_raw_transfer_alloc(uint32_t capacity) {
+	struct usb_raw_transfer_io *io = (struct usb_raw_transfer_io *)
+		malloc(sizeof(struct usb_raw_transfer_io) + capacity);
+	if (!io) {
+		perror("malloc() usb_raw_transfer_io");
+		exit(EXIT_FAILURE);
+	}
+	io->capacity = capacity;
+	io->inner.ep = 0;
+	io->inner.flags = 0;
+	io->inner.length = capacity;
+	return io;
+}
+
+struct usb_raw_transfer_io *usb_raw_transfer_dup(const struct usb_raw_transfer_io *io) {
+	struct usb_raw_transfer_io *copy = usb_raw_transfer_alloc(io->capacity);
+	copy->inner = io->inner;
+	memcpy(copy->data, io->data, io->inner.length);
+	return copy;
+}
+
+void usb_raw_transfer_free(struct usb_raw_transfer_io *io) {
+	free(io);
+}
+
+/*----------------------------------------------------------------------*/
+
+static const char *speed_names[] = {
+	[USB_SPEED_UNKNOWN] =		"UNKNOWN",
+	[USB_SPEED_LOW] =		"low-speed",
+	[USB_SPEED_FULL] =		"full-speed",
+	[USB_SPEED_HIGH] =		"high-speed",
+	[USB_SPEED_WIRELESS] =		"wireless",
+	[USB_SPEED_SUPER] =		"super-speed",
+	[USB_SPEED_SUPER_PLUS] =	"super-speed-plus",
+};
+
+const char *usb_speed_name(enum usb_device_speed speed) {
+	if (speed < 0 || speed > USB_SPEED_SUPER_PLUS)
+		speed = USB_SPEED_UNKNOWN;
+	return speed_names[speed];
+}
+
+// Accepts the names the kernel uses in sysfs, and the same without "-speed".
+enum usb_device_speed usb_speed_parse(const char *name) {
+	for (int i = USB_SPEED_LOW; i <= USB_SPEED_SUPER_PLUS; i++) {
+		size_t length = strlen(speed_names[i]) - strlen("-speed");
+		if (!strcmp(name, speed_names[i]))
+			return (enum usb_device_speed)i;
+		if (i != USB_SPEED_SUPER_PLUS && strlen(name) == length &&
+		    !strncmp(name, speed_names[i], length))
+			return (enum usb_device_speed)i;
+	}
+	if (!strcmp(name, "super-plus"))
+		return USB_SPEED_SUPER_PLUS;
+	return USB_SPEED_UNKNOWN;
+}
+
+// High speed, what the proxy always used, if the UDC does not say.
+enum usb_device_speed usb_raw_udc_max_speed(const char *device) {
+	char path[256];
+	snprintf(path, sizeof(path), "/sys/class/udc/%s/maximum_speed", device);
+	FILE *file = fopen(path, "r");
+	if (!file)
+		return USB_SPEED_HIGH;
+
+	char name[32] = {};
+	if (!fgets(name, sizeof(name), file))
+		name[0] = '\0';
+	fclose(file);
+	name[strcspn(name, "\n")] = '\0';
+
+	enum usb_device_speed speed = usb_speed_parse(name);
+	return speed == USB_SPEED_UNKNOWN ? USB_SPEED_HIGH : speed;
+}
+
 int usb_raw_open() {
 	int fd = open("/dev/raw-gadget", O_RDWR);
 	if (fd < 0) {
@@ -101,7 +178,9 @@ int usb_raw_ep_disable(int fd, uint32_t num) {
 }
 
 int usb_raw_ep_read(int fd, struct usb_raw_ep_io *io) {
+	USB_PROXY_PROBE(raw_ep_read_entry, io->ep, io->length);
 	int rv = ioctl(fd, USB_RAW_IOCTL_EP_READ, io);
+	USB_PROXY_PROBE(raw_ep_read_return, io->ep, rv);
 	if (rv < 0) {
 		if (errno == EINPROGRESS) {
 			// Ignore failures caused by the test that halts endpoints.
@@ -116,7 +195,9 @@ int usb_raw_ep_read(int fd, struct usb_raw_ep_io *io) {
 }
 
 int usb_raw_ep_write(int fd, struct usb_raw_ep_io *io) {
+	USB_PROXY_PROBE(raw_ep_write_entry, io->ep, io->length);
 	int rv = ioctl(fd, USB_RAW_IOCTL_EP_WRITE, io);
+	USB_PROXY_PROBE(raw_ep_write_return, io->ep, rv);
 	if (rv < 0) {
 		if (errno == EINPROGRESS) {
 			// Ignore failures caused by the test that halts endpoints.
@@ -319,11 +400,11 @@ void log_event(struct usb_raw_event *event) {
 	}
 }
 
-void print_eps_info(int fd) {
+void print_eps_info(HostBackend *host) {
 	struct usb_raw_eps_info info;
 	memset(&info, 0, sizeof(info));
 
-	int num = usb_raw_eps_info(fd, &info);
+	int num = host->eps_info(&info);
 	for (int i = 0; i < num; i++) {
 		printf("ep #%d:\n", i);
 		printf("  name: %s\n", &info.eps[i].name[0]);
@@ -340,3 +421,68 @@ void print_eps_info(int fd) {
 		printf("  max_streams: %u\n", info.eps[i].limits.max_streams);
 	}
 }
+
+/*----------------------------------------------------------------------*/
+
+void RawGadgetHost::init(enum usb_device_speed speed, const char *driver,
+			const char *device) {
+	fd = usb_raw_open();
+	usb_raw_init(fd, speed, driver, device);
+}
+
+void RawGadgetHost::run() {
+	usb_raw_run(fd);
+}
+
+void RawGadgetHost::close() {
+	::close(fd);
+	fd = -1;
+}
+
+void RawGadgetHost::event_fetch(struct usb_raw_event *event) {
+	usb_raw_event_fetch(fd, event);
+}
+
+int RawGadgetHost::ep0_read(struct usb_raw_ep_io *io) {
+	return usb_raw_ep0_read(fd, io);
+}
+
+int RawGadgetHost::ep0_write(struct usb_raw_ep_io *io) {
+	return usb_raw_ep0_write(fd, io);
+}
+
+void RawGadgetHost::ep0_stall() {
+	usb_raw_ep0_stall(fd);
+}
+
+void RawGadgetHost::ep_stall(uint32_t num) {
+	usb_raw_ep_set_halt(fd, num);
+}
+
+int RawGadgetHost::ep_enable(struct usb_endpoint_descriptor *desc) {
+	return usb_raw_ep_enable(fd, desc);
+}
+
+int RawGadgetHost::ep_disable(uint32_t num) {
+	return usb_raw_ep_disable(fd, num);
+}
+
+int RawGadgetHost::ep_read(struct usb_raw_ep_io *io) {
+	return usb_raw_ep_read(fd, io);
+}
+
+int RawGadgetHost::ep_write(struct usb_raw_ep_io *io) {
+	return usb_raw_ep_write(fd, io);
+}
+
+void RawGadgetHost::configure() {
+	usb_raw_configure(fd);
+}
+
+void RawGadgetHost::vbus_draw(uint32_t power) {
+	usb_raw_vbus_draw(fd, power);
+}
+
+int RawGadgetHost::eps_info(struct usb_raw_eps_info *info) {
+	return usb_raw_eps_info(fd, info);
+}
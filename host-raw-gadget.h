@@ -1,3 +1,5 @@
+#pragma once
+
 #include <pthread.h>
 #include <mutex>
 #include <deque>
@@ -106,25 +108,42 @@ struct usb_raw_int_io {
 	char				data[EP_MAX_PACKET_INT];
 };
 
+// Largest transfer the proxy moves in one piece; also the largest wLength.
+#define USB_RAW_TRANSFER_MAX	65536
+
+/*
+ * One transfer on its way through the proxy: the usb_raw_ep_io header the
+ * raw-gadget ioctls take, directly followed by room for `capacity` bytes of
+ * data. It is sized per endpoint and per request, so it is heap allocated
+ * with usb_raw_transfer_alloc() and handed between threads by pointer.
+ */
 struct usb_raw_transfer_io {
+	uint32_t			capacity;
 	struct usb_raw_ep_io		inner;
-	char				data[1024];
+	char				data[0];
 };
 
+struct usb_raw_transfer_io *usb_raw_transfer_alloc(uint32_t capacity);
+struct usb_raw_transfer_io *usb_raw_transfer_dup(const struct usb_raw_transfer_io *io);
+void usb_raw_transfer_free(struct usb_raw_transfer_io *io);
+
 /*----------------------------------------------------------------------*/
 
+struct transform_endpoint;
+
 struct thread_info {
-	int				fd;
 	int				ep_num;
+	int				transfer_size;	// bytes per read from the device
 	struct usb_endpoint_descriptor 	endpoint;
-	std::string			transfer_type;
-	std::string			dir;
-	std::deque<usb_raw_transfer_io> *data_queue;
+	std::deque<usb_raw_transfer_io *> *data_queue;
 	std::mutex			*data_mutex;
+	struct transform_endpoint	*transform;	// NULL without --transform
 };
 
 struct raw_gadget_endpoint {
-	struct usb_endpoint_descriptor	endpoint;
+	struct usb_endpoint_descriptor	endpoint;		// as enabled on the gadget
+	struct usb_endpoint_descriptor	device_endpoint;	// as reported by the device
+	struct usb_ss_ep_comp_descriptor companion;		// zeroed if there is none
 	pthread_t			thread_read;
 	pthread_t			thread_write;
 	struct thread_info		thread_info;
@@ -164,6 +183,10 @@ enum usb_injection_flags {
 
 /*----------------------------------------------------------------------*/
 
+const char *usb_speed_name(enum usb_device_speed speed);
+enum usb_device_speed usb_speed_parse(const char *name);
+enum usb_device_speed usb_raw_udc_max_speed(const char *device);
+
 int usb_raw_open();
 void usb_raw_init(int fd, enum usb_device_speed speed,
 			const char *driver, const char *device);
@@ -183,4 +206,5 @@ void usb_raw_ep_set_halt(int fd, int ep);
 
 void log_control_request(struct usb_ctrlrequest *ctrl);
 void log_event(struct usb_raw_event *event);
-void print_eps_info(int fd);
+class HostBackend;
+void print_eps_info(HostBackend *host);
@@ -0,0 +1,774 @@
+#include <algorithm>
+#include <errno.h>
+#include <libgen.h>
+#include <mutex>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <time.h>
+
+#include "injection.h"
+#include "gpio.h"
+#include "hid-report.h"
+#include "stats.h"
+
+struct injection_reload_stats injection_reload_stats;
+
+static const char *control_action_names[] = {"modify", "ignore", "stall"};
+
+thread_local std::vector<std::string> *injection_matches = NULL;
+
+static void record_match(const std::string &list, unsigned int index) {
+	if (injection_matches)
+		injection_matches->push_back(list + "[" + std::to_string(index) + "]");
+}
+
+static std::atomic<struct injection_rule_set *> current_rules(new injection_rule_set());
+static std::atomic<uint64_t> rules_generation(0);
+static std::mutex rules_update_mutex;
+static std::string last_error;
+
+static std::mutex gpio_mutex;
+static bool gpio_ready = false;
+static std::vector<unsigned int> gpio_configured;
+
+static int watch_fd = -1;
+static std::string watch_path;
+static std::atomic<bool> watch_running(false);
+static pthread_t watch_thread;
+
+/*----------------------------------------------------------------------*/
+
+static uint64_t monotonic_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool is_hex_digit(char c) {
+	return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+static bool compile_hex_string(const Json::Value &value, const std::string &where,
+			std::string &raw, std::string &hex, std::vector<std::string> &errors) {
+	if (value.isNull()) {
+		raw.clear();
+		hex.clear();
+		return true;
+	}
+	if (!value.isString()) {
+		errors.push_back(where + ": expected a hex string");
+		return false;
+	}
+
+	hex = value.asString();
+	for (size_t pos = hex.find("\\x"); pos != std::string::npos; pos = hex.find("\\x", pos + 2)) {
+		if (pos + 3 >= hex.length() || !is_hex_digit(hex[pos + 2]) || !is_hex_digit(hex[pos + 3])) {
+			errors.push_back(where + ": invalid escape in \"" + hex + "\"");
+			return false;
+		}
+	}
+	raw = hexToAscii(hex);
+	return true;
+}
+
+static void compile_patterns(const Json::Value &value, const std::string &where,
+			std::vector<injection_pattern> &patterns, std::vector<std::string> &errors) {
+	if (value.isNull())
+		return;
+	if (!value.isArray()) {
+		errors.push_back(where + ": expected an array of hex strings");
+		return;
+	}
+	for (unsigned int i = 0; i < value.size(); i++) {
+		injection_pattern pattern;
+		if (!compile_hex_string(value[i], where + "[" + std::to_string(i) + "]",
+				pattern.pattern, pattern.pattern_hex, errors))
+			continue;
+		if (pattern.pattern.empty()) {
+			errors.push_back(where + "[" + std::to_string(i) + "]: empty pattern");
+			continue;
+		}
+		patterns.push_back(pattern);
+	}
+}
+
+// Rule files write hex numbers as if they were decimal, e.g. 81 for 0x81.
+static bool compile_hex_number(const Json::Value &rule, const char *key, int max,
+			const std::string &where, int &out, std::vector<std::string> &errors) {
+	const Json::Value &value = rule[key];
+	out = 0;
+	if (value.isNull())
+		return true;
+	if (!value.isUInt()) {
+		errors.push_back(where + "." + key + ": expected a hex number");
+		return false;
+	}
+	// Over five digits is out of range for any field, and could overflow.
+	if (value.asUInt() > 99999 || (out = hexToDecimal(value.asUInt())) > max) {
+		errors.push_back(where + "." + key + ": value out of range");
+		return false;
+	}
+	return true;
+}
+
+static bool compile_enable(const Json::Value &rule, const std::string &where,
+			std::vector<std::string> &errors) {
+	if (!rule.isObject()) {
+		errors.push_back(where + ": expected an object");
+		return false;
+	}
+	if (!rule["enable"].isNull() && !rule["enable"].isBool()) {
+		errors.push_back(where + ".enable: expected true or false");
+		return false;
+	}
+	return rule["enable"].asBool();
+}
+
+static void compile_pins(const Json::Value &value, const std::string &where,
+			std::vector<unsigned int> &pins, std::vector<std::string> &errors) {
+	if (value.isNull())
+		return;
+	if (!value.isArray()) {
+		errors.push_back(where + ": expected an array of GPIO pin numbers");
+		return;
+	}
+	for (unsigned int i = 0; i < value.size(); i++) {
+		if (!value[i].isUInt() || value[i].asUInt() > 63) {
+			errors.push_back(where + "[" + std::to_string(i) + "]: invalid GPIO pin");
+			continue;
+		}
+		pins.push_back(value[i].asUInt());
+	}
+}
+
+/*
+ * Compiles "field_replacements", fields named by HID usage, into masked byte
+ * replacements. Without a report descriptor for the endpoint, e.g. before
+ * the device is opened, the rule carries none until the rules are compiled
+ * again.
+ */
+static void compile_field_replacements(const Json::Value &value, uint8_t ep_address,
+			const std::string &where, std::vector<injection_byte_replacement> &replacements,
+			std::vector<std::string> &errors) {
+	if (value.isNull())
+		return;
+	if (!value.isArray()) {
+		errors.push_back(where + ": expected an array");
+		return;
+	}
+
+	std::vector<hid_field> fields;
+	bool known = hid_report_fields(ep_address, fields);
+	for (unsigned int i = 0; i < value.size(); i++) {
+		const Json::Value &replacement = value[i];
+		std::string item = where + "[" + std::to_string(i) + "]";
+		uint32_t usage;
+		if (!replacement.isObject() || !replacement["usage"].isString() ||
+		    !hid_usage_parse(replacement["usage"].asString(), &usage) ||
+		    !replacement["value"].isInt64()) {
+			errors.push_back(item + ": expected a usage and a value");
+			continue;
+		}
+		int report_id = -1;
+		if (!replacement["report_id"].isNull()) {
+			if (!replacement["report_id"].isUInt() || replacement["report_id"].asUInt() > 0xff) {
+				errors.push_back(item + ".report_id: expected a number up to 255");
+				continue;
+			}
+			report_id = replacement["report_id"].asUInt();
+		}
+		if (!known) {
+			// Resolved again once the descriptors are read.
+			if (hid_reports_loaded()) {
+				char endpoint[3];
+				snprintf(endpoint, sizeof(endpoint), "%02x", ep_address);
+				errors.push_back(item + ": no HID report descriptor for endpoint " + endpoint);
+			}
+			continue;
+		}
+
+		bool output = !(ep_address & USB_DIR_IN);
+		auto field = std::find_if(fields.begin(), fields.end(), [&](const hid_field &field) {
+			return field.usage == usage && field.output == output &&
+				(report_id < 0 || field.report_id == report_id);
+		});
+		if (field == fields.end()) {
+			char endpoint[3];
+			snprintf(endpoint, sizeof(endpoint), "%02x", ep_address);
+			errors.push_back(item + ": no " + replacement["usage"].asString() +
+				" field in the reports of endpoint " + endpoint);
+			continue;
+		}
+
+		int64_t number = replacement["value"].asInt64();
+		int64_t low = field->logical_minimum < 0 ? -(1ll << (field->bit_size - 1)) : 0;
+		int64_t high = field->logical_minimum < 0 ? (1ll << (field->bit_size - 1)) - 1 :
+			(1ll << field->bit_size) - 1;
+		if (number < low || number > high) {
+			errors.push_back(item + ".value: does not fit in " +
+				std::to_string(field->bit_size) + " bits");
+			continue;
+		}
+
+		uint64_t bits = ((uint64_t)number & ((1ull << field->bit_size) - 1)) << (field->bit_offset % 8);
+		uint64_t mask = ((1ull << field->bit_size) - 1) << (field->bit_offset % 8);
+		for (unsigned int byte = field->bit_offset / 8; mask; byte++, bits >>= 8, mask >>= 8) {
+			replacements.push_back({byte, (unsigned char)(bits & 0xff),
+				(unsigned char)(mask & 0xff), field->report_id ? field->report_id : -1});
+		}
+	}
+}
+
+static void compile_control_rules(const Json::Value &source, struct injection_rule_set *rules,
+			std::vector<std::string> &errors) {
+	const Json::Value &control = source["control"];
+	if (control.isNull())
+		return;
+	if (!control.isObject()) {
+		errors.push_back("control: expected an object");
+		return;
+	}
+
+	for (int action = 0; action < 3; action++) {
+		const char *name = control_action_names[action];
+		const Json::Value &list = control[name];
+		if (list.isNull())
+			continue;
+		if (!list.isArray()) {
+			errors.push_back(std::string("control.") + name + ": expected an array");
+			continue;
+		}
+
+		for (unsigned int i = 0; i < list.size(); i++) {
+			const Json::Value &rule = list[i];
+			std::string where = std::string("control.") + name + "[" + std::to_string(i) + "]";
+			bool enabled = compile_enable(rule, where, errors);
+			if (!rule.isObject())
+				continue;
+
+			injection_control_rule compiled;
+			compiled.index = i;
+			compiled.action = static_cast<ControlAction>(action);
+
+			int bRequestType, bRequest, wValue, wIndex, wLength;
+			bool valid = compile_hex_number(rule, "bRequestType", 0xff, where, bRequestType, errors);
+			valid &= compile_hex_number(rule, "bRequest", 0xff, where, bRequest, errors);
+			valid &= compile_hex_number(rule, "wValue", 0xffff, where, wValue, errors);
+			valid &= compile_hex_number(rule, "wIndex", 0xffff, where, wIndex, errors);
+			valid &= compile_hex_number(rule, "wLength", 0xffff, where, wLength, errors);
+			compiled.ctrl.bRequestType = bRequestType;
+			compiled.ctrl.bRequest = bRequest;
+			compiled.ctrl.wValue = wValue;
+			compiled.ctrl.wIndex = wIndex;
+			compiled.ctrl.wLength = wLength;
+
+			compile_patterns(rule["content_pattern"], where + ".content_pattern",
+				compiled.patterns, errors);
+			valid &= compile_hex_string(rule["replacement"], where + ".replacement",
+				compiled.replacement, compiled.replacement_hex, errors);
+
+			if (enabled && valid)
+				rules->control.push_back(compiled);
+		}
+	}
+}
+
+static void compile_ep_rules(const Json::Value &source, const char *transfer_type,
+			std::vector<injection_ep_rule> &compiled_rules, std::vector<unsigned int> *gpio_pins,
+			std::vector<std::string> &errors) {
+	const Json::Value &list = source[transfer_type];
+	if (list.isNull())
+		return;
+	if (!list.isArray()) {
+		errors.push_back(std::string(transfer_type) + ": expected an array");
+		return;
+	}
+
+	for (unsigned int i = 0; i < list.size(); i++) {
+		const Json::Value &rule = list[i];
+		std::string where = std::string(transfer_type) + "[" + std::to_string(i) + "]";
+		bool enabled = compile_enable(rule, where, errors);
+		if (!rule.isObject())
+			continue;
+
+		injection_ep_rule compiled;
+		compiled.index = i;
+
+		int ep_address;
+		bool valid = compile_hex_number(rule, "ep_address", 0xff, where, ep_address, errors);
+		compiled.ep_address = ep_address;
+
+		// Backwards compatibility: "type" might not exist, use default if "type" is missing.
+		compiled.type = RuleType::Default;
+		if (rule.isMember("type")) {
+			if (!rule["type"].isUInt() || rule["type"].asUInt() > 1) {
+				errors.push_back(where + ".type: expected 0 or 1");
+				continue;
+			}
+			compiled.type = static_cast<RuleType>(rule["type"].asUInt());
+		}
+
+		if (compiled.type == RuleType::Default) {
+			compile_patterns(rule["content_pattern"], where + ".content_pattern",
+				compiled.patterns, errors);
+			valid &= compile_hex_string(rule["replacement"], where + ".replacement",
+				compiled.replacement, compiled.replacement_hex, errors);
+		}
+		else if (compiled.type == RuleType::RaspberryPiGpio) {
+			size_t error_count = errors.size();
+			const Json::Value &gpio = rule["gpio"];
+			if (gpio.isObject()) {
+				compile_pins(gpio["on"], where + ".gpio.on", compiled.gpio_on, errors);
+				compile_pins(gpio["off"], where + ".gpio.off", compiled.gpio_off, errors);
+			}
+			else if (!gpio.isNull())
+				errors.push_back(where + ".gpio: expected an object");
+
+			// Consider "replace" type as default, if it is not set.
+			compiled.byte_replacement_type = ByteReplacementType::Replace;
+			if (rule.isMember("byte_replacement_type")) {
+				if (!rule["byte_replacement_type"].isUInt() ||
+				    rule["byte_replacement_type"].asUInt() > 1)
+					errors.push_back(where + ".byte_replacement_type: expected 0 or 1");
+				else
+					compiled.byte_replacement_type = static_cast<ByteReplacementType>(
+						rule["byte_replacement_type"].asUInt());
+			}
+
+			const Json::Value &replacements = rule["byte_replacements"];
+			if (!replacements.isNull() && !replacements.isArray())
+				errors.push_back(where + ".byte_replacements: expected an array");
+			for (unsigned int j = 0; replacements.isArray() && j < replacements.size(); j++) {
+				const Json::Value &replacement = replacements[j];
+				if (!replacement.isObject() || !replacement["index"].isUInt() ||
+				    !replacement["value"].isUInt() ||
+				    replacement["value"].asUInt() > 0xff) {
+					errors.push_back(where + ".byte_replacements[" + std::to_string(j) +
+						"]: expected an index and a byte value");
+					continue;
+				}
+				compiled.byte_replacements.push_back({replacement["index"].asUInt(),
+					(unsigned char)replacement["value"].asUInt(), 0xff, -1});
+			}
+			compile_field_replacements(rule["field_replacements"], compiled.ep_address,
+				where + ".field_replacements", compiled.byte_replacements, errors);
+			valid &= errors.size() == error_count;
+
+			if (enabled && valid && gpio_pins) {
+				gpio_pins->insert(gpio_pins->end(), compiled.gpio_on.begin(), compiled.gpio_on.end());
+				gpio_pins->insert(gpio_pins->end(), compiled.gpio_off.begin(), compiled.gpio_off.end());
+			}
+		}
+
+		if (enabled && valid)
+			compiled_rules.push_back(compiled);
+	}
+}
+
+struct injection_rule_set *injection_rules_compile(const Json::Value &source,
+			std::vector<std::string> &errors) {
+	if (!source.isObject()) {
+		errors.push_back("top level: expected an object");
+		return NULL;
+	}
+
+	struct injection_rule_set *rules = new injection_rule_set();
+	rules->source = source;
+	rules->generation = 0;
+
+	// The checks above should leave nothing for jsoncpp to throw on, but a
+	// rule file must never take the proxy down.
+	try {
+		compile_control_rules(source, rules, errors);
+		compile_ep_rules(source, "int", rules->int_rules, &rules->gpio_pins, errors);
+		compile_ep_rules(source, "bulk", rules->bulk_rules, NULL, errors);
+	}
+	catch (const std::exception &e) {
+		errors.push_back(std::string("malformed rules: ") + e.what());
+	}
+
+	std::sort(rules->gpio_pins.begin(), rules->gpio_pins.end());
+	rules->gpio_pins.erase(std::unique(rules->gpio_pins.begin(), rules->gpio_pins.end()),
+		rules->gpio_pins.end());
+
+	if (!errors.empty()) {
+		delete rules;
+		return NULL;
+	}
+	return rules;
+}
+
+/*----------------------------------------------------------------------*/
+
+const struct injection_rule_set *injection_rules() {
+	return current_rules.load();
+}
+
+static void configure_gpio_pins(const std::vector<unsigned int> &pins) {
+	std::lock_guard<std::mutex> lock(gpio_mutex);
+	if (!gpio_ready)
+		return;
+
+	for (unsigned int gpio_index : pins) {
+		if (std::find(gpio_configured.begin(), gpio_configured.end(), gpio_index) !=
+				gpio_configured.end())
+			continue;
+		gpio_input_pullup(gpio_index);
+		gpio_configured.push_back(gpio_index);
+		printf("wiringPi: activated pin %d as input\n", gpio_index);
+	}
+}
+
+void injection_rules_publish(struct injection_rule_set *rules) {
+	std::vector<unsigned int> gpio_pins = rules->gpio_pins;
+
+	rules->generation = ++rules_generation;
+	injection_reload_stats.generation.store(rules->generation, std::memory_order_relaxed);
+
+	struct injection_rule_set *old_rules = current_rules.exchange(rules);
+	rcu_retire([old_rules]() { delete old_rules; });
+	rcu_reclaim();
+
+	configure_gpio_pins(gpio_pins);
+}
+
+// Called with rules_update_mutex held.
+static bool update_rules_locked(const Json::Value &source, const std::string &origin,
+			std::string &error) {
+	std::vector<std::string> errors;
+	struct injection_rule_set *rules = injection_rules_compile(source, errors);
+	if (!rules) {
+		error.clear();
+		for (size_t i = 0; i < errors.size(); i++)
+			error += (i ? "; " : "") + errors[i];
+
+		last_error = origin + ": " + error;
+		stats_inc(injection_reload_stats.rejected);
+		return false;
+	}
+
+	injection_rules_publish(rules);
+	return true;
+}
+
+static bool update_rules(const Json::Value &source, const std::string &origin, std::string &error) {
+	std::lock_guard<std::mutex> lock(rules_update_mutex);
+	return update_rules_locked(source, origin, error);
+}
+
+bool injection_rules_load(const std::string &path, std::string &error) {
+	Json::Reader jsonReader;
+	Json::Value source;
+	std::ifstream ifs(path.c_str());
+	if (!ifs.is_open()) {
+		error = "cannot open file";
+		std::lock_guard<std::mutex> lock(rules_update_mutex);
+		last_error = path + ": " + error;
+		stats_inc(injection_reload_stats.rejected);
+		return false;
+	}
+	if (!jsonReader.parse(ifs, source)) {
+		error = jsonReader.getFormattedErrorMessages();
+		std::lock_guard<std::mutex> lock(rules_update_mutex);
+		last_error = path + ": " + error;
+		stats_inc(injection_reload_stats.rejected);
+		return false;
+	}
+	return update_rules(source, path, error);
+}
+
+bool injection_rules_update(const Json::Value &source, std::string &error) {
+	return update_rules(source, "control socket", error);
+}
+
+bool injection_rule_set_enabled(const std::string &type, const std::string &action,
+			unsigned int index, bool enable, std::string &error) {
+	// Held from reading the rules to publishing them, so that a reload in
+	// between isn't overwritten by the older rules.
+	std::lock_guard<std::mutex> lock(rules_update_mutex);
+	Json::Value source;
+	{
+		rcu_read_guard guard;
+		source = injection_rules()->source;
+	}
+
+	Json::Value *rules = NULL;
+	if (source.isObject() && type == "control") {
+		if (source["control"].isObject())
+			rules = &source["control"][action];
+	}
+	else if (source.isObject() && (type == "int" || type == "bulk" || type == "isoc"))
+		rules = &source[type];
+	if (!rules || !rules->isArray() || index >= rules->size() || !(*rules)[index].isObject()) {
+		error = "no such rule";
+		return false;
+	}
+
+	(*rules)[index]["enable"] = enable;
+	return update_rules_locked(source, "control socket", error);
+}
+
+bool injection_rules_recompile(std::string &error) {
+	std::lock_guard<std::mutex> lock(rules_update_mutex);
+	Json::Value source;
+	{
+		rcu_read_guard guard;
+		source = injection_rules()->source;
+	}
+	return update_rules_locked(source, "HID report descriptors", error);
+}
+
+std::string injection_last_error() {
+	std::lock_guard<std::mutex> lock(rules_update_mutex);
+	return last_error;
+}
+
+/*----------------------------------------------------------------------*/
+
+static bool watch_event_matches(int fd, const std::string &name) {
+	char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	bool matches = false;
+
+	ssize_t length = read(fd, buffer, sizeof(buffer));
+	for (char *ptr = buffer; length > 0 && ptr < buffer + length;) {
+		struct inotify_event *event = (struct inotify_event *)ptr;
+		if (event->len && name == event->name)
+			matches = true;
+		ptr += sizeof(struct inotify_event) + event->len;
+	}
+	return matches;
+}
+
+static void *injection_watch_loop(void *arg __attribute__((unused))) {
+	printf("Start injection watch thread, thread id(%d)\n", gettid());
+
+	std::string path_copy = watch_path;
+	std::string name = basename(&path_copy[0]);
+
+	while (watch_running) {
+		struct pollfd pfd = { watch_fd, POLLIN, 0 };
+		int rv = poll(&pfd, 1, 200);
+		if (rv <= 0) {
+			rcu_reclaim();
+			continue;
+		}
+		if (!watch_event_matches(watch_fd, name))
+			continue;
+
+		// Editors tend to write a file in several steps, wait for them to settle.
+		uint64_t start = monotonic_us();
+		while (poll(&pfd, 1, 20) > 0)
+			watch_event_matches(watch_fd, name);
+
+		std::string error;
+		if (injection_rules_load(watch_path, error)) {
+			uint64_t latency = monotonic_us() - start;
+			injection_reload_stats.last_latency_us.store(latency, std::memory_order_relaxed);
+			stats_inc(injection_reload_stats.reloads);
+			printf("Reloaded injection file %s in %llu us (generation %llu)\n",
+				watch_path.c_str(), (unsigned long long)latency,
+				(unsigned long long)injection_reload_stats.generation.load());
+		}
+		else {
+			fprintf(stderr, "Rejected injection file %s, keeping previous rules: %s\n",
+				watch_path.c_str(), error.c_str());
+		}
+	}
+
+	printf("End injection watch thread, thread id(%d)\n", gettid());
+	return NULL;
+}
+
+int injection_watch_start(const std::string &path) {
+	watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watch_fd < 0) {
+		perror("inotify_init1()");
+		return -1;
+	}
+
+	// Watch the directory, editors often replace the file instead of rewriting it.
+	std::string path_copy = path;
+	std::string dir = dirname(&path_copy[0]);
+	if (inotify_add_watch(watch_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		perror("inotify_add_watch()");
+		close(watch_fd);
+		watch_fd = -1;
+		return -1;
+	}
+
+	watch_path = path;
+	watch_running = true;
+	pthread_create(&watch_thread, 0, injection_watch_loop, nullptr);
+	printf("Watching injection file %s for changes\n", path.c_str());
+	return 0;
+}
+
+void injection_watch_stop() {
+	if (watch_fd < 0)
+		return;
+
+	watch_running = false;
+	if (pthread_join(watch_thread, NULL))
+		fprintf(stderr, "Error join injection watch thread\n");
+	close(watch_fd);
+	watch_fd = -1;
+}
+
+/*----------------------------------------------------------------------*/
+
+void injection_gpio_setup() {
+	gpio_setup();
+
+	{
+		std::lock_guard<std::mutex> lock(gpio_mutex);
+		gpio_ready = true;
+	}
+
+	rcu_read_guard guard;
+	configure_gpio_pins(injection_rules()->gpio_pins);
+}
+
+bool is_any_gpio_pin_triggered()
+{
+	rcu_read_guard guard;
+	const std::vector<unsigned int> &pins = injection_rules()->gpio_pins;
+	return std::any_of(pins.begin(), pins.end(), [](unsigned int gpio_index){
+		return gpio_is_low(gpio_index);
+	});
+}
+
+bool injection(struct usb_raw_transfer_io &io, const std::vector<injection_pattern> &patterns,
+			const std::string &replacement, const std::string &replacement_hex) {
+	bool data_modified = false;
+	std::string data(io.data, io.inner.length);
+	for (const injection_pattern &pattern : patterns) {
+		std::string::size_type pos = data.find(pattern.pattern);
+		while (pos != std::string::npos) {
+			if (data.length() - pattern.pattern.length() + replacement.length() > io.capacity)
+				break;
+
+			data = data.replace(pos, pattern.pattern.length(), replacement);
+			printf("Modified from %s to %s at Index %ld\n", pattern.pattern_hex.c_str(),
+				replacement_hex.c_str(), pos);
+			data_modified = true;
+
+			pos = data.find(pattern.pattern);
+		}
+	}
+
+	if (data_modified) {
+		io.inner.length = data.length();
+		for (size_t j = 0; j < data.length(); j++) {
+			io.data[j] = data[j];
+		}
+	}
+	return data_modified;
+}
+
+void injection(struct usb_raw_control_event &event, struct usb_raw_transfer_io &io, int &injection_flags) {
+	// This is just a simple injection function for control transfer.
+	rcu_read_guard guard;
+	for (const injection_control_rule &rule : injection_rules()->control) {
+		if (event.ctrl.bRequestType != rule.ctrl.bRequestType ||
+		    event.ctrl.bRequest     != rule.ctrl.bRequest ||
+		    event.ctrl.wValue       != rule.ctrl.wValue ||
+		    event.ctrl.wIndex       != rule.ctrl.wIndex ||
+		    event.ctrl.wLength      != rule.ctrl.wLength)
+			continue;
+
+		printf("Matched injection rule: %s, index: %d\n",
+			control_action_names[(int)rule.action], rule.index);
+		record_match(std::string("control.") + control_action_names[(int)rule.action], rule.index);
+		stats_inc(proxy_stats.control_injected);
+		switch (rule.action) {
+		case ControlAction::Modify:
+			injection(io, rule.patterns, rule.replacement, rule.replacement_hex);
+			if (!(event.ctrl.bRequestType & USB_DIR_IN))
+				event.ctrl.wLength = io.inner.length;
+			break;
+		case ControlAction::Ignore:
+			printf("Ignore this control transfer\n");
+			injection_flags = USB_INJECTION_FLAG_IGNORE;
+			break;
+		case ControlAction::Stall:
+			injection_flags = USB_INJECTION_FLAG_STALL;
+			break;
+		}
+	}
+}
+
+bool injection(struct usb_raw_transfer_io &io, struct usb_endpoint_descriptor ep, std::string transfer_type) {
+	if (transfer_type == "int")
+		return injection(io, ep, USB_ENDPOINT_XFER_INT);
+	else if (transfer_type == "bulk")
+		return injection(io, ep, USB_ENDPOINT_XFER_BULK);
+	return false;
+}
+
+bool injection(struct usb_raw_transfer_io &io, struct usb_endpoint_descriptor ep, int transfer_type) {
+	// This is just a simple injection function for int and bulk transfer.
+	rcu_read_guard guard;
+	const struct injection_rule_set *rules = injection_rules();
+	const std::vector<injection_ep_rule> *ep_rules;
+	const char *list;
+	if (transfer_type == USB_ENDPOINT_XFER_INT) {
+		ep_rules = &rules->int_rules;
+		list = "int";
+	}
+	else if (transfer_type == USB_ENDPOINT_XFER_BULK) {
+		ep_rules = &rules->bulk_rules;
+		list = "bulk";
+	}
+	else
+		return false;
+
+	bool any_modified = false;
+	for (const injection_ep_rule &rule : *ep_rules) {
+		if (rule.ep_address != ep.bEndpointAddress)
+			continue;
+
+		if (rule.type == RuleType::Default) {
+			if (injection(io, rule.patterns, rule.replacement, rule.replacement_hex)) {
+				record_match(list, rule.index);
+				any_modified = true;
+				break;
+			}
+		}
+		else if (rule.type == RuleType::RaspberryPiGpio) {
+			const bool are_all_required_on = std::all_of(rule.gpio_on.begin(), rule.gpio_on.end(),
+				[](unsigned int gpio_index){
+				return gpio_is_low(gpio_index);
+			});
+
+			const bool are_all_required_off = std::all_of(rule.gpio_off.begin(), rule.gpio_off.end(),
+				[](unsigned int gpio_index){
+				return !gpio_is_low(gpio_index);
+			});
+
+			bool is_condition_met = are_all_required_on && are_all_required_off;
+			if (!is_condition_met)
+				continue;
+			record_match(list, rule.index);
+
+			for (const injection_byte_replacement &replacement : rule.byte_replacements) {
+				if (replacement.index >= io.inner.length ||
+				    (replacement.report_id >= 0 && (uint8_t)io.data[0] != replacement.report_id))
+					continue;
+
+				any_modified = true;
+				switch (rule.byte_replacement_type) {
+				case ByteReplacementType::Replace:
+					io.data[replacement.index] = (io.data[replacement.index] & ~replacement.mask) |
+						char(replacement.value);
+					break;
+				case ByteReplacementType::BitwiseOr:
+					io.data[replacement.index] = io.data[replacement.index] | char(replacement.value);
+					break;
+				}
+			}
+		}
+	}
+
+	return any_modified;
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "host-raw-gadget.h"
+#include "rcu.h"
+
+enum class RuleType {
+	Default = 0,
+	RaspberryPiGpio = 1
+};
+
+enum class ByteReplacementType {
+	Replace = 0,
+	BitwiseOr = 1
+};
+
+enum class ControlAction {
+	Modify = 0,
+	Ignore = 1,
+	Stall = 2
+};
+
+/*
+ * Injection rules compiled from the JSON rule file. A rule set is immutable
+ * once published; the endpoint threads read it under rcu_read_lock() and a
+ * reload or a toggle from the control socket publishes a whole new set.
+ */
+
+struct injection_pattern {
+	std::string	pattern;	// raw bytes to look for
+	std::string	pattern_hex;	// as written in the rule file, for logging
+};
+
+/*
+ * A byte written in the rule file, or one byte of a field named by its HID
+ * usage. Fields are compiled against the endpoint's report descriptor into
+ * the bytes they span: Replace sets the bits in mask to value, BitwiseOr sets
+ * those of value.
+ */
+struct injection_byte_replacement {
+	unsigned int	index;
+	unsigned char	value;
+	unsigned char	mask;		// 0xff for whole bytes
+	int		report_id;	// applies only to this report, -1 for any
+};
+
+struct injection_control_rule {
+	unsigned int			index;
+	ControlAction			action;
+	struct usb_ctrlrequest		ctrl;
+	std::vector<injection_pattern>	patterns;
+	std::string			replacement;
+	std::string			replacement_hex;
+};
+
+struct injection_ep_rule {
+	unsigned int				index;
+	uint8_t					ep_address;
+	RuleType				type;
+	std::vector<injection_pattern>		patterns;
+	std::string				replacement;
+	std::string				replacement_hex;
+	std::vector<unsigned int>		gpio_on;
+	std::vector<unsigned int>		gpio_off;
+	ByteReplacementType			byte_replacement_type;
+	std::vector<injection_byte_replacement>	byte_replacements;
+};
+
+struct injection_rule_set {
+	Json::Value					source;
+	uint64_t					generation;
+	std::vector<injection_control_rule>		control;	// enabled rules in evaluation order
+	std::vector<injection_ep_rule>			int_rules;
+	std::vector<injection_ep_rule>			bulk_rules;
+	std::vector<unsigned int>			gpio_pins;
+};
+
+struct injection_reload_stats {
+	std::atomic<uint64_t>	reloads;
+	std::atomic<uint64_t>	rejected;
+	std::atomic<uint64_t>	last_latency_us;
+	std::atomic<uint64_t>	generation;
+};
+
+extern struct injection_reload_stats injection_reload_stats;
+
+/*
+ * When set, the injection() overloads append every rule that matched on this
+ * thread, named as in the rule file, e.g. "control.stall[0]" or "int[2]".
+ * usb-proxy-replay uses it; the proxy threads leave it unset.
+ */
+extern thread_local std::vector<std::string> *injection_matches;
+
+// Returns the current rule set. Only valid inside an RCU read-side section.
+const struct injection_rule_set *injection_rules();
+
+struct injection_rule_set *injection_rules_compile(const Json::Value &source,
+			std::vector<std::string> &errors);
+void injection_rules_publish(struct injection_rule_set *rules);
+bool injection_rules_load(const std::string &path, std::string &error);
+bool injection_rules_update(const Json::Value &source, std::string &error);
+// Enables or disables one rule, as named by the control socket's `rule` command.
+bool injection_rule_set_enabled(const std::string &type, const std::string &action,
+			unsigned int index, bool enable, std::string &error);
+// Compiles the current rules again, once the HID report descriptors are known.
+bool injection_rules_recompile(std::string &error);
+std::string injection_last_error();
+
+int injection_watch_start(const std::string &path);
+void injection_watch_stop();
+
+void injection_gpio_setup();
+bool is_any_gpio_pin_triggered();
+
+bool injection(struct usb_raw_transfer_io &io, const std::vector<injection_pattern> &patterns,
+			const std::string &replacement, const std::string &replacement_hex);
+void injection(struct usb_raw_control_event &event, struct usb_raw_transfer_io &io,
+			int &injection_flags);
+bool injection(struct usb_raw_transfer_io &io, struct usb_endpoint_descriptor ep,
+			std::string transfer_type);
+// As above, with the transfer type as USB_ENDPOINT_XFER_INT or _BULK.
+bool injection(struct usb_raw_transfer_io &io, struct usb_endpoint_descriptor ep,
+			int transfer_type);
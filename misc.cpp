@@ -2,6 +2,13 @@
 
 #include "misc.h"
 
+std::atomic<int> verbose_level(0);
+bool please_stop_ep0 = false;
+bool please_stop_eps = false;
+
+std::atomic<bool> injection_enabled(false);
+std::string injection_file = "injection.json";
+
 std::string hexToAscii(std::string input) {
 	std::string output = input;
 	size_t pos = output.find("\\x");
@@ -28,3 +35,29 @@ int hexToDecimal(int input) {
 	}
 	return output;
 }
+
+bool cpu_list_parse(const std::string &list, cpu_set_t *set) {
+	CPU_ZERO(set);
+	std::istringstream iss(list);
+	std::string range;
+	bool any = false;
+	while (std::getline(iss, range, ',')) {
+		char *end;
+		long first = strtol(range.c_str(), &end, 10);
+		long last = first;
+		if (end == range.c_str())
+			return false;
+		if (*end == '-') {
+			const char *start = end + 1;
+			last = strtol(start, &end, 10);
+			if (end == start)
+				return false;
+		}
+		if (*end || first < 0 || last < first || last >= CPU_SETSIZE)
+			return false;
+		for (long cpu = first; cpu <= last; cpu++)
+			CPU_SET(cpu, set);
+		any = true;
+	}
+	return any;
+}
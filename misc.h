@@ -8,18 +8,21 @@
 #include <string>
 #include <getopt.h>
 #include <signal.h>
+#include <sched.h>
+#include <atomic>
 #include <chrono>
 #include <sys/stat.h>
 #include <linux/usb/ch9.h>
 #include <jsoncpp/json/json.h>
 
-extern int verbose_level;
+extern std::atomic<int> verbose_level;
 extern bool please_stop_ep0;
 extern bool please_stop_eps;
 
-extern bool injection_enabled;
+extern std::atomic<bool> injection_enabled;
 extern std::string injection_file;
-extern Json::Value injection_config;
 
 std::string hexToAscii(std::string input);
 int hexToDecimal(int input);
+// Parses a CPU list like `0-2,5`. Returns false for an empty or invalid list.
+bool cpu_list_parse(const std::string &list, cpu_set_t *set);
@@ -0,0 +1,21 @@
+#pragma once
+
+/*
+ * USDT static tracepoints, provider "usb_proxy".
+ *
+ * A probe compiles to a single nop plus an ELF note and costs nothing until
+ * a tracer such as bpftrace or perf attaches to it. When <sys/sdt.h> is not
+ * available (install systemtap-sdt-dev), or the build sets NO_USDT, the
+ * probes compile to nothing. See bpftrace/ for example scripts.
+ */
+
+#if !defined(NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define USB_PROXY_PROBE(name, ...)	STAP_PROBEV(usb_proxy, name, ##__VA_ARGS__)
+#endif
+#endif
+
+#ifndef USB_PROXY_PROBE
+#define USB_PROXY_PROBE(name, ...)	do {} while (0)
+#endif
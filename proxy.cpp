@@ -1,232 +1,363 @@
 #include <algorithm>
+#include <map>
 #include <set>
-#include <vector>
-#include <wiringPi.h>
 
-#include "host-raw-gadget.h"
-#include "device-libusb.h"
+#include "backend.h"
+#include "descriptors.h"
+#include "injection.h"
+#include "capture.h"
+#include "control-cache.h"
+#include "cpu-accounting.h"
+#include "probes.h"
+#include "realtime.h"
+#include "shm-injection.h"
+#include "stats.h"
+#include "tap.h"
+#include "transform.h"
 #include "misc.h"
 
-std::vector<std::string> transfer_types{"control", "int", "bulk", "isoc"};
-std::vector<std::string> control_type{"modify", "ignore", "stall"};
-std::string transfer_type = "control";
-
-std::set<unsigned int> used_gpio_pins;
-std::map<unsigned char, struct usb_raw_transfer_io> last_messages;
-
-enum class RuleType {
-	Default = 0,
-	RaspberryPiGpio = 1
-};
-
-enum class ByteReplacementType {
-	Replace = 0,
-	BitwiseOr = 1
-};
-
-bool is_any_gpio_pin_triggered() 
-{
-	return std::any_of(used_gpio_pins.begin(), used_gpio_pins.end(), [](unsigned int gpio_index){ 
-		return (digitalRead(gpio_index) == LOW); 
-	});
-}
-
-void injection(struct usb_raw_transfer_io &io, Json::Value patterns, std::string replacement_hex, bool &data_modified) {
-	std::string data(io.data, io.inner.length);
-	std::string replacement = hexToAscii(replacement_hex);
-	for (unsigned int j = 0; j < patterns.size(); j++) {
-		std::string pattern_hex = patterns[j].asString();
-		std::string pattern = hexToAscii(pattern_hex);
-
-		std::string::size_type pos = data.find(pattern);
-		while (pos != std::string::npos) {
-			if (data.length() - pattern.length() + replacement.length() > 1023)
-				break;
+HostBackend	*host_backend;
+DeviceBackend	*device_backend;
+
+enum usb_device_speed	device_speed = USB_SPEED_HIGH;
+enum usb_device_speed	gadget_speed = USB_SPEED_HIGH;
+int			bulk_transfer_size = 16384;
+std::map<uint8_t, unsigned int>	poll_intervals;
+std::set<int>			hidden_interfaces;
+std::set<uint8_t>		hidden_endpoints;
+
+int setup_host_usb_desc() {
+	const struct libusb_device_descriptor *device_desc = device_backend->device_descriptor();
+
+	host_device_desc.device = {
+		.bLength =		device_desc->bLength,
+		.bDescriptorType =	device_desc->bDescriptorType,
+		.bcdUSB =		device_desc->bcdUSB,
+		.bDeviceClass =		device_desc->bDeviceClass,
+		.bDeviceSubClass =	device_desc->bDeviceSubClass,
+		.bDeviceProtocol =	device_desc->bDeviceProtocol,
+		.bMaxPacketSize0 =	device_desc->bMaxPacketSize0,
+		.idVendor =		device_desc->idVendor,
+		.idProduct =		device_desc->idProduct,
+		.bcdDevice =		device_desc->bcdDevice,
+		.iManufacturer =	device_desc->iManufacturer,
+		.iProduct =		device_desc->iProduct,
+		.iSerialNumber =	device_desc->iSerialNumber,
+		.bNumConfigurations =	device_desc->bNumConfigurations,
+	};
+
+	int bNumConfigurations = device_desc->bNumConfigurations;
+	host_device_desc.configs = new struct raw_gadget_config[bNumConfigurations];
+	for (int i = 0; i < bNumConfigurations; i++) {
+		const struct libusb_config_descriptor *config_desc = device_backend->config_descriptor(i);
+		struct usb_config_descriptor temp_config = {
+			.bLength =		config_desc->bLength,
+			.bDescriptorType =	config_desc->bDescriptorType,
+			.wTotalLength =		config_desc->wTotalLength,
+			.bNumInterfaces =	config_desc->bNumInterfaces,
+			.bConfigurationValue =	config_desc->bConfigurationValue,
+			.iConfiguration = 	config_desc->iConfiguration,
+			.bmAttributes =		config_desc->bmAttributes,
+			.bMaxPower =		config_desc->MaxPower,
+		};
+		host_device_desc.configs[i].config = temp_config;
+
+		int bNumInterfaces = config_desc->bNumInterfaces;
+		struct raw_gadget_interface *temp_interfaces =
+			new struct raw_gadget_interface[bNumInterfaces];
+		int visible_interfaces = 0;
+		for (int j = 0; j < bNumInterfaces; j++) {
+			int interface_number = config_desc->interface[j].altsetting[0].bInterfaceNumber;
+			if (hidden_interfaces.count(interface_number)) {
+				printf("Hiding interface %d of configuration %d\n", interface_number,
+					config_desc->bConfigurationValue);
+				continue;
+			}
 
-			data = data.replace(pos, pattern.length(), replacement);
-			printf("Modified from %s to %s at Index %ld\n", pattern_hex.c_str(), replacement_hex.c_str(), pos);
-			data_modified = true;
+			int num_altsetting = config_desc->interface[j].num_altsetting;
+			struct raw_gadget_altsetting *temp_altsettings =
+				new struct raw_gadget_altsetting[num_altsetting];
+			for (int k = 0; k < num_altsetting; k++) {
+				const struct libusb_interface_descriptor temp_device_altsetting =
+					config_desc->interface[j].altsetting[k];
+				struct usb_interface_descriptor temp_host_altsetting = {
+					.bLength =		temp_device_altsetting.bLength,
+					.bDescriptorType =	temp_device_altsetting.bDescriptorType,
+					.bInterfaceNumber =	temp_device_altsetting.bInterfaceNumber,
+					.bAlternateSetting =	temp_device_altsetting.bAlternateSetting,
+					.bNumEndpoints =	temp_device_altsetting.bNumEndpoints,
+					.bInterfaceClass =	temp_device_altsetting.bInterfaceClass,
+					.bInterfaceSubClass =	temp_device_altsetting.bInterfaceSubClass,
+					.bInterfaceProtocol =	temp_device_altsetting.bInterfaceProtocol,
+					.iInterface =		temp_device_altsetting.iInterface,
+				};
+				int bNumEndpoints = 0;
+				for (int l = 0; l < temp_device_altsetting.bNumEndpoints; l++) {
+					if (!hidden_endpoints.count(temp_device_altsetting.endpoint[l].bEndpointAddress))
+						bNumEndpoints++;
+				}
+				temp_host_altsetting.bNumEndpoints = bNumEndpoints;
+				temp_altsettings[k].interface = temp_host_altsetting;
+				temp_altsettings[k].endpoints = NULL;
+
+				if (!bNumEndpoints) {
+					printf("InterfaceNumber %x AlternateSetting %x has no endpoint, skip\n",
+						temp_device_altsetting.bInterfaceNumber,
+						temp_device_altsetting.bAlternateSetting);
+					continue;
+				}
 
-			pos = data.find(pattern);
+				struct raw_gadget_endpoint *temp_endpoints =
+					new struct raw_gadget_endpoint[bNumEndpoints];
+				int n = 0;
+				for (int l = 0; l < temp_device_altsetting.bNumEndpoints; l++) {
+					if (hidden_endpoints.count(temp_device_altsetting.endpoint[l].bEndpointAddress))
+						continue;
+					struct usb_endpoint_descriptor temp_endpoint = {
+						.bLength =		temp_device_altsetting.endpoint[l].bLength,
+						.bDescriptorType =	temp_device_altsetting.endpoint[l].bDescriptorType,
+						.bEndpointAddress =	temp_device_altsetting.endpoint[l].bEndpointAddress,
+						.bmAttributes =		temp_device_altsetting.endpoint[l].bmAttributes,
+						.wMaxPacketSize =	temp_device_altsetting.endpoint[l].wMaxPacketSize,
+						.bInterval =		temp_device_altsetting.endpoint[l].bInterval,
+						.bRefresh =		temp_device_altsetting.endpoint[l].bRefresh,
+						.bSynchAddress = 	temp_device_altsetting.endpoint[l].bSynchAddress,
+					};
+					temp_endpoints[n].device_endpoint = temp_endpoint;
+					memset(&temp_endpoints[n].companion, 0,
+						sizeof(temp_endpoints[n].companion));
+					descriptor_find_ss_companion(&temp_device_altsetting.endpoint[l],
+						&temp_endpoints[n].companion);
+					descriptor_adapt_endpoint(&temp_endpoint, device_speed, gadget_speed);
+					descriptor_override_interval(&temp_endpoint, poll_intervals, gadget_speed);
+					temp_endpoints[n].endpoint = temp_endpoint;
+					temp_endpoints[n].thread_read = 0;
+					temp_endpoints[n].thread_write = 0;
+					memset((void *)&temp_endpoints[n].thread_info, 0,
+						sizeof(temp_endpoints[n].thread_info));
+					temp_endpoints[n].thread_info.ep_num = -1;
+					n++;
+				}
+				temp_altsettings[k].endpoints = temp_endpoints;
+			}
+			temp_interfaces[visible_interfaces].altsettings = temp_altsettings;
+			temp_interfaces[visible_interfaces].num_altsettings = config_desc->interface[j].num_altsetting;
+			temp_interfaces[visible_interfaces].current_altsetting = 0;
+			visible_interfaces++;
 		}
+		host_device_desc.configs[i].config.bNumInterfaces = visible_interfaces;
+		host_device_desc.configs[i].interfaces = temp_interfaces;
 	}
 
-	if (data_modified) {
-		io.inner.length = data.length();
-		for (size_t j = 0; j < data.length(); j++) {
-			io.data[j] = data[j];
-		}
-	}
-}
+	host_device_desc.current_config = 0;
 
-void injection(struct usb_raw_control_event &event, struct usb_raw_transfer_io &io, int &injection_flags) {
-	// This is just a simple injection function for control transfer.
-	for (unsigned int i = 0; i < control_type.size(); i++) {
-		for (unsigned int j = 0; j < injection_config[transfer_type][control_type[i]].size(); j++) {
-			Json::Value rule = injection_config[transfer_type][control_type[i]][j];
-			if (rule["enable"].asBool() != true)
-				continue;
-
-			if (event.ctrl.bRequestType != hexToDecimal(rule["bRequestType"].asInt()) ||
-			    event.ctrl.bRequest     != hexToDecimal(rule["bRequest"].asInt()) ||
-			    event.ctrl.wValue       != hexToDecimal(rule["wValue"].asInt()) ||
-			    event.ctrl.wIndex       != hexToDecimal(rule["wIndex"].asInt()) ||
-			    event.ctrl.wLength      != hexToDecimal(rule["wLength"].asInt()))
-				continue;
-
-			printf("Matched injection rule: %s, index: %d\n", control_type[i].c_str(), j);
-			if (control_type[i] == "modify") {
-				Json::Value patterns = rule["content_pattern"];
-				std::string replacement_hex = rule["replacement"].asString();
-				bool data_modified = false;
+	return 0;
+}
 
-				injection(io, patterns, replacement_hex, data_modified);
-				if (!(event.ctrl.bRequestType & USB_DIR_IN))
-					event.ctrl.wLength = io.inner.length;
-			}
-			else if (control_type[i] == "ignore") {
-				printf("Ignore this control transfer\n");
-				injection_flags = USB_INJECTION_FLAG_IGNORE;
-			}
-			else if (control_type[i] == "stall") {
-				injection_flags = USB_INJECTION_FLAG_STALL;
+void free_host_usb_desc() {
+	for (int i = 0; i < host_device_desc.device.bNumConfigurations; i++) {
+		struct raw_gadget_config *config = &host_device_desc.configs[i];
+		for (int j = 0; j < config->config.bNumInterfaces; j++) {
+			struct raw_gadget_interface *iface = &config->interfaces[j];
+			for (int k = 0; k < iface->num_altsettings; k++) {
+				delete[] iface->altsettings[k].endpoints;
 			}
+			delete[] iface->altsettings;
 		}
+		delete[] config->interfaces;
 	}
+	delete[] host_device_desc.configs;
 }
 
-void injection(struct usb_raw_transfer_io &io, struct usb_endpoint_descriptor ep, std::string transfer_type) {
-	// This is just a simple injection function for int and bulk transfer.
-	for (unsigned int i = 0; i < injection_config[transfer_type].size(); i++) {
-		Json::Value rule = injection_config[transfer_type][i];
-		if (rule["enable"].asBool() != true ||
-		    hexToDecimal(rule["ep_address"].asInt()) != ep.bEndpointAddress)
-			continue;
-
-		// Backwards compatibility: "type" might not exist, use default if "type" is missing.
-		RuleType rule_type = RuleType::Default;
-		if(rule.isMember("type"))
-		{
-			rule_type = static_cast<RuleType>(rule["type"].asUInt());
-		}
-
-		if(rule_type == RuleType::Default)
-		{
-			Json::Value patterns = rule["content_pattern"];
-			std::string replacement_hex = rule["replacement"].asString();
-			bool data_modified = false;
-
-			injection(io, patterns, replacement_hex, data_modified);
-
-			if (data_modified)
-				break;
-		}
-		else if(rule_type == RuleType::RaspberryPiGpio)
-		{
-			auto gpio_on = rule["gpio"]["on"];
-			const bool are_all_required_on = std::all_of(gpio_on.begin(), gpio_on.end(), [](Json::Value gpio_index){
-				return (digitalRead(gpio_index.asUInt()) == LOW);
-			});
-
-			auto gpio_off = rule["gpio"]["off"];
-			const bool are_all_required_off = std::all_of(gpio_off.begin(), gpio_off.end(), [](Json::Value gpio_index){
-				return (digitalRead(gpio_index.asUInt()) != LOW);
-			});
-
-			bool is_condition_met = are_all_required_on && are_all_required_off;
-			if(!is_condition_met)
-			{
-				continue;
-			}
-
-			// Consider "replace" type as default, if it is not set.
-			ByteReplacementType replacement_type = ByteReplacementType::Replace;
-			if(rule.isMember("byte_replacement_type"))
-			{
-				replacement_type = static_cast<ByteReplacementType>(rule["byte_replacement_type"].asUInt());
-			}
-
-			for (unsigned int j = 0; j < rule["byte_replacements"].size(); j++) {
-				Json::Value byte_replacement_rule = rule["byte_replacements"][j];
-
-				unsigned int index = byte_replacement_rule["index"].asUInt();
-				unsigned int value = byte_replacement_rule["value"].asUInt();
+// One service interval's worth of data at the device's speed: a full burst
+// on SuperSpeed, all transactions of a high-bandwidth endpoint on high speed.
+// Capped to whole packets that fit the transfer buffer.
+static int ep_transfer_size(const struct raw_gadget_endpoint *ep) {
+	const struct usb_endpoint_descriptor *desc = &ep->device_endpoint;
+	bool periodic = usb_endpoint_xfer_int(desc) || usb_endpoint_xfer_isoc(desc);
+	int maxp = usb_endpoint_maxp(desc);
+	int size = maxp;
+
+	if (device_speed >= USB_SPEED_SUPER) {
+		size *= ep->companion.bMaxBurst + 1;
+		if (usb_endpoint_xfer_isoc(desc))
+			size *= USB_SS_MULT(ep->companion.bmAttributes);
+	}
+	else if (device_speed == USB_SPEED_HIGH && periodic)
+		size *= usb_endpoint_maxp_mult(desc);
+
+	// Bulk endpoints carry no rate; read as much as the host or device
+	// has queued, in whole packets so only the last one can be short.
+	if (usb_endpoint_xfer_bulk(desc) && maxp > 0)
+		size = std::max(bulk_transfer_size / maxp, 1) * maxp;
+
+	int limit = USB_RAW_TRANSFER_MAX;
+	if (size > limit && maxp > 0)
+		size = std::max(limit / maxp, 1) * maxp;
+	return std::min(size, limit);
+}
 
-				if(index >= io.inner.length)
-				{
-					continue;
-				}
+bool poll_interval_parse(const char *spec) {
+	unsigned int address, interval_us;
+	if (sscanf(spec, "%x:%u", &address, &interval_us) != 2 || address & 0x70 ||
+	    (address & 0x0f) == 0 || interval_us == 0)
+		return false;
+	poll_intervals[address] = interval_us;
+	return true;
+}
 
-				//printf("GPIO %s signal detected, modifying byte %d\n", rule["gpio"].asString().c_str(), index);
+bool hidden_endpoint_parse(const char *spec) {
+	unsigned int address;
+	char end;
+	if (sscanf(spec, "%x%c", &address, &end) != 1 || address > 0xff || address & 0x70 ||
+	    (address & 0x0f) == 0)
+		return false;
+	hidden_endpoints.insert(address);
+	return true;
+}
 
-				switch(replacement_type) {
-				case ByteReplacementType::Replace: {
-					io.data[index] = char(value);
-					break;
-				}
-				case ByteReplacementType::BitwiseOr: {
-					io.data[index] = io.data[index] | char(value);
-					break;
-				}
-				}
-			}
-		}
+// The device answered at its own speed; rewrite what the host gets when
+// the gadget runs slower, polls faster or hides part of the device.
+// Returns the new length.
+static int adapt_descriptor(const struct usb_ctrlrequest *ctrl, unsigned char *data, int length) {
+	switch (ctrl->wValue >> 8) {
+	case USB_DT_DEVICE:
+		descriptor_adapt_device(data, length, device_speed, gadget_speed);
+		break;
+	case USB_DT_CONFIG: {
+		int index = ctrl->wValue & 0xff;
+		if (index >= device_backend->device_descriptor()->bNumConfigurations)
+			break;
+		std::string config = descriptor_hide(descriptor_override_intervals(
+			descriptor_adapt_config(
+				descriptor_serialize_config(device_backend->config_descriptor(index)),
+				device_speed, gadget_speed), poll_intervals, gadget_speed),
+			hidden_interfaces, hidden_endpoints);
+		length = std::min((int)config.size(), (int)ctrl->wLength);
+		memcpy(data, config.data(), length);
+		break;
 	}
+	}
+	return length;
 }
 
-void printData(struct usb_raw_transfer_io io, __u8 bEndpointAddress, std::string transfer_type, std::string dir) {
+void printData(const struct usb_raw_transfer_io &io, __u8 bEndpointAddress, const char *transfer_type, const char *dir) {
 	printf("Sending data to EP%x(%s_%s):", bEndpointAddress,
-		transfer_type.c_str(), dir.c_str());
+		transfer_type, dir);
 	for (unsigned int i = 0; i < io.inner.length; i++) {
 		printf(" %02hhx", (unsigned)io.data[i]);
 	}
 	printf("\n");
 }
 
-void *ep_loop_write(void *arg) {
+static constexpr const char *ep_type_name(int type) {
+	return type == USB_ENDPOINT_XFER_ISOC ? "isoc" :
+		type == USB_ENDPOINT_XFER_BULK ? "bulk" : "int";
+}
+
+static constexpr const char *ep_dir_name(bool in) {
+	return in ? "in" : "out";
+}
+
+/*
+ * The endpoint loops are instantiated once per transfer type and direction
+ * (see ep_loops_select()), so the direction test and the type and direction
+ * names are fixed at compile time instead of being looked up per packet.
+ * Injection and logging are still checked per packet, since both can be
+ * switched through the control socket while the endpoints are running.
+ */
+template <int Type, bool In>
+static void *ep_loop_write(void *arg) {
+	static constexpr const char *transfer_type = ep_type_name(Type);
+	static constexpr const char *dir = ep_dir_name(In);
 	struct thread_info thread_info = *((struct thread_info*) arg);
-	int fd = thread_info.fd;
 	int ep_num = thread_info.ep_num;
 	struct usb_endpoint_descriptor ep = thread_info.endpoint;
-	std::string transfer_type = thread_info.transfer_type;
-	std::string dir = thread_info.dir;
-	std::deque<usb_raw_transfer_io> *data_queue = thread_info.data_queue;
+	std::deque<usb_raw_transfer_io *> *data_queue = thread_info.data_queue;
 	std::mutex *data_mutex = thread_info.data_mutex;
+	struct ep_stats *stats = ep_stats_get(ep.bEndpointAddress);
 
 	printf("Start writing thread for EP%02x, thread id(%d)\n",
 		ep.bEndpointAddress, gettid());
+	cpu_account_thread(ep.bEndpointAddress);
+	realtime_thread(ep_priority(ep.bEndpointAddress, ep.bmAttributes));
 
+	bool last_injected = false;
 	while (!please_stop_eps) {
 		assert(ep_num != -1);
-		if (data_queue->size() == 0) {
+
+		// Packets from shared-memory rings take turns with the queue.
+		struct usb_raw_transfer_io *io = NULL;
+		if (!last_injected || data_queue->size() == 0)
+			io = shm_injection_pop(ep.bEndpointAddress, ep_num);
+		last_injected = io != NULL;
+
+		if (io) {
+			stats_inc(stats->injected);
+			USB_PROXY_PROBE(shm_dequeue, ep.bEndpointAddress, io->inner.length);
+		}
+		else if (data_queue->size() == 0) {
+			cpu_stage(CPU_STAGE_IDLE);
 			usleep(100);
 			continue;
 		}
+		else {
+			cpu_stage(CPU_STAGE_QUEUE);
+			data_mutex->lock();
+			io = data_queue->front();
+			data_queue->pop_front();
+			data_mutex->unlock();
+			stats_queue_pop(stats);
+			USB_PROXY_PROBE(ep_dequeue, ep.bEndpointAddress, io->inner.length);
+		}
 
-		data_mutex->lock();
-		struct usb_raw_transfer_io io = data_queue->front();
-		data_queue->pop_front();
-		data_mutex->unlock();
+		if (verbose_level >= 2) {
+			cpu_stage(CPU_STAGE_LOG);
+			printData(*io, ep.bEndpointAddress, transfer_type, dir);
+		}
+
+		if (capture_active) {
+			cpu_stage(CPU_STAGE_CAPTURE);
+			capture_packet(ep.bEndpointAddress, transfer_type, dir,
+				io->data, io->inner.length);
+		}
 
-		if (verbose_level >= 2)
-			printData(io, ep.bEndpointAddress, transfer_type, dir);
+		if (tap_active) {
+			cpu_stage(CPU_STAGE_CAPTURE);
+			tap_packet(ep.bEndpointAddress, Type, io->data, io->inner.length);
+		}
 
-		if (ep.bEndpointAddress & USB_DIR_IN) {
-			int rv = usb_raw_ep_write(fd, (struct usb_raw_ep_io *)&io);
-			if (rv > 0) {
+		if (In) {
+			cpu_stage(CPU_STAGE_RAW_GADGET);
+			int rv = host_backend->ep_write(&io->inner);
+			cpu_stage(CPU_STAGE_LOG);
+			if (rv >= 0) {
 				printf("EP%x(%s_%s): wrote %d bytes to host\n", ep.bEndpointAddress,
-					transfer_type.c_str(), dir.c_str(), rv);
+					transfer_type, dir, rv);
+				stats_inc(stats->forwarded);
+				stats_inc(stats->bytes, rv);
+				stats_first_packet();
+			}
+			else {
+				stats_inc(stats->errors);
 			}
 		}
 		else {
-			int length = io.inner.length;
-			unsigned char *data = new unsigned char[length];
-			memcpy(data, io.data, length);
-			send_data(ep.bEndpointAddress, ep.bmAttributes, data, length);
-
-			if (data)
-				delete[] data;
+			int length = io->inner.length;
+			cpu_stage(CPU_STAGE_LIBUSB);
+			int rv = device_backend->send_data(ep.bEndpointAddress, ep.bmAttributes,
+				(uint8_t *)io->data, length);
+			cpu_stage(CPU_STAGE_OTHER);
+			if (rv == LIBUSB_SUCCESS) {
+				stats_inc(stats->forwarded);
+				stats_inc(stats->bytes, length);
+				stats_first_packet();
+			}
+			else {
+				stats_inc(stats->errors);
+			}
 		}
+		usb_raw_transfer_free(io);
 	}
 
 	printf("End writing thread for EP%02x, thread id(%d)\n",
@@ -234,111 +365,248 @@ void *ep_loop_write(void *arg) {
 	return NULL;
 }
 
-void *ep_loop_read(void *arg) {
+// Runs the endpoint's transform. Returns false if the packet is not to be
+// forwarded, after halting the endpoint if the transform asked for that.
+static bool ep_transform(const struct thread_info &thread_info, struct usb_raw_transfer_io *io,
+			std::vector<struct usb_raw_transfer_io *> &emitted) {
+	cpu_stage(CPU_STAGE_INJECTION);
+	switch (transform_apply(thread_info.transform, io, emitted)) {
+	case USB_PROXY_DROP:
+		return false;
+	case USB_PROXY_STALL:
+		printf("EP%x: stalled by transform\n", thread_info.endpoint.bEndpointAddress);
+		host_backend->ep_stall(thread_info.ep_num);
+		return false;
+	default:
+		return true;
+	}
+}
+
+template <int Type, bool In>
+static void *ep_loop_read(void *arg) {
+	static constexpr const char *transfer_type = ep_type_name(Type);
+	static constexpr const char *dir = ep_dir_name(In);
 	struct thread_info thread_info = *((struct thread_info*) arg);
-	int fd = thread_info.fd;
 	int ep_num = thread_info.ep_num;
 	struct usb_endpoint_descriptor ep = thread_info.endpoint;
-	std::string transfer_type = thread_info.transfer_type;
-	std::string dir = thread_info.dir;
-	std::deque<usb_raw_transfer_io> *data_queue = thread_info.data_queue;
+	std::deque<usb_raw_transfer_io *> *data_queue = thread_info.data_queue;
 	std::mutex *data_mutex = thread_info.data_mutex;
+	struct ep_stats *stats = ep_stats_get(ep.bEndpointAddress);
+	std::vector<struct usb_raw_transfer_io *> emitted;
+	std::vector<int> emitted_lengths;	// for the probes, read before queueing
+	// Only this thread uses it, to replay the endpoint's last packet when
+	// a GPIO pin triggers.
+	struct usb_raw_transfer_io *last_message = NULL;
 
 	printf("Start reading thread for EP%02x, thread id(%d)\n",
 		ep.bEndpointAddress, gettid());
+	cpu_account_thread(ep.bEndpointAddress);
+	realtime_thread(ep_priority(ep.bEndpointAddress, ep.bmAttributes));
 
 	while (!please_stop_eps) {
 		assert(ep_num != -1);
-		struct usb_raw_transfer_io io;
-		
-		if (ep.bEndpointAddress & USB_DIR_IN) {
+
+		if (In) {
 			unsigned char *data = NULL;
 			int nbytes = -1;
 
 			if (data_queue->size() >= 32) {
+				cpu_stage(CPU_STAGE_LOG);
 				printf("EP%x(%s_%s): queue contains %lu, sleeping\n", ep.bEndpointAddress,
-						transfer_type.c_str(), dir.c_str(), data_queue->size());
+						transfer_type, dir, data_queue->size());
+				cpu_stage(CPU_STAGE_IDLE);
 				usleep(100);
 				continue;
 			}
 
-			receive_data(ep.bEndpointAddress, ep.bmAttributes, ep.wMaxPacketSize, &data, &nbytes, 20);
-
-			if (nbytes > 0) {
-				memcpy(io.data, data, nbytes);
-				io.inner.ep = ep_num;
-				io.inner.flags = 0;
-				io.inner.length = nbytes;
+			cpu_stage(CPU_STAGE_LIBUSB);
+			device_backend->receive_data(ep.bEndpointAddress, ep.bmAttributes,
+				thread_info.transfer_size, &data, &nbytes, 20);
+			cpu_stage(CPU_STAGE_OTHER);
+
+			// Zero-length packets end a transfer that filled whole
+			// packets and are passed on like any other.
+			if (nbytes >= 0) {
+				struct usb_raw_transfer_io *io = usb_raw_transfer_alloc(thread_info.transfer_size);
+				if (nbytes > 0)
+					memcpy(io->data, data, nbytes);
+				io->inner.ep = ep_num;
+				io->inner.flags = 0;
+				io->inner.length = nbytes;
 
-				if (injection_enabled)
-					injection(io, ep, transfer_type);
-
-				data_mutex->lock();
-				data_queue->push_back(io);
-				last_messages[ep.bEndpointAddress] = io;
-				data_mutex->unlock();
+				if (injection_enabled) {
+					cpu_stage(CPU_STAGE_INJECTION);
+					if (injection(*io, ep, Type))
+						stats_inc(stats->injected);
+				}
 
-				if (verbose_level)
-					printf("EP%x(%s_%s): enqueued %d bytes to queue\n", ep.bEndpointAddress,
-							transfer_type.c_str(), dir.c_str(), nbytes);
+				if (thread_info.transform && !ep_transform(thread_info, io, emitted))
+					usb_raw_transfer_free(io);
+				else {
+					cpu_stage(CPU_STAGE_QUEUE);
+					// io belongs to the writing thread once queued.
+					int length = io->inner.length;
+					emitted_lengths.clear();
+					for (struct usb_raw_transfer_io *extra : emitted)
+						emitted_lengths.push_back(extra->inner.length);
+					usb_raw_transfer_free(last_message);
+					last_message = usb_raw_transfer_dup(io);
+					data_mutex->lock();
+					data_queue->push_back(io);
+					data_queue->insert(data_queue->end(), emitted.begin(), emitted.end());
+					data_mutex->unlock();
+					for (size_t i = 0; i <= emitted.size(); i++)
+						stats_queue_push(stats);
+					USB_PROXY_PROBE(ep_enqueue, ep.bEndpointAddress, length, 0);
+					for (size_t i = 0; i < emitted_lengths.size(); i++)
+						USB_PROXY_PROBE(ep_enqueue, ep.bEndpointAddress, emitted_lengths[i], 0);
+					emitted.clear();
+
+					cpu_stage(CPU_STAGE_LOG);
+					if (verbose_level)
+						printf("EP%x(%s_%s): enqueued %d bytes to queue\n", ep.bEndpointAddress,
+								transfer_type, dir, length);
+				}
 			}
 
-			if(is_any_gpio_pin_triggered() && last_messages.count(ep.bEndpointAddress) > 0)
+			cpu_stage(CPU_STAGE_INJECTION);
+			if(is_any_gpio_pin_triggered() && last_message)
 			{
-				struct usb_raw_transfer_io last_io = last_messages[ep.bEndpointAddress];
+				struct usb_raw_transfer_io *last_io = usb_raw_transfer_dup(last_message);
 
-				if (injection_enabled)
-					injection(last_io, ep, transfer_type);
+				if (injection_enabled && injection(*last_io, ep, Type))
+					stats_inc(stats->injected);
 
+				cpu_stage(CPU_STAGE_QUEUE);
+				int length = last_io->inner.length;
 				data_mutex->lock();
 				data_queue->push_back(last_io);
 				data_mutex->unlock();
+				stats_queue_push(stats);
+				USB_PROXY_PROBE(ep_enqueue, ep.bEndpointAddress, length, 1);
 
+				cpu_stage(CPU_STAGE_LOG);
 				if (verbose_level)
 					printf("EP%x(%s_%s): artificially enqueued %d bytes to queue\n", ep.bEndpointAddress,
-							transfer_type.c_str(), dir.c_str(), last_io.inner.length);
+							transfer_type, dir, length);
 			}
 
+			cpu_stage(CPU_STAGE_OTHER);
 			if (data)
 				delete[] data;
 		}
 		else 
 		{
-			io.inner.ep = ep_num;
-			io.inner.flags = 0;
-			io.inner.length = sizeof(io.data);
+			// Stop taking data from the host while the device side is not
+			// draining the queue (e.g. while it is reconnecting), so the
+			// host is NAKed instead of the queue growing without bound.
+			if (data_queue->size() >= 1024) {
+				cpu_stage(CPU_STAGE_IDLE);
+				usleep(100);
+				continue;
+			}
 
-			int rv = usb_raw_ep_read(fd, (struct usb_raw_ep_io *)&io);
+			struct usb_raw_transfer_io *io = usb_raw_transfer_alloc(thread_info.transfer_size);
+			io->inner.ep = ep_num;
+			io->inner.flags = 0;
+			io->inner.length = io->capacity;
+
+			cpu_stage(CPU_STAGE_RAW_GADGET);
+			int rv = host_backend->ep_read(&io->inner);
 			if (rv >= 0) {
+				cpu_stage(CPU_STAGE_LOG);
 				printf("EP%x(%s_%s): read %d bytes from host\n", ep.bEndpointAddress,
-						transfer_type.c_str(), dir.c_str(), rv);
-				io.inner.length = rv;
-
-				if (injection_enabled)
-					injection(io, ep, transfer_type);
+						transfer_type, dir, rv);
+				io->inner.length = rv;
 
-				data_mutex->lock();
-				data_queue->push_back(io);
-				last_messages[ep.bEndpointAddress] = io;
-				data_mutex->unlock();
+				if (injection_enabled) {
+					cpu_stage(CPU_STAGE_INJECTION);
+					if (injection(*io, ep, Type))
+						stats_inc(stats->injected);
+				}
 
-				if (verbose_level)
-					printf("EP%x(%s_%s): enqueued %d bytes to queue\n", ep.bEndpointAddress,
-							transfer_type.c_str(), dir.c_str(), rv);
+				if (thread_info.transform && !ep_transform(thread_info, io, emitted))
+					usb_raw_transfer_free(io);
+				else {
+					cpu_stage(CPU_STAGE_QUEUE);
+					// As rewritten by the injection rules and the transform.
+					int length = io->inner.length;
+					emitted_lengths.clear();
+					for (struct usb_raw_transfer_io *extra : emitted)
+						emitted_lengths.push_back(extra->inner.length);
+					usb_raw_transfer_free(last_message);
+					last_message = usb_raw_transfer_dup(io);
+					data_mutex->lock();
+					data_queue->push_back(io);
+					data_queue->insert(data_queue->end(), emitted.begin(), emitted.end());
+					data_mutex->unlock();
+					for (size_t i = 0; i <= emitted.size(); i++)
+						stats_queue_push(stats);
+					USB_PROXY_PROBE(ep_enqueue, ep.bEndpointAddress, length, 0);
+					for (size_t i = 0; i < emitted_lengths.size(); i++)
+						USB_PROXY_PROBE(ep_enqueue, ep.bEndpointAddress, emitted_lengths[i], 0);
+					emitted.clear();
+
+					cpu_stage(CPU_STAGE_LOG);
+					if (verbose_level)
+						printf("EP%x(%s_%s): enqueued %d bytes to queue\n", ep.bEndpointAddress,
+								transfer_type, dir, length);
+				}
 			}
+			else
+				usb_raw_transfer_free(io);
+			cpu_stage(CPU_STAGE_OTHER);
 		}
 	}
 
+	usb_raw_transfer_free(last_message);
+
 	printf("End reading thread for EP%02x, thread id(%d)\n",
 		ep.bEndpointAddress, gettid());
 	return NULL;
 }
 
-void process_eps(int fd, int config, int interface, int altsetting) {
+typedef void *(*ep_loop_fn)(void *);
+
+template <int Type>
+static void ep_loops_for(bool in, ep_loop_fn *read, ep_loop_fn *write) {
+	if (in) {
+		*read = ep_loop_read<Type, true>;
+		*write = ep_loop_write<Type, true>;
+	}
+	else {
+		*read = ep_loop_read<Type, false>;
+		*write = ep_loop_write<Type, false>;
+	}
+}
+
+// Picks the loop instantiations for an endpoint. Returns false for a
+// transfer type that has none.
+static bool ep_loops_select(const struct usb_endpoint_descriptor *desc,
+			ep_loop_fn *read, ep_loop_fn *write) {
+	bool in = usb_endpoint_dir_in(desc);
+	switch (usb_endpoint_type(desc)) {
+	case USB_ENDPOINT_XFER_ISOC:
+		ep_loops_for<USB_ENDPOINT_XFER_ISOC>(in, read, write);
+		return true;
+	case USB_ENDPOINT_XFER_BULK:
+		ep_loops_for<USB_ENDPOINT_XFER_BULK>(in, read, write);
+		return true;
+	case USB_ENDPOINT_XFER_INT:
+		ep_loops_for<USB_ENDPOINT_XFER_INT>(in, read, write);
+		return true;
+	default:
+		return false;
+	}
+}
+
+void process_eps(int config, int interface, int altsetting) {
 	struct raw_gadget_altsetting *alt = &host_device_desc.configs[config]
 					.interfaces[interface].altsettings[altsetting];
 
 	printf("Activating %d endpoints on interface %d\n", (int)alt->interface.bNumEndpoints, interface);
+	USB_PROXY_PROBE(altsetting_activate, config, interface, altsetting,
+		alt->interface.bNumEndpoints);
 
 	for (int i = 0; i < alt->interface.bNumEndpoints; i++) {
 		struct raw_gadget_endpoint *ep = &alt->endpoints[i];
@@ -346,83 +614,50 @@ void process_eps(int fd, int config, int interface, int altsetting) {
 		int addr = usb_endpoint_num(&ep->endpoint);
 		assert(addr != 0);
 
-		ep->thread_info.fd = fd;
-		ep->thread_info.endpoint = ep->endpoint;
-		ep->thread_info.data_queue = new std::deque<usb_raw_transfer_io>;
-		ep->thread_info.data_mutex = new std::mutex;
-
-		switch (usb_endpoint_type(&ep->endpoint)) {
-		case USB_ENDPOINT_XFER_ISOC:
-			ep->thread_info.transfer_type = "isoc";
-			break;
-		case USB_ENDPOINT_XFER_BULK:
-			ep->thread_info.transfer_type = "bulk";
-			break;
-		case USB_ENDPOINT_XFER_INT:
-			ep->thread_info.transfer_type = "int";
-			break;
-		default:
+		ep_loop_fn loop_read, loop_write;
+		if (!ep_loops_select(&ep->endpoint, &loop_read, &loop_write)) {
 			printf("transfer_type %d is invalid\n", usb_endpoint_type(&ep->endpoint));
 			assert(false);
 		}
 
-		if (usb_endpoint_dir_in(&ep->endpoint))
-			ep->thread_info.dir = "in";
-		else
-			ep->thread_info.dir = "out";
+		ep->thread_info.endpoint = ep->endpoint;
+		ep->thread_info.transfer_size = ep_transfer_size(ep);
+		ep->thread_info.data_queue = new std::deque<usb_raw_transfer_io *>;
+		ep->thread_info.data_mutex = new std::mutex;
 
-		ep->thread_info.ep_num = usb_raw_ep_enable(fd, &ep->thread_info.endpoint);
-		printf("%s_%s: addr = %u, ep = #%d\n",
-			ep->thread_info.transfer_type.c_str(),
-			ep->thread_info.dir.c_str(),
-			addr, ep->thread_info.ep_num);
+		ep->thread_info.ep_num = host_backend->ep_enable(&ep->thread_info.endpoint);
+		ep->thread_info.transform = transform_open(&ep->thread_info.endpoint);
+		stats_ep_activate(ep->endpoint.bEndpointAddress, ep->endpoint.bmAttributes);
+		printf("%s_%s: addr = %u, ep = #%d, priority %s\n",
+			ep_type_name(usb_endpoint_type(&ep->endpoint)),
+			ep_dir_name(usb_endpoint_dir_in(&ep->endpoint)),
+			addr, ep->thread_info.ep_num,
+			priority_class_name(ep_priority(ep->endpoint.bEndpointAddress,
+				ep->endpoint.bmAttributes)));
 
 		if (verbose_level)
 			printf("Creating thread for EP%02x\n",
 				ep->thread_info.endpoint.bEndpointAddress);
 		pthread_create(&ep->thread_read, 0,
-			ep_loop_read, (void *)&ep->thread_info);
+			loop_read, (void *)&ep->thread_info);
 		pthread_create(&ep->thread_write, 0,
-			ep_loop_write, (void *)&ep->thread_info);
+			loop_write, (void *)&ep->thread_info);
 	}
    
 	printf("Activating wiringPi API\n");
 
-	wiringPiSetupGpio();
-
-	for (unsigned int j = 0; j < injection_config["int"].size(); j++) {
-		Json::Value rule = injection_config["int"][j];
-		if (rule["enable"].asBool() != true)
-			continue;
-
-		const RuleType injection_type = static_cast<RuleType>(rule["type"].asUInt());
-		if (injection_type != RuleType::RaspberryPiGpio)
-			continue;
-
-		auto gpio_on = rule["gpio"]["on"];
-		std::for_each(gpio_on.begin(), gpio_on.end(), [](Json::Value gpio_index){
-			used_gpio_pins.insert(gpio_index.asUInt());
-		});
-
-		auto gpio_off = rule["gpio"]["off"];
-		std::for_each(gpio_off.begin(), gpio_off.end(), [](Json::Value gpio_index){
-			used_gpio_pins.insert(gpio_index.asUInt());
-		});
-	}
-
-	std::for_each(used_gpio_pins.begin(), used_gpio_pins.end(), [](unsigned int gpio_index){ 
-		pinMode(gpio_index, INPUT);
-		pullUpDnControl(gpio_index, PUD_UP); 
-		printf("wiringPi: activated pin %d as input\n", gpio_index);
-	});
+	injection_gpio_setup();
 
 	printf("process_eps done\n");
 }
 
-void terminate_eps(int fd, int config, int interface, int altsetting) {
+void terminate_eps(int config, int interface, int altsetting) {
 	struct raw_gadget_altsetting *alt = &host_device_desc.configs[config]
 					.interfaces[interface].altsettings[altsetting];
 
+	USB_PROXY_PROBE(altsetting_terminate, config, interface, altsetting,
+		alt->interface.bNumEndpoints);
+
 	please_stop_eps = true;
 
 	for (int i = 0; i < alt->interface.bNumEndpoints; i++) {
@@ -437,9 +672,14 @@ void terminate_eps(int fd, int config, int interface, int altsetting) {
 		ep->thread_read = 0;
 		ep->thread_write = 0;
 
-		usb_raw_ep_disable(fd, ep->thread_info.ep_num);
+		host_backend->ep_disable(ep->thread_info.ep_num);
 		ep->thread_info.ep_num = -1;
+		transform_close(ep->thread_info.transform);
+		ep->thread_info.transform = NULL;
+		stats_ep_deactivate(ep->endpoint.bEndpointAddress);
 
+		for (struct usb_raw_transfer_io *io : *ep->thread_info.data_queue)
+			usb_raw_transfer_free(io);
 		delete ep->thread_info.data_queue;
 		delete ep->thread_info.data_mutex;
 	}
@@ -447,34 +687,47 @@ void terminate_eps(int fd, int config, int interface, int altsetting) {
 	please_stop_eps = false;
 }
 
-void ep0_loop(int fd) {
+void ep0_loop() {
 	bool set_configuration_done_once = false;
+	// wLength is 16 bits, so one buffer fits every control transfer.
+	struct usb_raw_transfer_io *io = usb_raw_transfer_alloc(0xffff);
+	std::chrono::steady_clock::time_point run_time = std::chrono::steady_clock::now();
 
 	printf("Start for EP0, thread id(%d)\n", gettid());
+	cpu_account_thread(0x00);
+	realtime_thread(PRIORITY_NORMAL);
 
 	if (verbose_level)
-		print_eps_info(fd);
+		print_eps_info(host_backend);
 
 	while (!please_stop_ep0) {
 		struct usb_raw_control_event event;
 		event.inner.type = 0;
 		event.inner.length = sizeof(event.ctrl);
 
-		usb_raw_event_fetch(fd, (struct usb_raw_event *)&event);
+		cpu_stage(CPU_STAGE_IDLE);
+		host_backend->event_fetch((struct usb_raw_event *)&event);
+		cpu_stage(CPU_STAGE_LOG);
 		log_event((struct usb_raw_event *)&event);
+		cpu_stage(CPU_STAGE_OTHER);
 
 		if (event.inner.length == 4294967295) {
 			printf("End for EP0, thread id(%d)\n", gettid());
+			usb_raw_transfer_free(io);
 			return;
 		}
 
+		USB_PROXY_PROBE(ep0_event, event.inner.type, event.ctrl.bRequestType,
+			event.ctrl.bRequest, event.ctrl.wValue, event.ctrl.wIndex, event.ctrl.wLength);
+
 		if (event.inner.type != USB_RAW_EVENT_CONTROL)
 			continue;
 
-		struct usb_raw_transfer_io io;
-		io.inner.ep = 0;
-		io.inner.flags = 0;
-		io.inner.length = event.ctrl.wLength;
+		stats_inc(proxy_stats.control_requests);
+
+		io->inner.ep = 0;
+		io->inner.flags = 0;
+		io->inner.length = event.ctrl.wLength;
 
 		int injection_flags = USB_INJECTION_FLAG_NONE;
 		int nbytes = 0;
@@ -483,22 +736,42 @@ void ep0_loop(int fd) {
 
 		int rv = -1;
 		if (event.ctrl.bRequestType & USB_DIR_IN) {
-			result = control_request(&event.ctrl, &nbytes, &control_data, 1000);
+			cpu_stage(CPU_STAGE_LIBUSB);
+			if (control_cache_lookup(&event.ctrl, control_data, &nbytes))
+				result = 0;
+			else {
+				result = device_backend->control_request(&event.ctrl, &nbytes, &control_data, 1000);
+				if (result == 0)
+					control_cache_store(&event.ctrl, control_data, nbytes);
+			}
+			cpu_stage(CPU_STAGE_OTHER);
+			if (result == 0 && (gadget_speed < device_speed || !poll_intervals.empty() ||
+			    !hidden_interfaces.empty() || !hidden_endpoints.empty()) &&
+			    event.ctrl.bRequestType == USB_DIR_IN &&
+			    event.ctrl.bRequest == USB_REQ_GET_DESCRIPTOR)
+				nbytes = adapt_descriptor(&event.ctrl, control_data, nbytes);
 			if (result == 0) {
-				memcpy(&io.data[0], control_data, nbytes);
-				io.inner.length = nbytes;
+				memcpy(&io->data[0], control_data, nbytes);
+				io->inner.length = nbytes;
 
 				if (injection_enabled) {
-					injection(event, io, injection_flags);
+					{
+						cpu_stage_scope scope(CPU_STAGE_INJECTION);
+						injection(event, *io, injection_flags);
+					}
+					USB_PROXY_PROBE(ep0_injection, event.ctrl.bRequestType,
+						event.ctrl.bRequest, injection_flags);
 					switch(injection_flags) {
 					case USB_INJECTION_FLAG_NONE:
 						break;
 					case USB_INJECTION_FLAG_IGNORE:
+						stats_inc(proxy_stats.control_ignored);
 						delete[] control_data;
 						continue;
 					case USB_INJECTION_FLAG_STALL:
+						stats_inc(proxy_stats.control_stalls);
 						delete[] control_data;
-						usb_raw_ep0_stall(fd);
+						host_backend->ep0_stall();
 						continue;
 					default:
 						printf("[Warning] Unknown injection flags: %d\n", injection_flags);
@@ -507,17 +780,28 @@ void ep0_loop(int fd) {
 				}
 
 				if (verbose_level >= 2)
-					printData(io, 0x00, "control", "in");
+					printData(*io, 0x00, "control", "in");
 
-				rv = usb_raw_ep0_write(fd, (struct usb_raw_ep_io *)&io);
+				if (capture_active)
+					capture_control(&event.ctrl, io->data, io->inner.length);
+				if (tap_active)
+					tap_control(&event.ctrl, io->data, io->inner.length);
+
+				cpu_stage(CPU_STAGE_RAW_GADGET);
+				rv = host_backend->ep0_write(&io->inner);
+				cpu_stage(CPU_STAGE_OTHER);
 				printf("ep0: transferred %d bytes (in)\n", rv);
 			}
 			else {
-				usb_raw_ep0_stall(fd);
+				stats_inc(proxy_stats.control_stalls);
+				host_backend->ep0_stall();
 			}
 		}
 		else {
-			rv = usb_raw_ep0_read(fd, (struct usb_raw_ep_io *)&io);
+			cpu_stage(CPU_STAGE_RAW_GADGET);
+			rv = host_backend->ep0_read(&io->inner);
+			cpu_stage(CPU_STAGE_OTHER);
+			control_cache_invalidate(&event.ctrl);
 
 			if (event.ctrl.bRequestType == 0x00 && event.ctrl.bRequest == 0x09) { // Set configuration
 				int desired_config = -1;
@@ -540,24 +824,30 @@ void ep0_loop(int fd) {
 						struct raw_gadget_interface *iface = &config->interfaces[i];
 						int interface_num = iface->altsettings[iface->current_altsetting]
 							.interface.bInterfaceNumber;
-						terminate_eps(fd, host_device_desc.current_config, i,
+						terminate_eps(host_device_desc.current_config, i,
 								iface->current_altsetting);
-						release_interface(interface_num);
+						device_backend->release_interface(interface_num);
 					}
 				}
 
-				usb_raw_configure(fd);
-				set_configuration(config->config.bConfigurationValue);
+				host_backend->configure();
+				device_backend->set_configuration(config->config.bConfigurationValue);
 				host_device_desc.current_config = desired_config;
 
 				for (int i = 0; i < config->config.bNumInterfaces; i++) {
 					struct raw_gadget_interface *iface = &config->interfaces[i];
 					iface->current_altsetting = 0;
 					int interface_num = iface->altsettings[0].interface.bInterfaceNumber;
-					claim_interface(interface_num);
-					process_eps(fd, desired_config, i, 0);
+					device_backend->claim_interface(interface_num);
+					process_eps(desired_config, i, 0);
 				}
 
+				if (!set_configuration_done_once) {
+					uint64_t configured_us = std::chrono::duration_cast<std::chrono::microseconds>(
+						std::chrono::steady_clock::now() - run_time).count();
+					proxy_stats.host_configured_us.store(configured_us, std::memory_order_relaxed);
+					printf("Host configured %.1f ms after start\n", configured_us / 1000.0);
+				}
 				set_configuration_done_once = true;
 			}
 			else if (event.ctrl.bRequestType == 0x01 && event.ctrl.bRequest == 0x0b) { // Set interface/alt_setting
@@ -595,26 +885,33 @@ void ep0_loop(int fd) {
 
 				printf("Changing interface/altsetting\n");
 
-				terminate_eps(fd, host_device_desc.current_config,
+				terminate_eps(host_device_desc.current_config,
 					desired_interface, iface->current_altsetting);
-				set_interface_alt_setting(alt->interface.bInterfaceNumber,
+				device_backend->set_interface_alt_setting(alt->interface.bInterfaceNumber,
 					alt->interface.bAlternateSetting);
-				process_eps(fd, host_device_desc.current_config,
+				process_eps(host_device_desc.current_config,
 					desired_interface, desired_altsetting);
 				iface->current_altsetting = desired_altsetting;
 			}
 			else {
 				if (injection_enabled) {
-					injection(event, io, injection_flags);
+					{
+						cpu_stage_scope scope(CPU_STAGE_INJECTION);
+						injection(event, *io, injection_flags);
+					}
+					USB_PROXY_PROBE(ep0_injection, event.ctrl.bRequestType,
+						event.ctrl.bRequest, injection_flags);
 					switch(injection_flags) {
 					case USB_INJECTION_FLAG_NONE:
 						break;
 					case USB_INJECTION_FLAG_IGNORE:
+						stats_inc(proxy_stats.control_ignored);
 						delete[] control_data;
 						continue;
 					case USB_INJECTION_FLAG_STALL:
+						stats_inc(proxy_stats.control_stalls);
 						delete[] control_data;
-						usb_raw_ep0_stall(fd);
+						host_backend->ep0_stall();
 						continue;
 					default:
 						printf("[Warning] Unknown injection flags: %d\n", injection_flags);
@@ -622,17 +919,28 @@ void ep0_loop(int fd) {
 					}
 				}
 
-				memcpy(control_data, io.data, event.ctrl.wLength);
+				// A modify rule may have grown the data stage.
+				delete[] control_data;
+				control_data = new unsigned char[event.ctrl.wLength];
+				memcpy(control_data, io->data, event.ctrl.wLength);
 
 				if (verbose_level >= 2)
-					printData(io, 0x00, "control", "out");
+					printData(*io, 0x00, "control", "out");
+
+				if (capture_active)
+					capture_control(&event.ctrl, io->data, event.ctrl.wLength);
+				if (tap_active)
+					tap_control(&event.ctrl, io->data, event.ctrl.wLength);
 
-				result = control_request(&event.ctrl, &nbytes, &control_data, 1000);
+				cpu_stage(CPU_STAGE_LIBUSB);
+				result = device_backend->control_request(&event.ctrl, &nbytes, &control_data, 1000);
+				cpu_stage(CPU_STAGE_OTHER);
 				if (result == 0) {
 					printf("ep0: transferred %d bytes (out)\n", rv);
 				}
 				else {
-					usb_raw_ep0_stall(fd);
+					stats_inc(proxy_stats.control_stalls);
+					host_backend->ep0_stall();
 				}
 			}
 		}
@@ -646,10 +954,11 @@ void ep0_loop(int fd) {
 		struct raw_gadget_interface *iface = &config->interfaces[i];
 		int interface_num = iface->altsettings[iface->current_altsetting]
 			.interface.bInterfaceNumber;
-		terminate_eps(fd, host_device_desc.current_config, i,
+		terminate_eps(host_device_desc.current_config, i,
 				iface->current_altsetting);
-		release_interface(interface_num);
+		device_backend->release_interface(interface_num);
 	}
 
+	usb_raw_transfer_free(io);
 	printf("End for EP0, thread id(%d)\n", gettid());
 }
@@ -1 +1,27 @@
-void ep0_loop(int fd);
+#include <map>
+#include <set>
+
+#include "host-raw-gadget.h"
+
+// Speed of the proxied device's link, and the speed the gadget is run at.
+extern enum usb_device_speed device_speed;
+extern enum usb_device_speed gadget_speed;
+// Bytes a bulk endpoint moves per transfer, in whole packets.
+extern int bulk_transfer_size;
+// Polling intervals advertised to the host, in microseconds by endpoint
+// address, see descriptor_override_interval().
+extern std::map<uint8_t, unsigned int> poll_intervals;
+// Interfaces, by number, and endpoints, by address, kept from the host:
+// they are left out of the descriptors, not claimed and never proxied.
+extern std::set<int> hidden_interfaces;
+extern std::set<uint8_t> hidden_endpoints;
+
+int setup_host_usb_desc();
+void free_host_usb_desc();
+void terminate_eps(int config, int interface, int altsetting);
+void ep0_loop();
+// Parses `<address>:<microseconds>`, address in hex, into poll_intervals.
+bool poll_interval_parse(const char *spec);
+// Parses an endpoint address in hex into hidden_endpoints.
+bool hidden_endpoint_parse(const char *spec);
+void printData(const struct usb_raw_transfer_io &io, __u8 bEndpointAddress, const char *transfer_type, const char *dir);
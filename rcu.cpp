@@ -0,0 +1,102 @@
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "rcu.h"
+
+struct alignas(64) rcu_slot {
+	std::atomic<bool>	used;
+	std::atomic<uint64_t>	epoch;	// 0 while the thread is outside a read-side section
+};
+
+struct rcu_reader {
+	int	slot = -1;
+	int	depth = 0;
+
+	~rcu_reader();
+};
+
+struct rcu_retired {
+	uint64_t		epoch;
+	std::function<void()>	reclaim;
+};
+
+static std::atomic<uint64_t> rcu_epoch(1);
+static struct rcu_slot rcu_slots[RCU_MAX_READERS];
+static thread_local struct rcu_reader rcu_reader;
+
+static std::mutex rcu_retired_mutex;
+static std::vector<struct rcu_retired> rcu_retired_list;
+
+rcu_reader::~rcu_reader() {
+	if (slot < 0)
+		return;
+	rcu_slots[slot].epoch.store(0);
+	rcu_slots[slot].used.store(false);
+}
+
+static int rcu_claim_slot() {
+	for (int i = 0; i < RCU_MAX_READERS; i++) {
+		bool expected = false;
+		if (rcu_slots[i].used.compare_exchange_strong(expected, true))
+			return i;
+	}
+	fprintf(stderr, "RCU: more than %d reader threads\n", RCU_MAX_READERS);
+	abort();
+}
+
+void rcu_read_lock() {
+	if (rcu_reader.depth++ > 0)
+		return;
+	if (rcu_reader.slot < 0)
+		rcu_reader.slot = rcu_claim_slot();
+	// Sequentially consistent so that the pointer loaded afterwards is
+	// ordered after a writer's scan that may have missed this slot.
+	rcu_slots[rcu_reader.slot].epoch.store(rcu_epoch.load());
+}
+
+void rcu_read_unlock() {
+	if (--rcu_reader.depth > 0)
+		return;
+	rcu_slots[rcu_reader.slot].epoch.store(0, std::memory_order_release);
+}
+
+void rcu_retire(std::function<void()> reclaim) {
+	// Readers that enter from now on can only observe the new object.
+	uint64_t epoch = rcu_epoch.fetch_add(1) + 1;
+
+	std::lock_guard<std::mutex> lock(rcu_retired_mutex);
+	rcu_retired_list.push_back({epoch, reclaim});
+}
+
+int rcu_reclaim() {
+	uint64_t oldest = UINT64_MAX;
+	for (int i = 0; i < RCU_MAX_READERS; i++) {
+		uint64_t epoch = rcu_slots[i].epoch.load();
+		if (epoch && epoch < oldest)
+			oldest = epoch;
+	}
+
+	std::vector<std::function<void()>> ready;
+	int pending;
+	{
+		std::lock_guard<std::mutex> lock(rcu_retired_mutex);
+		auto it = rcu_retired_list.begin();
+		while (it != rcu_retired_list.end()) {
+			if (it->epoch <= oldest) {
+				ready.push_back(it->reclaim);
+				it = rcu_retired_list.erase(it);
+			}
+			else {
+				it++;
+			}
+		}
+		pending = rcu_retired_list.size();
+	}
+
+	for (auto &reclaim : ready)
+		reclaim();
+	return pending;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+
+/*
+ * Minimal epoch-based read-copy-update.
+ *
+ * Readers bracket their accesses with rcu_read_lock()/rcu_read_unlock(),
+ * which only publish the current epoch in a per-thread slot and never block.
+ * Writers swap in a new object, then hand the old one to rcu_retire(); it is
+ * reclaimed by rcu_reclaim() once every reader that could still see it has
+ * left its read-side section.
+ */
+
+#define RCU_MAX_READERS	128
+
+void rcu_read_lock();
+void rcu_read_unlock();
+void rcu_retire(std::function<void()> reclaim);
+int rcu_reclaim();
+
+struct rcu_read_guard {
+	rcu_read_guard() { rcu_read_lock(); }
+	~rcu_read_guard() { rcu_read_unlock(); }
+	rcu_read_guard(const rcu_read_guard &) = delete;
+	rcu_read_guard &operator=(const rcu_read_guard &) = delete;
+};
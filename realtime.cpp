@@ -0,0 +1,134 @@
+#include <malloc.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <linux/usb/ch9.h>
+
+#include "realtime.h"
+
+int realtime_priority = 0;
+bool realtime_cpus_set = false;
+cpu_set_t realtime_cpus;
+bool realtime_lock_memory = false;
+std::map<uint8_t, int> ep_priorities;
+
+static const char *priority_class_names[] = { "low", "normal", "high" };
+
+int realtime_setup() {
+	if (realtime_priority) {
+		// The lower classes run below realtime_priority.
+		int min = sched_get_priority_min(SCHED_FIFO) + PRIORITY_HIGH;
+		int max = sched_get_priority_max(SCHED_FIFO);
+		if (realtime_priority < min || realtime_priority > max) {
+			printf("Real-time priority must be between %d and %d\n", min, max);
+			return 1;
+		}
+	}
+
+	if (realtime_cpus_set) {
+		cpu_set_t allowed, others;
+		if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+			perror("sched_getaffinity");
+			return 1;
+		}
+		CPU_AND(&realtime_cpus, &realtime_cpus, &allowed);
+		if (CPU_COUNT(&realtime_cpus) == 0) {
+			printf("None of the real-time CPUs can be used\n");
+			return 1;
+		}
+
+		// Threads started from here on inherit this, and only the data
+		// path moves itself back onto the real-time CPUs.
+		CPU_XOR(&others, &allowed, &realtime_cpus);
+		if (CPU_COUNT(&others) == 0)
+			printf("No CPUs left for the other threads, sharing the real-time CPUs\n");
+		else if (sched_setaffinity(0, sizeof(others), &others)) {
+			perror("sched_setaffinity");
+			return 1;
+		}
+	}
+
+	if (realtime_lock_memory) {
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setstacksize(&attr, REALTIME_STACK_SIZE);
+		pthread_setattr_default_np(&attr);
+		pthread_attr_destroy(&attr);
+
+		mallopt(M_TRIM_THRESHOLD, -1);
+		mallopt(M_MMAP_MAX, 0);
+		if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+			perror("mlockall");
+			return 1;
+		}
+	}
+
+	printf("Data path threads: %s, %s, memory %s\n",
+		realtime_priority ? "SCHED_FIFO" : "SCHED_OTHER",
+		realtime_cpus_set ? "pinned" : "not pinned",
+		realtime_lock_memory ? "locked" : "not locked");
+	return 0;
+}
+
+void realtime_thread(int priority) {
+	if (realtime_cpus_set &&
+	    pthread_setaffinity_np(pthread_self(), sizeof(realtime_cpus), &realtime_cpus))
+		perror("pthread_setaffinity_np");
+
+	if (realtime_priority) {
+		struct sched_param param = {};
+		param.sched_priority = realtime_priority - (PRIORITY_HIGH - priority);
+		int rv = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (rv)
+			fprintf(stderr, "pthread_setschedparam: %s\n", strerror(rv));
+	}
+
+	if (realtime_lock_memory) {
+		// Touch the stack this thread will use and grow its malloc
+		// arena, which is never trimmed, to cover the transfer buffers.
+		volatile char stack[REALTIME_STACK_PREFAULT];
+		memset((char *)stack, 0, sizeof(stack));
+		char *heap = (char *)malloc(REALTIME_HEAP_PREFAULT);
+		if (heap) {
+			memset(heap, 0, REALTIME_HEAP_PREFAULT);
+			free(heap);
+		}
+	}
+}
+
+int ep_priority(uint8_t bEndpointAddress, uint8_t bmAttributes) {
+	auto it = ep_priorities.find(bEndpointAddress);
+	if (it != ep_priorities.end())
+		return it->second;
+
+	switch (bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) {
+	case USB_ENDPOINT_XFER_INT:
+		return PRIORITY_HIGH;
+	case USB_ENDPOINT_XFER_CONTROL:
+		return PRIORITY_NORMAL;
+	default:
+		return PRIORITY_LOW;
+	}
+}
+
+bool ep_priority_parse(const char *spec) {
+	unsigned int address;
+	char name[8];
+	if (sscanf(spec, "%x:%7s", &address, name) != 2 || address & 0x70 ||
+	    (address & 0x0f) == 0)
+		return false;
+
+	for (int priority = PRIORITY_LOW; priority <= PRIORITY_HIGH; priority++) {
+		if (!strcmp(name, priority_class_names[priority])) {
+			ep_priorities[address] = priority;
+			return true;
+		}
+	}
+	return false;
+}
+
+const char *priority_class_name(int priority) {
+	return priority_class_names[priority];
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <map>
+#include <sched.h>
+#include <stdint.h>
+
+/*
+ * Optional real-time setup for the threads that move packets: ep0, the
+ * endpoint loops and the usbfs reaper.
+ *
+ * - realtime_priority > 0 runs them as SCHED_FIFO at that priority, so a
+ *   report is not held up behind ordinary processes.
+ * - With realtime_cpus, they run on those CPUs only, and every other thread
+ *   (control socket, injection file watcher, CPU reports, hotplug) is kept
+ *   off them.
+ * - realtime_lock_memory locks the process in memory, keeps malloc from
+ *   returning memory to the kernel, and faults in each thread's stack and
+ *   heap up front, so the data path takes no page faults once running.
+ */
+
+/*
+ * Each data path thread also belongs to a priority class: by default
+ * interrupt endpoints and the usbfs reaper are high, ep0 is normal, and bulk
+ * and isochronous endpoints are low, so a saturating bulk copy does not
+ * delay input reports. With realtime_priority, the high class runs at that
+ * SCHED_FIFO priority and each class below it one priority lower. Under
+ * SCHED_OTHER the classes are not applied: renicing the bulk threads made
+ * interrupt latency worse, not better. --ep_priority moves single endpoints
+ * to another class.
+ */
+
+enum priority_class {
+	PRIORITY_LOW,
+	PRIORITY_NORMAL,
+	PRIORITY_HIGH,
+};
+
+#define REALTIME_STACK_SIZE	(512 * 1024)	// per thread, locked in full
+#define REALTIME_STACK_PREFAULT	(64 * 1024)
+#define REALTIME_HEAP_PREFAULT	(1024 * 1024)
+
+extern int realtime_priority;
+extern bool realtime_cpus_set;
+extern cpu_set_t realtime_cpus;
+extern bool realtime_lock_memory;
+extern std::map<uint8_t, int> ep_priorities;	// overrides by endpoint address
+
+// Call from main() before starting any thread. Returns 0 on success.
+int realtime_setup();
+// Call at the start of each thread on the data path.
+void realtime_thread(int priority);
+
+int ep_priority(uint8_t bEndpointAddress, uint8_t bmAttributes);
+// Parses `<address>:<low|normal|high>`, address in hex, into ep_priorities.
+bool ep_priority_parse(const char *spec);
+const char *priority_class_name(int priority);
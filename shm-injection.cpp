@@ -0,0 +1,339 @@
+#include <algorithm>
+#include <errno.h>
+#include <mutex>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <vector>
+
+#include "misc.h"
+#include "rcu.h"
+#include "shm-injection.h"
+#include "stats.h"
+#include "usb-proxy-shm.h"
+
+std::atomic<int> shm_injection_rings(0);
+
+// The proxy's own copy of the geometry: the header is shared with the
+// producer, so nothing in it is trusted for addressing.
+struct shm_ring {
+	struct usb_proxy_shm_ring	*ring;
+	size_t				size;
+	uint32_t			slot_count;
+	uint32_t			slot_size;
+};
+
+struct shm_ring_list {
+	std::vector<struct shm_ring *>	rings;
+};
+
+struct shm_client {
+	int			fd;		// -1 once the producer has gone
+	std::string		request;
+	struct shm_ring		*ring;
+	uint8_t			endpoint;
+	uint64_t		closed_us;
+};
+
+// By endpoint, indexed like proxy_stats.eps.
+static std::atomic<struct shm_ring_list *> ring_lists[32];
+static std::mutex lists_mutex;
+
+static int shm_fd = -1;
+static std::string shm_path;
+static std::atomic<bool> shm_running(false);
+static pthread_t shm_thread;
+
+static int endpoint_slot(uint8_t address) {
+	return (address & 0x0f) | ((address & 0x80) >> 3);
+}
+
+/*----------------------------------------------------------------------*/
+
+struct usb_raw_transfer_io *shm_injection_pop_slow(uint8_t ep_address, int ep_num) {
+	static thread_local size_t next = 0;
+	rcu_read_guard guard;
+	struct shm_ring_list *list = ring_lists[endpoint_slot(ep_address)].load();
+	if (!list || list->rings.empty())
+		return NULL;
+
+	// Round robin, so that one busy producer doesn't shut out the others.
+	for (size_t i = 0; i < list->rings.size(); i++) {
+		struct shm_ring *entry = list->rings[(next + i) % list->rings.size()];
+		struct usb_proxy_shm_ring *ring = entry->ring;
+		uint64_t tail = ring->tail;
+		if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail)
+			continue;
+
+		const uint8_t *slot = (const uint8_t *)(ring + 1) +
+			(tail & (entry->slot_count - 1)) * entry->slot_size;
+		uint32_t length;
+		memcpy(&length, slot, sizeof(length));
+		length = std::min(length, entry->slot_size - (uint32_t)sizeof(length));
+
+		struct usb_raw_transfer_io *io = usb_raw_transfer_alloc(std::max(length, 1u));
+		memcpy(io->data, slot + sizeof(length), length);
+		io->inner.ep = ep_num;
+		io->inner.flags = 0;
+		io->inner.length = length;
+		__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+		next = (next + i + 1) % list->rings.size();
+		return io;
+	}
+	return NULL;
+}
+
+/*----------------------------------------------------------------------*/
+
+static void publish(uint8_t endpoint, struct shm_ring *add, struct shm_ring *remove) {
+	std::lock_guard<std::mutex> lock(lists_mutex);
+	std::atomic<struct shm_ring_list *> &slot = ring_lists[endpoint_slot(endpoint)];
+	struct shm_ring_list *list = new shm_ring_list();
+	struct shm_ring_list *old_list = slot.load();
+	if (old_list)
+		list->rings = old_list->rings;
+	if (add) {
+		list->rings.push_back(add);
+		shm_injection_rings++;
+	}
+	if (remove) {
+		list->rings.erase(std::remove(list->rings.begin(), list->rings.end(), remove),
+			list->rings.end());
+		shm_injection_rings--;
+	}
+	slot.store(list);
+
+	rcu_retire([old_list, remove]() {
+		delete old_list;
+		if (remove) {
+			munmap(remove->ring, remove->size);
+			delete remove;
+		}
+	});
+}
+
+static bool endpoint_exists(uint8_t address) {
+	for (int i = 0; i < host_device_desc.device.bNumConfigurations; i++) {
+		const struct raw_gadget_config *config = &host_device_desc.configs[i];
+		for (int j = 0; j < config->config.bNumInterfaces; j++) {
+			const struct raw_gadget_interface *iface = &config->interfaces[j];
+			for (int k = 0; k < iface->num_altsettings; k++) {
+				const struct raw_gadget_altsetting *alt = &iface->altsettings[k];
+				for (int l = 0; l < alt->interface.bNumEndpoints; l++) {
+					if (alt->endpoints[l].endpoint.bEndpointAddress == address)
+						return true;
+				}
+			}
+		}
+	}
+	return false;
+}
+
+static struct shm_ring *create_ring(uint8_t endpoint, uint32_t max_length, int *memfd) {
+	uint32_t slot_size = (sizeof(uint32_t) + max_length + 7) & ~7u;
+	uint32_t slot_count = SHM_SLOTS;
+	while (slot_count > 16 && usb_proxy_shm_size(slot_count, slot_size) > SHM_MAX_BYTES)
+		slot_count /= 2;
+	size_t size = usb_proxy_shm_size(slot_count, slot_size);
+
+	*memfd = memfd_create("usb-proxy-shm", MFD_CLOEXEC);
+	if (*memfd < 0) {
+		perror("memfd_create()");
+		return NULL;
+	}
+	void *mapped = MAP_FAILED;
+	if (ftruncate(*memfd, size) == 0)
+		mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *memfd, 0);
+	if (mapped == MAP_FAILED) {
+		perror("mmap() shared memory ring");
+		close(*memfd);
+		return NULL;
+	}
+
+	struct shm_ring *entry = new shm_ring();
+	entry->ring = (struct usb_proxy_shm_ring *)mapped;
+	entry->size = size;
+	entry->slot_count = slot_count;
+	entry->slot_size = slot_size;
+	entry->ring->magic = USB_PROXY_SHM_MAGIC;
+	entry->ring->version = USB_PROXY_SHM_VERSION;
+	entry->ring->slot_count = slot_count;
+	entry->ring->slot_size = slot_size;
+	entry->ring->endpoint = endpoint;
+	return entry;
+}
+
+static void reply(int fd, const std::string &text, int memfd) {
+	struct iovec iov = { (void *)text.data(), text.size() };
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	union {
+		struct cmsghdr	header;
+		char		buffer[CMSG_SPACE(sizeof(int))];
+	} control;
+	if (memfd >= 0) {
+		msg.msg_control = control.buffer;
+		msg.msg_controllen = sizeof(control.buffer);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &memfd, sizeof(memfd));
+	}
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0)
+		perror("sendmsg() shared memory socket");
+}
+
+// Handles the request line of a new connection. Returns false to drop it.
+static bool handle_request(struct shm_client &client) {
+	unsigned int endpoint, max_length = 0;
+	int fields = sscanf(client.request.c_str(), "%x %u", &endpoint, &max_length);
+	if (fields < 1 || endpoint > 0xff || (endpoint & 0x0f) == 0 || !endpoint_exists(endpoint)) {
+		reply(client.fd, "error: no such endpoint\n", -1);
+		return false;
+	}
+	if (max_length == 0)
+		max_length = SHM_DEFAULT_LENGTH;
+	if (max_length > USB_RAW_TRANSFER_MAX) {
+		reply(client.fd, "error: packets can be at most " +
+			std::to_string(USB_RAW_TRANSFER_MAX) + " bytes\n", -1);
+		return false;
+	}
+
+	int memfd;
+	client.ring = create_ring(endpoint, max_length, &memfd);
+	if (!client.ring) {
+		reply(client.fd, "error: can't create ring\n", -1);
+		return false;
+	}
+	client.endpoint = endpoint;
+	reply(client.fd, "ok\n", memfd);
+	close(memfd);
+	publish(endpoint, client.ring, NULL);
+	printf("Shared memory ring for EP%02x: %u slots of %u bytes\n", endpoint,
+		client.ring->slot_count, client.ring->slot_size);
+	return true;
+}
+
+// Reads from a client. Returns false once it has disconnected.
+static bool read_client(struct shm_client &client) {
+	char chunk[128];
+	ssize_t n = read(client.fd, chunk, sizeof(chunk));
+	if (n < 0 && errno == EINTR)
+		return true;
+	if (n <= 0)
+		return false;
+	if (client.ring)
+		return true;	// nothing is expected after the request
+
+	client.request.append(chunk, n);
+	if (client.request.find('\n') != std::string::npos)
+		return handle_request(client);
+	return client.request.size() < 64;
+}
+
+static void *shm_socket_loop(void *arg __attribute__((unused))) {
+	printf("Start shared memory socket thread, thread id(%d)\n", gettid());
+	std::vector<struct shm_client> clients;
+
+	while (shm_running) {
+		std::vector<struct pollfd> fds = { { shm_fd, POLLIN, 0 } };
+		for (const struct shm_client &client : clients)
+			fds.push_back({ client.fd, POLLIN, 0 });
+		int rv = poll(fds.data(), fds.size(), 100);
+
+		for (size_t i = 1; rv > 0 && i < fds.size(); i++) {
+			struct shm_client &client = clients[i - 1];
+			if (!fds[i].revents || read_client(client))
+				continue;
+			close(client.fd);
+			client.fd = -1;
+			client.closed_us = stats_now_us();
+		}
+		if (rv > 0 && fds[0].revents) {
+			int fd = accept4(shm_fd, NULL, NULL, SOCK_CLOEXEC);
+			if (fd >= 0)
+				clients.push_back({ fd, "", NULL, 0, 0 });
+		}
+
+		// A ring outlives its producer until it is drained.
+		uint64_t now = stats_now_us();
+		for (auto it = clients.begin(); it != clients.end();) {
+			if (it->fd >= 0) {
+				it++;
+				continue;
+			}
+			struct shm_ring *ring = it->ring;
+			if (ring && __atomic_load_n(&ring->ring->head, __ATOMIC_ACQUIRE) !=
+			    __atomic_load_n(&ring->ring->tail, __ATOMIC_ACQUIRE) &&
+			    now - it->closed_us < SHM_DRAIN_TIMEOUT_US) {
+				it++;
+				continue;
+			}
+			if (ring)
+				publish(it->endpoint, NULL, ring);
+			it = clients.erase(it);
+		}
+		rcu_reclaim();
+	}
+
+	for (struct shm_client &client : clients) {
+		if (client.fd >= 0)
+			close(client.fd);
+		if (client.ring)
+			publish(client.endpoint, NULL, client.ring);
+	}
+	rcu_reclaim();
+
+	printf("End shared memory socket thread, thread id(%d)\n", gettid());
+	return NULL;
+}
+
+int shm_injection_start(const std::string &path) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Shared memory socket path too long: %s\n", path.c_str());
+		return -1;
+	}
+	strcpy(addr.sun_path, path.c_str());
+
+	shm_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (shm_fd < 0) {
+		perror("socket() shared memory socket");
+		return -1;
+	}
+
+	unlink(path.c_str());
+	if (bind(shm_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(shm_fd, 16) < 0) {
+		perror("bind() shared memory socket");
+		close(shm_fd);
+		shm_fd = -1;
+		return -1;
+	}
+
+	shm_path = path;
+	shm_running = true;
+	pthread_create(&shm_thread, 0, shm_socket_loop, nullptr);
+	printf("Shared memory socket listening on %s\n", path.c_str());
+	return 0;
+}
+
+void shm_injection_stop() {
+	if (shm_fd < 0)
+		return;
+
+	shm_running = false;
+	if (pthread_join(shm_thread, NULL))
+		fprintf(stderr, "Error join shm_thread\n");
+	close(shm_fd);
+	unlink(shm_path.c_str());
+	shm_fd = -1;
+}
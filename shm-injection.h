@@ -0,0 +1,33 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+
+#include "host-raw-gadget.h"
+
+/*
+ * Injection through shared-memory rings, see usb-proxy-shm.h for the
+ * producer side. A thread serves the socket, creating a ring per
+ * connection. The rings of each endpoint are published with RCU, and the
+ * endpoint's write loop takes packets from them with shm_injection_pop(),
+ * which costs one relaxed load while no ring is open.
+ */
+
+#define SHM_DEFAULT_LENGTH	1020		// packet bytes per slot by default
+#define SHM_SLOTS		1024
+#define SHM_MAX_BYTES		(16 * 1024 * 1024)	// per ring, fewer slots above
+#define SHM_DRAIN_TIMEOUT_US	(1000 * 1000)	// for a ring whose producer left
+
+extern std::atomic<int> shm_injection_rings;
+
+int shm_injection_start(const std::string &path);
+void shm_injection_stop();
+
+struct usb_raw_transfer_io *shm_injection_pop_slow(uint8_t ep_address, int ep_num);
+
+// Takes the next packet pushed for the endpoint, or returns NULL.
+static inline struct usb_raw_transfer_io *shm_injection_pop(uint8_t ep_address, int ep_num) {
+	if (shm_injection_rings.load(std::memory_order_relaxed) == 0)
+		return NULL;
+	return shm_injection_pop_slow(ep_address, ep_num);
+}
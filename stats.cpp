@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include "stats.h"
+
+struct proxy_stats proxy_stats;
+
+void stats_device_attached() {
+	proxy_stats.first_packet_us.store(0, std::memory_order_relaxed);
+	proxy_stats.device_attached_us.store(stats_now_us(), std::memory_order_release);
+}
+
+void stats_first_packet_slow() {
+	uint64_t attached = proxy_stats.device_attached_us.load(std::memory_order_acquire);
+	if (attached == 0)
+		return;
+
+	uint64_t elapsed = stats_now_us() - attached;
+	uint64_t expected = 0;
+	if (elapsed == 0)
+		elapsed = 1;
+	if (proxy_stats.first_packet_us.compare_exchange_strong(expected, elapsed, std::memory_order_relaxed))
+		printf("First packet forwarded %.1f ms after device attach\n", elapsed / 1000.0);
+}
+
+void stats_ep_activate(uint8_t bEndpointAddress, uint8_t bmAttributes) {
+	struct ep_stats *stats = ep_stats_get(bEndpointAddress);
+	stats->bEndpointAddress.store(bEndpointAddress, std::memory_order_relaxed);
+	stats->bmAttributes.store(bmAttributes, std::memory_order_relaxed);
+	stats->queue_depth.store(0, std::memory_order_relaxed);
+	stats->active.store(true, std::memory_order_release);
+}
+
+void stats_ep_deactivate(uint8_t bEndpointAddress) {
+	struct ep_stats *stats = ep_stats_get(bEndpointAddress);
+	stats->active.store(false, std::memory_order_release);
+	stats->queue_depth.store(0, std::memory_order_relaxed);
+}
+
+void stats_queue_push(struct ep_stats *stats) {
+	int32_t depth = stats->queue_depth.fetch_add(1, std::memory_order_relaxed) + 1;
+	if (depth > stats->queue_max.load(std::memory_order_relaxed))
+		stats->queue_max.store(depth, std::memory_order_relaxed);
+	stats->enqueued.fetch_add(1, std::memory_order_relaxed);
+}
+
+void stats_queue_pop(struct ep_stats *stats) {
+	stats->queue_depth.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void stats_ep_snapshot(int slot, struct ep_stats_snapshot *snapshot) {
+	struct ep_stats *stats = &proxy_stats.eps[slot];
+	snapshot->active = stats->active.load(std::memory_order_acquire);
+	snapshot->bEndpointAddress = stats->bEndpointAddress.load(std::memory_order_relaxed);
+	snapshot->bmAttributes = stats->bmAttributes.load(std::memory_order_relaxed);
+	snapshot->enqueued = stats->enqueued.load(std::memory_order_relaxed);
+	snapshot->forwarded = stats->forwarded.load(std::memory_order_relaxed);
+	snapshot->bytes = stats->bytes.load(std::memory_order_relaxed);
+	snapshot->injected = stats->injected.load(std::memory_order_relaxed);
+	snapshot->errors = stats->errors.load(std::memory_order_relaxed);
+	snapshot->queue_depth = stats->queue_depth.load(std::memory_order_relaxed);
+	snapshot->queue_max = stats->queue_max.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+
+/*
+ * Live counters shared between the data path and the control socket.
+ *
+ * Every counter is a relaxed atomic that is only ever incremented (or, for
+ * queue depth, adjusted) by the endpoint threads. Readers take a snapshot by
+ * loading each field, so neither side ever takes a lock.
+ */
+
+#define EP_STATS_SLOTS	32
+
+struct alignas(64) ep_stats {
+	std::atomic<bool>	active;
+	std::atomic<uint8_t>	bEndpointAddress;
+	std::atomic<uint8_t>	bmAttributes;
+	std::atomic<uint64_t>	enqueued;
+	std::atomic<uint64_t>	forwarded;
+	std::atomic<uint64_t>	bytes;
+	std::atomic<uint64_t>	injected;
+	std::atomic<uint64_t>	errors;
+	std::atomic<int32_t>	queue_depth;
+	std::atomic<int32_t>	queue_max;
+};
+
+struct proxy_stats {
+	std::atomic<uint64_t>	control_requests;
+	std::atomic<uint64_t>	control_stalls;
+	std::atomic<uint64_t>	control_ignored;
+	std::atomic<uint64_t>	control_injected;
+	std::atomic<uint64_t>	control_cache_hits;
+	std::atomic<uint64_t>	control_cache_misses;
+	std::atomic<uint64_t>	host_configured_us;	// from raw-gadget run to SET_CONFIGURATION
+	std::atomic<uint64_t>	device_attached_us;	// stats_now_us() when the device was found
+	std::atomic<uint64_t>	first_packet_us;	// from device attach to first forwarded packet
+	std::atomic<uint64_t>	device_reconnects;
+	std::atomic<uint64_t>	device_downtime_us;	// last device-left to reconnected
+	struct ep_stats		eps[EP_STATS_SLOTS];
+};
+
+struct ep_stats_snapshot {
+	bool		active;
+	uint8_t		bEndpointAddress;
+	uint8_t		bmAttributes;
+	uint64_t	enqueued;
+	uint64_t	forwarded;
+	uint64_t	bytes;
+	uint64_t	injected;
+	uint64_t	errors;
+	int32_t		queue_depth;
+	int32_t		queue_max;
+};
+
+extern struct proxy_stats proxy_stats;
+
+static inline struct ep_stats *ep_stats_get(uint8_t bEndpointAddress) {
+	return &proxy_stats.eps[(bEndpointAddress & 0x0f) | ((bEndpointAddress & 0x80) >> 3)];
+}
+
+static inline void stats_inc(std::atomic<uint64_t> &counter, uint64_t value = 1) {
+	counter.fetch_add(value, std::memory_order_relaxed);
+}
+
+static inline uint64_t stats_now_us() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void stats_device_attached();
+void stats_first_packet_slow();
+
+// Called for every forwarded data packet; only the first one after an
+// attach leaves the fast path.
+static inline void stats_first_packet() {
+	if (proxy_stats.first_packet_us.load(std::memory_order_relaxed) == 0)
+		stats_first_packet_slow();
+}
+
+void stats_ep_activate(uint8_t bEndpointAddress, uint8_t bmAttributes);
+void stats_ep_deactivate(uint8_t bEndpointAddress);
+void stats_queue_push(struct ep_stats *stats);
+void stats_queue_pop(struct ep_stats *stats);
+void stats_ep_snapshot(int slot, struct ep_stats_snapshot *snapshot);
@@ -0,0 +1,223 @@
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <vector>
+
+#include "misc.h"
+#include "tap.h"
+#include "usb-proxy-tap.h"
+
+std::atomic<bool> tap_active(false);
+
+static struct usb_proxy_tap_ring *tap_ring = NULL;
+static size_t tap_ring_size;
+static int tap_ring_fd = -1;	// read-only, what subscribers get
+
+static int tap_fd = -1;
+static std::string tap_path;
+static std::atomic<bool> tap_running(false);
+static pthread_t tap_thread;
+
+static uint64_t tap_timestamp() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Claims the next slot and fills it in; the sequence is stored last, so a
+// subscriber never takes a half-written slot for a whole one.
+static void tap_publish(uint8_t address, uint8_t transfer_type, const struct usb_ctrlrequest *ctrl,
+			const char *data, int length) {
+	struct usb_proxy_tap_ring *ring = tap_ring;
+	uint64_t sequence = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+	struct usb_proxy_tap_slot *slot = (struct usb_proxy_tap_slot *)usb_proxy_tap_slot(ring,
+		sequence);
+
+	__atomic_store_n(&slot->sequence, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	uint32_t captured = std::min(std::max(length, 0), TAP_SNAPLEN);
+	slot->timestamp_ns = tap_timestamp();
+	slot->length = std::max(length, 0);
+	slot->captured = captured;
+	slot->endpoint = address;
+	slot->transfer_type = transfer_type;
+	if (ctrl)
+		memcpy(slot->setup, ctrl, sizeof(slot->setup));
+	else
+		memset(slot->setup, 0, sizeof(slot->setup));
+	memcpy(slot + 1, data, captured);
+	__atomic_store_n(&slot->sequence, sequence + 1, __ATOMIC_RELEASE);
+}
+
+void tap_packet(uint8_t bEndpointAddress, uint8_t transfer_type, const char *data, int length) {
+	tap_publish(bEndpointAddress, transfer_type, NULL, data, length);
+}
+
+void tap_control(const struct usb_ctrlrequest *ctrl, const char *data, int length) {
+	tap_publish(0x00, USB_ENDPOINT_XFER_CONTROL, ctrl, data, length);
+}
+
+/*----------------------------------------------------------------------*/
+
+static bool create_ring() {
+	uint32_t slot_size = (sizeof(struct usb_proxy_tap_slot) + TAP_SNAPLEN + 63) & ~63u;
+	tap_ring_size = usb_proxy_tap_size(TAP_SLOTS, slot_size);
+
+	int memfd = memfd_create("usb-proxy-tap", MFD_CLOEXEC);
+	if (memfd < 0) {
+		perror("memfd_create()");
+		return false;
+	}
+	void *mapped = MAP_FAILED;
+	if (ftruncate(memfd, tap_ring_size) == 0)
+		mapped = mmap(NULL, tap_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (mapped == MAP_FAILED) {
+		perror("mmap() tap ring");
+		close(memfd);
+		return false;
+	}
+
+	// Reopening it read-only keeps subscribers from mapping it writable.
+	std::string self = "/proc/self/fd/" + std::to_string(memfd);
+	tap_ring_fd = open(self.c_str(), O_RDONLY | O_CLOEXEC);
+	close(memfd);
+	if (tap_ring_fd < 0) {
+		perror("open() tap ring read-only");
+		munmap(mapped, tap_ring_size);
+		return false;
+	}
+
+	tap_ring = (struct usb_proxy_tap_ring *)mapped;
+	tap_ring->magic = USB_PROXY_TAP_MAGIC;
+	tap_ring->version = USB_PROXY_TAP_VERSION;
+	tap_ring->slot_count = TAP_SLOTS;
+	tap_ring->slot_size = slot_size;
+	return true;
+}
+
+static bool subscribe(int fd) {
+	static const char ok[] = "ok\n";
+	struct iovec iov = { (void *)ok, sizeof(ok) - 1 };
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	union {
+		struct cmsghdr	header;
+		char		buffer[CMSG_SPACE(sizeof(int))];
+	} control;
+	msg.msg_control = control.buffer;
+	msg.msg_controllen = sizeof(control.buffer);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &tap_ring_fd, sizeof(tap_ring_fd));
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0) {
+		perror("sendmsg() tap socket");
+		return false;
+	}
+	return true;
+}
+
+static void *tap_socket_loop(void *arg __attribute__((unused))) {
+	printf("Start tap socket thread, thread id(%d)\n", gettid());
+	std::vector<int> subscribers;
+
+	while (tap_running) {
+		std::vector<struct pollfd> fds = { { tap_fd, POLLIN, 0 } };
+		for (int fd : subscribers)
+			fds.push_back({ fd, POLLIN, 0 });
+		int rv = poll(fds.data(), fds.size(), 100);
+		if (rv <= 0)
+			continue;
+
+		// Subscribers have nothing to say; anything readable is a hangup.
+		for (size_t i = 1; i < fds.size(); i++) {
+			if (!fds[i].revents)
+				continue;
+			char chunk[64];
+			ssize_t n = read(fds[i].fd, chunk, sizeof(chunk));
+			if (n > 0 || (n < 0 && errno == EINTR))
+				continue;
+			close(fds[i].fd);
+			subscribers.erase(std::find(subscribers.begin(), subscribers.end(),
+				fds[i].fd));
+			printf("Tap subscriber left, %zu left\n", subscribers.size());
+		}
+		if (fds[0].revents) {
+			int fd = accept4(tap_fd, NULL, NULL, SOCK_CLOEXEC);
+			if (fd >= 0 && subscribe(fd)) {
+				subscribers.push_back(fd);
+				printf("Tap subscriber joined, %zu now\n", subscribers.size());
+			}
+			else if (fd >= 0)
+				close(fd);
+		}
+		tap_active = !subscribers.empty();
+	}
+
+	tap_active = false;
+	for (int fd : subscribers)
+		close(fd);
+
+	printf("End tap socket thread, thread id(%d)\n", gettid());
+	return NULL;
+}
+
+int tap_start(const std::string &path) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Tap socket path too long: %s\n", path.c_str());
+		return -1;
+	}
+	strcpy(addr.sun_path, path.c_str());
+
+	if (!create_ring())
+		return -1;
+
+	tap_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (tap_fd < 0) {
+		perror("socket() tap socket");
+		return -1;
+	}
+
+	unlink(path.c_str());
+	if (bind(tap_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(tap_fd, 16) < 0) {
+		perror("bind() tap socket");
+		close(tap_fd);
+		tap_fd = -1;
+		return -1;
+	}
+
+	tap_path = path;
+	tap_running = true;
+	pthread_create(&tap_thread, 0, tap_socket_loop, nullptr);
+	printf("Tap socket listening on %s\n", path.c_str());
+	return 0;
+}
+
+// Call once the endpoint threads have stopped, the ring goes with it.
+void tap_stop() {
+	if (tap_fd < 0)
+		return;
+
+	tap_running = false;
+	if (pthread_join(tap_thread, NULL))
+		fprintf(stderr, "Error join tap_thread\n");
+	close(tap_fd);
+	unlink(tap_path.c_str());
+	tap_fd = -1;
+
+	close(tap_ring_fd);
+	tap_ring_fd = -1;
+	munmap(tap_ring, tap_ring_size);
+	tap_ring = NULL;
+}
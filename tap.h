@@ -0,0 +1,23 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <linux/usb/ch9.h>
+
+/*
+ * Live traffic tap, see usb-proxy-tap.h for the subscriber side. A thread
+ * serves the socket and hands every subscriber the same ring; the endpoint
+ * threads publish into it while tap_active, each packet once, without ever
+ * waiting for a subscriber.
+ */
+
+#define TAP_SNAPLEN	1024		// payload bytes kept per packet
+#define TAP_SLOTS	4096
+
+extern std::atomic<bool> tap_active;
+
+int tap_start(const std::string &path);
+void tap_stop();
+
+void tap_packet(uint8_t bEndpointAddress, uint8_t transfer_type, const char *data, int length);
+void tap_control(const struct usb_ctrlrequest *ctrl, const char *data, int length);
@@ -0,0 +1,64 @@
+#!/bin/sh
+# Feeds usb-proxy-replay rule files that are valid JSON but not valid rules.
+# Each has to be rejected with an error, never crash the rule compiler.
+#
+#   $ make check
+
+REPLAY=${REPLAY:-./usb-proxy-replay}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+failed=0
+
+check() {
+	name=$1
+	expected=$2
+	cat > "$dir/rules.json"
+	output=$("$REPLAY" --injection_file="$dir/rules.json" --iterations=1 /dev/null 2>&1)
+	rc=$?
+	if [ $rc -ne "$expected" ]; then
+		echo "FAIL $name: exit status $rc, expected $expected"
+		echo "$output" | sed 's/^/    /'
+		failed=1
+	else
+		echo "ok   $name"
+	fi
+}
+
+check "valid rules" 0 <<'JSON'
+{"int": [{"enable": true, "ep_address": 81, "content_pattern": ["\\x01"], "replacement": "\\x02"}]}
+JSON
+check "top level array" 1 <<'JSON'
+[1, 2]
+JSON
+check "rule not an object" 1 <<'JSON'
+{"int": [5], "control": {"stall": ["x"]}}
+JSON
+check "gpio not an object" 1 <<'JSON'
+{"int": [{"enable": true, "ep_address": 81, "type": 1, "gpio": 5}]}
+JSON
+check "gpio pins not an array" 1 <<'JSON'
+{"int": [{"enable": true, "ep_address": 81, "type": 1, "gpio": {"on": {"a": 1}}}]}
+JSON
+check "byte replacement not an object" 1 <<'JSON'
+{"int": [{"enable": true, "ep_address": 81, "type": 1, "byte_replacements": [5]}]}
+JSON
+check "field replacement not an object" 1 <<'JSON'
+{"int": [{"enable": true, "ep_address": 81, "type": 1, "field_replacements": [[1]]}]}
+JSON
+check "number above INT_MAX" 1 <<'JSON'
+{"control": {"stall": [{"enable": true, "bRequest": 99999999999}]}}
+JSON
+check "number above UINT_MAX" 1 <<'JSON'
+{"int": [{"enable": true, "ep_address": 99999999999999999999}]}
+JSON
+check "negative number" 1 <<'JSON'
+{"int": [{"enable": true, "ep_address": -81}]}
+JSON
+check "fractional number" 1 <<'JSON'
+{"control": {"modify": [{"enable": true, "wValue": 1.5}]}}
+JSON
+check "control not an object" 1 <<'JSON'
+{"control": [1]}
+JSON
+
+exit $failed
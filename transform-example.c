@@ -0,0 +1,57 @@
+/*
+ * Example transform: with the argument `<index>:<mask>`, both in hex, it
+ * flips the bits of mask in byte index of every packet long enough to have
+ * it. Without an argument it passes packets through unchanged, which is
+ * what usb-proxy-bench uses to measure the cost of a transform.
+ *
+ *   $ make transform-example.so
+ *   $ ./usb-proxy --transform=81:./transform-example.so:0:03 ...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "usb-proxy-transform.h"
+
+struct flip {
+	unsigned int	index;
+	unsigned int	mask;
+};
+
+static int flip_open(const struct usb_proxy_endpoint *endpoint, const char *argument,
+			void **state) {
+	struct flip *flip = calloc(1, sizeof(*flip));
+	if (!flip)
+		return -1;
+	if (argument[0] && (sscanf(argument, "%x:%x", &flip->index, &flip->mask) != 2 ||
+	    flip->mask > 0xff)) {
+		fprintf(stderr, "transform-example: EP%02x: expected <index>:<mask>, got %s\n",
+			endpoint->address, argument);
+		free(flip);
+		return -1;
+	}
+	*state = flip;
+	return 0;
+}
+
+static int flip_transform(void *state, const struct usb_proxy_endpoint *endpoint
+			__attribute__((unused)), struct usb_proxy_packet *packet,
+			usb_proxy_emit_fn emit __attribute__((unused)),
+			void *emit_context __attribute__((unused))) {
+	struct flip *flip = state;
+	if (flip->index < packet->length)
+		packet->data[flip->index] ^= flip->mask;
+	return USB_PROXY_KEEP;
+}
+
+static void flip_close(void *state) {
+	free(state);
+}
+
+const struct usb_proxy_transform usb_proxy_transform = {
+	.abi_version =	USB_PROXY_TRANSFORM_ABI_VERSION,
+	.name =		"transform-example",
+	.open =		flip_open,
+	.transform =	flip_transform,
+	.close =	flip_close,
+};
@@ -0,0 +1,135 @@
+#include <algorithm>
+#include <dlfcn.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "transform.h"
+
+std::map<uint8_t, transform_binding> transform_bindings;
+
+bool transform_parse(const char *spec) {
+	unsigned int address;
+	int length = 0;
+	if (sscanf(spec, "%x:%n", &address, &length) != 1 || length == 0 ||
+	    address > 0xff || address & 0x70 || (address & 0x0f) == 0)
+		return false;
+
+	std::string rest = spec + length;
+	size_t colon = rest.find(':');
+	struct transform_binding binding;
+	binding.path = rest.substr(0, colon);
+	if (colon != std::string::npos)
+		binding.argument = rest.substr(colon + 1);
+	if (binding.path.empty() || transform_bindings.count(address))
+		return false;
+	transform_bindings[address] = binding;
+	return true;
+}
+
+int transforms_load() {
+	for (auto &entry : transform_bindings) {
+		struct transform_binding &binding = entry.second;
+		// dlopen() only searches the library path for names without a
+		// slash, which is rarely what a command line means.
+		std::string path = binding.path;
+		if (path.find('/') == std::string::npos)
+			path = "./" + path;
+
+		binding.handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+		if (!binding.handle) {
+			printf("Can't load transform %s: %s\n", binding.path.c_str(), dlerror());
+			return 1;
+		}
+		binding.ops = (const struct usb_proxy_transform *)
+			dlsym(binding.handle, "usb_proxy_transform");
+		if (!binding.ops || !binding.ops->transform) {
+			printf("Transform %s has no usb_proxy_transform\n", binding.path.c_str());
+			return 1;
+		}
+		if (binding.ops->abi_version != USB_PROXY_TRANSFORM_ABI_VERSION) {
+			printf("Transform %s is built for ABI version %u, not %u\n",
+				binding.path.c_str(), binding.ops->abi_version,
+				USB_PROXY_TRANSFORM_ABI_VERSION);
+			return 1;
+		}
+		printf("Transform %s bound to EP%02x\n",
+			binding.ops->name ? binding.ops->name : binding.path.c_str(), entry.first);
+	}
+	return 0;
+}
+
+void transforms_unload() {
+	for (auto &entry : transform_bindings) {
+		if (entry.second.handle)
+			dlclose(entry.second.handle);
+		entry.second.handle = NULL;
+		entry.second.ops = NULL;
+	}
+}
+
+struct transform_endpoint *transform_open(const struct usb_endpoint_descriptor *ep) {
+	auto it = transform_bindings.find(ep->bEndpointAddress);
+	if (it == transform_bindings.end() || !it->second.ops)
+		return NULL;
+
+	struct transform_endpoint *endpoint = new transform_endpoint();
+	endpoint->ops = it->second.ops;
+	endpoint->info.address = ep->bEndpointAddress;
+	endpoint->info.attributes = ep->bmAttributes;
+	endpoint->info.max_packet_size = usb_endpoint_maxp(ep);
+	endpoint->info.interval = ep->bInterval;
+	endpoint->state = NULL;
+	if (endpoint->ops->open &&
+	    endpoint->ops->open(&endpoint->info, it->second.argument.c_str(), &endpoint->state)) {
+		printf("Transform %s refused EP%02x\n", it->second.path.c_str(), ep->bEndpointAddress);
+		delete endpoint;
+		return NULL;
+	}
+	return endpoint;
+}
+
+void transform_close(struct transform_endpoint *endpoint) {
+	if (!endpoint)
+		return;
+	if (endpoint->ops->close)
+		endpoint->ops->close(endpoint->state);
+	delete endpoint;
+}
+
+struct emit_context {
+	struct usb_raw_transfer_io			*io;
+	std::vector<struct usb_raw_transfer_io *>	*emitted;
+};
+
+static int emit(void *context, const uint8_t *data, uint32_t length) {
+	struct emit_context *emit_context = (struct emit_context *)context;
+	if (length > USB_RAW_TRANSFER_MAX)
+		return -1;
+
+	struct usb_raw_transfer_io *io =
+		usb_raw_transfer_alloc(std::max(length, emit_context->io->capacity));
+	memcpy(io->data, data, length);
+	io->inner.ep = emit_context->io->inner.ep;
+	io->inner.flags = 0;
+	io->inner.length = length;
+	emit_context->emitted->push_back(io);
+	return 0;
+}
+
+int transform_apply(struct transform_endpoint *endpoint, struct usb_raw_transfer_io *io,
+			std::vector<struct usb_raw_transfer_io *> &emitted) {
+	struct usb_proxy_packet packet = { (uint8_t *)io->data, io->inner.length, io->capacity };
+	struct emit_context emit_context = { io, &emitted };
+	size_t first = emitted.size();
+
+	int verdict = endpoint->ops->transform(endpoint->state, &endpoint->info, &packet,
+		emit, &emit_context);
+	io->inner.length = std::min(packet.length, io->capacity);
+
+	if (verdict != USB_PROXY_EMIT) {
+		for (size_t i = first; i < emitted.size(); i++)
+			usb_raw_transfer_free(emitted[i]);
+		emitted.resize(first);
+	}
+	return verdict;
+}
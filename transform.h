@@ -0,0 +1,49 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "host-raw-gadget.h"
+#include "usb-proxy-transform.h"
+
+/*
+ * Native packet transforms, see usb-proxy-transform.h for the ABI. Each
+ * --transform binds a library to one endpoint address; the library is
+ * loaded once at startup by transforms_load(), and opened for the endpoint
+ * each time process_eps() activates it.
+ */
+
+struct transform_binding {
+	std::string				path;
+	std::string				argument;
+	void					*handle = NULL;
+	const struct usb_proxy_transform	*ops = NULL;
+};
+
+// An active endpoint's transform, kept in its thread_info.
+struct transform_endpoint {
+	const struct usb_proxy_transform	*ops;
+	struct usb_proxy_endpoint		info;
+	void					*state;
+};
+
+extern std::map<uint8_t, transform_binding> transform_bindings;
+
+// Parses `<address>:<library>[:<argument>]`, address in hex.
+bool transform_parse(const char *spec);
+// Returns 0 once every bound library is loaded.
+int transforms_load();
+void transforms_unload();
+
+// Returns NULL if no transform is bound to the endpoint or open() refused it.
+struct transform_endpoint *transform_open(const struct usb_endpoint_descriptor *ep);
+void transform_close(struct transform_endpoint *endpoint);
+
+/*
+ * Runs the transform on io, resizing it to the length the transform left.
+ * Returns the verdict; packets emitted with USB_PROXY_EMIT are appended to
+ * emitted, and are discarded with any other verdict.
+ */
+int transform_apply(struct transform_endpoint *endpoint, struct usb_raw_transfer_io *io,
+			std::vector<struct usb_raw_transfer_io *> &emitted);
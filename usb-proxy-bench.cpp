@@ -0,0 +1,545 @@
+#include <algorithm>
+#include <thread>
+#include <fcntl.h>
+
+#include "backend-mock.h"
+#include "device-replay.h"
+#include "capture.h"
+#include "control-cache.h"
+#include "stats.h"
+#include "proxy.h"
+#include "injection.h"
+#include "misc.h"
+#include "realtime.h"
+#include "shm-injection.h"
+#include "tap.h"
+#include "transform.h"
+#include "usb-proxy-shm.h"
+#include "usb-proxy-tap.h"
+
+/*
+ * Runs the proxy core between a MockHost and a MockDevice, so the data path
+ * can be measured without a UDC, a device or a Raspberry Pi.
+ */
+
+void usage() {
+	printf("Usage:\n");
+	printf("\t-h/--help: print this help message\n");
+	printf("\t-v/--verbose: increase verbosity, and keep the proxy log output\n");
+	printf("\t--duration: seconds to measure for, 5 by default\n");
+	printf("\t--endpoint: add an endpoint,\n");
+	printf("\t  `<int|bulk>:<address>:<wMaxPacketSize>[:<rate>[:<bInterval>]]`\n");
+	printf("\t--injection_file: enable injection with the rules in this file\n");
+	printf("\t--json: print the results as JSON\n");
+	printf("\t--capture_file: capture all proxied packets to this file\n");
+	printf("\t--replay: emulate the device recorded in this capture file, with its IN traffic\n");
+	printf("\t--replay_speed: timing factor for the replayed traffic, 0 (default) for as fast\n");
+	printf("\t  as possible\n");
+	printf("\t--control_latency_us: emulated device round trip for each control request\n");
+	printf("\t--no_control_cache: forward every descriptor request to the device\n");
+	printf("\t--bulk_transfer_size: bytes per bulk transfer, 16384 by default, up to 65536\n");
+	printf("\t--rt_priority: run ep0 and the endpoint threads as SCHED_FIFO at this priority\n");
+	printf("\t--rt_cpus: run ep0 and the endpoint threads on these CPUs\n");
+	printf("\t--lock_memory: lock all memory and prefault stacks and buffers\n");
+	printf("\t--load: run this many busy threads next to the proxy while measuring\n");
+	printf("\t--ep_priority: put an endpoint in another priority class, `<address>:<low|normal|high>`\n");
+	printf("\t--poll_interval: have the host poll an interrupt endpoint this often,\n");
+	printf("\t  `<address>:<microseconds>`\n");
+	printf("\t--host_polling: deliver interrupt IN packets only at the host's polling interval\n");
+	printf("\t--transform: run packets of an endpoint through a transform library,\n");
+	printf("\t  `<address>:<library>[:<argument>]`\n");
+	printf("\t--shm_inject: push timestamped packets into an endpoint through a shared-memory\n");
+	printf("\t  ring from another thread, `<address>:<rate>`\n");
+	printf("\t--tap: follow the traffic tap with this many subscriber threads, each taking\n");
+	printf("\t  the given time per packet, `<subscribers>[:<microseconds>]`\n\n");
+	printf("* `address` is in hex, `rate` is packets per second from the source (0 for\n");
+	printf("  as fast as possible).\n");
+	printf("* `bInterval` is in high-speed units, 2^(bInterval-1) x 125 us.\n");
+	printf("* Without `endpoint`, a mouse-like int:81:8:1000 plus a bulk:82:512 and\n");
+	printf("  bulk:02:512 pair are emulated.\n");
+	printf("* With `replay`, the IN endpoints of the recording are measured and `endpoint`\n");
+	printf("  is ignored. Replayed packets carry no timestamp, so no latency is reported.\n");
+	printf("* With `shm_inject`, the endpoint's figures cover the device's and the\n");
+	printf("  injected packets together; give it a rate of 1 to see the ring alone.\n\n");
+	exit(1);
+}
+
+bool parse_endpoint(const char *spec, struct mock_endpoint &ep) {
+	char type[8];
+	unsigned int address, max_packet, rate = 0, interval = 0;
+	int fields = sscanf(spec, "%7[a-z]:%x:%u:%u:%u", type, &address, &max_packet, &rate,
+			&interval);
+	if (fields < 3)
+		return false;
+
+	ep = {};
+	if (!strcmp(type, "int")) {
+		ep.bmAttributes = USB_ENDPOINT_XFER_INT;
+		ep.bInterval = fields == 5 ? interval : 1;
+		if (ep.bInterval < 1 || ep.bInterval > 16)
+			return false;
+	}
+	else if (!strcmp(type, "bulk"))
+		ep.bmAttributes = USB_ENDPOINT_XFER_BULK;
+	else
+		return false;
+
+	if (address & 0x70 || (address & 0x0f) == 0 || max_packet == 0 || max_packet > 1024)
+		return false;
+
+	ep.bEndpointAddress = address;
+	ep.wMaxPacketSize = max_packet;
+	ep.rate = rate;
+	return true;
+}
+
+Json::Value endpoint_result(const struct mock_endpoint &ep, struct mock_ep_counters *counters,
+			double seconds) {
+	std::vector<uint64_t> &samples = counters->latencies_ns;
+	std::sort(samples.begin(), samples.end());
+	auto percentile = [&](double p) -> double {
+		if (samples.empty())
+			return 0;
+		size_t index = std::min(samples.size() - 1, (size_t)(p * samples.size()));
+		return samples[index] / 1000.0;
+	};
+
+	char name[8];
+	snprintf(name, sizeof(name), "%02x", ep.bEndpointAddress);
+
+	Json::Value result;
+	result["endpoint"] = name;
+	result["type"] = (ep.bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) == USB_ENDPOINT_XFER_INT ?
+		"int" : "bulk";
+	result["dir"] = ep.bEndpointAddress & USB_DIR_IN ? "in" : "out";
+	result["packets"] = (Json::UInt64)counters->packets.load();
+	result["packets_per_second"] = counters->packets.load() / seconds;
+	result["mb_per_second"] = counters->bytes.load() / seconds / 1e6;
+	result["latency_us"]["p50"] = percentile(0.50);
+	result["latency_us"]["p99"] = percentile(0.99);
+	result["latency_us"]["p99.9"] = percentile(0.999);
+	result["latency_us"]["max"] = samples.empty() ? 0 : samples.back() / 1000.0;
+	return result;
+}
+
+int main(int argc, char **argv)
+{
+	std::vector<mock_endpoint> endpoints;
+	double duration = 5;
+	bool json = false;
+	std::string capture_file;
+	std::string replay_file;
+	ReplayDevice replay_device;
+	replay_device.traffic = true;
+	replay_device.loop = true;
+	replay_device.speed = 0;
+	unsigned int control_latency_us = 0;
+	int load_threads = 0;
+	bool host_polling = false;
+	unsigned int shm_endpoint = 0, shm_rate = 0;
+	unsigned int tap_subscribers = 0, tap_cost_us = 0;
+
+	int opt, lopt, loidx;
+	const char *optstring = "hv";
+	const struct option long_options[] = {
+		{"help", no_argument, &lopt, 1},
+		{"verbose", no_argument, &lopt, 2},
+		{"duration", required_argument, &lopt, 3},
+		{"endpoint", required_argument, &lopt, 4},
+		{"injection_file", required_argument, &lopt, 5},
+		{"json", no_argument, &lopt, 6},
+		{"capture_file", required_argument, &lopt, 7},
+		{"replay", required_argument, &lopt, 8},
+		{"replay_speed", required_argument, &lopt, 9},
+		{"control_latency_us", required_argument, &lopt, 10},
+		{"no_control_cache", no_argument, &lopt, 11},
+		{"bulk_transfer_size", required_argument, &lopt, 12},
+		{"rt_priority", required_argument, &lopt, 13},
+		{"rt_cpus", required_argument, &lopt, 14},
+		{"lock_memory", no_argument, &lopt, 15},
+		{"load", required_argument, &lopt, 16},
+		{"ep_priority", required_argument, &lopt, 17},
+		{"poll_interval", required_argument, &lopt, 18},
+		{"host_polling", no_argument, &lopt, 19},
+		{"transform", required_argument, &lopt, 20},
+		{"shm_inject", required_argument, &lopt, 21},
+		{"tap", required_argument, &lopt, 22},
+		{0, 0, 0, 0}
+	};
+	while ((opt = getopt_long(argc, argv, optstring, long_options, &loidx)) != -1) {
+		if(opt == 0)
+			opt = lopt;
+		switch (opt) {
+		case 'h':
+			usage();
+			break;
+		case 'v':
+			verbose_level++;
+			break;
+		case 1:
+			usage();
+			break;
+		case 2:
+			verbose_level++;
+			break;
+		case 3:
+			duration = atof(optarg);
+			break;
+		case 4: {
+			struct mock_endpoint ep;
+			if (!parse_endpoint(optarg, ep)) {
+				printf("Invalid endpoint: %s\n", optarg);
+				return 1;
+			}
+			endpoints.push_back(ep);
+			break;
+		}
+		case 5:
+			injection_enabled = true;
+			injection_file = optarg;
+			break;
+		case 6:
+			json = true;
+			break;
+		case 7:
+			capture_file = optarg;
+			break;
+		case 8:
+			replay_file = optarg;
+			break;
+		case 9:
+			replay_device.speed = atof(optarg);
+			break;
+		case 10:
+			control_latency_us = atoi(optarg);
+			break;
+		case 11:
+			control_cache_enabled = false;
+			break;
+		case 12:
+			bulk_transfer_size = atoi(optarg);
+			if (bulk_transfer_size <= 0 || bulk_transfer_size > USB_RAW_TRANSFER_MAX) {
+				printf("Invalid bulk transfer size: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 13:
+			realtime_priority = atoi(optarg);
+			break;
+		case 14:
+			if (!cpu_list_parse(optarg, &realtime_cpus)) {
+				printf("Invalid CPU list: %s\n", optarg);
+				return 1;
+			}
+			realtime_cpus_set = true;
+			break;
+		case 15:
+			realtime_lock_memory = true;
+			break;
+		case 16:
+			load_threads = atoi(optarg);
+			break;
+		case 17:
+			if (!ep_priority_parse(optarg)) {
+				printf("Invalid endpoint priority: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 18:
+			if (!poll_interval_parse(optarg)) {
+				printf("Invalid poll interval: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 19:
+			host_polling = true;
+			break;
+		case 20:
+			if (!transform_parse(optarg)) {
+				printf("Invalid transform: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 21:
+			if (sscanf(optarg, "%x:%u", &shm_endpoint, &shm_rate) != 2 ||
+			    (shm_endpoint & 0x0f) == 0 || shm_endpoint > 0xff) {
+				printf("Invalid shared-memory injection: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 22:
+			if (sscanf(optarg, "%u:%u", &tap_subscribers, &tap_cost_us) < 1 ||
+			    tap_subscribers == 0) {
+				printf("Invalid tap: %s\n", optarg);
+				return 1;
+			}
+			break;
+
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (!replay_file.empty()) {
+		std::string error;
+		if (!replay_device.load(replay_file, error)) {
+			printf("Error loading replay file: %s\n%s\n", replay_file.c_str(), error.c_str());
+			return 1;
+		}
+
+		endpoints.clear();
+		const struct libusb_config_descriptor *config = replay_device.config_descriptor(0);
+		for (int i = 0; config && i < config->bNumInterfaces; i++) {
+			const struct libusb_interface_descriptor *alt = &config->interface[i].altsetting[0];
+			for (int j = 0; j < alt->bNumEndpoints; j++) {
+				const struct libusb_endpoint_descriptor *ep = &alt->endpoint[j];
+				if (ep->bEndpointAddress & USB_DIR_IN)
+					endpoints.push_back({ ep->bEndpointAddress, ep->bmAttributes,
+						ep->wMaxPacketSize, ep->bInterval, 0 });
+			}
+		}
+	}
+	else if (endpoints.empty()) {
+		endpoints.push_back({ 0x81, USB_ENDPOINT_XFER_INT, 8, 1, 1000 });
+		endpoints.push_back({ 0x82, USB_ENDPOINT_XFER_BULK, 512, 0, 0 });
+		endpoints.push_back({ 0x02, USB_ENDPOINT_XFER_BULK, 512, 0, 0 });
+	}
+
+	if (injection_enabled) {
+		std::string error;
+		if (!injection_rules_load(injection_file, error)) {
+			printf("Error parsing injection file: %s\n%s\n", injection_file.c_str(), error.c_str());
+			return 1;
+		}
+	}
+
+	cpu_set_t all_cpus;
+	sched_getaffinity(0, sizeof(all_cpus), &all_cpus);
+	if (realtime_setup())
+		return 1;
+	if (transforms_load())
+		return 1;
+
+	// The proxy logs every packet; keep that out of the measurement's way.
+	fflush(stdout);
+	int saved_stdout = dup(STDOUT_FILENO);
+	if (!verbose_level) {
+		int null_fd = open("/dev/null", O_WRONLY);
+		dup2(null_fd, STDOUT_FILENO);
+		close(null_fd);
+	}
+
+	if (!capture_file.empty() && !capture_start(capture_file))
+		return 1;
+
+	MockDevice mock_device(endpoints);
+	mock_device.control_latency_us = control_latency_us;
+	device_backend = &mock_device;
+	if (!replay_file.empty())
+		device_backend = &replay_device;
+	stats_device_attached();
+	capture_descriptors(device_backend);
+	control_cache_prefetch(device_backend);
+	setup_host_usb_desc();
+
+	MockHost mock_host(endpoints);
+	mock_host.timestamped = replay_file.empty();
+	mock_host.polling = host_polling;
+	host_backend = &mock_host;
+	host_backend->init(USB_SPEED_HIGH, "mock", "mock");
+	host_backend->run();
+
+	std::string shm_path = "/tmp/usb-proxy-bench-shm." + std::to_string(getpid());
+	if (shm_endpoint && shm_injection_start(shm_path))
+		return 1;
+
+	// A producer as an external process would be, timestamping its
+	// packets like the mock device does. Until the host has configured the
+	// device its ring just fills up.
+	std::atomic<bool> shm_stop(false);
+	std::atomic<uint64_t> shm_pushed(0), shm_full(0);
+	std::thread shm_producer;
+	if (shm_endpoint) {
+		int socket_fd;
+		struct usb_proxy_shm_ring *ring = usb_proxy_shm_open(shm_path.c_str(), shm_endpoint,
+			0, &socket_fd);
+		if (!ring) {
+			fprintf(stderr, "Can't open a shared-memory ring for EP%02x\n", shm_endpoint);
+			shm_injection_stop();
+			return 1;
+		}
+		uint16_t length = 8;
+		for (const mock_endpoint &ep : endpoints)
+			if (ep.bEndpointAddress == shm_endpoint)
+				length = std::max<uint16_t>(ep.wMaxPacketSize, 8);
+		shm_producer = std::thread([&shm_stop, &shm_pushed, &shm_full, ring, socket_fd,
+					length, shm_rate]() {
+			std::vector<uint8_t> packet(length);
+			uint64_t period_ns = shm_rate ? 1000000000ull / shm_rate : 0;
+			uint64_t next = mock_now_ns();
+			while (!shm_stop) {
+				if (period_ns) {
+					uint64_t now = mock_now_ns();
+					if (now < next) {
+						usleep(std::min<uint64_t>((next - now) / 1000, 1000));
+						continue;
+					}
+					next += period_ns;
+				}
+				uint64_t timestamp = mock_now_ns();
+				memcpy(packet.data(), &timestamp, sizeof(timestamp));
+				if (usb_proxy_shm_push(ring, packet.data(), packet.size()))
+					shm_full++;
+				else
+					shm_pushed++;
+				if (!period_ns)
+					sched_yield();
+			}
+			munmap(ring, usb_proxy_shm_size(ring->slot_count, ring->slot_size));
+			close(socket_fd);
+		});
+	}
+
+	// Subscribers like a decoder or a dashboard would be, optionally slow.
+	std::string tap_path = "/tmp/usb-proxy-bench-tap." + std::to_string(getpid());
+	if (tap_subscribers && tap_start(tap_path))
+		return 1;
+	std::atomic<bool> tap_recording(false), tap_stop_threads(false);
+	std::vector<struct usb_proxy_tap> taps(tap_subscribers);
+	std::vector<std::atomic<uint64_t>> tap_packets(tap_subscribers), tap_overruns(tap_subscribers);
+	std::vector<std::thread> tap_threads;
+	for (unsigned int i = 0; i < tap_subscribers; i++) {
+		if (usb_proxy_tap_open(tap_path.c_str(), &taps[i])) {
+			fprintf(stderr, "Can't subscribe to the tap\n");
+			tap_stop();
+			return 1;
+		}
+		tap_threads.emplace_back([&, i]() {
+			struct usb_proxy_tap_slot slot;
+			std::vector<uint8_t> payload(TAP_SNAPLEN);
+			while (!tap_stop_threads) {
+				uint64_t overruns = taps[i].overruns;
+				if (!usb_proxy_tap_next(&taps[i], &slot, payload.data(), payload.size())) {
+					usleep(50);
+					continue;
+				}
+				if (tap_recording) {
+					tap_packets[i]++;
+					tap_overruns[i] += taps[i].overruns - overruns;
+				}
+				if (tap_cost_us)
+					usleep(tap_cost_us);
+			}
+		});
+	}
+
+	std::thread ep0_thread(ep0_loop);
+	while (!mock_host.configured())
+		usleep(1000);
+
+	// Background load: each thread keeps a CPU busy and sweeps a buffer
+	// larger than the caches, like a compile or a log flush would. It may
+	// run anywhere, --rt_cpus only keeps the proxy's own threads apart.
+	std::atomic<bool> load_stop(false);
+	std::vector<std::thread> load;
+	for (int i = 0; i < load_threads; i++)
+		load.emplace_back([&load_stop, &all_cpus]() {
+			sched_setaffinity(0, sizeof(all_cpus), &all_cpus);
+			std::vector<char> buffer(16 * 1024 * 1024);
+			while (!load_stop)
+				for (size_t j = 0; j < buffer.size() && !load_stop; j += 64)
+					buffer[j]++;
+		});
+
+	// Let the endpoint threads settle before measuring.
+	usleep(200000);
+	mock_host.recording = true;
+	mock_device.recording = true;
+	tap_recording = true;
+	uint64_t start = mock_now_ns();
+	usleep(duration * 1000000);
+	mock_host.recording = false;
+	mock_device.recording = false;
+	tap_recording = false;
+	double seconds = (mock_now_ns() - start) / 1e9;
+	load_stop = true;
+	for (std::thread &thread : load)
+		thread.join();
+	shm_stop = true;
+	if (shm_producer.joinable())
+		shm_producer.join();
+	tap_stop_threads = true;
+	for (std::thread &thread : tap_threads)
+		thread.join();
+
+	please_stop_ep0 = true;
+	ep0_thread.join();
+	struct raw_gadget_config *config = &host_device_desc.configs[host_device_desc.current_config];
+	for (int i = 0; i < config->config.bNumInterfaces; i++)
+		terminate_eps(host_device_desc.current_config, i, config->interfaces[i].current_altsetting);
+	shm_injection_stop();
+	for (struct usb_proxy_tap &tap : taps)
+		usb_proxy_tap_close(&tap);
+	tap_stop();
+	free_host_usb_desc();
+	transforms_unload();
+	capture_stop();
+
+	fflush(stdout);
+	dup2(saved_stdout, STDOUT_FILENO);
+	close(saved_stdout);
+
+	Json::Value results(Json::arrayValue);
+	for (const mock_endpoint &ep : endpoints) {
+		struct mock_ep_counters *counters = ep.bEndpointAddress & USB_DIR_IN ?
+			&mock_host.in[ep.bEndpointAddress & 0x0f] :
+			&mock_device.out[ep.bEndpointAddress & 0x0f];
+		results.append(endpoint_result(ep, counters, seconds));
+	}
+
+	if (json) {
+		Json::Value root;
+		root["duration"] = seconds;
+		root["injection"] = injection_enabled.load();
+		root["load_threads"] = load_threads;
+		root["host_configured_ms"] = proxy_stats.host_configured_us / 1000.0;
+		root["first_packet_ms"] = proxy_stats.first_packet_us / 1000.0;
+		root["endpoints"] = results;
+		if (shm_endpoint) {
+			root["shm_injection"]["pushed"] = (Json::UInt64)shm_pushed.load();
+			root["shm_injection"]["ring_full"] = (Json::UInt64)shm_full.load();
+		}
+		for (unsigned int i = 0; i < tap_subscribers; i++) {
+			Json::Value subscriber;
+			subscriber["packets"] = (Json::UInt64)tap_packets[i].load();
+			subscriber["overruns"] = (Json::UInt64)tap_overruns[i].load();
+			root["tap_subscribers"].append(subscriber);
+		}
+		Json::StreamWriterBuilder builder;
+		builder["indentation"] = "  ";
+		printf("%s\n", Json::writeString(builder, root).c_str());
+		return 0;
+	}
+
+	printf("%.2f s, injection %s, host configured in %.2f ms, first packet after %.2f ms\n",
+		seconds, injection_enabled ? "on" : "off", proxy_stats.host_configured_us / 1000.0,
+		proxy_stats.first_packet_us / 1000.0);
+	printf("EP   type dir      pkt/s     MB/s   p50 us   p99 us p99.9 us   max us\n");
+	for (const Json::Value &result : results) {
+		printf("%-4s %-4s %-3s %10.0f %8.2f %8.1f %8.1f %8.1f %8.1f\n",
+			result["endpoint"].asCString(), result["type"].asCString(),
+			result["dir"].asCString(), result["packets_per_second"].asDouble(),
+			result["mb_per_second"].asDouble(), result["latency_us"]["p50"].asDouble(),
+			result["latency_us"]["p99"].asDouble(), result["latency_us"]["p99.9"].asDouble(),
+			result["latency_us"]["max"].asDouble());
+	}
+	if (shm_endpoint)
+		printf("Shared-memory ring for EP%02x: %lu packets pushed, %lu times full\n",
+			shm_endpoint, (unsigned long)shm_pushed.load(), (unsigned long)shm_full.load());
+	for (unsigned int i = 0; i < tap_subscribers; i++)
+		printf("Tap subscriber %u: %lu packets, %lu overruns\n", i,
+			(unsigned long)tap_packets[i].load(), (unsigned long)tap_overruns[i].load());
+
+	return 0;
+}
@@ -0,0 +1,520 @@
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/utsname.h>
+
+#include "injection.h"
+#include "proxy.h"
+#include "stats.h"
+#include "gpio.h"
+#include "misc.h"
+
+/*
+ * Microbenchmarks for the per-packet code paths: the injection() overloads,
+ * the hex helpers, the endpoint queue and printData(). Results are printed
+ * as JSON so they can be compared between releases.
+ *
+ * The GPIO functions are provided here instead of by gpio-none.cpp, so the
+ * Raspberry Pi rules can be measured with pins pressed and released.
+ */
+
+static bool gpio_low[64];
+
+int gpio_setup() {
+	return 0;
+}
+
+void gpio_input_pullup(unsigned int pin __attribute__((unused))) {
+}
+
+bool gpio_is_low(unsigned int pin) {
+	return pin < 64 && gpio_low[pin];
+}
+
+/*----------------------------------------------------------------------*/
+
+static double min_time = 0.2;
+static int repetitions = 5;
+static std::string filter;
+static Json::Value results(Json::arrayValue);
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Times `op` in batches until min_time has passed, repeats that, and keeps
+// the median and the best ns/op of the repetitions.
+static void bench(const std::string &name, const std::function<void()> &op) {
+	if (!filter.empty() && name.find(filter) == std::string::npos)
+		return;
+
+	uint64_t batch = 1;
+	for (;;) {
+		uint64_t start = now_ns();
+		for (uint64_t i = 0; i < batch; i++)
+			op();
+		if (now_ns() - start > 10000000 || batch >= (1ull << 30))
+			break;
+		batch *= 2;
+	}
+
+	std::vector<double> ns_per_op;
+	uint64_t iterations = 0;
+	for (int r = 0; r < repetitions; r++) {
+		uint64_t count = 0;
+		uint64_t start = now_ns(), elapsed;
+		do {
+			for (uint64_t i = 0; i < batch; i++)
+				op();
+			count += batch;
+			elapsed = now_ns() - start;
+		} while (elapsed < min_time * 1e9);
+		ns_per_op.push_back((double)elapsed / count);
+		iterations += count;
+	}
+	std::sort(ns_per_op.begin(), ns_per_op.end());
+
+	Json::Value result;
+	result["name"] = name;
+	result["iterations"] = (Json::UInt64)iterations;
+	result["ns_per_op"] = ns_per_op[ns_per_op.size() / 2];
+	result["ns_per_op_min"] = ns_per_op.front();
+	result["ops_per_second"] = 1e9 / ns_per_op[ns_per_op.size() / 2];
+	results.append(result);
+	fprintf(stderr, "%-48s %12.1f ns/op\n", name.c_str(), ns_per_op[ns_per_op.size() / 2]);
+}
+
+// For benchmarks that measure a whole run of N operations across threads.
+static void bench_run(const std::string &name, uint64_t operations,
+			const std::function<void()> &run) {
+	if (!filter.empty() && name.find(filter) == std::string::npos)
+		return;
+
+	std::vector<double> ns_per_op;
+	for (int r = 0; r < repetitions; r++) {
+		uint64_t start = now_ns();
+		run();
+		ns_per_op.push_back((double)(now_ns() - start) / operations);
+	}
+	std::sort(ns_per_op.begin(), ns_per_op.end());
+
+	Json::Value result;
+	result["name"] = name;
+	result["iterations"] = (Json::UInt64)(operations * repetitions);
+	result["ns_per_op"] = ns_per_op[ns_per_op.size() / 2];
+	result["ns_per_op_min"] = ns_per_op.front();
+	result["ops_per_second"] = 1e9 / ns_per_op[ns_per_op.size() / 2];
+	results.append(result);
+	fprintf(stderr, "%-48s %12.1f ns/op\n", name.c_str(), ns_per_op[ns_per_op.size() / 2]);
+}
+
+static bool load_rules(const Json::Value &source) {
+	std::string error;
+	if (!injection_rules_update(source, error)) {
+		fprintf(stderr, "Error compiling benchmark rules: %s\n", error.c_str());
+		return false;
+	}
+	return true;
+}
+
+static bool load_rules_file(const std::string &path) {
+	std::string error;
+	if (!injection_rules_load(path, error)) {
+		fprintf(stderr, "Error parsing injection file: %s\n%s\n", path.c_str(), error.c_str());
+		return false;
+	}
+	return true;
+}
+
+static std::string hex_escape(const std::string &bytes) {
+	std::string output;
+	char buffer[8];
+	for (unsigned char c : bytes) {
+		snprintf(buffer, sizeof(buffer), "\\x%02x", c);
+		output += buffer;
+	}
+	return output;
+}
+
+static Json::Value ep_rule(int ep_address, const std::vector<std::string> &patterns,
+			const std::string &replacement) {
+	Json::Value rule;
+	rule["ep_address"] = ep_address;
+	rule["enable"] = true;
+	rule["content_pattern"] = Json::Value(Json::arrayValue);
+	for (const std::string &pattern : patterns)
+		rule["content_pattern"].append(hex_escape(pattern));
+	rule["replacement"] = hex_escape(replacement);
+	return rule;
+}
+
+static Json::Value control_rule(int bRequestType, int bRequest, int wValue, int wLength,
+			const std::vector<std::string> &patterns, const std::string &replacement) {
+	Json::Value rule;
+	rule["enable"] = true;
+	rule["bRequestType"] = bRequestType;
+	rule["bRequest"] = bRequest;
+	rule["wValue"] = wValue;
+	rule["wIndex"] = 0;
+	rule["wLength"] = wLength;
+	rule["content_pattern"] = Json::Value(Json::arrayValue);
+	for (const std::string &pattern : patterns)
+		rule["content_pattern"].append(hex_escape(pattern));
+	rule["replacement"] = hex_escape(replacement);
+	return rule;
+}
+
+static void fill_io(struct usb_raw_transfer_io &io, const std::string &data) {
+	io.inner.ep = 1;
+	io.inner.flags = 0;
+	io.inner.length = data.size();
+	memcpy(io.data, data.data(), data.size());
+}
+
+/*----------------------------------------------------------------------*/
+
+static void bench_ep_injection(const std::string &rules_dir) {
+	struct usb_endpoint_descriptor int_ep = {};
+	int_ep.bEndpointAddress = 0x81;
+	int_ep.bmAttributes = USB_ENDPOINT_XFER_INT;
+	struct usb_endpoint_descriptor gamepad_ep = int_ep;
+	gamepad_ep.bEndpointAddress = 0x82;
+	struct usb_endpoint_descriptor bulk_ep = {};
+	bulk_ep.bEndpointAddress = 0x81;
+	bulk_ep.bmAttributes = USB_ENDPOINT_XFER_BULK;
+
+	const std::string mouse_report("\x01\x00\x00\x00", 4);
+	const std::string gamepad_report(std::string("\x00\x14", 2) + std::string(18, '\x00'));
+	const std::string bulk_packet(512, '\x5a');
+	struct usb_raw_transfer_io *io = usb_raw_transfer_alloc(USB_RAW_TRANSFER_MAX);
+
+	// The shipped rule files: every rule of injection.json is disabled.
+	if (load_rules_file(rules_dir + "injection.json")) {
+		bench("injection_ep/injection.json/int", [&]() {
+			fill_io(*io, mouse_report);
+			injection(*io, int_ep, "int");
+		});
+		bench("injection_ep/injection.json/bulk512", [&]() {
+			fill_io(*io, bulk_packet);
+			injection(*io, bulk_ep, "bulk");
+		});
+	}
+
+	if (load_rules_file(rules_dir + "injection-rpi-gpio.json")) {
+		memset(gpio_low, 0, sizeof(gpio_low));
+		bench("injection_ep/injection-rpi-gpio.json/released", [&]() {
+			fill_io(*io, gamepad_report);
+			injection(*io, gamepad_ep, "int");
+		});
+		bench("gpio_triggered/injection-rpi-gpio.json/released", [&]() {
+			is_any_gpio_pin_triggered();
+		});
+		gpio_low[23] = true;
+		gpio_low[13] = true;
+		bench("injection_ep/injection-rpi-gpio.json/pressed", [&]() {
+			fill_io(*io, gamepad_report);
+			injection(*io, gamepad_ep, "int");
+		});
+		bench("gpio_triggered/injection-rpi-gpio.json/pressed", [&]() {
+			is_any_gpio_pin_triggered();
+		});
+		memset(gpio_low, 0, sizeof(gpio_low));
+	}
+
+	// The README example: swap the mouse buttons.
+	Json::Value source;
+	source["int"].append(ep_rule(81, { std::string("\x01\x00", 2) }, std::string("\x02\x00", 2)));
+	if (load_rules(source)) {
+		bench("injection_ep/mouse_swap/match", [&]() {
+			fill_io(*io, mouse_report);
+			injection(*io, int_ep, "int");
+		});
+		bench("injection_ep/mouse_swap/miss", [&]() {
+			fill_io(*io, std::string("\x04\x00\x00\x00", 4));
+			injection(*io, int_ep, "int");
+		});
+	}
+
+	// Adversarial: 64 rules of 8 near-miss patterns each over a 1023-byte packet.
+	source = Json::Value();
+	for (int i = 0; i < 64; i++) {
+		std::vector<std::string> patterns;
+		for (int j = 0; j < 8; j++)
+			patterns.push_back(std::string(15, '\x5a') + char(i * 8 + j));
+		source["bulk"].append(ep_rule(81, patterns, "x"));
+	}
+	if (load_rules(source)) {
+		bench("injection_ep/64x8_near_miss/bulk1023", [&]() {
+			fill_io(*io, std::string(1023, '\x5a'));
+			injection(*io, bulk_ep, "bulk");
+		});
+	}
+
+	// Adversarial: a one-byte pattern that matches every byte of the packet.
+	source = Json::Value();
+	source["bulk"].append(ep_rule(81, { std::string(1, '\x00') }, std::string(1, '\x01')));
+	if (load_rules(source)) {
+		bench("injection_ep/match_every_byte/bulk512", [&]() {
+			fill_io(*io, std::string(512, '\x00'));
+			injection(*io, bulk_ep, "bulk");
+		});
+	}
+	usb_raw_transfer_free(io);
+}
+
+static void bench_control_injection(const std::string &rules_dir) {
+	struct usb_raw_control_event event;
+	event.inner.type = USB_RAW_EVENT_CONTROL;
+	event.inner.length = sizeof(event.ctrl);
+	event.ctrl = { USB_DIR_IN, USB_REQ_GET_DESCRIPTOR, USB_DT_DEVICE << 8, 0, 18 };
+	const std::string device_desc("\x12\x01\x00\x02\x00\x00\x00\x40\x6d\x04\x2d\xc5"
+		"\x00\x01\x01\x02\x00\x01", 18);
+	struct usb_raw_transfer_io *io = usb_raw_transfer_alloc(USB_RAW_TRANSFER_MAX);
+	int flags;
+
+	if (load_rules_file(rules_dir + "injection.json")) {
+		bench("injection_control/injection.json", [&]() {
+			fill_io(*io, device_desc);
+			flags = USB_INJECTION_FLAG_NONE;
+			injection(event, *io, flags);
+		});
+	}
+
+	// Rewrite the product id of the device descriptor.
+	Json::Value source;
+	source["control"]["modify"].append(control_rule(80, 6, 100, 12,
+		{ std::string("\x2d\xc5", 2) }, std::string("\x2e\xc5", 2)));
+	if (load_rules(source)) {
+		bench("injection_control/modify_product_id", [&]() {
+			fill_io(*io, device_desc);
+			flags = USB_INJECTION_FLAG_NONE;
+			injection(event, *io, flags);
+		});
+	}
+
+	// Adversarial: 256 rules that all differ from the request in wIndex only.
+	source = Json::Value();
+	for (int i = 0; i < 256; i++) {
+		Json::Value rule = control_rule(80, 6, 100, 12, {}, "");
+		rule["wIndex"] = i + 1;
+		source["control"][i % 2 ? "stall" : "ignore"].append(rule);
+	}
+	if (load_rules(source)) {
+		bench("injection_control/256_rules_miss", [&]() {
+			fill_io(*io, device_desc);
+			flags = USB_INJECTION_FLAG_NONE;
+			injection(event, *io, flags);
+		});
+	}
+	usb_raw_transfer_free(io);
+}
+
+static void bench_pattern_injection() {
+	std::vector<injection_pattern> patterns = {
+		{ std::string("\x01\x00", 2), "\\x01\\x00" },
+	};
+	const std::string replacement("\x02\x00", 2);
+	struct usb_raw_transfer_io *io = usb_raw_transfer_alloc(USB_RAW_TRANSFER_MAX);
+
+	bench("injection_patterns/mouse_swap", [&]() {
+		fill_io(*io, std::string("\x01\x00\x00\x00", 4));
+		injection(*io, patterns, replacement, "\\x02\\x00");
+	});
+	bench("injection_patterns/miss/bulk1024", [&]() {
+		fill_io(*io, std::string(1024, '\x5a'));
+		injection(*io, patterns, replacement, "\\x02\\x00");
+	});
+	usb_raw_transfer_free(io);
+}
+
+static void bench_hex() {
+	volatile int sink;
+	std::string short_pattern = "\\x01\\x00";
+	std::string long_pattern;
+	for (int i = 0; i < 64; i++)
+		long_pattern += "\\x5a";
+
+	bench("hexToAscii/2_bytes", [&]() {
+		sink = hexToAscii(short_pattern).size();
+	});
+	bench("hexToAscii/64_bytes", [&]() {
+		sink = hexToAscii(long_pattern).size();
+	});
+	bench("hexToDecimal/82", [&]() {
+		sink = hexToDecimal(82);
+	});
+	bench("hexToDecimal/9999", [&]() {
+		sink = hexToDecimal(9999);
+	});
+	(void)sink;
+}
+
+// Mirrors the queue handoff of ep_loop_read()/ep_loop_write(): a mutex
+// around a std::deque of usb_raw_transfer_io pointers, producers back off when 32
+// packets are queued and the consumer sleeps 100 us when the queue is empty.
+static void queue_run(int producers, uint64_t packets, bool proxy_backoff) {
+	std::deque<usb_raw_transfer_io *> data_queue;
+	std::mutex data_mutex;
+	struct ep_stats *stats = ep_stats_get(0x81);
+	std::vector<std::thread> threads;
+
+	for (int p = 0; p < producers; p++) {
+		threads.emplace_back([&, p]() {
+			for (uint64_t i = 0; i < packets / producers; i++) {
+				if (proxy_backoff && data_queue.size() >= 32) {
+					usleep(100);
+					i--;
+					continue;
+				}
+				struct usb_raw_transfer_io *io = usb_raw_transfer_alloc(512);
+				fill_io(*io, std::string(64, (char)p));
+				data_mutex.lock();
+				data_queue.push_back(io);
+				data_mutex.unlock();
+				stats_queue_push(stats);
+			}
+		});
+	}
+
+	uint64_t received = 0;
+	uint64_t expected = packets / producers * producers;
+	while (received < expected) {
+		if (data_queue.size() == 0) {
+			if (proxy_backoff)
+				usleep(100);
+			continue;
+		}
+		data_mutex.lock();
+		struct usb_raw_transfer_io *io = data_queue.front();
+		data_queue.pop_front();
+		data_mutex.unlock();
+		stats_queue_pop(stats);
+		received += io->inner.length ? 1 : 0;
+		usb_raw_transfer_free(io);
+	}
+
+	for (std::thread &thread : threads)
+		thread.join();
+}
+
+static void bench_queue() {
+	const uint64_t packets = 200000;
+	for (int producers : { 1, 2, 4 }) {
+		bench_run("queue/spin/" + std::to_string(producers) + "_producers", packets, [&]() {
+			queue_run(producers, packets, false);
+		});
+		bench_run("queue/proxy_backoff/" + std::to_string(producers) + "_producers", packets, [&]() {
+			queue_run(producers, packets, true);
+		});
+	}
+}
+
+static void bench_print_data() {
+	struct usb_raw_transfer_io *io = usb_raw_transfer_alloc(USB_RAW_TRANSFER_MAX);
+	for (int length : { 8, 64, 512, 1024 }) {
+		bench("printData/" + std::to_string(length), [&]() {
+			fill_io(*io, std::string(length, '\x5a'));
+			printData(*io, 0x81, "int", "in");
+		});
+	}
+	usb_raw_transfer_free(io);
+}
+
+/*----------------------------------------------------------------------*/
+
+void usage() {
+	printf("Usage:\n");
+	printf("\t-h/--help: print this help message\n");
+	printf("\t--filter: only run benchmarks whose name contains this string\n");
+	printf("\t--min_time: minimum seconds per repetition, 0.2 by default\n");
+	printf("\t--repetitions: repetitions per benchmark, 5 by default\n");
+	printf("\t--rules_dir: directory with injection.json and injection-rpi-gpio.json\n\n");
+	printf("* Results are printed as JSON on stdout, progress goes to stderr.\n\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	std::string rules_dir = "./";
+
+	int opt, lopt, loidx;
+	const char *optstring = "h";
+	const struct option long_options[] = {
+		{"help", no_argument, &lopt, 1},
+		{"filter", required_argument, &lopt, 2},
+		{"min_time", required_argument, &lopt, 3},
+		{"repetitions", required_argument, &lopt, 4},
+		{"rules_dir", required_argument, &lopt, 5},
+		{0, 0, 0, 0}
+	};
+	while ((opt = getopt_long(argc, argv, optstring, long_options, &loidx)) != -1) {
+		if(opt == 0)
+			opt = lopt;
+		switch (opt) {
+		case 'h':
+			usage();
+			break;
+		case 1:
+			usage();
+			break;
+		case 2:
+			filter = optarg;
+			break;
+		case 3:
+			min_time = atof(optarg);
+			break;
+		case 4:
+			repetitions = std::max(1, atoi(optarg));
+			break;
+		case 5:
+			rules_dir = std::string(optarg) + "/";
+			break;
+
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	// The code under test logs to stdout; measure with the output discarded.
+	fflush(stdout);
+	int saved_stdout = dup(STDOUT_FILENO);
+	int null_fd = open("/dev/null", O_WRONLY);
+	dup2(null_fd, STDOUT_FILENO);
+	close(null_fd);
+
+	injection_enabled = true;
+	injection_gpio_setup();
+
+	bench_ep_injection(rules_dir);
+	bench_control_injection(rules_dir);
+	bench_pattern_injection();
+	bench_hex();
+	bench_queue();
+	bench_print_data();
+
+	fflush(stdout);
+	dup2(saved_stdout, STDOUT_FILENO);
+	close(saved_stdout);
+
+	struct utsname uts;
+	uname(&uts);
+
+	Json::Value root;
+	root["version"] = 1;
+	root["machine"] = uts.machine;
+	root["kernel"] = uts.release;
+	root["min_time"] = min_time;
+	root["repetitions"] = repetitions;
+	root["benchmarks"] = results;
+	Json::StreamWriterBuilder builder;
+	builder["indentation"] = "  ";
+	printf("%s\n", Json::writeString(builder, root).c_str());
+	return 0;
+}
@@ -0,0 +1,308 @@
+#include <algorithm>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <map>
+#include <time.h>
+
+#include "capture.h"
+#include "injection.h"
+#include "gpio.h"
+#include "misc.h"
+
+/*
+ * Streams a capture file through the injection engine the proxy uses, as
+ * fast as the CPU allows, to check a rule file before deploying it. Every
+ * int, bulk and control packet is passed to the same injection() overload
+ * the proxy would call for it; the report lists the rules that matched, the
+ * rewritten packets and the throughput.
+ *
+ * There are no pins to read offline: --gpio_low lists the pins to treat as
+ * pressed for the Raspberry Pi rules.
+ */
+
+static bool gpio_low[64];
+
+int gpio_setup() {
+	return 0;
+}
+
+void gpio_input_pullup(unsigned int pin __attribute__((unused))) {
+}
+
+bool gpio_is_low(unsigned int pin) {
+	return pin < 64 && gpio_low[pin];
+}
+
+/*----------------------------------------------------------------------*/
+
+struct replay_item {
+	struct capture_record			record;
+	bool					control;
+	struct usb_raw_control_event		event;
+	std::string				data;
+	struct usb_endpoint_descriptor		ep;
+};
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static bool load_capture(const std::string &path, std::vector<replay_item> &items,
+			std::string &error) {
+	std::ifstream ifs(path.c_str());
+	if (!ifs.is_open()) {
+		error = "cannot open file";
+		return false;
+	}
+
+	std::string line;
+	for (int number = 1; std::getline(ifs, line); number++) {
+		if (line.empty() || line[0] == '#')
+			continue;
+
+		replay_item item;
+		if (!capture_parse_line(line, item.record)) {
+			error = "line " + std::to_string(number) + ": malformed";
+			return false;
+		}
+
+		const std::string &type = item.record.transfer_type;
+		const std::string &data = item.record.data;
+		item.control = type == "control";
+		if (!item.control && type != "int" && type != "bulk")
+			continue;
+
+		item.data = data.substr(0, USB_RAW_TRANSFER_MAX);
+
+		if (item.control) {
+			if (item.record.setup.empty())
+				continue;
+			item.event.inner.type = USB_RAW_EVENT_CONTROL;
+			item.event.inner.length = sizeof(item.event.ctrl);
+			memcpy(&item.event.ctrl, item.record.setup.data(), sizeof(item.event.ctrl));
+
+			// The proxy handles these itself and never passes them to injection.
+			const struct usb_ctrlrequest &ctrl = item.event.ctrl;
+			if ((ctrl.bRequestType == 0x00 && ctrl.bRequest == USB_REQ_SET_CONFIGURATION) ||
+			    (ctrl.bRequestType == 0x01 && ctrl.bRequest == USB_REQ_SET_INTERFACE))
+				continue;
+		}
+		else {
+			item.ep = {};
+			item.ep.bLength = USB_DT_ENDPOINT_SIZE;
+			item.ep.bDescriptorType = USB_DT_ENDPOINT;
+			item.ep.bEndpointAddress = item.record.bEndpointAddress;
+			item.ep.bmAttributes = type == "int" ? USB_ENDPOINT_XFER_INT : USB_ENDPOINT_XFER_BULK;
+		}
+		items.push_back(item);
+	}
+	return true;
+}
+
+// Runs one packet through injection the way proxy.cpp does. Returns the
+// injection flags for control packets, and whether the data was modified.
+static int evaluate(replay_item &item, struct usb_raw_transfer_io &io, bool &modified) {
+	io.inner.ep = item.record.bEndpointAddress & USB_ENDPOINT_NUMBER_MASK;
+	io.inner.flags = 0;
+	io.inner.length = item.data.size();
+	memcpy(io.data, item.data.data(), item.data.size());
+	if (item.control) {
+		struct usb_raw_control_event event = item.event;
+		int flags = USB_INJECTION_FLAG_NONE;
+		injection(event, io, flags);
+		modified = io.inner.length != item.data.size() ||
+			memcmp(io.data, item.data.data(), io.inner.length);
+		return flags;
+	}
+
+	modified = injection(io, item.ep, item.record.transfer_type);
+	return USB_INJECTION_FLAG_NONE;
+}
+
+void usage() {
+	printf("Usage: usb-proxy-replay [options] <capture file>\n");
+	printf("\t-h/--help: print this help message\n");
+	printf("\t--injection_file: the file that contains injection rules\n");
+	printf("\t--output: write the rewritten capture to this file\n");
+	printf("\t--gpio_low: comma separated GPIO pins to treat as pressed\n");
+	printf("\t--iterations: times to stream the capture for the throughput figure, 10 by default\n");
+	printf("\t--json: print the report as JSON\n\n");
+	printf("* If `injection_file` not specified, `usb-proxy-replay` will use `injection.json` by default.\n");
+	printf("* Record the capture with injection disabled, or the rules are applied twice.\n\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	std::string output_file;
+	int iterations = 10;
+	bool json = false;
+
+	int opt, lopt, loidx;
+	const char *optstring = "h";
+	const struct option long_options[] = {
+		{"help", no_argument, &lopt, 1},
+		{"injection_file", required_argument, &lopt, 2},
+		{"output", required_argument, &lopt, 3},
+		{"gpio_low", required_argument, &lopt, 4},
+		{"iterations", required_argument, &lopt, 5},
+		{"json", no_argument, &lopt, 6},
+		{0, 0, 0, 0}
+	};
+	while ((opt = getopt_long(argc, argv, optstring, long_options, &loidx)) != -1) {
+		if(opt == 0)
+			opt = lopt;
+		switch (opt) {
+		case 'h':
+			usage();
+			break;
+		case 1:
+			usage();
+			break;
+		case 2:
+			injection_file = optarg;
+			break;
+		case 3:
+			output_file = optarg;
+			break;
+		case 4: {
+			std::istringstream pins(optarg);
+			std::string pin;
+			while (std::getline(pins, pin, ',')) {
+				unsigned int index = atoi(pin.c_str());
+				if (index >= 64) {
+					printf("Invalid GPIO pin: %s\n", pin.c_str());
+					return 1;
+				}
+				gpio_low[index] = true;
+			}
+			break;
+		}
+		case 5:
+			iterations = std::max(1, atoi(optarg));
+			break;
+		case 6:
+			json = true;
+			break;
+
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if (optind != argc - 1)
+		usage();
+	std::string capture_file = argv[optind];
+
+	std::string error;
+	if (!injection_rules_load(injection_file, error)) {
+		printf("Error parsing injection file: %s\n%s\n", injection_file.c_str(), error.c_str());
+		return 1;
+	}
+
+	std::vector<replay_item> items;
+	if (!load_capture(capture_file, items, error)) {
+		printf("Error reading capture file: %s\n%s\n", capture_file.c_str(), error.c_str());
+		return 1;
+	}
+
+	FILE *output = NULL;
+	if (!output_file.empty()) {
+		output = fopen(output_file.c_str(), "w");
+		if (!output) {
+			perror("fopen() output file");
+			return 1;
+		}
+		fprintf(output, "# usb-proxy capture v1\n");
+		fprintf(output, "# rewritten by %s\n", injection_file.c_str());
+	}
+
+	// injection() logs every match to stdout; keep it out of the report.
+	fflush(stdout);
+	int saved_stdout = dup(STDOUT_FILENO);
+	int null_fd = open("/dev/null", O_WRONLY);
+	dup2(null_fd, STDOUT_FILENO);
+	close(null_fd);
+
+	// First pass: which rules matched what.
+	std::map<std::string, uint64_t> rule_hits;
+	uint64_t modified_count = 0, ignored_count = 0, stalled_count = 0;
+	std::vector<std::string> matches;
+	struct usb_raw_transfer_io *io = usb_raw_transfer_alloc(USB_RAW_TRANSFER_MAX);
+	for (replay_item &item : items) {
+		bool modified;
+		matches.clear();
+		injection_matches = &matches;
+		int flags = evaluate(item, *io, modified);
+		injection_matches = NULL;
+
+		for (const std::string &match : matches)
+			rule_hits[match]++;
+		modified_count += modified;
+		ignored_count += flags == USB_INJECTION_FLAG_IGNORE;
+		stalled_count += flags == USB_INJECTION_FLAG_STALL;
+
+		if (!output)
+			continue;
+		for (const std::string &match : matches)
+			fprintf(output, "# matched %s\n", match.c_str());
+		if (flags == USB_INJECTION_FLAG_IGNORE)
+			fprintf(output, "# ignored\n");
+		else if (flags == USB_INJECTION_FLAG_STALL)
+			fprintf(output, "# stalled\n");
+
+		struct capture_record rewritten = item.record;
+		rewritten.data.assign(io->data, io->inner.length);
+		fprintf(output, "%s\n", capture_format_line(rewritten).c_str());
+	}
+	if (output)
+		fclose(output);
+
+	// Then the throughput, without the bookkeeping.
+	uint64_t start = now_ns();
+	for (int i = 0; i < iterations; i++) {
+		for (replay_item &item : items) {
+			bool modified;
+			evaluate(item, *io, modified);
+		}
+	}
+	double seconds = (now_ns() - start) / 1e9;
+	uint64_t packets = (uint64_t)items.size() * iterations;
+	usb_raw_transfer_free(io);
+
+	fflush(stdout);
+	dup2(saved_stdout, STDOUT_FILENO);
+	close(saved_stdout);
+
+	Json::Value report;
+	report["capture_file"] = capture_file;
+	report["injection_file"] = injection_file;
+	report["packets"] = (Json::UInt64)items.size();
+	report["modified"] = (Json::UInt64)modified_count;
+	report["ignored"] = (Json::UInt64)ignored_count;
+	report["stalled"] = (Json::UInt64)stalled_count;
+	report["rules"] = Json::Value(Json::objectValue);
+	for (const auto &hit : rule_hits)
+		report["rules"][hit.first] = (Json::UInt64)hit.second;
+	report["packets_per_second"] = seconds > 0 ? packets / seconds : 0;
+	report["ns_per_packet"] = packets ? seconds * 1e9 / packets : 0;
+
+	if (json) {
+		Json::StreamWriterBuilder builder;
+		builder["indentation"] = "  ";
+		printf("%s\n", Json::writeString(builder, report).c_str());
+		return 0;
+	}
+
+	printf("%zu packets: %" PRIu64 " modified, %" PRIu64 " ignored, %" PRIu64 " stalled\n",
+		items.size(), modified_count, ignored_count, stalled_count);
+	for (const auto &hit : rule_hits)
+		printf("  %-24s %" PRIu64 " matches\n", hit.first.c_str(), hit.second);
+	if (rule_hits.empty())
+		printf("  no rule matched\n");
+	printf("%.0f packets/s, %.1f ns per packet (%d iterations)\n",
+		report["packets_per_second"].asDouble(), report["ns_per_packet"].asDouble(), iterations);
+	return 0;
+}
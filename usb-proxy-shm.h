@@ -0,0 +1,145 @@
+#ifndef USB_PROXY_SHM_H
+#define USB_PROXY_SHM_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+ * Shared-memory injection into usb-proxy, for local producer processes.
+ *
+ * A producer connects to the socket given with --shm_socket and sends one
+ * line, `<endpoint> [<max length>]\n`, with the endpoint address in hex.
+ * The proxy answers `ok\n` and passes the file descriptor of a new ring with
+ * SCM_RIGHTS, or answers `error: <reason>\n`. Each ring has one producer,
+ * the connection it was created for, and one consumer, the thread that
+ * forwards the endpoint's packets. The proxy merges the ring into that
+ * endpoint's stream, alternating with the device's packets when both are
+ * waiting: an IN endpoint's packets go to the host, an OUT endpoint's to the
+ * device. When the connection closes, what is left in the ring is still
+ * forwarded.
+ *
+ * usb_proxy_shm_open() and usb_proxy_shm_push() do all of this for C and
+ * C++ producers.
+ */
+
+#define USB_PROXY_SHM_MAGIC	0x6d687370	/* "pshm" */
+#define USB_PROXY_SHM_VERSION	1
+
+struct usb_proxy_shm_ring {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	slot_count;	// a power of two
+	uint32_t	slot_size;	// bytes per slot, the length word included
+	uint8_t		endpoint;
+	uint8_t		reserved[47];
+
+	// Free-running counters: the producer only writes head, the proxy
+	// only tail, each with release ordering.
+	uint64_t	head __attribute__((aligned(64)));
+	uint64_t	tail __attribute__((aligned(64)));
+
+	// slot_count slots follow, each a uint32_t length and the packet.
+};
+
+static inline uint8_t *usb_proxy_shm_slot(struct usb_proxy_shm_ring *ring, uint64_t index) {
+	return (uint8_t *)(ring + 1) + (index & (ring->slot_count - 1)) * ring->slot_size;
+}
+
+static inline size_t usb_proxy_shm_size(uint32_t slot_count, uint32_t slot_size) {
+	return sizeof(struct usb_proxy_shm_ring) + (size_t)slot_count * slot_size;
+}
+
+// Returns 0, or -1 if the ring is full or the packet too long for a slot.
+static inline int usb_proxy_shm_push(struct usb_proxy_shm_ring *ring, const void *data,
+			uint32_t length) {
+	uint64_t head = ring->head;
+	if (length > ring->slot_size - sizeof(uint32_t) ||
+	    head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= ring->slot_count)
+		return -1;
+
+	uint8_t *slot = usb_proxy_shm_slot(ring, head);
+	memcpy(slot, &length, sizeof(length));
+	memcpy(slot + sizeof(length), data, length);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Connects to the proxy and maps a ring for endpoint, for packets of up to
+ * max_length bytes (0 for the proxy's default). Returns NULL on failure.
+ * *socket_fd must stay open while the ring is used; closing it, or exiting,
+ * releases the ring.
+ */
+static inline struct usb_proxy_shm_ring *usb_proxy_shm_open(const char *socket_path,
+			uint8_t endpoint, uint32_t max_length, int *socket_fd) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(addr.sun_path))
+		return NULL;
+	strcpy(addr.sun_path, socket_path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return NULL;
+	char request[32];
+	int length = snprintf(request, sizeof(request), "%02x %u\n", endpoint, max_length);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    write(fd, request, length) != length) {
+		close(fd);
+		return NULL;
+	}
+
+	char reply[256] = "";
+	union {
+		struct cmsghdr	header;
+		char		buffer[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct iovec iov = { reply, sizeof(reply) - 1 };
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buffer;
+	msg.msg_controllen = sizeof(control.buffer);
+	struct cmsghdr *cmsg;
+	int ring_fd = -1;
+	if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) > 0 && (cmsg = CMSG_FIRSTHDR(&msg)) &&
+	    cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(&ring_fd, CMSG_DATA(cmsg), sizeof(ring_fd));
+	if (ring_fd < 0 || strncmp(reply, "ok", 2)) {
+		if (ring_fd >= 0)
+			close(ring_fd);
+		close(fd);
+		return NULL;
+	}
+
+	struct usb_proxy_shm_ring *ring = NULL;
+	void *header = mmap(NULL, sizeof(*ring), PROT_READ, MAP_SHARED, ring_fd, 0);
+	if (header != MAP_FAILED) {
+		size_t size = usb_proxy_shm_size(((struct usb_proxy_shm_ring *)header)->slot_count,
+			((struct usb_proxy_shm_ring *)header)->slot_size);
+		munmap(header, sizeof(*ring));
+		void *mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, 0);
+		if (mapped != MAP_FAILED)
+			ring = (struct usb_proxy_shm_ring *)mapped;
+	}
+	close(ring_fd);
+	if (ring && (ring->magic != USB_PROXY_SHM_MAGIC || ring->version != USB_PROXY_SHM_VERSION)) {
+		munmap(ring, usb_proxy_shm_size(ring->slot_count, ring->slot_size));
+		ring = NULL;
+	}
+	if (!ring) {
+		close(fd);
+		return NULL;
+	}
+	*socket_fd = fd;
+	return ring;
+}
+
+#endif
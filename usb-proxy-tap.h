@@ -0,0 +1,207 @@
+#ifndef USB_PROXY_TAP_H
+#define USB_PROXY_TAP_H
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+ * Live traffic tap of usb-proxy, for local analyzers.
+ *
+ * A subscriber connects to the socket given with --tap_socket; the proxy
+ * answers `ok\n` and passes a read-only file descriptor of the tap ring with
+ * SCM_RIGHTS, or answers `error: <reason>\n`. There is one ring, written
+ * once per packet whatever the number of subscribers, and each subscriber
+ * follows it with a cursor of its own. The proxy never waits for anyone: a
+ * subscriber that falls more than a ring behind loses packets, which
+ * usb_proxy_tap_next() detects and counts. The proxy only publishes while at
+ * least one subscriber is connected.
+ *
+ * Packets are published as the proxy forwards them, after injection and
+ * transforms, with up to slot_size - sizeof(struct usb_proxy_tap_slot)
+ * bytes of their payload. Control transfers appear on endpoint 00 with
+ * their setup packet.
+ */
+
+#define USB_PROXY_TAP_MAGIC	0x70617470	/* "ptap" */
+#define USB_PROXY_TAP_VERSION	1
+
+struct usb_proxy_tap_ring {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	slot_count;	// a power of two
+	uint32_t	slot_size;	// bytes per slot, the slot header included
+	uint8_t		reserved[48];
+
+	// Sequence of the next packet to be written; it is claimed here
+	// before it is written, so only a slot's own sequence says it is done.
+	uint64_t	head __attribute__((aligned(64)));
+
+	// slot_count slots follow.
+};
+
+struct usb_proxy_tap_slot {
+	uint64_t	sequence;	// its packet's sequence + 1, 0 while written
+	uint64_t	timestamp_ns;	// CLOCK_MONOTONIC
+	uint32_t	length;		// of the packet
+	uint32_t	captured;	// bytes of it that follow
+	uint8_t		endpoint;	// address, 00 for control transfers
+	uint8_t		transfer_type;	// USB_ENDPOINT_XFER_*
+	uint8_t		reserved[6];
+	uint8_t		setup[8];	// control transfers only
+
+	// captured bytes of payload follow.
+};
+
+struct usb_proxy_tap {
+	const struct usb_proxy_tap_ring	*ring;
+	int				socket_fd;
+	uint64_t			cursor;		// sequence of the next packet to read
+	uint64_t			overruns;	// packets lost by falling behind
+};
+
+static inline const struct usb_proxy_tap_slot *usb_proxy_tap_slot(
+			const struct usb_proxy_tap_ring *ring, uint64_t sequence) {
+	return (const struct usb_proxy_tap_slot *)((const uint8_t *)(ring + 1) +
+		(sequence & (ring->slot_count - 1)) * ring->slot_size);
+}
+
+static inline size_t usb_proxy_tap_size(uint32_t slot_count, uint32_t slot_size) {
+	return sizeof(struct usb_proxy_tap_ring) + (size_t)slot_count * slot_size;
+}
+
+/*
+ * Copies the next packet into *slot and up to capacity bytes of its payload
+ * into payload. Returns 1, or 0 if there is none yet. A subscriber that was
+ * overrun is moved up to half a ring behind the proxy, and the packets it
+ * skipped are added to tap->overruns.
+ */
+static inline int usb_proxy_tap_next(struct usb_proxy_tap *tap, struct usb_proxy_tap_slot *slot,
+			void *payload, uint32_t capacity) {
+	const struct usb_proxy_tap_ring *ring = tap->ring;
+	for (;;) {
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (tap->cursor >= head)
+			return 0;
+		if (head - tap->cursor > ring->slot_count) {
+			uint64_t resume = head - ring->slot_count / 2;
+			tap->overruns += resume - tap->cursor;
+			tap->cursor = resume;
+		}
+
+		const struct usb_proxy_tap_slot *source = usb_proxy_tap_slot(ring, tap->cursor);
+		uint64_t sequence = __atomic_load_n(&source->sequence, __ATOMIC_ACQUIRE);
+		if (sequence != tap->cursor + 1) {
+			if (sequence > tap->cursor + 1) {
+				tap->overruns++;
+				tap->cursor++;
+				continue;
+			}
+			return 0;	// still being written
+		}
+
+		memcpy(slot, source, sizeof(*slot));
+		uint32_t captured = slot->captured;
+		uint32_t room = ring->slot_size - sizeof(*slot);
+		if (captured > room)
+			captured = room;
+		if (captured > capacity)
+			captured = capacity;
+		memcpy(payload, source + 1, captured);
+
+		// Written over while it was copied?
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&source->sequence, __ATOMIC_RELAXED) != sequence) {
+			tap->overruns++;
+			tap->cursor++;
+			continue;
+		}
+		slot->captured = captured;
+		tap->cursor++;
+		return 1;
+	}
+}
+
+/*
+ * Connects to the proxy and maps the tap ring, starting at the next packet
+ * published. Returns 0, or -1 on failure. Closing tap->socket_fd, with
+ * usb_proxy_tap_close() or by exiting, unsubscribes.
+ */
+static inline int usb_proxy_tap_open(const char *socket_path, struct usb_proxy_tap *tap) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(addr.sun_path))
+		return -1;
+	strcpy(addr.sun_path, socket_path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	char reply[256] = "";
+	union {
+		struct cmsghdr	header;
+		char		buffer[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct iovec iov = { reply, sizeof(reply) - 1 };
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buffer;
+	msg.msg_controllen = sizeof(control.buffer);
+	struct cmsghdr *cmsg;
+	int ring_fd = -1;
+	if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) > 0 && (cmsg = CMSG_FIRSTHDR(&msg)) &&
+	    cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(&ring_fd, CMSG_DATA(cmsg), sizeof(ring_fd));
+	if (ring_fd < 0 || strncmp(reply, "ok", 2)) {
+		if (ring_fd >= 0)
+			close(ring_fd);
+		close(fd);
+		return -1;
+	}
+
+	const struct usb_proxy_tap_ring *ring = NULL;
+	void *header = mmap(NULL, sizeof(*ring), PROT_READ, MAP_SHARED, ring_fd, 0);
+	if (header != MAP_FAILED) {
+		size_t size = usb_proxy_tap_size(((struct usb_proxy_tap_ring *)header)->slot_count,
+			((struct usb_proxy_tap_ring *)header)->slot_size);
+		munmap(header, sizeof(*ring));
+		void *mapped = mmap(NULL, size, PROT_READ, MAP_SHARED, ring_fd, 0);
+		if (mapped != MAP_FAILED)
+			ring = (const struct usb_proxy_tap_ring *)mapped;
+	}
+	close(ring_fd);
+	if (ring && (ring->magic != USB_PROXY_TAP_MAGIC || ring->version != USB_PROXY_TAP_VERSION)) {
+		munmap((void *)ring, usb_proxy_tap_size(ring->slot_count, ring->slot_size));
+		ring = NULL;
+	}
+	if (!ring) {
+		close(fd);
+		return -1;
+	}
+
+	tap->ring = ring;
+	tap->socket_fd = fd;
+	tap->cursor = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	tap->overruns = 0;
+	return 0;
+}
+
+static inline void usb_proxy_tap_close(struct usb_proxy_tap *tap) {
+	munmap((void *)tap->ring, usb_proxy_tap_size(tap->ring->slot_count, tap->ring->slot_size));
+	close(tap->socket_fd);
+	tap->ring = NULL;
+	tap->socket_fd = -1;
+}
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef USB_PROXY_TRANSFORM_H
+#define USB_PROXY_TRANSFORM_H
+
+#include <stdint.h>
+
+/*
+ * C ABI for packet transforms loaded into usb-proxy with
+ * --transform=<address>:<library>[:<argument>].
+ *
+ * A transform library exports one symbol, `usb_proxy_transform`, a struct
+ * usb_proxy_transform with abi_version set to USB_PROXY_TRANSFORM_ABI_VERSION.
+ * Libraries built for another version are refused at startup. Fields are
+ * only ever added at the end, with a new version.
+ *
+ * Each time an endpoint it is bound to is activated, open() is called with
+ * the endpoint and the argument from the command line, and close() when the
+ * endpoint is deactivated. transform() is then called for every packet the
+ * endpoint carries, after the injection rules, from the thread that reads
+ * the packet: once per packet, never concurrently for one endpoint. The
+ * packet is edited in place, and its length may change up to its capacity.
+ */
+
+#define USB_PROXY_TRANSFORM_ABI_VERSION	1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum usb_proxy_verdict {
+	USB_PROXY_KEEP = 0,	// forward the packet
+	USB_PROXY_DROP = 1,	// don't forward it
+	USB_PROXY_STALL = 2,	// don't forward it, and halt the endpoint towards the host
+	USB_PROXY_EMIT = 3,	// forward it, then each packet passed to emit()
+};
+
+struct usb_proxy_endpoint {
+	uint8_t		address;	// bEndpointAddress, bit 7 set for IN
+	uint8_t		attributes;	// bmAttributes, transfer type in bits 0-1
+	uint16_t	max_packet_size;
+	uint8_t		interval;	// bInterval as the host sees it
+	uint8_t		reserved[3];
+};
+
+struct usb_proxy_packet {
+	uint8_t		*data;
+	uint32_t	length;
+	uint32_t	capacity;
+};
+
+// Queues a copy of data, forwarded after the packet if transform() returns
+// USB_PROXY_EMIT. Returns 0, or -1 if the packet is too long.
+typedef int (*usb_proxy_emit_fn)(void *context, const uint8_t *data, uint32_t length);
+
+struct usb_proxy_transform {
+	uint32_t	abi_version;
+	const char	*name;
+
+	// Optional. Returns 0 and sets *state, or non-zero to leave the
+	// endpoint untransformed.
+	int		(*open)(const struct usb_proxy_endpoint *endpoint,
+				const char *argument, void **state);
+	// Returns an enum usb_proxy_verdict.
+	int		(*transform)(void *state, const struct usb_proxy_endpoint *endpoint,
+				struct usb_proxy_packet *packet,
+				usb_proxy_emit_fn emit, void *emit_context);
+	// Optional.
+	void		(*close)(void *state);
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
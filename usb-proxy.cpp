@@ -1,15 +1,29 @@
-#include "host-raw-gadget.h"
 #include "device-libusb.h"
+#include "device-replay.h"
+#include "device-usbfs.h"
+#include "host-functionfs.h"
+#include "backend.h"
 #include "proxy.h"
+#include "injection.h"
+#include "capture.h"
+#include "control-socket.h"
+#include "control-cache.h"
+#include "hid-report.h"
+#include "cpu-accounting.h"
 #include "misc.h"
+#include "realtime.h"
+#include "shm-injection.h"
+#include "stats.h"
+#include "tap.h"
+#include "transform.h"
 
-int verbose_level = 0;
-bool please_stop_ep0 = false;
-bool please_stop_eps = false;
-
-bool injection_enabled = false;
-std::string injection_file = "injection.json";
-Json::Value injection_config;
+std::string control_socket_path;
+std::string capture_file;
+std::string cpu_accounting;
+int cpu_report_interval = 10;
+std::string replay_file;
+std::string shm_socket_path;
+std::string tap_socket_path;
 
 void usage() {
 	printf("Usage:\n");
@@ -20,9 +34,40 @@ void usage() {
 	printf("\t--vendor_id: use specific vendor_id of USB device\n");
 	printf("\t--product_id: use specific product_id of USB device\n");
 	printf("\t--enable_injection: enable the injection feature\n");
-	printf("\t--injection_file: specify the file that contains injection rules\n\n");
+	printf("\t--injection_file: specify the file that contains injection rules\n");
+	printf("\t--control_socket: listen for control commands on this Unix socket\n");
+	printf("\t--capture_file: capture all proxied packets to this file\n");
+	printf("\t--cpu_accounting: account CPU cost per endpoint and stage, `thread` or `cycles`\n");
+	printf("\t--cpu_report_interval: seconds between CPU accounting reports, 0 to disable\n");
+	printf("\t--replay: emulate the device recorded in this capture file instead of connecting one\n");
+	printf("\t--replay_traffic: also replay the recorded IN traffic\n");
+	printf("\t--replay_speed: timing factor for the replayed traffic, 0 for as fast as possible\n");
+	printf("\t--replay_loop: start the replayed traffic over when it ends\n");
+	printf("\t--no_control_cache: forward every descriptor request to the device\n");
+	printf("\t--reconnect: keep running when the device is unplugged and resume when it is back\n");
+	printf("\t--speed: run the gadget at low, full, high, super or super-plus speed\n");
+	printf("\t--bulk_transfer_size: bytes per bulk transfer, 16384 by default, up to 65536\n");
+	printf("\t--usbfs: submit transfers to the device's usbfs node directly instead of via libusb\n");
+	printf("\t--functionfs: serve the host through a FunctionFS gadget instead of raw-gadget\n");
+	printf("\t--rt_priority: run ep0 and the endpoint threads as SCHED_FIFO at this priority\n");
+	printf("\t--rt_cpus: run ep0 and the endpoint threads on these CPUs, e.g. `2-3`, and\n");
+	printf("\t  all other threads on the rest\n");
+	printf("\t--lock_memory: lock all memory and prefault stacks and buffers\n");
+	printf("\t--ep_priority: put an endpoint in another priority class, `<address>:<low|normal|high>`\n");
+	printf("\t--poll_interval: have the host poll an interrupt endpoint this often,\n");
+	printf("\t  `<address>:<microseconds>`\n");
+	printf("\t--hide_interface: keep an interface, by number, from the host\n");
+	printf("\t--hide_endpoint: keep an endpoint, by address in hex, from the host\n");
+	printf("\t--transform: run packets of an endpoint through a transform library,\n");
+	printf("\t  `<address>:<library>[:<argument>]`\n");
+	printf("\t--shm_socket: hand out shared-memory injection rings on this Unix socket,\n");
+	printf("\t  see usb-proxy-shm.h\n");
+	printf("\t--tap_socket: let local analyzers follow the traffic live on this Unix socket,\n");
+	printf("\t  see usb-proxy-tap.h\n\n");
 	printf("* If `device` not specified, `usb-proxy` will use `dummy_udc.0` as default device.\n");
 	printf("* If `driver` not specified, `usb-proxy` will use `dummy_udc` as default driver.\n");
+	printf("* If `speed` not specified, `usb-proxy` will use the device's speed, limited to\n");
+	printf("  what the UDC supports.\n");
 	printf("* If both `vendor_id` and `product_id` not specified, `usb-proxy` will connect\n");
 	printf("  the first USB device it can find.\n");
 	printf("* If `injection_file` not specified, `usb-proxy` will use `injection.json` by default.\n\n");
@@ -50,111 +95,16 @@ void handle_signal(int signum) {
 	}
 }
 
-int setup_host_usb_desc() {
-	host_device_desc.device = {
-		.bLength =		device_device_desc.bLength,
-		.bDescriptorType =	device_device_desc.bDescriptorType,
-		.bcdUSB =		device_device_desc.bcdUSB,
-		.bDeviceClass =		device_device_desc.bDeviceClass,
-		.bDeviceSubClass =	device_device_desc.bDeviceSubClass,
-		.bDeviceProtocol =	device_device_desc.bDeviceProtocol,
-		.bMaxPacketSize0 =	device_device_desc.bMaxPacketSize0,
-		.idVendor =		device_device_desc.idVendor,
-		.idProduct =		device_device_desc.idProduct,
-		.bcdDevice =		device_device_desc.bcdDevice,
-		.iManufacturer =	device_device_desc.iManufacturer,
-		.iProduct =		device_device_desc.iProduct,
-		.iSerialNumber =	device_device_desc.iSerialNumber,
-		.bNumConfigurations =	device_device_desc.bNumConfigurations,
-	};
-
-	int bNumConfigurations = device_device_desc.bNumConfigurations;
-	host_device_desc.configs = new struct raw_gadget_config[bNumConfigurations];
-	for (int i = 0; i < bNumConfigurations; i++) {
-		struct usb_config_descriptor temp_config = {
-			.bLength =		device_config_desc[i]->bLength,
-			.bDescriptorType =	device_config_desc[i]->bDescriptorType,
-			.wTotalLength =		device_config_desc[i]->wTotalLength,
-			.bNumInterfaces =	device_config_desc[i]->bNumInterfaces,
-			.bConfigurationValue =	device_config_desc[i]->bConfigurationValue,
-			.iConfiguration = 	device_config_desc[i]->iConfiguration,
-			.bmAttributes =		device_config_desc[i]->bmAttributes,
-			.bMaxPower =		device_config_desc[i]->MaxPower,
-		};
-		host_device_desc.configs[i].config = temp_config;
-
-		int bNumInterfaces = device_config_desc[i]->bNumInterfaces;
-		struct raw_gadget_interface *temp_interfaces =
-			new struct raw_gadget_interface[bNumInterfaces];
-		for (int j = 0; j < bNumInterfaces; j++) {
-			int num_altsetting = device_config_desc[i]->interface[j].num_altsetting;
-			struct raw_gadget_altsetting *temp_altsettings =
-				new struct raw_gadget_altsetting[num_altsetting];
-			for (int k = 0; k < num_altsetting; k++) {
-				const struct libusb_interface_descriptor temp_device_altsetting =
-					device_config_desc[i]->interface[j].altsetting[k];
-				struct usb_interface_descriptor temp_host_altsetting = {
-					.bLength =		temp_device_altsetting.bLength,
-					.bDescriptorType =	temp_device_altsetting.bDescriptorType,
-					.bInterfaceNumber =	temp_device_altsetting.bInterfaceNumber,
-					.bAlternateSetting =	temp_device_altsetting.bAlternateSetting,
-					.bNumEndpoints =	temp_device_altsetting.bNumEndpoints,
-					.bInterfaceClass =	temp_device_altsetting.bInterfaceClass,
-					.bInterfaceSubClass =	temp_device_altsetting.bInterfaceSubClass,
-					.bInterfaceProtocol =	temp_device_altsetting.bInterfaceProtocol,
-					.iInterface =		temp_device_altsetting.iInterface,
-				};
-				temp_altsettings[k].interface = temp_host_altsetting;
-
-				if (!temp_device_altsetting.bNumEndpoints) {
-					printf("InterfaceNumber %x AlternateSetting %x has no endpoint, skip\n",
-						temp_device_altsetting.bInterfaceNumber,
-						temp_device_altsetting.bAlternateSetting);
-					continue;
-				}
-
-				int bNumEndpoints = temp_device_altsetting.bNumEndpoints;
-				struct raw_gadget_endpoint *temp_endpoints =
-					new struct raw_gadget_endpoint[bNumEndpoints];
-				for (int l = 0; l < bNumEndpoints; l++) {
-					struct usb_endpoint_descriptor temp_endpoint = {
-						.bLength =		temp_device_altsetting.endpoint[l].bLength,
-						.bDescriptorType =	temp_device_altsetting.endpoint[l].bDescriptorType,
-						.bEndpointAddress =	temp_device_altsetting.endpoint[l].bEndpointAddress,
-						.bmAttributes =		temp_device_altsetting.endpoint[l].bmAttributes,
-						.wMaxPacketSize =	temp_device_altsetting.endpoint[l].wMaxPacketSize,
-						.bInterval =		temp_device_altsetting.endpoint[l].bInterval,
-						.bRefresh =		temp_device_altsetting.endpoint[l].bRefresh,
-						.bSynchAddress = 	temp_device_altsetting.endpoint[l].bSynchAddress,
-					};
-					temp_endpoints[l].endpoint = temp_endpoint;
-					temp_endpoints[l].thread_read = 0;
-					temp_endpoints[l].thread_write = 0;
-					memset((void *)&temp_endpoints[l].thread_info, 0,
-						sizeof(temp_endpoints[l].thread_info));
-					temp_endpoints[l].thread_info.ep_num = -1;
-				}
-				temp_altsettings[k].endpoints = temp_endpoints;
-			}
-			temp_interfaces[j].altsettings = temp_altsettings;
-			temp_interfaces[j].num_altsettings = device_config_desc[i]->interface[j].num_altsetting;
-			temp_interfaces[j].current_altsetting = 0;
-
-		}
-		host_device_desc.configs[i].interfaces = temp_interfaces;
-	}
-
-	host_device_desc.current_config = 0;
-
-	return 0;
-}
-
 int main(int argc, char **argv)
 {
 	const char *device = "dummy_udc.0";
 	const char *driver = "dummy_udc";
 	int vendor_id = -1;
 	int product_id = -1;
+	enum usb_device_speed speed = USB_SPEED_UNKNOWN;
+	bool use_usbfs = false;
+	bool use_functionfs = false;
+	ReplayDevice replay_device;
 
 	struct sigaction action;
 	memset(&action, 0, sizeof(struct sigaction));
@@ -173,6 +123,30 @@ int main(int argc, char **argv)
 		{"product_id", required_argument, &lopt, 6},
 		{"enable_injection", no_argument, &lopt, 7},
 		{"injection_file", required_argument, &lopt, 8},
+		{"control_socket", required_argument, &lopt, 9},
+		{"capture_file", required_argument, &lopt, 10},
+		{"cpu_accounting", required_argument, &lopt, 11},
+		{"cpu_report_interval", required_argument, &lopt, 12},
+		{"replay", required_argument, &lopt, 13},
+		{"replay_traffic", no_argument, &lopt, 14},
+		{"replay_speed", required_argument, &lopt, 15},
+		{"replay_loop", no_argument, &lopt, 16},
+		{"no_control_cache", no_argument, &lopt, 17},
+		{"reconnect", no_argument, &lopt, 18},
+		{"speed", required_argument, &lopt, 19},
+		{"bulk_transfer_size", required_argument, &lopt, 20},
+		{"usbfs", no_argument, &lopt, 21},
+		{"functionfs", no_argument, &lopt, 22},
+		{"rt_priority", required_argument, &lopt, 24},
+		{"rt_cpus", required_argument, &lopt, 25},
+		{"lock_memory", no_argument, &lopt, 26},
+		{"ep_priority", required_argument, &lopt, 27},
+		{"poll_interval", required_argument, &lopt, 28},
+		{"hide_interface", required_argument, &lopt, 29},
+		{"hide_endpoint", required_argument, &lopt, 30},
+		{"transform", required_argument, &lopt, 31},
+		{"shm_socket", required_argument, &lopt, 32},
+		{"tap_socket", required_argument, &lopt, 33},
 		{0, 0, 0, 0}
 	};
 	while ((opt = getopt_long(argc, argv, optstring, long_options, &loidx)) != -1) {
@@ -209,6 +183,109 @@ int main(int argc, char **argv)
 		case 8:
 			injection_file = optarg;
 			break;
+		case 9:
+			control_socket_path = optarg;
+			break;
+		case 10:
+			capture_file = optarg;
+			break;
+		case 11:
+			cpu_accounting = optarg;
+			break;
+		case 12:
+			cpu_report_interval = atoi(optarg);
+			break;
+		case 13:
+			replay_file = optarg;
+			break;
+		case 14:
+			replay_device.traffic = true;
+			break;
+		case 15:
+			replay_device.speed = atof(optarg);
+			break;
+		case 16:
+			replay_device.loop = true;
+			break;
+		case 17:
+			control_cache_enabled = false;
+			break;
+		case 18:
+			device_reconnect = true;
+			break;
+		case 19:
+			speed = usb_speed_parse(optarg);
+			if (speed == USB_SPEED_UNKNOWN || speed == USB_SPEED_WIRELESS) {
+				printf("Unknown speed: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 20:
+			bulk_transfer_size = atoi(optarg);
+			if (bulk_transfer_size <= 0 || bulk_transfer_size > USB_RAW_TRANSFER_MAX) {
+				printf("Invalid bulk transfer size: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 21:
+			use_usbfs = true;
+			break;
+		case 22:
+			use_functionfs = true;
+			break;
+		case 24:
+			realtime_priority = atoi(optarg);
+			break;
+		case 25:
+			if (!cpu_list_parse(optarg, &realtime_cpus)) {
+				printf("Invalid CPU list: %s\n", optarg);
+				return 1;
+			}
+			realtime_cpus_set = true;
+			break;
+		case 26:
+			realtime_lock_memory = true;
+			break;
+		case 27:
+			if (!ep_priority_parse(optarg)) {
+				printf("Invalid endpoint priority: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 28:
+			if (!poll_interval_parse(optarg)) {
+				printf("Invalid poll interval: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 29: {
+			char *end;
+			long number = strtol(optarg, &end, 10);
+			if (!*optarg || *end || number < 0 || number > 255) {
+				printf("Invalid interface number: %s\n", optarg);
+				return 1;
+			}
+			hidden_interfaces.insert(number);
+			break;
+		}
+		case 30:
+			if (!hidden_endpoint_parse(optarg)) {
+				printf("Invalid endpoint address: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 31:
+			if (!transform_parse(optarg)) {
+				printf("Invalid transform: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 32:
+			shm_socket_path = optarg;
+			break;
+		case 33:
+			tap_socket_path = optarg;
+			break;
 
 		default:
 			usage();
@@ -220,6 +297,12 @@ int main(int argc, char **argv)
 	printf("vendor_id is: %d\n", vendor_id);
 	printf("product_id is: %d\n", product_id);
 
+	if (realtime_setup())
+		return 1;
+
+	if (transforms_load())
+		return 1;
+
 	if (injection_enabled) {
 		printf("Injection enabled\n");
 		if (injection_file.empty()) {
@@ -232,47 +315,114 @@ int main(int argc, char **argv)
 			return 1;
 		}
 
-		Json::Reader jsonReader;
-		std::ifstream ifs(injection_file.c_str());
-		if (jsonReader.parse(ifs, injection_config))
+		std::string error;
+		if (injection_rules_load(injection_file, error))
 			printf("Parsed injection file: %s\n", injection_file.c_str());
 		else {
-			printf("Error parsing injection file: %s\n", injection_file.c_str());
+			printf("Error parsing injection file: %s\n%s\n", injection_file.c_str(), error.c_str());
 			return 1;
 		}
-		ifs.close();
+
+		if (injection_watch_start(injection_file))
+			return 1;
 	}
 
-	while (connect_device(vendor_id, product_id)) {
-		sleep(1);
+	if (!capture_file.empty() && !capture_start(capture_file))
+		return 1;
+
+	if (!cpu_accounting.empty() &&
+	    cpu_accounting_start(cpu_accounting.c_str(), cpu_report_interval))
+		return 1;
+
+	if (!tap_socket_path.empty() && tap_start(tap_socket_path))
+		return 1;
+
+	if (use_usbfs && device_reconnect) {
+		printf("--usbfs can't be used with --reconnect\n");
+		return 1;
 	}
-	printf("Device opened successfully\n");
+
+	LibusbDevice libusb_device;
+	UsbfsDevice usbfs_device;
+	if (!replay_file.empty()) {
+		std::string error;
+		if (!replay_device.load(replay_file, error)) {
+			printf("Error loading replay file: %s\n%s\n", replay_file.c_str(), error.c_str());
+			return 1;
+		}
+		device_backend = &replay_device;
+		stats_device_attached();
+	}
+	else {
+		while (connect_device(vendor_id, product_id)) {
+			if (please_stop_ep0)
+				return 1;
+			sleep(1);
+		}
+		printf("Device opened successfully\n");
+		device_backend = &libusb_device;
+		if (use_usbfs) {
+			if (usbfs_device.open())
+				return 1;
+			device_backend = &usbfs_device;
+		}
+	}
+	// Not before: the control thread uses device_backend.
+	if (!control_socket_path.empty() && control_socket_start(control_socket_path))
+		return 1;
+
+	capture_descriptors(device_backend);
+	control_cache_prefetch(device_backend);
+	hid_reports_load(device_backend);
+	if (injection_enabled) {
+		std::string error;
+		if (!injection_rules_recompile(error)) {
+			printf("Error resolving HID fields in injection file: %s\n%s\n",
+				injection_file.c_str(), error.c_str());
+			return 1;
+		}
+	}
+
+	// Low-speed gadgets are rarely supported; full speed carries the same
+	// descriptors unchanged.
+	device_speed = device_backend->link_speed();
+	if (speed != USB_SPEED_UNKNOWN)
+		gadget_speed = speed;
+	else
+		gadget_speed = std::max(std::min(device_speed, usb_raw_udc_max_speed(device)),
+					USB_SPEED_FULL);
+	printf("Device speed: %s, gadget speed: %s\n",
+		usb_speed_name(device_speed), usb_speed_name(gadget_speed));
 
 	setup_host_usb_desc();
 	printf("Setup USB config successfully\n");
 
-	int fd = usb_raw_open();
-	usb_raw_init(fd, USB_SPEED_HIGH, driver, device);
-	usb_raw_run(fd);
+	if (!shm_socket_path.empty() && shm_injection_start(shm_socket_path))
+		return 1;
 
-	ep0_loop(fd);
+	RawGadgetHost raw_gadget;
+	FunctionFsHost functionfs;
+	host_backend = &raw_gadget;
+	if (use_functionfs)
+		host_backend = &functionfs;
+	host_backend->init(gadget_speed, driver, device);
+	host_backend->run();
 
-	close(fd);
+	ep0_loop();
 
-	int bNumConfigurations = device_device_desc.bNumConfigurations;
-	for (int i = 0; i < bNumConfigurations; i++) {
-		int bNumInterfaces = device_config_desc[i]->bNumInterfaces;
-		for (int j = 0; j < bNumInterfaces; j++) {
-			int num_altsetting = device_config_desc[i]->interface[j].num_altsetting;
-			for (int k = 0; k < num_altsetting; k++) {
-				delete[] host_device_desc.configs[i].interfaces[j].altsettings[k].endpoints;
-			}
-			delete[] host_device_desc.configs[i].interfaces[j].altsettings;
-		}
-		delete[] host_device_desc.configs[i].interfaces;
-	}
-	delete[] host_device_desc.configs;
-	delete[] device_config_desc;
+	host_backend->close();
+	usbfs_device.close();
+
+	control_socket_stop();
+	shm_injection_stop();
+	tap_stop();
+	injection_watch_stop();
+	cpu_accounting_stop();
+	capture_stop();
+
+	free_host_usb_desc();
+	free_descriptor();
+	transforms_unload();
 
 	if (context && callback_handle != -1) {
 		libusb_hotplug_deregister_callback(context, callback_handle);
@@ -281,6 +431,10 @@ int main(int argc, char **argv)
 		pthread_join(hotplug_monitor_thread, NULL)) {
 		fprintf(stderr, "Error join hotplug_monitor_thread\n");
 	}
+	if (reconnect_thread &&
+		pthread_join(reconnect_thread, NULL)) {
+		fprintf(stderr, "Error join reconnect_thread\n");
+	}
 
 	return 0;
 }